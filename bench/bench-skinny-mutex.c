@@ -0,0 +1,634 @@
+/*
+ * Microbenchmarks comparing skinny mutexes with pthread mutexes, pthread
+ * spinlocks and a plain futex lock.
+ *
+ * Results are written to stdout as a JSON array, one object per
+ * measurement:
+ *
+ *   {"benchmark": ..., "lock": ..., "size": ..., "threads": ...,
+ *    "cs": ..., "ops": ..., "seconds": ..., "ns_per_op": ...}
+ *
+ * "size" is the size of the lock in bytes, "cs" is the length of the
+ * critical section (in increments of a shared counter, with the same
+ * amount of work done outside the lock), and "ns_per_op" is wall-clock
+ * time divided by the total number of operations across all threads.
+ */
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "skinny_mutex.h"
+
+static int max_threads;
+static long duration_ms = 200;
+static long uncontended_iters = 10000000;
+static bool first_result = true;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = {.tv_sec = ms / 1000,
+                          .tv_nsec = (ms % 1000) * 1000000};
+    while (nanosleep(&ts, &ts))
+        ;
+}
+
+/* Abort unless a call the benchmarks depend on succeeded.  This is not
+ * assert, because the calls must still be made under -DNDEBUG.
+ */
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "%s failed\n", what);
+        abort();
+    }
+}
+
+static void result(const char *benchmark,
+                   const char *lock,
+                   size_t size,
+                   int threads,
+                   int cs,
+                   long ops,
+                   double seconds)
+{
+    printf("%s\n  {\"benchmark\": \"%s\", \"lock\": \"%s\", \"size\": %zu, "
+           "\"threads\": %d, \"cs\": %d, \"ops\": %ld, \"seconds\": %.6f, "
+           "\"ns_per_op\": %.2f}",
+           first_result ? "[" : ",", benchmark, lock, size, threads, cs, ops,
+           seconds, ops ? seconds * 1e9 / ops : 0.0);
+    first_result = false;
+    fflush(stdout);
+}
+
+/* A futex lock in the style of Drepper's "Futexes Are Tricky": 0 is
+ * unlocked, 1 is locked, and 2 is locked with possible waiters.
+ */
+typedef struct {
+    int val;
+} futex_lock_t;
+
+static void futex_lock_init(futex_lock_t *l)
+{
+    l->val = 0;
+}
+
+static void futex_lock_destroy(futex_lock_t *l UNUSED) {}
+
+static void futex_lock_lock(futex_lock_t *l)
+{
+    int c = __sync_val_compare_and_swap(&l->val, 0, 1);
+    if (__builtin_expect(!c, 1))
+        return;
+
+    if (c != 2)
+        c = __atomic_exchange_n(&l->val, 2, __ATOMIC_ACQUIRE);
+
+    while (c) {
+        syscall(SYS_futex, &l->val, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        c = __atomic_exchange_n(&l->val, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void futex_lock_unlock(futex_lock_t *l)
+{
+    if (__builtin_expect(__sync_fetch_and_sub(&l->val, 1) == 1, 1))
+        return;
+
+    __atomic_store_n(&l->val, 0, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &l->val, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Uniform wrappers, so that the benchmarks below can be instantiated for
+ * each lock type with the lock operations inlined.
+ */
+static void skinny_init(skinny_mutex_t *m)
+{
+    check(!skinny_mutex_init(m), "skinny_mutex_init");
+}
+
+static void skinny_fair_init(skinny_mutex_t *m)
+{
+    check(!skinny_mutex_init_fair(m), "skinny_mutex_init_fair");
+}
+
+static void skinny_destroy(skinny_mutex_t *m)
+{
+    check(!skinny_mutex_destroy(m), "skinny_mutex_destroy");
+}
+
+static void skinny_lock(skinny_mutex_t *m)
+{
+    check(!skinny_mutex_lock(m), "skinny_mutex_lock");
+}
+
+static void skinny_unlock(skinny_mutex_t *m)
+{
+    check(!skinny_mutex_unlock(m), "skinny_mutex_unlock");
+}
+
+static void pmutex_init(pthread_mutex_t *m)
+{
+    check(!pthread_mutex_init(m, NULL), "pthread_mutex_init");
+}
+
+static void pmutex_destroy(pthread_mutex_t *m)
+{
+    check(!pthread_mutex_destroy(m), "pthread_mutex_destroy");
+}
+
+static void pmutex_lock(pthread_mutex_t *m)
+{
+    check(!pthread_mutex_lock(m), "pthread_mutex_lock");
+}
+
+static void pmutex_unlock(pthread_mutex_t *m)
+{
+    check(!pthread_mutex_unlock(m), "pthread_mutex_unlock");
+}
+
+static void spin_init(pthread_spinlock_t *s)
+{
+    check(!pthread_spin_init(s, PTHREAD_PROCESS_PRIVATE), "pthread_spin_init");
+}
+
+static void spin_destroy(pthread_spinlock_t *s)
+{
+    check(!pthread_spin_destroy(s), "pthread_spin_destroy");
+}
+
+static void spin_lock(pthread_spinlock_t *s)
+{
+    check(!pthread_spin_lock(s), "pthread_spin_lock");
+}
+
+static void spin_unlock(pthread_spinlock_t *s)
+{
+    check(!pthread_spin_unlock(s), "pthread_spin_unlock");
+}
+
+/* Shared state for the contention benchmark */
+struct contention {
+    void *lock;
+    int cs;
+    volatile bool stop;
+    volatile long counter;
+    pthread_barrier_t start;
+};
+
+/* Work outside the lock, of the same length as the critical section. */
+static void think(int cs)
+{
+    for (volatile int i = 0; i < cs; i++)
+        ;
+}
+
+struct lock_type {
+    const char *name;
+    size_t size;
+    void (*init)(void *lock);
+    void (*destroy)(void *lock);
+    double (*uncontended)(void *lock, long iters);
+    void *(*contention_thread)(void *v_c);
+};
+
+#define LOCK_TYPE(NAME, TYPE, INIT, DESTROY, LOCK, UNLOCK)              \
+    static double NAME##_uncontended(void *v_lock, long iters)          \
+    {                                                                   \
+        TYPE *lock = v_lock;                                            \
+        double start = now();                                           \
+                                                                        \
+        for (long i = 0; i < iters; i++) {                              \
+            LOCK(lock);                                                 \
+            UNLOCK(lock);                                               \
+        }                                                               \
+                                                                        \
+        return now() - start;                                           \
+    }                                                                   \
+                                                                        \
+    static void *NAME##_contention_thread(void *v_c)                    \
+    {                                                                   \
+        struct contention *c = v_c;                                     \
+        TYPE *lock = c->lock;                                           \
+        long ops = 0;                                                   \
+                                                                        \
+        pthread_barrier_wait(&c->start);                                \
+        while (!c->stop) {                                              \
+            LOCK(lock);                                                 \
+            for (int i = 0; i < c->cs; i++)                             \
+                c->counter++;                                           \
+            UNLOCK(lock);                                               \
+            ops++;                                                      \
+            think(c->cs);                                               \
+        }                                                               \
+                                                                        \
+        return (void *) ops;                                            \
+    }                                                                   \
+                                                                        \
+    static const struct lock_type NAME##_type = {                       \
+        #NAME,                                                          \
+        sizeof(TYPE),                                                   \
+        (void (*)(void *)) INIT,                                        \
+        (void (*)(void *)) DESTROY,                                     \
+        NAME##_uncontended,                                             \
+        NAME##_contention_thread,                                       \
+    };
+
+LOCK_TYPE(skinny,
+          skinny_mutex_t,
+          skinny_init,
+          skinny_destroy,
+          skinny_lock,
+          skinny_unlock)
+LOCK_TYPE(skinny_fair,
+          skinny_mutex_t,
+          skinny_fair_init,
+          skinny_destroy,
+          skinny_lock,
+          skinny_unlock)
+LOCK_TYPE(pthread,
+          pthread_mutex_t,
+          pmutex_init,
+          pmutex_destroy,
+          pmutex_lock,
+          pmutex_unlock)
+LOCK_TYPE(spinlock,
+          pthread_spinlock_t,
+          spin_init,
+          spin_destroy,
+          spin_lock,
+          spin_unlock)
+LOCK_TYPE(futex,
+          futex_lock_t,
+          futex_lock_init,
+          futex_lock_destroy,
+          futex_lock_lock,
+          futex_lock_unlock)
+
+static const struct lock_type *lock_types[] = {
+    &skinny_type, &skinny_fair_type, &pthread_type, &spinlock_type,
+    &futex_type,
+};
+
+#define NUM_LOCK_TYPES (int) (sizeof lock_types / sizeof lock_types[0])
+
+/* Uncontended lock/unlock pairs on a single thread */
+static void bench_uncontended(const struct lock_type *t)
+{
+    void *lock = malloc(t->size);
+
+    check(lock, "malloc");
+    t->init(lock);
+    result("uncontended", t->name, t->size, 1, 0, uncontended_iters,
+           t->uncontended(lock, uncontended_iters));
+    t->destroy(lock);
+    free(lock);
+}
+
+/* Throughput with "threads" threads locking the same lock */
+static void bench_contention(const struct lock_type *t, int threads, int cs)
+{
+    struct contention c = {.cs = cs, .stop = false, .counter = 0};
+    pthread_t tids[threads];
+    double start;
+    long ops = 0;
+
+    c.lock = malloc(t->size);
+    check(c.lock, "malloc");
+    t->init(c.lock);
+    check(!pthread_barrier_init(&c.start, NULL, threads + 1),
+          "pthread_barrier_init");
+
+    for (int i = 0; i < threads; i++)
+        check(!pthread_create(&tids[i], NULL, t->contention_thread, &c),
+              "pthread_create");
+
+    pthread_barrier_wait(&c.start);
+    start = now();
+    sleep_ms(duration_ms);
+    c.stop = true;
+
+    for (int i = 0; i < threads; i++) {
+        void *thread_ops;
+        check(!pthread_join(tids[i], &thread_ops), "pthread_join");
+        ops += (long) thread_ops;
+    }
+
+    result("contention", t->name, t->size, threads, cs, ops, now() - start);
+
+    /* Check that the lock really did provide mutual exclusion */
+    check(c.counter == ops * cs, "mutual exclusion");
+
+    check(!pthread_barrier_destroy(&c.start), "pthread_barrier_destroy");
+    t->destroy(c.lock);
+    free(c.lock);
+}
+
+/* Inflating and deflating a skinny mutex: a cond timedwait that has
+ * already timed out forces the mutex to acquire a fat_mutex, which is
+ * released again when the mutex is unlocked.  The pthread figures give the
+ * cost of the same operations without the inflation.
+ */
+static void bench_churn(void)
+{
+    struct timespec past = {0, 0};
+    skinny_mutex_t skinny;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    long iters = uncontended_iters / 10;
+    double start;
+    int res;
+
+    check(!pthread_cond_init(&cond, NULL), "pthread_cond_init");
+
+    check(!skinny_mutex_init(&skinny), "skinny_mutex_init");
+    start = now();
+    for (long i = 0; i < iters; i++) {
+        skinny_lock(&skinny);
+        res = skinny_mutex_cond_timedwait(&cond, &skinny, &past);
+        check(res == ETIMEDOUT, "skinny_mutex_cond_timedwait");
+        skinny_unlock(&skinny);
+    }
+    result("churn", "skinny", sizeof skinny, 1, 0, iters, now() - start);
+    skinny_destroy(&skinny);
+
+    pmutex_init(&mutex);
+    start = now();
+    for (long i = 0; i < iters; i++) {
+        pmutex_lock(&mutex);
+        res = pthread_cond_timedwait(&cond, &mutex, &past);
+        check(res == ETIMEDOUT, "pthread_cond_timedwait");
+        pmutex_unlock(&mutex);
+    }
+    result("churn", "pthread", sizeof mutex, 1, 0, iters, now() - start);
+    pmutex_destroy(&mutex);
+
+    check(!pthread_cond_destroy(&cond), "pthread_cond_destroy");
+}
+
+/* Two threads taking turns, signalling each other through a condition
+ * variable.  Each op is one turn, so a round trip is two ops.
+ */
+struct ping_pong {
+    skinny_mutex_t skinny;
+    pthread_mutex_t mutex;
+    bool use_skinny;
+    pthread_cond_t cond;
+    int turn;
+    bool stop;
+};
+
+static void ping_pong_lock(struct ping_pong *pp)
+{
+    if (pp->use_skinny)
+        skinny_lock(&pp->skinny);
+    else
+        pmutex_lock(&pp->mutex);
+}
+
+static void ping_pong_unlock(struct ping_pong *pp)
+{
+    if (pp->use_skinny)
+        skinny_unlock(&pp->skinny);
+    else
+        pmutex_unlock(&pp->mutex);
+}
+
+static void ping_pong_wait(struct ping_pong *pp)
+{
+    int res = pp->use_skinny ? skinny_mutex_cond_wait(&pp->cond, &pp->skinny)
+                             : pthread_cond_wait(&pp->cond, &pp->mutex);
+    check(!res, pp->use_skinny ? "skinny_mutex_cond_wait"
+                               : "pthread_cond_wait");
+}
+
+struct ping_pong_player {
+    struct ping_pong *pp;
+    int me;
+};
+
+static void *ping_pong_thread(void *v_player)
+{
+    struct ping_pong_player *player = v_player;
+    struct ping_pong *pp = player->pp;
+    long ops = 0;
+
+    ping_pong_lock(pp);
+    for (;;) {
+        while (pp->turn != player->me && !pp->stop)
+            ping_pong_wait(pp);
+
+        if (pp->stop)
+            break;
+
+        pp->turn = !player->me;
+        ops++;
+        check(!pthread_cond_signal(&pp->cond), "pthread_cond_signal");
+    }
+    ping_pong_unlock(pp);
+
+    return (void *) ops;
+}
+
+static void bench_ping_pong(bool use_skinny)
+{
+    struct ping_pong pp = {.use_skinny = use_skinny, .turn = 0, .stop = false};
+    struct ping_pong_player players[2];
+    pthread_t tids[2];
+    double start;
+    long ops = 0;
+
+    skinny_init(&pp.skinny);
+    pmutex_init(&pp.mutex);
+    check(!pthread_cond_init(&pp.cond, NULL), "pthread_cond_init");
+
+    start = now();
+    for (int i = 0; i < 2; i++) {
+        players[i].pp = &pp;
+        players[i].me = i;
+        check(!pthread_create(&tids[i], NULL, ping_pong_thread, &players[i]),
+              "pthread_create");
+    }
+
+    sleep_ms(duration_ms);
+    ping_pong_lock(&pp);
+    pp.stop = true;
+    check(!pthread_cond_broadcast(&pp.cond), "pthread_cond_broadcast");
+    ping_pong_unlock(&pp);
+
+    for (int i = 0; i < 2; i++) {
+        void *thread_ops;
+        check(!pthread_join(tids[i], &thread_ops), "pthread_join");
+        ops += (long) thread_ops;
+    }
+
+    if (use_skinny)
+        result("cond_ping_pong", "skinny", sizeof pp.skinny, 2, 0, ops,
+               now() - start);
+    else
+        result("cond_ping_pong", "pthread", sizeof pp.mutex, 2, 0, ops,
+               now() - start);
+
+    check(!pthread_cond_destroy(&pp.cond), "pthread_cond_destroy");
+    pmutex_destroy(&pp.mutex);
+    skinny_destroy(&pp.skinny);
+}
+
+/* Two threads repeatedly swapping two mutexes with skinny_mutex_transfer.
+ * Each transfer has to wait for the other thread to release the mutex it
+ * is transferring to, so each op is a handoff.
+ */
+struct transfer {
+    skinny_mutex_t mutexes[2];
+    pthread_barrier_t start;
+    volatile bool stop;
+};
+
+struct transfer_player {
+    struct transfer *tr;
+    int first;
+};
+
+static void *transfer_thread(void *v_player)
+{
+    struct transfer_player *player = v_player;
+    struct transfer *tr = player->tr;
+    int held = player->first;
+    long ops = 0;
+
+    skinny_lock(&tr->mutexes[held]);
+    pthread_barrier_wait(&tr->start);
+
+    while (!tr->stop) {
+        int res =
+            skinny_mutex_transfer(&tr->mutexes[held], &tr->mutexes[!held]);
+        check(!res, "skinny_mutex_transfer");
+        held = !held;
+        ops++;
+    }
+
+    skinny_unlock(&tr->mutexes[held]);
+    return (void *) ops;
+}
+
+static void bench_transfer(void)
+{
+    struct transfer tr = {.stop = false};
+    struct transfer_player players[2];
+    pthread_t tids[2];
+    double start;
+    long ops = 0;
+
+    skinny_init(&tr.mutexes[0]);
+    skinny_init(&tr.mutexes[1]);
+    check(!pthread_barrier_init(&tr.start, NULL, 3), "pthread_barrier_init");
+
+    for (int i = 0; i < 2; i++) {
+        players[i].tr = &tr;
+        players[i].first = i;
+        check(!pthread_create(&tids[i], NULL, transfer_thread, &players[i]),
+              "pthread_create");
+    }
+
+    pthread_barrier_wait(&tr.start);
+    start = now();
+    sleep_ms(duration_ms);
+    tr.stop = true;
+
+    for (int i = 0; i < 2; i++) {
+        void *thread_ops;
+        check(!pthread_join(tids[i], &thread_ops), "pthread_join");
+        ops += (long) thread_ops;
+    }
+
+    result("transfer", "skinny", sizeof tr.mutexes[0], 2, 0, ops,
+           now() - start);
+
+    check(!pthread_barrier_destroy(&tr.start), "pthread_barrier_destroy");
+    skinny_destroy(&tr.mutexes[0]);
+    skinny_destroy(&tr.mutexes[1]);
+}
+
+/* The thread counts for the contention benchmark double up to
+ * max_threads, which is always the last one measured.
+ */
+static int next_threads(int threads)
+{
+    if (threads == max_threads)
+        return threads + 1;
+
+    return threads * 2 < max_threads ? threads * 2 : max_threads;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t max_threads] [-d duration_ms] [-n iterations]\n"
+            "\n"
+            "  -t  highest thread count for the contention benchmark\n"
+            "      (default: twice the number of CPUs, at least 4)\n"
+            "  -d  duration of each timed benchmark (default: 200)\n"
+            "  -n  iterations of the uncontended benchmark (default: %ld)\n",
+            prog, uncontended_iters);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const int cs_lengths[] = {0, 10, 100, 1000};
+    int opt;
+
+    max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 4)
+        max_threads = 4;
+
+    while ((opt = getopt(argc, argv, "t:d:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration_ms = atol(optarg);
+            break;
+        case 'n':
+            uncontended_iters = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (max_threads < 1 || duration_ms < 1 || uncontended_iters < 1)
+        usage(argv[0]);
+
+    for (int i = 0; i < NUM_LOCK_TYPES; i++)
+        bench_uncontended(lock_types[i]);
+
+    for (int i = 0; i < NUM_LOCK_TYPES; i++)
+        for (unsigned int j = 0; j < sizeof cs_lengths / sizeof cs_lengths[0];
+             j++)
+            for (int threads = 1; threads <= max_threads;
+                 threads = next_threads(threads))
+                bench_contention(lock_types[i], threads, cs_lengths[j]);
+
+    bench_churn();
+    bench_ping_pong(true);
+    bench_ping_pong(false);
+    bench_transfer();
+
+    printf("\n]\n");
+    return 0;
+}
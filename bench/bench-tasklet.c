@@ -0,0 +1,548 @@
+/*
+ * Microbenchmarks for the tasklet scheduler: how many tasklets fit in
+ * memory and how fast they are created, and the cost of the main wakeup
+ * paths.
+ *
+ * Results are written to stdout as a JSON array, one object per
+ * measurement:
+ *
+ *   {"benchmark": ..., "threads": ..., "tasklets": ..., "ops": ...,
+ *    "seconds": ..., "ns_per_op": ..., "bytes_per_tasklet": ...}
+ *
+ * "threads" is the number of threads involved besides the one serving the
+ * run queue (so producers, for the wakeup benchmark), "tasklets" is the
+ * number of tasklets taking part, and "ns_per_op" is wall-clock time
+ * divided by "ops".  "bytes_per_tasklet" is the growth of the resident set
+ * per tasklet created, and is only measured by the create benchmark.
+ *
+ * Every benchmark uses private run queues, so the default scheduler never
+ * starts.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atomics.h"
+#include "tasklet.h"
+
+static int max_threads;
+static long num_tasklets = 1000000;
+static long iterations = 1000000;
+static bool first_result = true;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void result(const char *benchmark,
+                   int threads,
+                   long tasklets,
+                   long ops,
+                   double seconds,
+                   double bytes_per_tasklet)
+{
+    printf("%s\n  {\"benchmark\": \"%s\", \"threads\": %d, \"tasklets\": %ld, "
+           "\"ops\": %ld, \"seconds\": %.6f, \"ns_per_op\": %.2f, "
+           "\"bytes_per_tasklet\": %.2f}",
+           first_result ? "[" : ",", benchmark, threads, tasklets, ops,
+           seconds, ops ? seconds * 1e9 / ops : 0.0, bytes_per_tasklet);
+    first_result = false;
+    fflush(stdout);
+}
+
+/* The resident set size of the process, in bytes */
+static long resident_bytes(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size, resident = 0;
+
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+
+        fclose(f);
+    }
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Serve a run queue from another thread until 'done' is set.  Whoever
+ * sets it must then run a tasklet on the queue, so that the thread
+ * notices.
+ */
+struct server {
+    struct run_queue *runq;
+    bool done;
+    struct thread thread;
+};
+
+static void server_thread(void *v_s)
+{
+    struct server *s = v_s;
+
+    run_queue_target(s->runq);
+    while (!atomic_load_order(&s->done, ATOMIC_ACQUIRE))
+        run_queue_run(s->runq, true);
+
+    run_queue_target(NULL);
+}
+
+static void server_start(struct server *s, struct run_queue *runq)
+{
+    s->runq = runq;
+    s->done = false;
+    thread_init(&s->thread, server_thread, s);
+}
+
+static void server_stop_handler(void *v_t)
+{
+    tasklet_stop(v_t);
+}
+
+static void server_stop(struct server *s)
+{
+    struct mutex mutex;
+    struct tasklet t;
+
+    mutex_init(&mutex);
+    tasklet_init(&t, &mutex, &t);
+    atomic_store_order(&s->done, true, ATOMIC_RELEASE);
+
+    run_queue_target(s->runq);
+    tasklet_later(&t, server_stop_handler);
+    run_queue_target(NULL);
+    thread_fini(&s->thread);
+
+    mutex_lock(&mutex);
+    tasklet_fini(&t);
+    mutex_unlock_fini(&mutex);
+}
+
+/* The smallest useful tasklet: one with a mutex of its own. */
+struct bare_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+};
+
+static void bare_stop(void *v_bt)
+{
+    struct bare_tasklet *bt = v_bt;
+
+    tasklet_stop(&bt->tasklet);
+}
+
+/* Create 'num_tasklets' tasklets, run each of them once, and finalize
+ * them.
+ */
+static void bench_create(void)
+{
+    struct run_queue *runq = run_queue_create();
+    struct bare_tasklet *bts;
+    long before, after;
+    double start;
+
+    before = resident_bytes();
+    bts = malloc(num_tasklets * sizeof *bts);
+    assert(bts);
+
+    start = now();
+    for (long i = 0; i < num_tasklets; i++) {
+        mutex_init(&bts[i].mutex);
+        tasklet_init(&bts[i].tasklet, &bts[i].mutex, &bts[i]);
+    }
+
+    after = resident_bytes();
+    result("create", 0, num_tasklets, num_tasklets, now() - start,
+           (double) (after - before) / num_tasklets);
+
+    run_queue_target(runq);
+    start = now();
+    for (long i = 0; i < num_tasklets; i++)
+        tasklet_later(&bts[i].tasklet, bare_stop);
+
+    run_queue_run(runq, false);
+    result("run_once", 0, num_tasklets, num_tasklets, now() - start, 0);
+    run_queue_target(NULL);
+
+    start = now();
+    for (long i = 0; i < num_tasklets; i++) {
+        mutex_lock(&bts[i].mutex);
+        tasklet_fini(&bts[i].tasklet);
+        mutex_unlock_fini(&bts[i].mutex);
+    }
+
+    result("fini", 0, num_tasklets, num_tasklets, now() - start, 0);
+    free(bts);
+    run_queue_destroy(runq, NULL);
+}
+
+/* Two tasklets on one run queue taking turns through a pair of semaphores.
+ * Each op is one turn: a wait_list_up that wakes the other tasklet, and the
+ * wait_list_down that parks this one.
+ */
+struct ping_pong_player {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct wait_list *mine;
+    struct wait_list *theirs;
+    long left;
+};
+
+static void ping_pong_handler(void *v_p)
+{
+    struct ping_pong_player *p = v_p;
+
+    while (wait_list_down(p->mine, 1, &p->tasklet)) {
+        wait_list_up(p->theirs, 1);
+        if (!--p->left) {
+            tasklet_stop(&p->tasklet);
+            return;
+        }
+    }
+}
+
+static void bench_ping_pong(void)
+{
+    struct run_queue *runq = run_queue_create();
+    struct ping_pong_player players[2];
+    struct wait_list semas[2];
+    long rounds = iterations / 2;
+    double start;
+
+    wait_list_init(&semas[0], 1);
+    wait_list_init(&semas[1], 0);
+    run_queue_target(runq);
+
+    for (int i = 0; i < 2; i++) {
+        struct ping_pong_player *p = &players[i];
+
+        mutex_init(&p->mutex);
+        tasklet_init(&p->tasklet, &p->mutex, p);
+        p->mine = &semas[i];
+        p->theirs = &semas[!i];
+        p->left = rounds;
+    }
+
+    start = now();
+    for (int i = 0; i < 2; i++)
+        tasklet_later(&players[i].tasklet, ping_pong_handler);
+
+    run_queue_run(runq, false);
+    result("ping_pong", 0, 2, 2 * rounds, now() - start, 0);
+
+    for (int i = 0; i < 2; i++) {
+        assert(!players[i].left);
+        mutex_lock(&players[i].mutex);
+        tasklet_fini(&players[i].tasklet);
+        mutex_unlock_fini(&players[i].mutex);
+    }
+
+    run_queue_target(NULL);
+    wait_list_fini(&semas[0]);
+    wait_list_fini(&semas[1]);
+    run_queue_destroy(runq, NULL);
+}
+
+/* Broadcasting to 'size' tasklets waiting on one wait_list.  The broadcast
+ * result is the time in wait_list_broadcast itself, and the fan_out result
+ * also includes running all the woken tasklets.  Each op is one tasklet
+ * woken.
+ */
+struct fan_out_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct wait_list *wait;
+    long woken;
+};
+
+static void fan_out_handler(void *v_ft)
+{
+    struct fan_out_tasklet *ft = v_ft;
+
+    ft->woken++;
+    wait_list_wait(ft->wait, &ft->tasklet);
+}
+
+static void bench_fan_out(long size)
+{
+    struct run_queue *runq = run_queue_create();
+    struct fan_out_tasklet *fts = malloc(size * sizeof *fts);
+    long rounds = iterations / size ? iterations / size : 1;
+    double broadcast = 0, start;
+    struct wait_list wait;
+
+    assert(fts);
+    wait_list_init(&wait, 0);
+    run_queue_target(runq);
+
+    for (long i = 0; i < size; i++) {
+        mutex_init(&fts[i].mutex);
+        tasklet_init(&fts[i].tasklet, &fts[i].mutex, &fts[i]);
+        fts[i].wait = &wait;
+        fts[i].woken = 0;
+        tasklet_later(&fts[i].tasklet, fan_out_handler);
+    }
+
+    run_queue_run(runq, false);
+
+    start = now();
+    for (long r = 0; r < rounds; r++) {
+        double broadcast_start = now();
+
+        wait_list_broadcast(&wait);
+        broadcast += now() - broadcast_start;
+        run_queue_run(runq, false);
+    }
+
+    result("fan_out", 0, size, rounds * size, now() - start, 0);
+    result("broadcast", 0, size, rounds * size, broadcast, 0);
+
+    for (long i = 0; i < size; i++) {
+        assert(fts[i].woken == rounds + 1);
+        mutex_lock(&fts[i].mutex);
+        tasklet_fini(&fts[i].tasklet);
+        mutex_unlock_fini(&fts[i].mutex);
+    }
+
+    run_queue_target(NULL);
+    wait_list_fini(&wait);
+    free(fts);
+    run_queue_destroy(runq, NULL);
+}
+
+/* Producer threads waking consumer tasklets on a run queue served by
+ * another thread, with a semaphore per consumer.  Each producer has
+ * WAKEUP_CONSUMERS consumers of its own, and round-robins over them.  Each
+ * op is one wait_list_up, consumed by one wait_list_down.
+ */
+#define WAKEUP_CONSUMERS 16
+
+struct wakeup_consumer {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct wait_list sema;
+    struct tasklet_group *group;
+    long left;
+};
+
+struct wakeup_producer {
+    struct run_queue *runq;
+    struct wakeup_consumer *consumers;
+    long ups;
+    struct thread thread;
+};
+
+static void wakeup_consumer_handler(void *v_c)
+{
+    struct wakeup_consumer *c = v_c;
+
+    while (wait_list_down(&c->sema, 1, &c->tasklet)) {
+        if (!--c->left) {
+            tasklet_stop(&c->tasklet);
+            tasklet_group_done(c->group);
+            return;
+        }
+    }
+}
+
+static void wakeup_producer_thread(void *v_p)
+{
+    struct wakeup_producer *p = v_p;
+
+    /* Woken consumers go onto the consumers' run queue */
+    run_queue_target(p->runq);
+    for (long i = 0; i < p->ups; i++)
+        wait_list_up(&p->consumers[i % WAKEUP_CONSUMERS].sema, 1);
+
+    run_queue_target(NULL);
+}
+
+static void bench_wakeup(int threads)
+{
+    struct run_queue *runq = run_queue_create();
+    int n = threads * WAKEUP_CONSUMERS;
+    struct wakeup_consumer *consumers = malloc(n * sizeof *consumers);
+    struct wakeup_producer producers[threads];
+    long ups = iterations / n * WAKEUP_CONSUMERS;
+    struct tasklet_group group;
+    struct server server;
+    double start;
+
+    assert(consumers && ups);
+    tasklet_group_init(&group, n);
+    run_queue_target(runq);
+
+    for (int i = 0; i < n; i++) {
+        struct wakeup_consumer *c = &consumers[i];
+
+        mutex_init(&c->mutex);
+        tasklet_init(&c->tasklet, &c->mutex, c);
+        wait_list_init(&c->sema, 0);
+        c->group = &group;
+        c->left = ups / WAKEUP_CONSUMERS;
+        tasklet_later(&c->tasklet, wakeup_consumer_handler);
+    }
+
+    /* Get the consumers waiting before the clock starts */
+    run_queue_run(runq, false);
+    run_queue_target(NULL);
+    server_start(&server, runq);
+
+    start = now();
+    for (int i = 0; i < threads; i++) {
+        producers[i].runq = runq;
+        producers[i].consumers = &consumers[i * WAKEUP_CONSUMERS];
+        producers[i].ups = ups;
+        thread_init(&producers[i].thread, wakeup_producer_thread,
+                    &producers[i]);
+    }
+
+    tasklet_group_join_blocking(&group);
+    result("wakeup", threads, n, threads * ups, now() - start, 0);
+
+    for (int i = 0; i < threads; i++)
+        thread_fini(&producers[i].thread);
+
+    server_stop(&server);
+
+    for (int i = 0; i < n; i++) {
+        mutex_lock(&consumers[i].mutex);
+        tasklet_fini(&consumers[i].tasklet);
+        mutex_unlock_fini(&consumers[i].mutex);
+        wait_list_fini(&consumers[i].sema);
+    }
+
+    tasklet_group_fini(&group);
+    free(consumers);
+    run_queue_destroy(runq, NULL);
+}
+
+/* Stopping or finalizing a tasklet that keeps itself runnable on a run
+ * queue served by another thread, and then starting it again.  The
+ * tasklet is often the run queue's current tasklet, so tasklet_stop and
+ * tasklet_fini have to veto its next handler run and wait for the serving
+ * thread to let go of it.  Each op is one stop (or fini and init) and
+ * restart.
+ */
+struct spinner {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    long runs;
+};
+
+static void spinner_handler(void *v_s)
+{
+    struct spinner *s = v_s;
+
+    s->runs++;
+    tasklet_run(&s->tasklet);
+}
+
+static void bench_stop_running(bool fini)
+{
+    struct run_queue *runq = run_queue_create();
+    long ops = iterations / 100 ? iterations / 100 : 1;
+    struct server server;
+    struct spinner s;
+    double start;
+
+    mutex_init(&s.mutex);
+    tasklet_init(&s.tasklet, &s.mutex, &s);
+    s.runs = 0;
+    server_start(&server, runq);
+
+    run_queue_target(runq);
+    tasklet_later(&s.tasklet, spinner_handler);
+
+    start = now();
+    for (long i = 0; i < ops; i++) {
+        mutex_lock(&s.mutex);
+        if (fini) {
+            tasklet_fini(&s.tasklet);
+            tasklet_init(&s.tasklet, &s.mutex, &s);
+            tasklet_later(&s.tasklet, spinner_handler);
+        } else {
+            tasklet_stop(&s.tasklet);
+            tasklet_run(&s.tasklet);
+        }
+        mutex_unlock(&s.mutex);
+    }
+
+    result(fini ? "fini_running" : "stop_running", 1, 1, ops, now() - start,
+           0);
+    run_queue_target(NULL);
+
+    mutex_lock(&s.mutex);
+    tasklet_fini(&s.tasklet);
+    mutex_unlock_fini(&s.mutex);
+
+    server_stop(&server);
+    run_queue_destroy(runq, NULL);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t max_threads] [-n tasklets] [-i iterations]\n"
+            "\n"
+            "  -t  highest producer thread count for the wakeup benchmark\n"
+            "      (default: twice the number of CPUs, at least 4)\n"
+            "  -n  tasklets for the create benchmark (default: %ld)\n"
+            "  -i  ops for the wakeup benchmarks (default: %ld, and a\n"
+            "      hundredth of that for stop_running and fini_running)\n",
+            prog, num_tasklets, iterations);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    static const long fan_out_sizes[] = {10, 1000, 100000};
+    int opt;
+
+    max_threads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads < 4)
+        max_threads = 4;
+
+    while ((opt = getopt(argc, argv, "t:n:i:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'n':
+            num_tasklets = atol(optarg);
+            break;
+        case 'i':
+            iterations = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (max_threads < 1 || num_tasklets < 1 ||
+        iterations < (long) max_threads * WAKEUP_CONSUMERS)
+        usage(argv[0]);
+
+    bench_create();
+    bench_ping_pong();
+
+    for (unsigned int i = 0; i < sizeof fan_out_sizes / sizeof fan_out_sizes[0];
+         i++)
+        bench_fan_out(fan_out_sizes[i]);
+
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+        bench_wakeup(threads);
+
+    bench_stop_running(false);
+    bench_stop_running(true);
+
+    printf("\n]\n");
+    return 0;
+}
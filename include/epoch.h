@@ -0,0 +1,55 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/* Epoch-based reclamation.
+ *
+ * Lock-free readers can follow a pointer to an object at the same time as
+ * another thread unlinks it.  The object cannot be freed until every such
+ * reader is done with it.  Readers bracket their accesses with epoch_enter
+ * and epoch_exit, and the thread that unlinks an object hands it to
+ * epoch_defer rather than freeing it.  Once every thread that was inside a
+ * read-side section at that point has left it (a grace period), the
+ * deferred function is called.
+ *
+ * There is a single domain for the whole library, so an object unlinked by
+ * one ThreadKit structure waits only for the read-side sections that were
+ * in progress, whichever structure they were reading.  Read-side sections
+ * should be short, and must not block for long: a thread blocked inside a
+ * section holds up the reclamation of everything deferred after it
+ * entered.
+ */
+
+/* Embedded in an object whose freeing is deferred. */
+struct epoch_entry {
+    struct epoch_entry *next;
+    void (*fn)(struct epoch_entry *entry);
+    unsigned long epoch;
+};
+
+/* Begin a read-side section.  Sections may be nested.
+ *
+ * Returns 0, or ENOMEM if the calling thread could not be registered with
+ * the domain (only possible on its first call).
+ */
+int epoch_enter(void);
+
+/* End a read-side section begun by epoch_enter. */
+void epoch_exit(void);
+
+/* Call "fn" on "entry" once no read-side section that may have seen the
+ * object can still be in progress.  The object must already be unreachable
+ * for new readers.
+ *
+ * "fn" may be called from any thread that uses the domain, including from
+ * within a later call to epoch_defer by this thread, so it should not take
+ * locks that the caller of epoch_defer might hold.
+ */
+void epoch_defer(struct epoch_entry *entry,
+                 void (*fn)(struct epoch_entry *entry));
+
+/* Wait for a grace period, and then call any deferred functions that have
+ * become due.  The calling thread must not be inside a read-side section.
+ */
+void epoch_synchronize(void);
+
+#endif /* EPOCH_H */
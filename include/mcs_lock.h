@@ -0,0 +1,88 @@
+#ifndef MCS_LOCK_H
+#define MCS_LOCK_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A queued lock in the style of Mellor-Crummey and Scott.
+ *
+ * The lock itself is a single word pointing to the tail of a queue of
+ * waiting threads.  Each thread that locks it supplies a node, which must
+ * stay valid until the matching unlock.  A waiting thread spins only on its
+ * own node, which has a cache line to itself, so under heavy contention the
+ * lock word is touched once per acquisition rather than bouncing between all
+ * the contenders, and ownership passes to waiters in FIFO order.
+ *
+ * A waiter that does not get the lock after a short spin parks in the
+ * parking lot (see parking_lot.h), so oversubscribed threads do not burn
+ * CPU time that the lock holder might need.
+ */
+
+#define MCS_LOCK_CACHE_LINE 64
+
+struct mcs_node {
+    struct mcs_node *next;
+    uint8_t state;
+} __attribute__((aligned(MCS_LOCK_CACHE_LINE)));
+
+typedef struct {
+    struct mcs_node *tail;
+} mcs_lock_t;
+
+#define MCS_LOCK_INITIALIZER \
+    {                        \
+        NULL                 \
+    }
+
+static inline void mcs_lock_init(mcs_lock_t *l)
+{
+    l->tail = NULL;
+}
+
+static inline int mcs_lock_destroy(mcs_lock_t *l)
+{
+    return !l->tail ? 0 : EBUSY;
+}
+
+void mcs_lock_wait(struct mcs_node *prev, struct mcs_node *node);
+
+static inline void mcs_lock(mcs_lock_t *l, struct mcs_node *node)
+{
+    struct mcs_node *prev;
+
+    node->next = NULL;
+    node->state = 0;
+
+    prev = __atomic_exchange_n(&l->tail, node, __ATOMIC_ACQ_REL);
+    if (__builtin_expect(!prev, 1))
+        return;
+
+    mcs_lock_wait(prev, node);
+}
+
+static inline int mcs_lock_trylock(mcs_lock_t *l, struct mcs_node *node)
+{
+    node->next = NULL;
+    node->state = 0;
+
+    if (__sync_bool_compare_and_swap(&l->tail, NULL, node))
+        return 0;
+
+    return EBUSY;
+}
+
+void mcs_unlock_slow(mcs_lock_t *l, struct mcs_node *node);
+
+static inline void mcs_unlock(mcs_lock_t *l, struct mcs_node *node)
+{
+    if (__builtin_expect(
+            !node->next && __sync_bool_compare_and_swap(&l->tail, node, NULL),
+            1))
+        return;
+
+    mcs_unlock_slow(l, node);
+}
+
+#endif /* MCS_LOCK_H */
@@ -0,0 +1,149 @@
+#ifndef PARKING_LOT_H
+#define PARKING_LOT_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "atomics.h"
+
+/* The parking lot is a process-wide hash table mapping addresses to queues
+ * of blocked threads.  It lets a synchronization primitive keep only a
+ * couple of bits of state inline, and borrow the shared table whenever a
+ * thread actually has to block on it.
+ */
+
+/* Block the calling thread on "addr".
+ *
+ * "validate" is called with the bucket for "addr" locked, so it is atomic
+ * with respect to parking_lot_unpark_one and parking_lot_unpark_all on the
+ * same address.  If it returns false, the thread does not block.
+ *
+ * Returns 0 once woken by an unpark, EAGAIN if "validate" failed, ETIMEDOUT
+ * if "abstime" (measured against CLOCK_REALTIME) passed first, or another
+ * positive error code.
+ */
+int parking_lot_park(const void *addr,
+                     bool (*validate)(void *arg),
+                     void *arg,
+                     const struct timespec *abstime);
+
+/* Wake the thread that has been parked on "addr" for the longest.
+ *
+ * If "callback" is not NULL, it is called with the bucket for "addr" locked
+ * (whether or not a thread was found), and is told whether other threads
+ * remain parked on "addr".
+ *
+ * Returns the number of threads woken (0 or 1).
+ */
+int parking_lot_unpark_one(const void *addr,
+                           void (*callback)(void *arg, bool more_parked),
+                           void *arg);
+
+/* Wake all threads parked on "addr".  Returns the number of threads woken. */
+int parking_lot_unpark_all(const void *addr);
+
+/*
+ * Byte locks occupy a single byte.  Bit 0 says whether the lock is held, and
+ * bit 1 whether any threads are parked on it.  The remaining bits are left
+ * alone.
+ */
+typedef struct {
+    uint8_t val;
+} skinny_bytelock_t;
+
+#define SKINNY_BYTELOCK_INITIALIZER \
+    {                               \
+        0                           \
+    }
+
+#define SKINNY_LOCK_HELD 1
+#define SKINNY_LOCK_PARKED 2
+
+static inline void skinny_bytelock_init(skinny_bytelock_t *l)
+{
+    l->val = 0;
+}
+
+void skinny_bytelock_lock_slow(skinny_bytelock_t *l);
+void skinny_bytelock_unlock_slow(skinny_bytelock_t *l);
+
+static inline void skinny_bytelock_lock(skinny_bytelock_t *l)
+{
+    uint8_t v = l->val & ~(SKINNY_LOCK_HELD | SKINNY_LOCK_PARKED);
+    if (__builtin_expect(
+            atomic_cas(&l->val, v, v | SKINNY_LOCK_HELD, ATOMIC_ACQUIRE), 1))
+        return;
+    skinny_bytelock_lock_slow(l);
+}
+
+static inline void skinny_bytelock_unlock(skinny_bytelock_t *l)
+{
+    uint8_t v = l->val;
+    if (__builtin_expect(!(v & SKINNY_LOCK_PARKED) &&
+                             atomic_cas(&l->val, v, v & ~SKINNY_LOCK_HELD,
+                                        ATOMIC_RELEASE),
+                         1))
+        return;
+    skinny_bytelock_unlock_slow(l);
+}
+
+static inline int skinny_bytelock_trylock(skinny_bytelock_t *l)
+{
+    for (;;) {
+        uint8_t v = l->val;
+        if (v & SKINNY_LOCK_HELD)
+            return EBUSY;
+        if (atomic_cas(&l->val, v, v | SKINNY_LOCK_HELD, ATOMIC_ACQUIRE))
+            return 0;
+    }
+}
+
+/*
+ * Bit locks live in the two low bits of a pointer-sized word, so they can be
+ * embedded in a pointer to a 4-byte aligned object.  The remaining bits of
+ * the word belong to the caller, and can be read with skinny_bitlock_ptr and
+ * updated (with the lock held) with skinny_bitlock_set_ptr.
+ */
+void skinny_bitlock_lock_slow(uintptr_t *word);
+void skinny_bitlock_unlock_slow(uintptr_t *word);
+
+static inline void skinny_bitlock_lock(uintptr_t *word)
+{
+    uintptr_t v = *word & ~(uintptr_t)(SKINNY_LOCK_HELD | SKINNY_LOCK_PARKED);
+    if (__builtin_expect(
+            atomic_cas(word, v, v | SKINNY_LOCK_HELD, ATOMIC_ACQUIRE), 1))
+        return;
+    skinny_bitlock_lock_slow(word);
+}
+
+static inline void skinny_bitlock_unlock(uintptr_t *word)
+{
+    uintptr_t v = *word;
+    if (__builtin_expect(!(v & SKINNY_LOCK_PARKED) &&
+                             atomic_cas(word, v,
+                                        v & ~(uintptr_t) SKINNY_LOCK_HELD,
+                                        ATOMIC_RELEASE),
+                         1))
+        return;
+    skinny_bitlock_unlock_slow(word);
+}
+
+static inline void *skinny_bitlock_ptr(uintptr_t *word)
+{
+    return (void *) (*word & ~(uintptr_t)(SKINNY_LOCK_HELD |
+                                          SKINNY_LOCK_PARKED));
+}
+
+static inline void skinny_bitlock_set_ptr(uintptr_t *word, void *p)
+{
+    uintptr_t v;
+    do {
+        v = *word;
+    } while (!atomic_cas(
+        word, v, (uintptr_t) p | (v & (SKINNY_LOCK_HELD | SKINNY_LOCK_PARKED)),
+        ATOMIC_RELAXED));
+}
+
+#endif /* PARKING_LOT_H */
@@ -3,8 +3,11 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
+#include "atomics.h"
+
 typedef struct {
     void *val;
 } skinny_mutex_t;
@@ -15,9 +18,61 @@ static inline int skinny_mutex_init(skinny_mutex_t *m)
     return 0;
 }
 
+/* A fair skinny_mutex hands ownership directly to the thread that has been
+ * waiting longest, rather than letting newly arriving threads barge in.  The
+ * fairness flag lives in bit 1 of the unheld or uncontended word, so fair
+ * mutexes always take the out-of-line paths, but cost no extra memory.
+ */
+#define SKINNY_MUTEX_FAIR 2
+
+static inline int skinny_mutex_init_fair(skinny_mutex_t *m)
+{
+    m->val = (void *) SKINNY_MUTEX_FAIR;
+    return 0;
+}
+
+/* Error-checking mode.
+ *
+ * When SKINNY_MUTEX_ERRORCHECK is defined (consistently, for the whole
+ * program), skinny mutexes record which thread holds them, like a pthread
+ * mutex of type PTHREAD_MUTEX_ERRORCHECK: relocking returns EDEADLK, and
+ * unlocking (or waiting on a condition variable with) a mutex held by
+ * another thread returns EPERM.  Nested acquisitions are also fed into a
+ * lock graph, and any lock order inversion found is passed to the
+ * inversion handler (by default, logged to stderr).
+ *
+ * The inline fast paths below are disabled in this mode, so it is for
+ * debugging rather than production use.
+ */
+/* Is the mutex held by the calling thread?  Without error checking, the
+ * owner is not recorded, so this only says whether any thread holds it,
+ * which is still enough for assertions.
+ */
+int skinny_mutex_held_by_self(skinny_mutex_t *m);
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+/* Called when "acquired" is locked while holding "held", though elsewhere
+ * "held" has been locked (perhaps indirectly) while holding "acquired".
+ */
+typedef void skinny_mutex_inversion_handler_t(skinny_mutex_t *held,
+                                              skinny_mutex_t *acquired);
+
+/* Replace the inversion handler.  NULL restores the default. */
+void skinny_mutex_set_inversion_handler(
+    skinny_mutex_inversion_handler_t *handler);
+
+void skinny_mutex_debug_destroy(skinny_mutex_t *m);
+#endif
+
 static inline int skinny_mutex_destroy(skinny_mutex_t *m)
 {
-    return !m->val ? 0 : EBUSY;
+    if ((uintptr_t) m->val & ~(uintptr_t) SKINNY_MUTEX_FAIR)
+        return EBUSY;
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+    skinny_mutex_debug_destroy(m);
+#endif
+    return 0;
 }
 
 #define SKINNY_MUTEX_INITIALIZER \
@@ -25,13 +80,20 @@ static inline int skinny_mutex_destroy(skinny_mutex_t *m)
         (void *) 0               \
     }
 
+#define SKINNY_MUTEX_FAIR_INITIALIZER \
+    {                                 \
+        (void *) SKINNY_MUTEX_FAIR    \
+    }
+
 int skinny_mutex_lock_slow(skinny_mutex_t *m);
 
 static inline int skinny_mutex_lock(skinny_mutex_t *m)
 {
+#ifndef SKINNY_MUTEX_ERRORCHECK
     if (__builtin_expect(
-            __sync_bool_compare_and_swap(&m->val, (void *) 0, (void *) 1), 1))
+            atomic_cas(&m->val, (void *) 0, (void *) 1, ATOMIC_ACQUIRE), 1))
         return 0;
+#endif
     return skinny_mutex_lock_slow(m);
 }
 
@@ -39,9 +101,11 @@ int skinny_mutex_unlock_slow(skinny_mutex_t *m);
 
 static inline int skinny_mutex_unlock(skinny_mutex_t *m)
 {
+#ifndef SKINNY_MUTEX_ERRORCHECK
     if (__builtin_expect(
-            __sync_bool_compare_and_swap(&m->val, (void *) 1, (void *) 0), 1))
+            atomic_cas(&m->val, (void *) 1, (void *) 0, ATOMIC_RELEASE), 1))
         return 0;
+#endif
     return skinny_mutex_unlock_slow(m);
 }
 
@@ -54,4 +118,14 @@ int skinny_mutex_cond_timedwait(pthread_cond_t *cond,
 int skinny_mutex_transfer(skinny_mutex_t *a, skinny_mutex_t *b);
 int skinny_mutex_veto_transfer(skinny_mutex_t *m);
 
+/* Contention profiling: sample one in "period" contended acquisitions. */
+int skinny_mutex_profile_start(unsigned int period);
+void skinny_mutex_profile_stop(void);
+void skinny_mutex_profile_reset(void);
+
+/* Write the "top_n" lock and call site pairs with the most waiting time to
+ * "fd".  Returns the number of pairs sampled.
+ */
+int skinny_mutex_profile_report(int fd, int top_n);
+
 #endif /* SKINNY_MUTEX_H */
@@ -0,0 +1,106 @@
+#ifndef SKINNY_PI_MUTEX_H
+#define SKINNY_PI_MUTEX_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Priority-inheritance skinny mutexes, corresponding to pthread mutexes with
+ * the PTHREAD_PRIO_INHERIT protocol attribute.
+ *
+ * The mutex is a 32-bit futex word holding the thread ID of the owner, so
+ * that when a thread blocks on it the kernel knows which thread to boost.
+ * Uncontended locking and unlocking is still a single compare-and-swap.
+ */
+typedef struct {
+    uint32_t val;
+} skinny_pi_mutex_t;
+
+#define SKINNY_PI_MUTEX_INITIALIZER \
+    {                               \
+        0                           \
+    }
+
+/* Condition variables for use with skinny_pi_mutex_t.  Waiters are requeued
+ * directly onto the mutex by the kernel when signalled, so a woken waiter
+ * never runs without the mutex, and priority inheritance applies while it
+ * waits to reacquire it.
+ */
+typedef struct {
+    uint32_t seq;
+    skinny_pi_mutex_t *mutex;
+} skinny_pi_cond_t;
+
+#define SKINNY_PI_COND_INITIALIZER \
+    {                              \
+        0, (void *) 0              \
+    }
+
+extern __thread uint32_t skinny_pi_mutex_tid;
+uint32_t skinny_pi_mutex_gettid(void);
+
+/* The kernel thread ID of the calling thread. */
+static inline uint32_t skinny_pi_mutex_self(void)
+{
+    uint32_t tid = skinny_pi_mutex_tid;
+    return tid ? tid : skinny_pi_mutex_gettid();
+}
+
+static inline int skinny_pi_mutex_init(skinny_pi_mutex_t *m)
+{
+    m->val = 0;
+    return 0;
+}
+
+static inline int skinny_pi_mutex_destroy(skinny_pi_mutex_t *m)
+{
+    return !m->val ? 0 : EBUSY;
+}
+
+int skinny_pi_mutex_lock_slow(skinny_pi_mutex_t *m);
+
+static inline int skinny_pi_mutex_lock(skinny_pi_mutex_t *m)
+{
+    if (__builtin_expect(__sync_bool_compare_and_swap(&m->val, 0,
+                                                      skinny_pi_mutex_self()),
+                         1))
+        return 0;
+    return skinny_pi_mutex_lock_slow(m);
+}
+
+int skinny_pi_mutex_unlock_slow(skinny_pi_mutex_t *m);
+
+static inline int skinny_pi_mutex_unlock(skinny_pi_mutex_t *m)
+{
+    if (__builtin_expect(__sync_bool_compare_and_swap(
+                             &m->val, skinny_pi_mutex_self(), 0),
+                         1))
+        return 0;
+    return skinny_pi_mutex_unlock_slow(m);
+}
+
+int skinny_pi_mutex_trylock(skinny_pi_mutex_t *m);
+
+static inline int skinny_pi_cond_init(skinny_pi_cond_t *c)
+{
+    c->seq = 0;
+    c->mutex = (void *) 0;
+    return 0;
+}
+
+static inline int skinny_pi_cond_destroy(skinny_pi_cond_t *c)
+{
+    (void) c;
+    return 0;
+}
+
+int skinny_pi_cond_signal(skinny_pi_cond_t *c);
+int skinny_pi_cond_broadcast(skinny_pi_cond_t *c);
+
+int skinny_pi_mutex_cond_wait(skinny_pi_cond_t *cond, skinny_pi_mutex_t *m);
+int skinny_pi_mutex_cond_timedwait(skinny_pi_cond_t *cond,
+                                   skinny_pi_mutex_t *m,
+                                   const struct timespec *abstime);
+
+#endif /* SKINNY_PI_MUTEX_H */
@@ -0,0 +1,160 @@
+#ifndef SKINNY_SYNC_H
+#define SKINNY_SYNC_H
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "atomics.h"
+
+/*
+ * Semaphores, barriers and once-only initialization, each occupying one
+ * pointer-sized word.
+ *
+ * Like skinny mutexes (see skinny_mutex.h), the word holds a plain value
+ * updated with atomic operations until a thread needs to block.  Only then
+ * is it inflated to point to a structure holding a pthreads mutex and
+ * condition variable, which is freed again once no thread is blocked.  The
+ * plain values are always odd, or small, so they can be told apart from
+ * pointers.
+ */
+
+/* Counting semaphore, like sem_t. */
+typedef struct {
+    void *val;
+} skinny_sem_t;
+
+#define SKINNY_SEM_VALUE_MAX INT_MAX
+
+#define SKINNY_SEM_INITIALIZER(value)                  \
+    {                                                  \
+        (void *) (((uintptr_t)(value) << 1) | 1)       \
+    }
+
+static inline int skinny_sem_init(skinny_sem_t *sem, unsigned int value)
+{
+    if (value > SKINNY_SEM_VALUE_MAX)
+        return EINVAL;
+
+    sem->val = (void *) (((uintptr_t) value << 1) | 1);
+    return 0;
+}
+
+static inline int skinny_sem_destroy(skinny_sem_t *sem)
+{
+    /* Threads are blocked on the semaphore if it has been inflated. */
+    return ((uintptr_t) sem->val & 1) ? 0 : EBUSY;
+}
+
+int skinny_sem_wait_slow(skinny_sem_t *sem);
+
+/* Decrement the semaphore, waiting until its value is positive.  This is a
+ * cancellation point.
+ */
+static inline int skinny_sem_wait(skinny_sem_t *sem)
+{
+    uintptr_t v = (uintptr_t) sem->val;
+
+    if (__builtin_expect((v & 1) && v > 1 &&
+                             atomic_cas(&sem->val, (void *) v, (void *) (v - 2),
+                                        ATOMIC_ACQUIRE),
+                         1))
+        return 0;
+
+    return skinny_sem_wait_slow(sem);
+}
+
+int skinny_sem_post_slow(skinny_sem_t *sem);
+
+/* Increment the semaphore, waking a waiter if there is one.  Returns
+ * EOVERFLOW if the value would exceed SKINNY_SEM_VALUE_MAX.
+ */
+static inline int skinny_sem_post(skinny_sem_t *sem)
+{
+    uintptr_t v = (uintptr_t) sem->val;
+
+    if (__builtin_expect((v & 1) &&
+                             v < ((uintptr_t) SKINNY_SEM_VALUE_MAX << 1) &&
+                             atomic_cas(&sem->val, (void *) v, (void *) (v + 2),
+                                        ATOMIC_RELEASE),
+                         1))
+        return 0;
+
+    return skinny_sem_post_slow(sem);
+}
+
+/* Returns EAGAIN if the semaphore's value is zero. */
+int skinny_sem_trywait(skinny_sem_t *sem);
+
+/* Returns ETIMEDOUT if the value stays zero until "abstime" (measured
+ * against CLOCK_REALTIME).
+ */
+int skinny_sem_timedwait(skinny_sem_t *sem, const struct timespec *abstime);
+
+int skinny_sem_getvalue(skinny_sem_t *sem, int *value);
+
+/* Barrier, like pthread_barrier_t. */
+typedef struct {
+    void *val;
+} skinny_barrier_t;
+
+#define SKINNY_BARRIER_SERIAL_THREAD PTHREAD_BARRIER_SERIAL_THREAD
+
+#define SKINNY_BARRIER_INITIALIZER(count)              \
+    {                                                  \
+        (void *) (((uintptr_t)(count) << 1) | 1)       \
+    }
+
+static inline int skinny_barrier_init(skinny_barrier_t *barrier,
+                                      unsigned int count)
+{
+    if (!count || count > INT_MAX)
+        return EINVAL;
+
+    barrier->val = (void *) (((uintptr_t) count << 1) | 1);
+    return 0;
+}
+
+static inline int skinny_barrier_destroy(skinny_barrier_t *barrier)
+{
+    return ((uintptr_t) barrier->val & 1) ? 0 : EBUSY;
+}
+
+/* Wait until "count" threads have called skinny_barrier_wait.  One of them
+ * gets SKINNY_BARRIER_SERIAL_THREAD, and the others 0.  This is not a
+ * cancellation point.
+ */
+int skinny_barrier_wait(skinny_barrier_t *barrier);
+
+/* Once-only initialization, like pthread_once_t. */
+typedef struct {
+    void *val;
+} skinny_once_t;
+
+#define SKINNY_ONCE_INIT \
+    {                    \
+        (void *) 0       \
+    }
+
+/* The word of a skinny_once_t whose routine has completed */
+#define SKINNY_ONCE_DONE 2
+
+int skinny_once_slow(skinny_once_t *once, void (*init_routine)(void));
+
+/* Call "init_routine" unless it has already been called for "once".  If
+ * another thread is calling it, wait for it to return.  As with
+ * pthread_once, if "init_routine" is cancelled, a later call runs it again.
+ */
+static inline int skinny_once(skinny_once_t *once, void (*init_routine)(void))
+{
+    if (__builtin_expect(atomic_load_order(&once->val, ATOMIC_ACQUIRE) ==
+                             (void *) SKINNY_ONCE_DONE,
+                         1))
+        return 0;
+
+    return skinny_once_slow(once, init_routine);
+}
+
+#endif /* SKINNY_SYNC_H */
@@ -2,19 +2,39 @@
 #define TASKLET_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 
 #include "thread.h"
 
+/* Priority classes.  A run queue runs its higher priority tasklets first,
+ * in FIFO order within each class.
+ */
+enum tasklet_priority {
+    TASKLET_PRIORITY_HIGH,
+    TASKLET_PRIORITY_NORMAL,
+    TASKLET_PRIORITY_LOW,
+    TASKLET_PRIORITIES
+};
+
 struct tasklet {
     struct mutex *mutex;
 
     void (*handler)(void *);
     void *data;
 
-    struct mutex wait_mutex;
-    struct wait_list *wait; /* Covered by wait_mutex */
-    int unwaiting;          /* Covered by wait_mutex */
+    /* The wait_list the tasklet is on, with a bit lock in the low bits
+     * that covers it and unwaiting.
+     */
+    uintptr_t wait;
+    int unwaiting;
     bool waited;
+
+    unsigned char priority; /* Set using atomic ops */
+    unsigned char requeues; /* Times run again in a row, covered by runq */
+    unsigned char level;    /* Ready list the tasklet is on, ditto */
+
     struct tasklet *wait_next; /* Covered by wait's mutex */
     struct tasklet *wait_prev; /* Ditto */
 
@@ -32,15 +52,94 @@ struct wait_list {
 
 struct run_queue *run_queue_create(void);
 
-/* Set the preferred run queue for this thread. */
+/* Destroy a run queue made by run_queue_create.  The tasklets still
+ * runnable on it, and the timers armed from it, move to 'dest', or if that
+ * is NULL, to where tasklet_run would put them from the calling thread.
+ * No thread may still be serving or targeting the run queue, and no
+ * tasklet_fd or tasklet_io may still be using it.  Its memory is freed
+ * once no other thread can still be looking at it.
+ */
+void run_queue_destroy(struct run_queue *runq, struct run_queue *dest);
+
+/* Start the default scheduler with 'workers' run queues, each served by a
+ * worker thread pinned to a CPU.  0 means one per CPU that the process may
+ * run on.  Tasklets that are run without a targeted run queue go to the
+ * queue for the current CPU.
+ *
+ * Without a call to this, the scheduler starts with one queue per CPU the
+ * first time it is needed.  Returns EBUSY if it has already started.
+ */
+int tasklet_scheduler_init(unsigned int workers);
+
+/* Set the preferred run queue for this thread, overriding the default
+ * scheduler.  NULL restores the default.
+ */
 void run_queue_target(struct run_queue *runq);
 
-/* Serve a run queue.  Returns once the run queue is drained.
- * If 'wait' is set, waits until tasklets arrive.
+/* Serve a run queue.  Returns once the run queue is drained, or its budget
+ * is used up.  If 'wait' is set, waits until tasklets arrive.
  */
 void run_queue_run(struct run_queue *runq, int wait);
 
+/* Limit how long each run_queue_run call serves the run queue, so that a
+ * thread serving several queues gets round them all.  'tasklets' is the
+ * number of tasklets to run, and 'ns' the time in nanoseconds to run them
+ * for (checked after each tasklet).  0 means no limit.
+ */
+void run_queue_set_budget(struct run_queue *runq, unsigned int tasklets,
+                          uint64_t ns);
+
+/* Scheduling statistics, kept per run queue while enabled. */
+#define TASKLET_STATS_BUCKETS 32
+
+/* buckets[i] counts the values from 2^i up to 2^(i+1) - 1, except that
+ * buckets[0] also counts 0, and the last bucket everything too big for it.
+ */
+struct tasklet_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[TASKLET_STATS_BUCKETS];
+};
+
+struct tasklet_stats {
+    uint64_t ran;               /* Handlers run */
+    uint64_t requeues;          /* Made runnable again while running */
+    uint64_t transfer_failures; /* mutex_transfer to a tasklet failed */
+    uint64_t idle_ns;           /* Time spent waiting for tasklets */
+
+    /* From being made runnable to being run, in nanoseconds.  Sampled:
+     * each run queue times one tasklet at a time.
+     */
+    struct tasklet_histogram latency;
+    struct tasklet_histogram handler; /* Handler run times, in ns */
+    struct tasklet_histogram depth;   /* Ready tasklets, at each pick */
+};
+
+/* Start, stop and reset the statistics.  Run the program with
+ * TASKLET_STATS=1 in the environment to start them at startup and print
+ * a report to stderr at exit.
+ */
+void tasklet_stats_start(void);
+void tasklet_stats_stop(void);
+void tasklet_stats_reset(void);
+
+/* Copy a run queue's statistics. */
+void run_queue_get_stats(struct run_queue *runq, struct tasklet_stats *stats);
+
+/* Write a line for each run queue to 'fd'.  Returns the number of run
+ * queues.
+ */
+int tasklet_stats_report(int fd);
+
 void tasklet_init(struct tasklet *tasklet, struct mutex *mutex, void *data);
+
+/* Tasklets start as TASKLET_PRIORITY_NORMAL.  A new priority applies from
+ * the next time the tasklet is queued.  A tasklet that keeps making itself
+ * runnable again (e.g. with tasklet_later) is run one class lower until it
+ * waits.
+ */
+void tasklet_set_priority(struct tasklet *t, enum tasklet_priority prio);
 void tasklet_fini(struct tasklet *t);
 void tasklet_stop(struct tasklet *t);
 void tasklet_run(struct tasklet *t);
@@ -74,4 +173,382 @@ bool wait_list_nonempty(struct wait_list *w);
 void wait_list_wait(struct wait_list *w, struct tasklet *t);
 void wait_list_broadcast(struct wait_list *w);
 
+/* Run the first waiting tasklet, which stays on the wait_list, and move it
+ * to the back.  For waiters that recheck their condition when run, this
+ * wakes one at a time without counting.
+ */
+void wait_list_wake_one(struct wait_list *w);
+
+/* Remove the tasklet from the wait_list it is on, if any. */
+void tasklet_unwait(struct tasklet *t);
+
+/* Tasklet mutexes.
+ *
+ * A tasklet_mutex is held by a tasklet rather than a thread, across as many
+ * runs of its handler as it likes.  tasklet_mutex_lock either takes it and
+ * returns true, or queues the tasklet on the mutex's wait_list and returns
+ * false, so that the handler can return and the worker thread carries on
+ * with other tasklets.  Waiters get the mutex in FIFO order: unlocking it
+ * reserves it for the first waiter and runs that tasklet, whose next
+ * tasklet_mutex_lock then succeeds.  If that tasklet is stopped instead,
+ * the reservation passes to the next waiter.
+ */
+struct tasklet_mutex {
+    struct wait_list waiters; /* up_count is 1 while it is unlocked */
+};
+
+void tasklet_mutex_init(struct tasklet_mutex *m);
+void tasklet_mutex_fini(struct tasklet_mutex *m);
+bool tasklet_mutex_lock(struct tasklet_mutex *m, struct tasklet *t);
+
+/* Take the mutex only if it is unlocked and no tasklet is waiting for it. */
+bool tasklet_mutex_trylock(struct tasklet_mutex *m);
+
+/* Any thread or tasklet may unlock the mutex on behalf of its holder. */
+void tasklet_mutex_unlock(struct tasklet_mutex *m);
+
+/* Timers.
+ *
+ * Times are in nanoseconds on the CLOCK_MONOTONIC clock, as returned by
+ * tasklet_now.  A tasklet_timer belongs to one tasklet, and lets it wait
+ * until a deadline, alone or together with a wait_list.  While armed, the
+ * timer sits on the timing wheel of the run queue of the thread that armed
+ * it, and the run queue's worker fires it, to a resolution of about a
+ * millisecond.  A timer whose wait completes first is cancelled in O(1).
+ *
+ * Call tasklet_timer_fini with the tasklet's mutex held, before
+ * tasklet_fini.
+ */
+struct tasklet_timer {
+    struct tasklet *tasklet;
+    struct run_queue *runq; /* Whose wheel the timer is on, or NULL */
+    uint64_t expires;       /* In ticks of the wheel */
+    unsigned int slot;
+    struct tasklet_timer *next;   /* Covered by the wheel's mutex */
+    struct tasklet_timer **pprev; /* Ditto */
+    struct wait_list sleep;
+};
+
+uint64_t tasklet_now(void);
+
+void tasklet_timer_init(struct tasklet_timer *timer, struct tasklet *t);
+void tasklet_timer_fini(struct tasklet_timer *timer);
+
+/* Disarm the timer, if it is armed. */
+void tasklet_timer_cancel(struct tasklet_timer *timer);
+
+/* Return true if "deadline" has passed.  Otherwise arrange for the tasklet
+ * to be run when it does, and return false.
+ */
+bool tasklet_sleep_until(struct tasklet_timer *timer, uint64_t deadline);
+
+/* Like wait_list_down, but also returns true once "deadline" has passed,
+ * setting "timed_out" to say which happened.  On a timeout, the tasklet is
+ * no longer waiting on the wait_list.
+ */
+bool wait_list_down_timed(struct wait_list *w, int n,
+                          struct tasklet_timer *timer, uint64_t deadline,
+                          bool *timed_out);
+
+/* Channels.
+ *
+ * A tasklet_chan is a bounded multi-producer, multi-consumer queue of
+ * pointers.  Its capacity is rounded up to a power of two, and is at least
+ * 2.  Sending and receiving are lock-free while they need not wait: the
+ * ring follows Vyukov's bounded MPMC queue, and the channel's locks are
+ * only taken to wake a waiting tasklet.
+ *
+ * Like wait_list_down, tasklet_chan_send and tasklet_chan_recv either
+ * complete at once, or arrange for the tasklet to be run again when they
+ * might succeed.  They return 0 on success, EAGAIN if the tasklet should
+ * wait, or EPIPE once the channel is closed: for senders as soon as it is
+ * closed, and for receivers once the messages sent before that have been
+ * received.
+ */
+#define TASKLET_CHAN_CACHE_LINE 64
+
+enum { TASKLET_CHAN_RECV, TASKLET_CHAN_SEND };
+
+struct tasklet_chan_cell;
+struct tasklet_chan_case;
+
+struct tasklet_chan {
+    /* Where the next message is sent, with the closed flag in the top
+     * bit.  Set using atomic ops.
+     */
+    unsigned long send_pos __attribute__((aligned(TASKLET_CHAN_CACHE_LINE)));
+
+    /* Where the next message is received from.  Set using atomic ops. */
+    unsigned long recv_pos __attribute__((aligned(TASKLET_CHAN_CACHE_LINE)));
+
+    struct tasklet_chan_cell *cells
+        __attribute__((aligned(TASKLET_CHAN_CACHE_LINE)));
+    unsigned long mask;
+
+    /* Tasklets waiting in tasklet_chan_recv and tasklet_chan_send */
+    struct wait_list waiting[2];
+
+    /* tasklet_select cases waiting on the channel.  The counts are set
+     * using atomic ops, and the lists are covered by mutex.
+     */
+    struct mutex mutex;
+    unsigned int watching[2];
+    struct tasklet_chan_case *watchers[2];
+};
+
+/* Returns 0, or ENOMEM. */
+int tasklet_chan_init(struct tasklet_chan *c, unsigned int capacity);
+
+/* Any tasklets still waiting are made runnable. */
+void tasklet_chan_fini(struct tasklet_chan *c);
+
+int tasklet_chan_send(struct tasklet_chan *c, void *msg, struct tasklet *t);
+int tasklet_chan_recv(struct tasklet_chan *c, void **msgp, struct tasklet *t);
+
+/* Close the channel, and wake all the tasklets waiting on it.  Closing a
+ * closed channel does nothing.
+ */
+void tasklet_chan_close(struct tasklet_chan *c);
+
+/* Select over several channels.
+ *
+ * A tasklet_select holds an array of cases, each a send or receive on a
+ * channel.  tasklet_select tries them, starting from a different case each
+ * time for fairness, and completes the first that can proceed, returning
+ * its index with its "result" set to 0 or EPIPE (and "msg" set, for a
+ * receive).  If none can, it returns -1 and the tasklet is run again when
+ * one of the channels changes.
+ */
+struct tasklet_chan_case {
+    struct tasklet_chan *chan;
+    int op; /* TASKLET_CHAN_SEND or TASKLET_CHAN_RECV */
+    void *msg;
+    int result;
+
+    struct tasklet_select *select;
+    struct tasklet_chan_case *watch_next; /* Covered by chan's mutex */
+    struct tasklet_chan_case *watch_prev; /* Ditto */
+};
+
+struct tasklet_select {
+    struct tasklet *tasklet;
+    struct tasklet_chan_case *cases;
+    unsigned int n;
+    unsigned int start;
+    bool watching;
+    struct wait_list wake;
+};
+
+void tasklet_select_init(struct tasklet_select *s, struct tasklet *t,
+                         struct tasklet_chan_case *cases, unsigned int n);
+void tasklet_select_fini(struct tasklet_select *s);
+int tasklet_select(struct tasklet_select *s);
+
+/* Joining.
+ *
+ * A tasklet_join is completed once, with a result, typically by the
+ * tasklet it belongs to as it finishes.  Like wait_list_down, tasklet_join
+ * either returns true with the result, or arranges for the waiting tasklet
+ * to be run once the join completes and returns false.  A thread that is
+ * not serving a run queue can block in tasklet_join_blocking instead.
+ */
+struct tasklet_join {
+    unsigned int state; /* Set using atomic ops */
+    void *result;
+    struct wait_list waiters;
+};
+
+void tasklet_join_init(struct tasklet_join *j);
+
+/* Any tasklets still waiting are made runnable. */
+void tasklet_join_fini(struct tasklet_join *j);
+
+void tasklet_join_complete(struct tasklet_join *j, void *result);
+bool tasklet_join(struct tasklet_join *j, struct tasklet *t, void **resultp);
+void *tasklet_join_blocking(struct tasklet_join *j);
+
+/* A tasklet_group completes when all of its children have called
+ * tasklet_group_done.  It starts with 'n' children.  tasklet_group_add adds
+ * more, but only while the group has not completed, e.g. from a child that
+ * has not yet called tasklet_group_done.
+ */
+struct tasklet_group {
+    unsigned int pending; /* Set using atomic ops */
+    struct tasklet_join join;
+};
+
+void tasklet_group_init(struct tasklet_group *g, unsigned int n);
+void tasklet_group_fini(struct tasklet_group *g);
+void tasklet_group_add(struct tasklet_group *g, unsigned int n);
+void tasklet_group_done(struct tasklet_group *g);
+
+static inline bool tasklet_group_join(struct tasklet_group *g,
+                                      struct tasklet *t)
+{
+    return tasklet_join(&g->join, t, NULL);
+}
+
+static inline void tasklet_group_join_blocking(struct tasklet_group *g)
+{
+    tasklet_join_blocking(&g->join);
+}
+
+/* Stackful coroutines.
+ *
+ * A tasklet_coro is a tasklet whose handler runs a function on a stack of
+ * its own, so that the function can wait in the middle, in blocking style:
+ * tasklet_coro_suspend returns to the run queue, and the coroutine resumes
+ * where it left off the next time its tasklet is run.  So any of the calls
+ * that either succeed or arrange for a tasklet to be run later (wait_list,
+ * tasklet_fd, tasklet_io, timers, channels, joins, tasklet mutexes) can be
+ * used inline, by passing &co->tasklet and suspending until they succeed,
+ * which tasklet_coro_await does.
+ *
+ * Like any tasklet, the coroutine runs with its mutex held, and it can be
+ * stopped and run again.  It may resume on a different thread from the one
+ * it suspended on.  Once its function returns, the tasklet is stopped and
+ * the stack goes back to a pool.  Stacks are mmap'd, with a guard page
+ * below them so that an overflow faults.
+ */
+#define TASKLET_CORO_STACK_SIZE (64 * 1024)
+
+struct tasklet_coro_stack;
+
+struct tasklet_coro {
+    struct tasklet tasklet;
+    void (*fn)(struct tasklet_coro *co);
+    void *data;
+    struct tasklet_coro_stack *stack; /* NULL once fn has returned */
+};
+
+/* Start the coroutine with tasklet_run(&co->tasklet).  'stack_size' of 0
+ * means TASKLET_CORO_STACK_SIZE.  Returns 0, or ENOMEM.
+ */
+int tasklet_coro_init(struct tasklet_coro *co, struct mutex *mutex,
+                      void (*fn)(struct tasklet_coro *co), void *data,
+                      size_t stack_size);
+
+/* Call with the mutex held.  If the coroutine has not returned, it is
+ * abandoned where it is suspended, without unwinding its stack.
+ */
+void tasklet_coro_fini(struct tasklet_coro *co);
+
+/* Return to the run queue, from within the coroutine.  The caller must have
+ * arranged for the tasklet to be run again, or it never resumes.
+ */
+void tasklet_coro_suspend(struct tasklet_coro *co);
+
+/* Let the other runnable tasklets run, and then resume. */
+void tasklet_coro_yield(struct tasklet_coro *co);
+
+#define tasklet_coro_await(co, cond)      \
+    do {                                  \
+        while (!(cond))                   \
+            tasklet_coro_suspend(co);     \
+    } while (0)
+
+static inline void tasklet_coro_down(struct tasklet_coro *co,
+                                     struct wait_list *w, int n)
+{
+    tasklet_coro_await(co, wait_list_down(w, n, &co->tasklet));
+}
+
+/* Waiting for file descriptors.
+ *
+ * A tasklet_fd registers a file descriptor with the reactor of the calling
+ * thread's run queue, using edge-triggered epoll.  The file descriptor
+ * should be non-blocking.  A tasklet does its I/O until it gets EAGAIN, and
+ * then calls tasklet_fd_wait_readable or tasklet_fd_wait_writable, which,
+ * like wait_list_down, either return true to say the I/O should be tried
+ * again, or arrange for the tasklet to be run when the file descriptor
+ * becomes ready and return false.
+ */
+struct tasklet_fd {
+    int fd;
+    struct reactor *reactor;
+    struct wait_list readable;
+    struct wait_list writable;
+};
+
+/* Returns 0, EEXIST if the file descriptor is already registered with the
+ * same reactor, or an error from creating the reactor or from epoll_ctl.
+ */
+int tasklet_fd_init(struct tasklet_fd *tfd, int fd);
+
+/* Unregister the file descriptor.  Call this before closing it.  Any
+ * tasklets still waiting are made runnable.
+ */
+void tasklet_fd_fini(struct tasklet_fd *tfd);
+
+static inline bool tasklet_fd_wait_readable(struct tasklet_fd *tfd,
+                                            struct tasklet *t)
+{
+    return wait_list_down(&tfd->readable, 1, t);
+}
+
+static inline bool tasklet_fd_wait_writable(struct tasklet_fd *tfd,
+                                            struct tasklet *t)
+{
+    return wait_list_down(&tfd->writable, 1, t);
+}
+
+/* Completion-based I/O.
+ *
+ * A tasklet_io carries out one operation at a time on behalf of a tasklet.
+ * The tasklet starts the operation with one of the tasklet_io_* calls
+ * below, and then calls tasklet_io_wait, which returns true once the
+ * operation has completed, or arranges for the tasklet to be run when it
+ * does and returns false.  The result is then in "result": what the
+ * corresponding system call would return, or a negated errno value.
+ *
+ * Operations are done with an io_uring for each run queue where the kernel
+ * supports it, and otherwise by a pool of helper threads.  Setting the
+ * TASKLET_IO_URING environment variable to 0 forces the latter.  A helper
+ * is tied up for as long as its operation blocks, e.g. an accept on an
+ * idle socket, so the pool grows on demand, up to 256 threads.  Beyond
+ * that, operations queue until a helper is free.  Unlike
+ * with tasklet_fd, the file descriptor may be blocking, and may be a
+ * regular file.  The buffer and the tasklet_io must remain valid until the
+ * operation completes.
+ */
+enum {
+    TASKLET_IO_READ,
+    TASKLET_IO_WRITE,
+    TASKLET_IO_FSYNC,
+    TASKLET_IO_ACCEPT
+};
+
+struct tasklet_io {
+    struct wait_list done;
+    int op;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    struct sockaddr *addr;
+    socklen_t *addrlen;
+    ssize_t result;
+    struct tasklet_io *helper_next; /* Queued for a helper thread */
+};
+
+void tasklet_io_init(struct tasklet_io *io);
+void tasklet_io_fini(struct tasklet_io *io);
+
+/* These return 0 if the operation was started, or an error such as
+ * ENOMEM, or EAGAIN if too many operations are already queued.  An offset
+ * of -1 means the current file position.
+ */
+int tasklet_io_read(struct tasklet_io *io, int fd, void *buf, size_t len,
+                    off_t offset);
+int tasklet_io_write(struct tasklet_io *io, int fd, const void *buf,
+                     size_t len, off_t offset);
+int tasklet_io_fsync(struct tasklet_io *io, int fd);
+int tasklet_io_accept(struct tasklet_io *io, int fd, struct sockaddr *addr,
+                      socklen_t *addrlen);
+
+static inline bool tasklet_io_wait(struct tasklet_io *io, struct tasklet *t)
+{
+    return wait_list_down(&io->done, 1, t);
+}
+
 #endif
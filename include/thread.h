@@ -4,8 +4,10 @@
 #include <assert.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "skinny_mutex.h"
+#include "skinny_sync.h"
 
 typedef pthread_t thread_handle_t;
 static inline thread_handle_t thread_handle_current(void)
@@ -28,25 +30,46 @@ static inline thread_handle_t thread_get_handle(struct thread *thr)
 
 void thread_signal(thread_handle_t thr, int sig);
 
+/* Restrict a thread to run only on the given CPU.  Returns 0 or an error
+ * code from pthread_setaffinity_np.
+ */
+int thread_set_cpu(thread_handle_t thr, int cpu);
+
+/* Whether a mutex is held is read from its skinny word, so a struct mutex
+ * is a single word.  In error-checking builds, mutex_init and cond_init
+ * also allocate a byte that their _fini functions free, so that valgrind
+ * reports any that are never finalized.
+ */
 struct mutex {
     skinny_mutex_t mutex;
-    bool held;
+#ifdef SKINNY_MUTEX_ERRORCHECK
     void *init;
+#endif
 };
 
 struct cond {
     pthread_cond_t cond;
+#ifdef SKINNY_MUTEX_ERRORCHECK
     void *init;
+#endif
 };
 
-#define MUTEX_INITIALIZER                     \
-    {                                         \
-        SKINNY_MUTEX_INITIALIZER, FALSE, NULL \
+#ifdef SKINNY_MUTEX_ERRORCHECK
+#define MUTEX_INITIALIZER               \
+    {                                   \
+        SKINNY_MUTEX_INITIALIZER, NULL  \
     }
+#else
+#define MUTEX_INITIALIZER         \
+    {                             \
+        SKINNY_MUTEX_INITIALIZER  \
+    }
+#endif
 
 void mutex_init(struct mutex *m);
 void mutex_fini(struct mutex *m);
 void mutex_lock(struct mutex *m);
+bool mutex_trylock(struct mutex *m);
 void mutex_unlock(struct mutex *m);
 bool mutex_transfer(struct mutex *a, struct mutex *b);
 void mutex_veto_transfer(struct mutex *m);
@@ -59,35 +82,42 @@ static inline void mutex_unlock_fini(struct mutex *m)
 
 static inline void mutex_assert_held(struct mutex *m)
 {
-    assert(m->held);
+    assert(skinny_mutex_held_by_self(&m->mutex));
 }
 
 void cond_init(struct cond *c);
 void cond_fini(struct cond *c);
 void cond_wait(struct cond *c, struct mutex *m);
+
+/* Like cond_wait, but returns once CLOCK_MONOTONIC reaches "abstime". */
+void cond_timedwait(struct cond *c, struct mutex *m,
+                    const struct timespec *abstime);
 void cond_signal(struct cond *c);
 void cond_broadcast(struct cond *c);
 
 struct tls_var {
-    pthread_once_t once;
+    skinny_once_t once;
     pthread_key_t key;
 };
 
-#define TLS_VAR_DECLARE_STATIC(name)                       \
-    static pthread_once_t name##_once = PTHREAD_ONCE_INIT; \
-    static pthread_key_t name##_key;                       \
-                                                           \
-    static void name##_once_func(void)                     \
-    {                                                      \
-        pthread_key_create(&name##_key, NULL);             \
+/* skinny_once keeps the check that the key has been created inline, where
+ * pthread_once would be a library call on every access.
+ */
+#define TLS_VAR_DECLARE_STATIC(name)                      \
+    static skinny_once_t name##_once = SKINNY_ONCE_INIT; \
+    static pthread_key_t name##_key;                      \
+                                                          \
+    static void name##_once_func(void)                    \
+    {                                                     \
+        pthread_key_create(&name##_key, NULL);            \
     }
 
-#define TLS_VAR_GET(name)                          \
-    (pthread_once(&name##_once, name##_once_func), \
+#define TLS_VAR_GET(name)                         \
+    (skinny_once(&name##_once, name##_once_func), \
      pthread_getspecific(name##_key))
 
-#define TLS_VAR_SET(name, val)                     \
-    (pthread_once(&name##_once, name##_once_func), \
+#define TLS_VAR_SET(name, val)                    \
+    (skinny_once(&name##_once, name##_once_func), \
      pthread_setspecific(name##_key, val))
 
 #endif
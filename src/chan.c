@@ -0,0 +1,325 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "atomics.h"
+#include "tasklet.h"
+
+/* The top bit of send_pos says that the channel is closed.  A closed
+   channel's send_pos never changes again, because senders CAS it. */
+#define CHAN_CLOSED (~0UL ^ (~0UL >> 1))
+
+/* The ring is Vyukov's bounded MPMC queue.  Each cell's sequence number
+   says whose turn it is: it equals the position of the sender that may
+   fill it, and then that position plus one until a receiver empties it,
+   when it moves on by a lap to the next sender's position. */
+struct tasklet_chan_cell {
+    unsigned long seq;
+    void *msg;
+};
+
+int tasklet_chan_init(struct tasklet_chan *c, unsigned int capacity)
+{
+    unsigned long size = 2;
+
+    while (size < capacity)
+        size <<= 1;
+
+    c->cells = malloc(size * sizeof *c->cells);
+    if (!c->cells)
+        return ENOMEM;
+
+    for (unsigned long i = 0; i < size; i++)
+        c->cells[i].seq = i;
+
+    c->mask = size - 1;
+    c->send_pos = c->recv_pos = 0;
+    wait_list_init(&c->waiting[TASKLET_CHAN_RECV], 0);
+    wait_list_init(&c->waiting[TASKLET_CHAN_SEND], 0);
+    mutex_init(&c->mutex);
+    c->watching[TASKLET_CHAN_RECV] = c->watching[TASKLET_CHAN_SEND] = 0;
+    c->watchers[TASKLET_CHAN_RECV] = c->watchers[TASKLET_CHAN_SEND] = NULL;
+    return 0;
+}
+
+void tasklet_chan_fini(struct tasklet_chan *c)
+{
+    assert(!c->watchers[TASKLET_CHAN_RECV] && !c->watchers[TASKLET_CHAN_SEND]);
+
+    wait_list_fini(&c->waiting[TASKLET_CHAN_RECV]);
+    wait_list_fini(&c->waiting[TASKLET_CHAN_SEND]);
+    mutex_fini(&c->mutex);
+    free(c->cells);
+}
+
+static int chan_try_send(struct tasklet_chan *c, void *msg)
+{
+    unsigned long pos = atomic_load_order(&c->send_pos, ATOMIC_RELAXED);
+
+    for (;;) {
+        struct tasklet_chan_cell *cell;
+        long diff;
+
+        if (pos & CHAN_CLOSED)
+            return EPIPE;
+
+        cell = &c->cells[pos & c->mask];
+        diff = (long) (atomic_load_order(&cell->seq, ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (atomic_cas(&c->send_pos, pos, pos + 1, ATOMIC_RELAXED)) {
+                cell->msg = msg;
+                atomic_store_order(&cell->seq, pos + 1, ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            /* The cell still holds the message from the previous lap */
+            return EAGAIN;
+        }
+
+        pos = atomic_load_order(&c->send_pos, ATOMIC_RELAXED);
+    }
+}
+
+static int chan_try_recv(struct tasklet_chan *c, void **msgp)
+{
+    unsigned long pos = atomic_load_order(&c->recv_pos, ATOMIC_RELAXED);
+
+    for (;;) {
+        struct tasklet_chan_cell *cell = &c->cells[pos & c->mask];
+        long diff;
+
+        diff = (long) (atomic_load_order(&cell->seq, ATOMIC_ACQUIRE)
+                       - (pos + 1));
+        if (diff == 0) {
+            if (atomic_cas(&c->recv_pos, pos, pos + 1, ATOMIC_RELAXED)) {
+                *msgp = cell->msg;
+                atomic_store_order(&cell->seq, pos + c->mask + 1,
+                                   ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            /* The cell is not filled yet.  If the channel is closed and
+               no sender claimed it first, it never will be. */
+            unsigned long send_pos
+                = atomic_load_order(&c->send_pos, ATOMIC_ACQUIRE);
+
+            return send_pos == (pos | CHAN_CLOSED) ? EPIPE : EAGAIN;
+        }
+
+        pos = atomic_load_order(&c->recv_pos, ATOMIC_RELAXED);
+    }
+}
+
+/* Wake the selects watching for "op" to become possible. */
+static void chan_wake_watchers(struct tasklet_chan *c, int op)
+{
+    mutex_lock(&c->mutex);
+
+    for (struct tasklet_chan_case *cs = c->watchers[op]; cs;
+         cs = cs->watch_next)
+        wait_list_broadcast(&cs->select->wake);
+
+    mutex_unlock(&c->mutex);
+}
+
+/* Having completed an operation, wake whatever waits for "op" to become
+   possible as a result. */
+static void chan_notify(struct tasklet_chan *c, int op)
+{
+    /* Pairs with the fences in tasklet_chan_send, tasklet_chan_recv and
+       tasklet_select: either we see the waiter, or its retry sees the
+       operation we completed. */
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    if (wait_list_nonempty(&c->waiting[op]))
+        wait_list_wake_one(&c->waiting[op]);
+
+    if (atomic_load_order(&c->watching[op], ATOMIC_RELAXED))
+        chan_wake_watchers(c, op);
+}
+
+/* Once a tasklet is done with the channel, take it off the wait_list, so
+   that it does not soak up wakeups meant for tasklets still waiting.  Only
+   the tasklet itself puts it on a wait_list, so if it is on none, that
+   cannot change under us. */
+static void chan_unwait(struct tasklet *t)
+{
+    if (atomic_load_order(&t->wait, ATOMIC_RELAXED))
+        tasklet_unwait(t);
+}
+
+int tasklet_chan_send(struct tasklet_chan *c, void *msg, struct tasklet *t)
+{
+    int res = chan_try_send(c, msg);
+
+    if (res == EAGAIN) {
+        wait_list_wait(&c->waiting[TASKLET_CHAN_SEND], t);
+        atomic_fence(ATOMIC_SEQ_CST);
+        res = chan_try_send(c, msg);
+        if (res == EAGAIN)
+            return EAGAIN;
+    }
+
+    chan_unwait(t);
+    if (!res)
+        chan_notify(c, TASKLET_CHAN_RECV);
+
+    return res;
+}
+
+int tasklet_chan_recv(struct tasklet_chan *c, void **msgp, struct tasklet *t)
+{
+    int res = chan_try_recv(c, msgp);
+
+    if (res == EAGAIN) {
+        wait_list_wait(&c->waiting[TASKLET_CHAN_RECV], t);
+        atomic_fence(ATOMIC_SEQ_CST);
+        res = chan_try_recv(c, msgp);
+        if (res == EAGAIN)
+            return EAGAIN;
+    }
+
+    chan_unwait(t);
+    if (!res)
+        chan_notify(c, TASKLET_CHAN_SEND);
+
+    return res;
+}
+
+void tasklet_chan_close(struct tasklet_chan *c)
+{
+    unsigned long pos = atomic_load_order(&c->send_pos, ATOMIC_RELAXED);
+
+    for (;;) {
+        if (pos & CHAN_CLOSED)
+            return;
+
+        if (atomic_cas(&c->send_pos, pos, pos | CHAN_CLOSED, ATOMIC_RELEASE))
+            break;
+
+        pos = atomic_load_order(&c->send_pos, ATOMIC_RELAXED);
+    }
+
+    /* Waiters join under these mutexes before they retry, so no fence is
+       needed to be sure of seeing them. */
+    wait_list_broadcast(&c->waiting[TASKLET_CHAN_RECV]);
+    wait_list_broadcast(&c->waiting[TASKLET_CHAN_SEND]);
+    chan_wake_watchers(c, TASKLET_CHAN_RECV);
+    chan_wake_watchers(c, TASKLET_CHAN_SEND);
+}
+
+void tasklet_select_init(struct tasklet_select *s, struct tasklet *t,
+                         struct tasklet_chan_case *cases, unsigned int n)
+{
+    s->tasklet = t;
+    s->cases = cases;
+    s->n = n;
+    s->start = 0;
+    s->watching = false;
+    wait_list_init(&s->wake, 0);
+
+    for (unsigned int i = 0; i < n; i++)
+        cases[i].select = s;
+}
+
+static void select_watch(struct tasklet_select *s)
+{
+    for (unsigned int i = 0; i < s->n; i++) {
+        struct tasklet_chan_case *cs = &s->cases[i];
+        struct tasklet_chan *c = cs->chan;
+
+        mutex_lock(&c->mutex);
+        cs->watch_prev = NULL;
+        cs->watch_next = c->watchers[cs->op];
+        if (cs->watch_next)
+            cs->watch_next->watch_prev = cs;
+
+        c->watchers[cs->op] = cs;
+        atomic_add_fetch_order(&c->watching[cs->op], 1, ATOMIC_RELAXED);
+        mutex_unlock(&c->mutex);
+    }
+
+    s->watching = true;
+}
+
+static void select_unwatch(struct tasklet_select *s)
+{
+    if (!s->watching)
+        return;
+
+    for (unsigned int i = 0; i < s->n; i++) {
+        struct tasklet_chan_case *cs = &s->cases[i];
+        struct tasklet_chan *c = cs->chan;
+
+        mutex_lock(&c->mutex);
+        if (cs->watch_prev)
+            cs->watch_prev->watch_next = cs->watch_next;
+        else
+            c->watchers[cs->op] = cs->watch_next;
+
+        if (cs->watch_next)
+            cs->watch_next->watch_prev = cs->watch_prev;
+
+        atomic_add_fetch_order(&c->watching[cs->op], -1, ATOMIC_RELAXED);
+        mutex_unlock(&c->mutex);
+    }
+
+    s->watching = false;
+}
+
+void tasklet_select_fini(struct tasklet_select *s)
+{
+    select_unwatch(s);
+    wait_list_fini(&s->wake);
+}
+
+/* Try each case once, starting after the case that completed last time,
+   so that a busy channel cannot starve the others. */
+static int select_try(struct tasklet_select *s)
+{
+    for (unsigned int i = 0; i < s->n; i++) {
+        unsigned int j = (s->start + i) % s->n;
+        struct tasklet_chan_case *cs = &s->cases[j];
+        int res;
+
+        if (cs->op == TASKLET_CHAN_SEND)
+            res = chan_try_send(cs->chan, cs->msg);
+        else
+            res = chan_try_recv(cs->chan, &cs->msg);
+
+        if (res != EAGAIN) {
+            cs->result = res;
+            if (!res)
+                chan_notify(cs->chan, cs->op == TASKLET_CHAN_SEND
+                                          ? TASKLET_CHAN_RECV
+                                          : TASKLET_CHAN_SEND);
+
+            s->start = (j + 1) % s->n;
+            return j;
+        }
+    }
+
+    return -1;
+}
+
+int tasklet_select(struct tasklet_select *s)
+{
+    int i = select_try(s);
+
+    if (i < 0) {
+        /* Join the wake list before watching the channels, so that
+           whoever sees us watching will find us on it. */
+        wait_list_wait(&s->wake, s->tasklet);
+        if (!s->watching)
+            select_watch(s);
+
+        atomic_fence(ATOMIC_SEQ_CST);
+        i = select_try(s);
+        if (i < 0)
+            return -1;
+    }
+
+    select_unwatch(s);
+    chan_unwait(s->tasklet);
+    return i;
+}
@@ -0,0 +1,289 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The context switch is hand-written for x86-64.  Elsewhere, or when built
+   with -DTASKLET_CORO_UCONTEXT, it falls back to swapcontext, which also
+   saves and restores the signal mask with a system call each time. */
+#if !defined(__x86_64__) || defined(TASKLET_CORO_UCONTEXT)
+#define CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#ifdef __SANITIZE_THREAD__
+#include <sanitizer/tsan_interface.h>
+#endif
+
+#include "skinny_mutex.h"
+#include "tasklet.h"
+
+/* How many free stacks to keep for reuse */
+#define CORO_POOL_MAX 64
+
+/* A stack is a single mapping: a guard page at the bottom, then the stack
+   itself, with this header at the very top. */
+struct tasklet_coro_stack {
+    size_t size;                     /* Of the whole mapping */
+    struct tasklet_coro_stack *next; /* In the pool */
+#ifdef CORO_UCONTEXT
+    ucontext_t ctx;
+    ucontext_t caller_ctx;
+#else
+    void *sp;
+    void *caller_sp;
+#endif
+#ifdef __SANITIZE_THREAD__
+    void *fiber;
+    void *caller_fiber;
+#endif
+};
+
+static skinny_mutex_t pool_mutex = SKINNY_MUTEX_INITIALIZER;
+static struct tasklet_coro_stack *pool;
+static unsigned int pool_count;
+
+/* The coroutine running on this thread, if any */
+static __thread struct tasklet_coro *current;
+
+static struct tasklet_coro_stack *coro_stack_get(size_t stack_size)
+{
+    size_t page = sysconf(_SC_PAGESIZE), size;
+    struct tasklet_coro_stack **pp, *s;
+    char *base;
+
+    size = (stack_size + sizeof *s + page - 1) / page * page + page;
+
+    skinny_mutex_lock(&pool_mutex);
+    for (pp = &pool; (s = *pp); pp = &s->next) {
+        if (s->size == size) {
+            *pp = s->next;
+            pool_count--;
+            break;
+        }
+    }
+    skinny_mutex_unlock(&pool_mutex);
+
+    if (s)
+        return s;
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    if (mprotect(base, page, PROT_NONE)) {
+        munmap(base, size);
+        return NULL;
+    }
+
+    s = (struct tasklet_coro_stack *) (base + size) - 1;
+    s->size = size;
+    return s;
+}
+
+static void coro_stack_put(struct tasklet_coro_stack *s)
+{
+#ifdef __SANITIZE_THREAD__
+    __tsan_destroy_fiber(s->fiber);
+#endif
+
+    skinny_mutex_lock(&pool_mutex);
+    if (pool_count < CORO_POOL_MAX) {
+        s->next = pool;
+        pool = s;
+        pool_count++;
+        s = NULL;
+    }
+    skinny_mutex_unlock(&pool_mutex);
+
+    if (s)
+        munmap((char *) (s + 1) - s->size, s->size);
+}
+
+#ifndef CORO_UCONTEXT
+/* Push the callee-saved registers and the floating point control words
+   onto the current stack, save the stack pointer in *save, and pop the
+   same from the stack at sp.  A new stack is prepared so that this
+   "returns" to tasklet_coro_entry, which calls the function in r13 with
+   the argument in r12. */
+void tasklet_coro_switch(void **save, void *sp)
+    __attribute__((visibility("hidden")));
+void tasklet_coro_entry(void) __attribute__((visibility("hidden")));
+
+__asm__(".text\n"
+        ".p2align 4\n"
+        ".globl tasklet_coro_switch\n"
+        ".hidden tasklet_coro_switch\n"
+        ".type tasklet_coro_switch, @function\n"
+        "tasklet_coro_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size tasklet_coro_switch, .-tasklet_coro_switch\n"
+        ".p2align 4\n"
+        ".globl tasklet_coro_entry\n"
+        ".hidden tasklet_coro_entry\n"
+        ".type tasklet_coro_entry, @function\n"
+        "tasklet_coro_entry:\n"
+        "    movq %r12, %rdi\n"
+        "    call *%r13\n"
+        "    ud2\n"
+        ".size tasklet_coro_entry, .-tasklet_coro_entry\n");
+#endif
+
+static void coro_switch_in(struct tasklet_coro_stack *s)
+{
+#ifdef __SANITIZE_THREAD__
+    s->caller_fiber = __tsan_get_current_fiber();
+    __tsan_switch_to_fiber(s->fiber, 0);
+#endif
+#ifdef CORO_UCONTEXT
+    swapcontext(&s->caller_ctx, &s->ctx);
+#else
+    tasklet_coro_switch(&s->caller_sp, s->sp);
+#endif
+}
+
+static void coro_switch_out(struct tasklet_coro_stack *s)
+{
+#ifdef __SANITIZE_THREAD__
+    __tsan_switch_to_fiber(s->caller_fiber, 0);
+#endif
+#ifdef CORO_UCONTEXT
+    swapcontext(&s->ctx, &s->caller_ctx);
+#else
+    tasklet_coro_switch(&s->sp, s->caller_sp);
+#endif
+}
+
+static void coro_main(struct tasklet_coro *co)
+{
+    struct tasklet_coro_stack *s = co->stack;
+
+    co->fn(co);
+
+    /* coro_handler puts the stack back once we are off it */
+    co->stack = NULL;
+    tasklet_stop(&co->tasklet);
+    coro_switch_out(s);
+    abort();
+}
+
+#ifdef CORO_UCONTEXT
+/* makecontext only passes int arguments */
+static void coro_main_ucontext(unsigned int hi, unsigned int lo)
+{
+    coro_main((struct tasklet_coro *) (uintptr_t) ((uint64_t) hi << 32 | lo));
+}
+#endif
+
+/* Set up the stack so that the first switch to it enters coro_main. */
+static void coro_prepare(struct tasklet_coro_stack *s, struct tasklet_coro *co)
+{
+#ifdef CORO_UCONTEXT
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *bottom = (char *) (s + 1) - s->size + page;
+    uint64_t arg = (uintptr_t) co;
+
+    getcontext(&s->ctx);
+    s->ctx.uc_stack.ss_sp = bottom;
+    s->ctx.uc_stack.ss_size = (char *) s - bottom;
+    s->ctx.uc_link = NULL;
+    makecontext(&s->ctx, (void (*)(void)) coro_main_ucontext, 2,
+                (unsigned int) (arg >> 32), (unsigned int) arg);
+#else
+    uint64_t *sp = (uint64_t *) ((uintptr_t) s & ~(uintptr_t) 15) - 8;
+
+    sp[0] = 0x1f80 | (uint64_t) 0x37f << 32; /* Default MXCSR, x87 CW */
+    sp[1] = 0;                               /* r15 */
+    sp[2] = 0;                               /* r14 */
+    sp[3] = (uintptr_t) coro_main;           /* r13 */
+    sp[4] = (uintptr_t) co;                  /* r12 */
+    sp[5] = 0;                               /* rbx */
+    sp[6] = 0;                               /* rbp */
+    sp[7] = (uintptr_t) tasklet_coro_entry;  /* Return address */
+    s->sp = sp;
+#endif
+#ifdef __SANITIZE_THREAD__
+    s->fiber = __tsan_create_fiber(0);
+#endif
+}
+
+static void coro_handler(void *v_co)
+{
+    struct tasklet_coro *co = v_co;
+    struct tasklet_coro *was = current;
+    struct tasklet_coro_stack *s = co->stack;
+
+    /* A coroutine can run another tasklet directly with tasklet_goto, and
+       that can be a coroutine too. */
+    current = co;
+    coro_switch_in(s);
+    current = was;
+
+    if (!co->stack)
+        coro_stack_put(s);
+}
+
+int tasklet_coro_init(struct tasklet_coro *co, struct mutex *mutex,
+                      void (*fn)(struct tasklet_coro *co), void *data,
+                      size_t stack_size)
+{
+    co->stack = coro_stack_get(stack_size ? stack_size
+                                          : TASKLET_CORO_STACK_SIZE);
+    if (!co->stack)
+        return ENOMEM;
+
+    tasklet_init(&co->tasklet, mutex, co);
+    co->tasklet.handler = coro_handler;
+    co->fn = fn;
+    co->data = data;
+    coro_prepare(co->stack, co);
+    return 0;
+}
+
+void tasklet_coro_fini(struct tasklet_coro *co)
+{
+    tasklet_fini(&co->tasklet);
+    if (co->stack) {
+        coro_stack_put(co->stack);
+        co->stack = NULL;
+    }
+}
+
+void tasklet_coro_suspend(struct tasklet_coro *co)
+{
+    assert(current == co);
+    coro_switch_out(co->stack);
+}
+
+void tasklet_coro_yield(struct tasklet_coro *co)
+{
+    tasklet_run(&co->tasklet);
+    tasklet_coro_suspend(co);
+}
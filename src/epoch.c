@@ -0,0 +1,274 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "epoch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "atomics.h"
+
+/*
+ * The global epoch advances in steps of EPOCH_STEP, so that the low bit of
+ * a thread's published epoch can say whether it is inside a read-side
+ * section.  The epoch can only advance when every thread inside a section
+ * entered it during the current epoch.  So once the epoch has advanced
+ * twice past the epoch in which an object was deferred, every section that
+ * could have seen the object has ended.
+ *
+ * The memory ordering follows the usual scheme: a thread publishes its
+ * epoch and then issues a full fence before reading any shared pointers,
+ * and the thread advancing the epoch issues a full fence before it looks at
+ * the published epochs.
+ */
+#define EPOCH_ACTIVE 1
+#define EPOCH_STEP 2
+
+/* How many entries a thread defers before it tries to reclaim them */
+#define EPOCH_BATCH 16
+
+struct epoch_thread {
+    /* The epoch in which the current read-side section began, with
+     * EPOCH_ACTIVE set, or 0 outside of a section.
+     */
+    unsigned long epoch;
+
+    /* Depth of nested read-side sections */
+    unsigned int nesting;
+
+    /* Is this record owned by a live thread? */
+    bool in_use;
+
+    /* Entries deferred by this thread, oldest first */
+    struct epoch_entry *limbo_head;
+    struct epoch_entry **limbo_tail;
+    unsigned int limbo_count;
+
+    /* All records ever allocated */
+    struct epoch_thread *next;
+};
+
+static unsigned long global_epoch;
+
+/* Thread records are never freed, but are reused when their threads exit */
+static struct epoch_thread *threads;
+
+static __thread struct epoch_thread *self;
+
+/* Used to notice thread exit */
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+/* Entries deferred by threads that have since exited */
+static pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_entry *orphans;
+
+static void thread_exit(void *v_t)
+{
+    struct epoch_thread *t = v_t;
+
+    if (t->limbo_head) {
+        pthread_mutex_lock(&orphans_mutex);
+        *t->limbo_tail = orphans;
+        orphans = t->limbo_head;
+        pthread_mutex_unlock(&orphans_mutex);
+
+        t->limbo_head = NULL;
+        t->limbo_tail = &t->limbo_head;
+        t->limbo_count = 0;
+    }
+
+    /* The thread might have been cancelled inside a section. */
+    t->nesting = 0;
+    atomic_store_order(&t->epoch, 0, ATOMIC_RELEASE);
+
+    self = NULL;
+    atomic_store_order(&t->in_use, false, ATOMIC_RELEASE);
+}
+
+static void create_key(void)
+{
+    /* Without the key, records are simply never reused. */
+    pthread_key_create(&key, thread_exit);
+}
+
+static struct epoch_thread *thread_register(void)
+{
+    struct epoch_thread *t;
+
+    pthread_once(&key_once, create_key);
+
+    for (t = atomic_load_order(&threads, ATOMIC_ACQUIRE); t; t = t->next)
+        if (!atomic_load_order(&t->in_use, ATOMIC_RELAXED) &&
+            atomic_cas(&t->in_use, false, true, ATOMIC_ACQUIRE))
+            goto found;
+
+    t = calloc(1, sizeof *t);
+    if (!t)
+        return NULL;
+
+    t->in_use = true;
+    t->limbo_tail = &t->limbo_head;
+
+    do {
+        t->next = atomic_load_order(&threads, ATOMIC_RELAXED);
+    } while (!atomic_cas(&threads, t->next, t, ATOMIC_RELEASE));
+
+found:
+    pthread_setspecific(key, t);
+    return self = t;
+}
+
+int epoch_enter(void)
+{
+    struct epoch_thread *t = self;
+
+    if (!t) {
+        t = thread_register();
+        if (!t)
+            return ENOMEM;
+    }
+
+    if (!t->nesting++) {
+        unsigned long epoch = atomic_load_order(&global_epoch, ATOMIC_RELAXED);
+
+        atomic_store_order(&t->epoch, epoch | EPOCH_ACTIVE, ATOMIC_RELAXED);
+        atomic_fence(ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
+void epoch_exit(void)
+{
+    struct epoch_thread *t = self;
+
+    if (!--t->nesting)
+        atomic_store_order(&t->epoch, 0, ATOMIC_RELEASE);
+}
+
+/* Advance the global epoch if every thread in a read-side section has
+ * caught up with it.  Returns the resulting global epoch.
+ */
+static unsigned long try_advance(void)
+{
+    unsigned long epoch = atomic_load_order(&global_epoch, ATOMIC_ACQUIRE);
+
+    atomic_fence(ATOMIC_SEQ_CST);
+
+    for (struct epoch_thread *t = atomic_load_order(&threads, ATOMIC_ACQUIRE);
+         t; t = t->next) {
+        unsigned long e = atomic_load_order(&t->epoch, ATOMIC_RELAXED);
+
+        if ((e & EPOCH_ACTIVE) && e != (epoch | EPOCH_ACTIVE))
+            return epoch;
+    }
+
+    /* Pairs with the release in epoch_exit, so that the sections we have
+     * seen end happen before anything deferred is freed.
+     */
+    atomic_fence(ATOMIC_ACQUIRE);
+
+    /* If this fails, another thread advanced it for us. */
+    atomic_cas(&global_epoch, epoch, epoch + EPOCH_STEP, ATOMIC_RELEASE);
+    return atomic_load_order(&global_epoch, ATOMIC_ACQUIRE);
+}
+
+static bool due(struct epoch_entry *entry, unsigned long epoch)
+{
+    return epoch - entry->epoch >= 2 * EPOCH_STEP;
+}
+
+static void collect_orphans(unsigned long epoch)
+{
+    struct epoch_entry *ready = NULL, **p;
+
+    if (!atomic_load_order(&orphans, ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&orphans_mutex);
+    for (p = &orphans; *p;) {
+        struct epoch_entry *entry = *p;
+
+        if (due(entry, epoch)) {
+            *p = entry->next;
+            entry->next = ready;
+            ready = entry;
+        } else {
+            p = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&orphans_mutex);
+
+    while (ready) {
+        struct epoch_entry *entry = ready;
+        ready = entry->next;
+        entry->fn(entry);
+    }
+}
+
+/* Call the deferred functions that have become due. */
+static void collect(struct epoch_thread *t)
+{
+    unsigned long epoch = try_advance();
+
+    while (t->limbo_head && due(t->limbo_head, epoch)) {
+        struct epoch_entry *entry = t->limbo_head;
+
+        t->limbo_head = entry->next;
+        if (!t->limbo_head)
+            t->limbo_tail = &t->limbo_head;
+
+        t->limbo_count--;
+        entry->fn(entry);
+    }
+
+    collect_orphans(epoch);
+}
+
+void epoch_defer(struct epoch_entry *entry,
+                 void (*fn)(struct epoch_entry *entry))
+{
+    struct epoch_thread *t = self;
+
+    if (!t) {
+        t = thread_register();
+        if (!t) {
+            /* Nowhere to put the entry, so wait until it is due. */
+            epoch_synchronize();
+            fn(entry);
+            return;
+        }
+    }
+
+    entry->fn = fn;
+    entry->next = NULL;
+    atomic_fence(ATOMIC_SEQ_CST);
+    entry->epoch = atomic_load_order(&global_epoch, ATOMIC_RELAXED);
+
+    *t->limbo_tail = entry;
+    t->limbo_tail = &entry->next;
+
+    if (++t->limbo_count >= EPOCH_BATCH)
+        collect(t);
+}
+
+void epoch_synchronize(void)
+{
+    unsigned long target;
+
+    atomic_fence(ATOMIC_SEQ_CST);
+    target = atomic_load_order(&global_epoch, ATOMIC_RELAXED) + 2 * EPOCH_STEP;
+
+    while ((long) (try_advance() - target) < 0)
+        sched_yield();
+
+    if (self)
+        collect(self);
+    else
+        collect_orphans(target);
+}
@@ -0,0 +1,109 @@
+#include <assert.h>
+
+#include "atomics.h"
+#include "parking_lot.h"
+#include "tasklet.h"
+
+/* Bits in tasklet_join's state.  A thread sets JOIN_PARKED before it
+   parks on the state, so that tasklet_join_complete only goes to the
+   parking lot when a thread might be there. */
+#define JOIN_DONE 1
+#define JOIN_PARKED 2
+
+void tasklet_join_init(struct tasklet_join *j)
+{
+    j->state = 0;
+    j->result = NULL;
+    wait_list_init(&j->waiters, 0);
+}
+
+void tasklet_join_fini(struct tasklet_join *j)
+{
+    wait_list_fini(&j->waiters);
+}
+
+void tasklet_join_complete(struct tasklet_join *j, void *result)
+{
+    unsigned int state;
+
+    j->result = result;
+    state = atomic_xchg(&j->state, JOIN_DONE, ATOMIC_ACQ_REL);
+    assert(!(state & JOIN_DONE));
+
+    if (state & JOIN_PARKED)
+        parking_lot_unpark_all(&j->state);
+
+    /* Waiters join under the wait_list's mutex before they check again,
+       so no fence is needed to be sure of seeing them. */
+    wait_list_broadcast(&j->waiters);
+}
+
+bool tasklet_join(struct tasklet_join *j, struct tasklet *t, void **resultp)
+{
+    if (!(atomic_load_order(&j->state, ATOMIC_ACQUIRE) & JOIN_DONE)) {
+        wait_list_wait(&j->waiters, t);
+        if (!(atomic_load_order(&j->state, ATOMIC_ACQUIRE) & JOIN_DONE))
+            return false;
+    }
+
+    /* As in chan.c: only the tasklet itself puts it on a wait_list, so if
+       it is on none, that cannot change under us. */
+    if (atomic_load_order(&t->wait, ATOMIC_RELAXED))
+        tasklet_unwait(t);
+
+    if (resultp)
+        *resultp = j->result;
+
+    return true;
+}
+
+static bool join_validate(void *v_j)
+{
+    struct tasklet_join *j = v_j;
+
+    return atomic_load_order(&j->state, ATOMIC_RELAXED) == JOIN_PARKED;
+}
+
+void *tasklet_join_blocking(struct tasklet_join *j)
+{
+    unsigned int state = atomic_load_order(&j->state, ATOMIC_ACQUIRE);
+
+    while (!(state & JOIN_DONE)) {
+        if (state & JOIN_PARKED ||
+            atomic_cas(&j->state, state, JOIN_PARKED, ATOMIC_RELAXED))
+            parking_lot_park(&j->state, join_validate, j, NULL);
+
+        state = atomic_load_order(&j->state, ATOMIC_ACQUIRE);
+    }
+
+    return j->result;
+}
+
+void tasklet_group_init(struct tasklet_group *g, unsigned int n)
+{
+    g->pending = n;
+    tasklet_join_init(&g->join);
+    if (!n)
+        tasklet_join_complete(&g->join, NULL);
+}
+
+void tasklet_group_fini(struct tasklet_group *g)
+{
+    tasklet_join_fini(&g->join);
+}
+
+void tasklet_group_add(struct tasklet_group *g, unsigned int n)
+{
+    unsigned int pending =
+        atomic_add_fetch_order(&g->pending, n, ATOMIC_RELAXED);
+
+    assert(pending > n);
+    (void) pending;
+}
+
+void tasklet_group_done(struct tasklet_group *g)
+{
+    /* Each child's work happens before the group completes */
+    if (!atomic_add_fetch_order(&g->pending, -1, ATOMIC_ACQ_REL))
+        tasklet_join_complete(&g->join, NULL);
+}
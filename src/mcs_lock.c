@@ -0,0 +1,78 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "mcs_lock.h"
+
+#include <sched.h>
+#include <stdbool.h>
+
+#include "parking_lot.h"
+
+/* Values of mcs_node.state */
+#define MCS_WAITING 0
+#define MCS_GRANTED 1
+#define MCS_PARKED 2
+
+/* How many times a waiter checks its node before parking. */
+#define SPIN_LIMIT 100
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static bool node_parked(void *v_node)
+{
+    struct mcs_node *node = v_node;
+    return __atomic_load_n(&node->state, __ATOMIC_ACQUIRE) == MCS_PARKED;
+}
+
+/* Called from mcs_lock when the lock is held.  "prev" is the node of the
+ * thread that was at the tail of the queue before us.
+ */
+void mcs_lock_wait(struct mcs_node *prev, struct mcs_node *node)
+{
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+    for (int spins = 0; spins < SPIN_LIMIT; spins++) {
+        if (__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) == MCS_GRANTED)
+            return;
+        cpu_relax();
+    }
+
+    if (!__sync_bool_compare_and_swap(&node->state, MCS_WAITING, MCS_PARKED))
+        /* The lock was granted in the meantime */
+        return;
+
+    /* Parking fails if the lock is granted before we block, and unparking
+       can come from a stale mcs_unlock_slow aimed at a previous user of
+       this node's address, so keep checking. */
+    while (__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != MCS_GRANTED)
+        parking_lot_park(node, node_parked, node, NULL);
+}
+
+/* Called from mcs_unlock when there is, or is about to be, a successor. */
+void mcs_unlock_slow(mcs_lock_t *l, struct mcs_node *node)
+{
+    struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    if (!next) {
+        if (__sync_bool_compare_and_swap(&l->tail, node, NULL))
+            return;
+
+        /* A successor has swapped itself into the tail, but not yet
+           linked itself to our node. */
+        while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+            sched_yield();
+    }
+
+    /* The successor may return and reuse its node as soon as it sees
+       MCS_GRANTED.  parking_lot_unpark_one only uses the address as a
+       key, so it is safe to call afterwards. */
+    if (__atomic_exchange_n(&next->state, MCS_GRANTED, __ATOMIC_ACQ_REL) ==
+        MCS_PARKED)
+        parking_lot_unpark_one(next, NULL, NULL);
+}
@@ -0,0 +1,351 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "parking_lot.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "logger.h"
+#include "skinny_mutex.h"
+
+/* log2 of the number of buckets in the parking lot. */
+#define PARKING_LOT_BUCKET_BITS 10
+#define PARKING_LOT_BUCKETS (1 << PARKING_LOT_BUCKET_BITS)
+
+/* How many times a lock spins (yielding the CPU) before parking. */
+#define SPIN_LIMIT 40
+
+/* A thread blocked in parking_lot_park.  It lives on the parked thread's
+ * stack, and is only touched with the bucket's mutex held.
+ */
+struct parked_thread {
+    const void *addr;
+    pthread_cond_t cond;
+    bool unparked;
+    struct parked_thread *next;
+};
+
+/*
+ * Each bucket holds a FIFO queue of the threads parked on addresses that
+ * hash to it.  The bucket mutex is a skinny_mutex, and parked threads wait
+ * with skinny_mutex_cond_timedwait, so a bucket only carries a fat_mutex
+ * while some thread is actually blocked on it.  An idle parking lot costs
+ * three words per bucket.
+ */
+struct bucket {
+    skinny_mutex_t mutex;
+    struct parked_thread *head;
+    struct parked_thread *tail;
+};
+
+static struct bucket buckets[PARKING_LOT_BUCKETS];
+
+static struct bucket *bucket_for(const void *addr)
+{
+    /* Fibonacci hashing: the high bits of the product are well mixed. */
+    uint64_t h = (uint64_t)(uintptr_t) addr * 0x9E3779B97F4A7C15ull;
+    return &buckets[h >> (64 - PARKING_LOT_BUCKET_BITS)];
+}
+
+/* There is no good way to report a failure to take a bucket lock to the
+ * caller of an unlock function, so treat it as fatal.
+ */
+static void bucket_lock(struct bucket *b)
+{
+    int res = skinny_mutex_lock(&b->mutex);
+    if (res) {
+        log_err("parking lot bucket lock failed with %d", res);
+        abort();
+    }
+}
+
+static void bucket_unlock(struct bucket *b)
+{
+    int res = skinny_mutex_unlock(&b->mutex);
+    if (res) {
+        log_err("parking lot bucket unlock failed with %d", res);
+        abort();
+    }
+}
+
+static void bucket_remove(struct bucket *b,
+                          struct parked_thread *prev,
+                          struct parked_thread *p)
+{
+    if (prev)
+        prev->next = p->next;
+    else
+        b->head = p->next;
+
+    if (b->tail == p)
+        b->tail = prev;
+}
+
+int parking_lot_park(const void *addr,
+                     bool (*validate)(void *arg),
+                     void *arg,
+                     const struct timespec *abstime)
+{
+    struct bucket *b = bucket_for(addr);
+    struct parked_thread me;
+    int res, old_state, old_state2;
+
+    bucket_lock(b);
+
+    if (validate && !validate(arg)) {
+        bucket_unlock(b);
+        return EAGAIN;
+    }
+
+    me.addr = addr;
+    me.unparked = false;
+    me.next = NULL;
+    res = pthread_cond_init(&me.cond, NULL);
+    if (res) {
+        bucket_unlock(b);
+        return res;
+    }
+
+    if (b->tail)
+        b->tail->next = &me;
+    else
+        b->head = &me;
+    b->tail = &me;
+
+    /* Parking is not a cancellation point, but skinny_mutex_cond_wait is,
+       so we need to defer cancellation around it. */
+    assert(!pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state));
+    do {
+        res = skinny_mutex_cond_timedwait(&me.cond, &b->mutex, abstime);
+    } while (!me.unparked && !res);
+    assert(!pthread_setcancelstate(old_state, &old_state2));
+
+    if (me.unparked) {
+        /* An unpark raced with the timeout, the unpark wins. */
+        res = 0;
+    } else {
+        struct parked_thread *prev = NULL, *p = b->head;
+
+        while (p != &me) {
+            prev = p;
+            p = p->next;
+        }
+
+        bucket_remove(b, prev, &me);
+    }
+
+    bucket_unlock(b);
+    pthread_cond_destroy(&me.cond);
+    return res;
+}
+
+int parking_lot_unpark_one(const void *addr,
+                           void (*callback)(void *arg, bool more_parked),
+                           void *arg)
+{
+    struct bucket *b = bucket_for(addr);
+    struct parked_thread *prev = NULL, *p;
+    bool more = false;
+
+    bucket_lock(b);
+
+    for (p = b->head; p; prev = p, p = p->next)
+        if (p->addr == addr)
+            break;
+
+    if (p) {
+        struct parked_thread *q;
+
+        for (q = p->next; q; q = q->next) {
+            if (q->addr == addr) {
+                more = true;
+                break;
+            }
+        }
+
+        bucket_remove(b, prev, p);
+    }
+
+    if (callback)
+        callback(arg, more);
+
+    if (p) {
+        p->unparked = true;
+        pthread_cond_signal(&p->cond);
+    }
+
+    bucket_unlock(b);
+    return !!p;
+}
+
+int parking_lot_unpark_all(const void *addr)
+{
+    struct bucket *b = bucket_for(addr);
+    struct parked_thread *prev = NULL, *p, *next;
+    int woken = 0;
+
+    bucket_lock(b);
+
+    for (p = b->head; p; p = next) {
+        next = p->next;
+        if (p->addr != addr) {
+            prev = p;
+            continue;
+        }
+
+        bucket_remove(b, prev, p);
+        p->unparked = true;
+        pthread_cond_signal(&p->cond);
+        woken++;
+    }
+
+    bucket_unlock(b);
+    return woken;
+}
+
+/*
+ * Byte locks and bit locks follow the same protocol; they differ only in the
+ * width of the word holding the flags.
+ *
+ * A locker that finds the lock held spins for a while, and then sets the
+ * PARKED flag and parks on the lock's address.  The PARKED flag is only
+ * cleared by an unlocker, with the bucket locked, when it wakes the last
+ * parked thread.  So an unlocker that sees PARKED clear knows there is nobody
+ * to wake, and the fast path can stay a single CAS.
+ */
+
+static bool bytelock_validate(void *v_l)
+{
+    skinny_bytelock_t *l = v_l;
+    uint8_t v = l->val;
+    return (v & SKINNY_LOCK_HELD) && (v & SKINNY_LOCK_PARKED);
+}
+
+void skinny_bytelock_lock_slow(skinny_bytelock_t *l)
+{
+    int spins = 0;
+
+    for (;;) {
+        uint8_t v = l->val;
+
+        if (!(v & SKINNY_LOCK_HELD)) {
+            if (atomic_cas(&l->val, v, v | SKINNY_LOCK_HELD, ATOMIC_ACQUIRE))
+                return;
+            continue;
+        }
+
+        if (!(v & SKINNY_LOCK_PARKED)) {
+            if (spins < SPIN_LIMIT) {
+                spins++;
+                sched_yield();
+                continue;
+            }
+
+            if (!atomic_cas(&l->val, v, v | SKINNY_LOCK_PARKED, ATOMIC_RELAXED))
+                continue;
+        }
+
+        parking_lot_park(l, bytelock_validate, l, NULL);
+        spins = 0;
+    }
+}
+
+static void bytelock_unpark_callback(void *v_l, bool more_parked)
+{
+    skinny_bytelock_t *l = v_l;
+    uint8_t v, clear = SKINNY_LOCK_HELD;
+
+    if (!more_parked)
+        clear |= SKINNY_LOCK_PARKED;
+
+    do {
+        v = l->val;
+    } while (!atomic_cas(&l->val, v, v & ~clear, ATOMIC_RELEASE));
+}
+
+void skinny_bytelock_unlock_slow(skinny_bytelock_t *l)
+{
+    for (;;) {
+        uint8_t v = l->val;
+
+        assert(v & SKINNY_LOCK_HELD);
+        if (v & SKINNY_LOCK_PARKED)
+            break;
+
+        /* The PARKED flag was clear after all */
+        if (atomic_cas(&l->val, v, v & ~SKINNY_LOCK_HELD, ATOMIC_RELEASE))
+            return;
+    }
+
+    parking_lot_unpark_one(l, bytelock_unpark_callback, l);
+}
+
+static bool bitlock_validate(void *v_word)
+{
+    uintptr_t *word = v_word;
+    uintptr_t v = *word;
+    return (v & SKINNY_LOCK_HELD) && (v & SKINNY_LOCK_PARKED);
+}
+
+void skinny_bitlock_lock_slow(uintptr_t *word)
+{
+    int spins = 0;
+
+    for (;;) {
+        uintptr_t v = *word;
+
+        if (!(v & SKINNY_LOCK_HELD)) {
+            if (atomic_cas(word, v, v | SKINNY_LOCK_HELD, ATOMIC_ACQUIRE))
+                return;
+            continue;
+        }
+
+        if (!(v & SKINNY_LOCK_PARKED)) {
+            if (spins < SPIN_LIMIT) {
+                spins++;
+                sched_yield();
+                continue;
+            }
+
+            if (!atomic_cas(word, v, v | SKINNY_LOCK_PARKED, ATOMIC_RELAXED))
+                continue;
+        }
+
+        parking_lot_park(word, bitlock_validate, word, NULL);
+        spins = 0;
+    }
+}
+
+static void bitlock_unpark_callback(void *v_word, bool more_parked)
+{
+    uintptr_t *word = v_word;
+    uintptr_t v, clear = SKINNY_LOCK_HELD;
+
+    if (!more_parked)
+        clear |= SKINNY_LOCK_PARKED;
+
+    do {
+        v = *word;
+    } while (!atomic_cas(word, v, v & ~clear, ATOMIC_RELEASE));
+}
+
+void skinny_bitlock_unlock_slow(uintptr_t *word)
+{
+    for (;;) {
+        uintptr_t v = *word;
+
+        assert(v & SKINNY_LOCK_HELD);
+        if (v & SKINNY_LOCK_PARKED)
+            break;
+
+        if (atomic_cas(word, v, v & ~(uintptr_t) SKINNY_LOCK_HELD,
+                       ATOMIC_RELEASE))
+            return;
+    }
+
+    parking_lot_unpark_one(word, bitlock_unpark_callback, word);
+}
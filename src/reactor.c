@@ -0,0 +1,246 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "reactor.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "tasklet.h"
+
+/* How many events to handle per epoll_wait call */
+#define REACTOR_EVENTS 64
+
+struct reactor {
+    int epfd;
+    int eventfd;
+
+    /* Registered tasklet_fds, indexed by file descriptor.  Events are
+       handled with the mutex held, and an event for a file descriptor that
+       is no longer registered is dropped, so tasklet_fd_fini does not have
+       to wait for a poll in progress. */
+    struct mutex mutex;
+    struct tasklet_fd **fds;
+    unsigned int nr_fds;
+
+    /* Set by reactor_set_hook */
+    int hook_fd;
+    void (*hook)(void *arg);
+    void *hook_arg;
+};
+
+int reactor_create(struct reactor **rp)
+{
+    struct reactor *r = malloc(sizeof *r);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET};
+    int res;
+
+    if (!r)
+        return ENOMEM;
+
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        res = errno;
+        goto free;
+    }
+
+    r->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->eventfd < 0) {
+        res = errno;
+        goto close_epfd;
+    }
+
+    ev.data.fd = r->eventfd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->eventfd, &ev)) {
+        res = errno;
+        goto close_eventfd;
+    }
+
+    mutex_init(&r->mutex);
+    r->fds = NULL;
+    r->nr_fds = 0;
+    r->hook_fd = -1;
+    r->hook = NULL;
+    *rp = r;
+    return 0;
+
+close_eventfd:
+    close(r->eventfd);
+close_epfd:
+    close(r->epfd);
+free:
+    free(r);
+    return res;
+}
+
+void reactor_destroy(struct reactor *r)
+{
+    mutex_fini(&r->mutex);
+    close(r->eventfd);
+    close(r->epfd);
+    free(r->fds);
+    free(r);
+}
+
+void reactor_poll(struct reactor *r, int timeout)
+{
+    struct epoll_event events[REACTOR_EVENTS];
+    int n = epoll_wait(r->epfd, events, REACTOR_EVENTS, timeout);
+    bool hook = false;
+
+    if (n <= 0)
+        return;
+
+    mutex_lock(&r->mutex);
+
+    for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        uint32_t e = events[i].events;
+        struct tasklet_fd *tfd;
+
+        if (fd == r->eventfd) {
+            uint64_t count;
+            ssize_t res UNUSED = read(fd, &count, sizeof count);
+            continue;
+        }
+
+        if (fd == r->hook_fd) {
+            hook = true;
+            continue;
+        }
+
+        if ((unsigned int) fd >= r->nr_fds || !(tfd = r->fds[fd]))
+            continue;
+
+        /* Errors and hangups wake both directions, so that the tasklets
+           find out from read or write. */
+        if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            wait_list_set(&tfd->readable, 1, true);
+
+        if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            wait_list_set(&tfd->writable, 1, true);
+    }
+
+    mutex_unlock(&r->mutex);
+
+    if (hook)
+        r->hook(r->hook_arg);
+}
+
+int reactor_set_hook(struct reactor *r, int fd, void (*hook)(void *arg),
+                     void *arg)
+{
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.fd = fd};
+    int res = 0;
+
+    mutex_lock(&r->mutex);
+    assert(r->hook_fd < 0);
+
+    r->hook = hook;
+    r->hook_arg = arg;
+    r->hook_fd = fd;
+
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        res = errno;
+        r->hook_fd = -1;
+    }
+
+    mutex_unlock(&r->mutex);
+    return res;
+}
+
+void reactor_wake(struct reactor *r)
+{
+    uint64_t one = 1;
+    ssize_t res UNUSED = write(r->eventfd, &one, sizeof one);
+}
+
+/* Make room for fd in r->fds.  Called with r->mutex held. */
+static int reactor_reserve(struct reactor *r, int fd)
+{
+    struct tasklet_fd **fds;
+    unsigned int n;
+
+    if ((unsigned int) fd < r->nr_fds)
+        return 0;
+
+    n = r->nr_fds ? r->nr_fds : 64;
+    while (n <= (unsigned int) fd)
+        n *= 2;
+
+    fds = realloc(r->fds, n * sizeof *fds);
+    if (!fds)
+        return ENOMEM;
+
+    memset(fds + r->nr_fds, 0, (n - r->nr_fds) * sizeof *fds);
+    r->fds = fds;
+    r->nr_fds = n;
+    return 0;
+}
+
+int tasklet_fd_init(struct tasklet_fd *tfd, int fd)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.fd = fd,
+    };
+    struct reactor *r;
+    int res;
+
+    if (fd < 0)
+        return EBADF;
+
+    res = thread_reactor(&r);
+    if (res)
+        return res;
+
+    tfd->fd = fd;
+    tfd->reactor = r;
+
+    /* Until we hear otherwise, assume the file descriptor is ready, so
+       that the first wait says to try the I/O. */
+    wait_list_init(&tfd->readable, 1);
+    wait_list_init(&tfd->writable, 1);
+
+    mutex_lock(&r->mutex);
+
+    res = reactor_reserve(r, fd);
+    if (!res && r->fds[fd])
+        res = EEXIST;
+
+    if (!res) {
+        r->fds[fd] = tfd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            res = errno;
+            r->fds[fd] = NULL;
+        }
+    }
+
+    mutex_unlock(&r->mutex);
+
+    if (res) {
+        wait_list_fini(&tfd->readable);
+        wait_list_fini(&tfd->writable);
+    }
+
+    return res;
+}
+
+void tasklet_fd_fini(struct tasklet_fd *tfd)
+{
+    struct reactor *r = tfd->reactor;
+
+    mutex_lock(&r->mutex);
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, tfd->fd, NULL);
+    r->fds[tfd->fd] = NULL;
+    mutex_unlock(&r->mutex);
+
+    wait_list_fini(&tfd->readable);
+    wait_list_fini(&tfd->writable);
+}
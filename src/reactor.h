@@ -0,0 +1,35 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/* The I/O reactor behind struct tasklet_fd.  Each run queue that has file
+ * descriptors registered with it gets a reactor: an edge-triggered epoll
+ * instance that its worker blocks in when it has nothing else to do, and an
+ * eventfd that tasklet_run writes to in order to wake the worker.
+ */
+
+struct reactor;
+
+int reactor_create(struct reactor **rp);
+void reactor_destroy(struct reactor *r);
+
+/* Wait for up to "timeout" milliseconds (-1 for ever) for I/O readiness or
+ * a wakeup, and make the tasklets waiting for ready file descriptors
+ * runnable.  Must not be called with a run queue mutex held.
+ */
+void reactor_poll(struct reactor *r, int timeout);
+
+/* Interrupt reactor_poll, or make the next call return at once. */
+void reactor_wake(struct reactor *r);
+
+/* Have reactor_poll call "hook" whenever "fd" becomes readable.  Used for
+ * the io_uring completion queue.  There can only be one hook.
+ */
+int reactor_set_hook(struct reactor *r, int fd, void (*hook)(void *arg),
+                     void *arg);
+
+/* The reactor of the calling thread's run queue, created if need be.
+ * Defined in tasklet.c.
+ */
+int thread_reactor(struct reactor **rp);
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef SKINNY_FAT_H
+#define SKINNY_FAT_H
+
+/* The inflation machinery behind skinny_mutex_t, shared with the other
+ * one-word primitives in skinny_sync.c.
+ *
+ * Each primitive is a pointer-sized "skinny word".  While no thread needs
+ * to block, the word holds a thin value, whose meaning depends on the
+ * primitive, and is updated with compare-and-swap.  When a thread needs to
+ * block, the word is pointed at a fat_mutex, which holds a pthreads mutex
+ * and condition variable along with the primitive's state.  When the last
+ * thread is done with the fat_mutex, the word is returned to a thin value
+ * and the fat_mutex is freed.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "atomics.h"
+#include "epoch.h"
+#include "logger.h"
+
+/* The function says how to behave when we encounter an error while recovering
+ * from another error.
+ *
+ * It is not clear what the right thing to do in general is.  Here we assume
+ * it is better to blow up than to discard an error code (which might lead to
+ * blowing up later on anyway).
+ */
+static inline int recover(int res1, int res2)
+{
+    if (res2 == 0)
+        return res1;
+
+    if (res1 == 0)
+        return res2;
+
+    log_err("got error %d while recovering from %d\n", res2, res1);
+    abort();
+}
+
+/* Is the skinny word a thin value, rather than a pointer to a fat_mutex?
+ * fat_mutexes are allocated with malloc, so their addresses never have the
+ * low two bits set.  Thin values are either 0, or have one of those bits
+ * set.
+ */
+#define THIN_BITS 3
+#define thin(p) (((uintptr_t)(p) & THIN_BITS) || !(p))
+
+/*
+ * A skinny_mutex_t contains a pointer-sized word.  The non-contended cases
+ * is simple: If the mutex is not held, it contains 0.  If the mutex is held
+ * but not contended, it contains 1.  A compare-and-swap is used to acquire
+ * an unheld skinny_mutex, or to release it when held.
+ *
+ * When a lock becomes contended - when a thread tries to lock a skinny_mutex
+ * that is already held - we fall back to standard pthreads synchronization
+ * primitives (so that the thread can block and be woken again when it has
+ * a chance to acquire the lock).  The fat_mutex struct holds all the state
+ * necessary to handle contention cases (that is, a normal pthreads mutex
+ * and condition variable, and a flag to indicate whether the skinny_mutex
+ * is held or not).
+ *
+ * Fair skinny_mutexes use the values 2 (not held) and 3 (held but not
+ * contended) instead of 0 and 1, so the plain compare-and-swap fast paths
+ * always fail for them.  Their fat_mutex hands the lock directly to the
+ * longest waiting thread on release, with a FIFO queue of waiters each
+ * blocked on its own condition variable, so that only the new owner wakes.
+ *
+ * In error-checking builds (see skinny_mutex.h), the held values also
+ * include the address of the owning thread's debug_thread, and the
+ * fat_mutex records the owner.
+ */
+struct fat_waiter {
+    pthread_cond_t cond;
+    bool granted;
+    struct fat_waiter *next;
+};
+
+struct fat_mutex {
+    /* For deferred freeing.  This comes first, so that the fat_mutex can be
+     * recovered from it.
+     */
+    struct epoch_entry epoch;
+
+    /* Is the lock held? */
+    bool held;
+
+    /* How many threads are waiting to acquire the associated skinny_mutex. */
+    long waiters;
+
+    /* References that prevent the fat_mutex being freed.  This includes:
+     *
+     * - References from threads waiting to acquire the mutex.
+     *
+     * - A pseudo-reference from the thread holding the skinny_mutex (this
+     *   might not correspond to an explicit reference, but keeps the fat_mutex
+     *   pinned while the mutex is held).
+     *
+     * - References from threads waiting on condition variables associated
+     *   with the skinny_mutex.
+     */
+    long refcount;
+
+    /* The pthreads mutex guarding the other fields. */
+    pthread_mutex_t mutex;
+
+    /* Conv var signalled when the mutex is released and there are waiters */
+    pthread_cond_t cond;
+
+    /* Transfer generation. */
+    long transfer_gen;
+    long transfers;
+
+    /* Is this the fat_mutex of a fair skinny_mutex? */
+    bool fair;
+
+    /* FIFO of threads waiting for a handoff, only used when fair. */
+    struct fat_waiter *queue_head;
+    struct fat_waiter *queue_tail;
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+    /* The debug_self() of the holding thread */
+    uintptr_t owner;
+#endif
+
+    /* The thin value the word returns to when the fat_mutex is freed.  The
+     * user of the fat_mutex keeps this up to date with its state.
+     */
+    void *deflated;
+
+    /* State of the primitives in skinny_sync.c */
+    long count;
+    long generation;
+};
+
+/* Set up the state of a new fat_mutex for the thin value "head".  Called
+ * before the fat_mutex is visible to other threads.
+ */
+typedef void fat_mutex_init_t(struct fat_mutex *fat, void *head);
+
+/* Given a skinny word containing a pointer, find the associated fat_mutex
+ * and lock its mutex.
+ *
+ * "word" points to the skinny word.
+ *
+ * "fatp" is used to return the pointer to the locked fat_mutex.
+ *
+ * Returns 0 on success, a positive error code, or <0 if the word was found
+ * to no longer point to a fat_mutex.
+ */
+int fat_mutex_find(void **word, struct fat_mutex **fatp);
+
+/* Get and lock the fat_mutex associated with a skinny word, allocating it
+ * (and initializing it with "init") if necessary.
+ *
+ * "head" is the value previously seen in the word.
+ *
+ * Returns 0 on success, a positive error code, or <0 if the word changed so
+ * that the operation should be retried.
+ */
+int fat_mutex_get(void **word,
+                  void *head,
+                  struct fat_mutex **fatp,
+                  fat_mutex_init_t *init);
+
+/* Decrement the refcount on a fat_mutex and unlock it.  When the refcount
+ * reaches zero, the word returns to fat->deflated, and the fat_mutex is
+ * freed after a grace period.
+ */
+int fat_mutex_release(void **word, struct fat_mutex *fat);
+
+#endif /* SKINNY_FAT_H */
@@ -10,335 +10,116 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "epoch.h"
 #include "logger.h"
+#include "skinny_fat.h"
+#include "skinny_mutex_debug.h"
+#include "skinny_mutex_profile.h"
 
-#define CAS(p, a, b) __sync_bool_compare_and_swap(p, a, b)
+/* The bit of a skinny_mutex word that says an uncontended mutex is held. */
+#define SKINNY_HELD 1
 
-/* Atomically exchange the value of a pointer in memory.
- *
- * This is absent from GCC's builtin atomics, but we can simulate it with CAS.
+/* The thin skinny_mutex word "head", once acquired by the calling thread.
+ * In error-checking builds, the held word records the owner as well.
  */
-static inline void *atomic_xchg(void **ptr, void *new)
+static inline void *thin_held(void *head)
 {
-    void *old;
-    do {
-        old = *ptr;
-    } while (!CAS(ptr, old, new));
-    return old;
+    return (void *) ((uintptr_t) head | debug_self() | SKINNY_HELD);
 }
 
-/* Atomically subtract from a byte in memory, and test the subsequent value,
- * returning zero if it reached zero, and non-zero otherwise.
+/* Is the thin skinny_mutex word "head" held by the calling thread?  Without
+ * error checking, we can only tell whether it is held.
  */
-static inline int atomic_sub_and_test(uint8_t *ptr, uint8_t x)
+static inline bool thin_held_by_self(void *head)
 {
-    return __sync_sub_and_fetch(ptr, x);
+    return ((uintptr_t) head & ~(uintptr_t) SKINNY_MUTEX_FAIR) ==
+           (debug_self() | SKINNY_HELD);
 }
 
-/* The function says how to behave when we encounter an error while recovering
- * from another error.
- *
- * It is not clear what the right thing to do in general is.  Here we assume
- * it is better to blow up than to discard an error code (which might lead to
- * blowing up later on anyway).
- */
-static int recover(int res1, int res2)
+#ifdef SKINNY_MUTEX_ERRORCHECK
+static inline void fat_mutex_set_owner(struct fat_mutex *fat, uintptr_t owner)
 {
-    if (res2 == 0)
-        return res1;
-
-    if (res1 == 0)
-        return res2;
-
-    log_err("got error %d while recovering from %d\n", res2, res1);
-    abort();
+    fat->owner = owner;
 }
 
-/* The common header for the fat_mutex and peg structs */
-struct common {
-    uint8_t peg;
-};
-
-/*
- * A skinny_mutex_t contains a pointer-sized word.  The non-contended cases
- * is simple: If the mutex is not held, it contains 0.  If the mutex is held
- * but not contended, it contains 1.  A compare-and-swap is used to acquire
- * an unheld skinny_mutex, or to release it when held.
- *
- * When a lock becomes contended - when a thread tries to lock a skinny_mutex
- * that is already held - we fall back to standard pthreads synchronization
- * primitives (so that the thread can block and be woken again when it has
- * a chance to acquire the lock).  The fat_mutex struct holds all the state
- * necessary to handle contention cases (that is, a normal pthreads mutex
- * and condition variable, and a flag to indicate whether the skinny_mutex
- * is held or not).
- */
-struct fat_mutex {
-    struct common common;
-
-    /* Is the lock held? */
-    bool held;
-
-    /* How many threads are waiting to acquire the associated skinny_mutex. */
-    long waiters;
-
-    /* References that prevent the fat_mutex being freed.  This includes:
-     *
-     * - References from threads waiting to acquire the mutex.
-     *
-     * - References from pegs (see below) not on the primary chain (another
-     *   way of looking at it is that we do include the reference from the
-     *   primary chain, which could be the one from the skinny_mutex, but we
-     *   offset the refcount value by -1, so a refcount of 0 means we only
-     *   have the primary chain).
-     *
-     * - A pseudo-reference from the thread holding the skinny_mutex (this
-     *   might not correspond to an explicit reference, but keeps the fat_mutex
-     *   pinned while the mutex is held).
-     *
-     * - References from threads waiting on condition variables associated
-     *   with the skinny_mutex.
-     */
-    long refcount;
-
-    /* The pthreads mutex guarding the other fields. */
-    pthread_mutex_t mutex;
-
-    /* Conv var signalled when the mutex is released and there are waiters */
-    pthread_cond_t cond;
+/* Is the fat_mutex held by the calling thread? */
+static inline bool fat_mutex_held_by_self(struct fat_mutex *fat)
+{
+    return fat->held && fat->owner == debug_self();
+}
+#else
+static inline void fat_mutex_set_owner(struct fat_mutex *fat UNUSED,
+                                       uintptr_t owner UNUSED)
+{
+}
 
-    /* Transfer generation. */
-    long transfer_gen;
-    long transfers;
-};
+/* Without error checking, we can only tell whether it is held. */
+static inline bool fat_mutex_held_by_self(struct fat_mutex *fat)
+{
+    return fat->held;
+}
+#endif
 
 /*
- * If the skinny_mutex points to a fat_mutex, a thread cannot simply
+ * If the skinny word points to a fat_mutex, a thread cannot simply
  * obtain the pointer and dereference it, as another thread might free
- * the fat_mutex between those two points.  There needs to be some way
- * for a thread to communicate its intent to access the fat_mutex.
- *
- * Many lock-free algoithms solve this problem using hazard pointers.
- * But hazard pointers require tracking the set of all threads
- * involved.  Furthermore, for efficiency, hazard pointer
- * implementations batch deallocations, and process a batch using a
- * data structure that allows efficient comparison of a candidate
- * pointer with the set of hazard pointers.  Implementing all this
- * involves a substantial amount of code.
- *
- * We use a simpler approach: Pegging.  This approach has higher
- * per-access costs than hazard pointers, but we only access the
- * fat_mutex when other significant costs are involved (e.g. blocking
- * the thread on a pthreds mutex), so the cost of this part is likely
- * to be marginal.
-
- * A thread indicates its intent to access the fat_mutex by allocating
- * a peg struct and storing a pointer to it into the skinny_mutex,
- * replacing the pointer to the fat_mutex (see fat_mutex_peg).  The
- * skinny_mutex is updated with CAS so that installing a peg is
- * atomic.  A fat_mutex can only be freed if the skinny_mutex points
- * directly to it, so the presence of the peg prevents it being freed,
- * hence the name (see fat_mutex_release).
- *
- * The peg struct has a "next" pointer in it, pointing to the previous
- * value of the skinny_mutex.  This might be a fat_mutex, but it an
- * also be another peg.  So chains of pegs can be built up, starting
- * with the skinny_mutex, followed by zero or more pegs, and
- * terminating with the fat_mutex, e.g.:
- *
- * +--------------+   +--------+   +--------+   +-----------+
- * | skinny_mutex |   |   peg  |   |   peg  |   | fat_mutex |
- * +--------------+   +--------+   +--------|   +-----------+
- * | val  *---------->| next *---->| next *---->|   ...     |
- * +--------------+   |   ...  |   |   ...  |   +-----------+
- *                    +--------+   +--------+
- *
- * During the process of releasing a peg (in the second half of
- * fat_mutex_peg), the skinny_mutex is set to point to the fat_mutex
- * again, possibly leaving chains which of pegs which do not originate
- * at the skinny_mutex (these are accounted for in the fat_mutex's
- * refcount, so the pegs on these chains still prevent the fat_mutex
- * being freed).  We refer to the chain connecting the skinny_mutex to
- * the fat_mutex as the primary chain, and the others as secondary
- * chains, e.g.:
+ * the fat_mutex between those two points.
  *
- *                    +--------+   +--------+
- *                    |   peg  |   |   peg  |
- *  Secondary chain:  +--------+   +--------|
- *                    | next *---->| next *-------\
- *                    |   ...  |   |   ...  |      \
- *                    +--------+   +--------+      |
- *                                                 |
- *                          Primary chain:         v
- * +--------------+   +--------+   +--------+   +-----------+
- * | skinny_mutex |   |   peg  |   |   peg  |   | fat_mutex |
- * +--------------+   +--------+   +--------|   +-----------+
- * | val  *---------->| next *---->| next *---->|   ...     |
- * +--------------+   |   ...  |   |   ...  |   +-----------+
- *                    +--------+   +--------+      ^
- *                                                 |
- *                                 +--------+      |
- *                                 |   peg  |      |
- *                                 +--------|      /
- *               Secondary chain:  | next *-------/
- *                                 |   ...  |
- *                                 +--------+
+ * So a thread only follows the pointer inside an epoch read-side section
+ * (see epoch.h), and fat_mutex_release defers freeing a fat_mutex until
+ * all such sections have ended.  Once a thread has locked the fat_mutex
+ * and checked that the word still points to it, the fat_mutex cannot be
+ * released until the thread unlocks it, so the section can end there.
  */
-struct peg {
-    struct common common;
 
-    /* The refcount on this peg.  The peg can be freed when this falls to 0.
-     * This never exceeds 2, so we only need a byte.
-     */
-    uint8_t refcount;
-
-    /* The next peg in the chain, or the fat_mutex at the end of the chain. */
-    struct common *next;
-};
-
-
-/* Given a skinny_mutex containing a pointer, find the associated
- * fat_mutex and lock its mutex.
- *
- * "skinny" points to the skinny_mutex.
- *
- * "p" is the pointer previously obtained from the skinny_mutex.
- *
- * "fatp" is used to return the pointer to the locked fat_mutex.
- *
- * Returns 0 on success, a positive error code, or <0 if the
- * skinny_mutex was found to no longer contain a pointer.
- */
-static int fat_mutex_peg(skinny_mutex_t *skinny,
-                         struct common *p,
-                         struct fat_mutex **fatp)
+/* See skinny_fat.h */
+int fat_mutex_find(void **word, struct fat_mutex **fatp)
 {
-    int res;
-    volatile unsigned int peg_refcount_decr;
     struct fat_mutex *fat;
-    struct peg *peg = malloc(sizeof *peg);
-    if (!peg)
-        return ENOMEM;
-
-    /* Install our peg.  The initial ref count is two: One for the
-     * reference from this thread, and one that will be from the
-     * skinny_mutex.
-     */
-    peg->common.peg = 1;
-    peg->refcount = 2;
-    peg->next = p;
-
-    while (!CAS(&skinny->val, p, peg)) {
-        /* value in the skinny_mutex has changed from what we saw earlier. */
-
-        p = skinny->val;
-        if ((uintptr_t) p <= 1) {
-            /* There is no longer a fat_mutex to peg, so backtrack. */
-            free(peg);
-            return -1;
-        }
+    int res = epoch_enter();
+    if (res)
+        return res;
 
-        /* There is a new fat_mutex, so try again to install our peg. */
-        peg->next = p;
+    fat = atomic_load_order(word, ATOMIC_ACQUIRE);
+    if (thin(fat)) {
+        res = -1;
+        goto out;
     }
 
-    /* Our peg is now installed.  Now we know the rest of the
-     * chain won't disappear under us, so we can walk it to find
-     * the fat_mutex and lock it. */
-    while (p->peg)
-        p = ((struct peg *) p)->next;
-
-    *fatp = fat = (struct fat_mutex *) p;
     res = pthread_mutex_lock(&fat->mutex);
+    if (res)
+        goto out;
 
-    /* The fat_mutex is locked, and we know it won't go away while we hold
-     * its lock. So we can release our peg.
-     *
-     * To do this, we set the skinny_mutex to point to the fat_mutex, turning
-     * the primary chain into a secondary chain. Note that we don't know
-     * whether this thread's peg is still on the primary chain when we do
-     * this.  Handling the various cases correctly hinges on the refcounts.
-     * By the end of this function, the fat_mutex refcount can be incremented,
-     * decremented, or returned to its original value.
-     */
-    p = atomic_xchg(&skinny->val, fat);
-
-    /* By setting the skinny_mutex to point to the fat_mutex, we have
-     * heoretically created a new reference to it. This  might be a real
-     * reference (e.g. from a new secondary chain) or not.  If not, we will
-     * decrement the fat_mutex refcount below.
-     */
-    fat->refcount++;
-
-    /* In this loop, walk peg chain starting with old value of skinny_mutex. */
-    for (;;) {
-        struct peg *chain_peg;
-
-        peg_refcount_decr = 2;
-        if (p == &peg->common)
-            /* We have reached our peg, so fall through to the loop below. */
-            break;
-
-        peg_refcount_decr = 1;
-        if (p == &fat->common) {
-            /* We have reached the fat_mutex at the end of the chain,
-             * eliminating a reference to it.
-             */
-            fat->refcount--;
-            break;
-        }
-
-        /* Decrement refcount of peg, and see whether we can free it yet. */
-        chain_peg = (struct peg *) p;
-        if (atomic_sub_and_test(&chain_peg->refcount, 1))
-            /* We can't free this peg yet, so leave a
-             * secondary chain in place. */
-            break;
-
-        /* Free the peg, and proceed to the next peg in the chain. */
-        p = chain_peg->next;
-        free(chain_peg);
-    }
-
-    for (;;) {
-        if (atomic_sub_and_test(&peg->refcount, peg_refcount_decr))
-            /* We can not free peg yet, so leave a secondary chain in place. */
-            break;
-
-        /* No references to the peg remain, so free it. */
-        p = peg->next;
-        free(peg);
-
-        if (p == &fat->common) {
-            /* We have reached the fat_mutex at the end of the chain,
-             * eliminating a reference to it.
-             */
-            fat->refcount--;
-            break;
-        }
-
-        /* Proceed to the next peg in the chain. */
-        peg = (struct peg *) p;
-        peg_refcount_decr = 1;
+    /* The fat_mutex might have been released before we locked it. */
+    if (*word != fat) {
+        pthread_mutex_unlock(&fat->mutex);
+        res = -1;
+        goto out;
     }
 
+    *fatp = fat;
+out:
+    epoch_exit();
     return res;
 }
 
-/* Allocate a fat_mutex and associate it with a skinny_mutex.
+/* Allocate a fat_mutex and associate it with a skinny word.
  *
- * "skinny" points to the skinny_mutex.
+ * "word" points to the skinny word.
  *
- * "head" is the value previously obtained from the skinny_mutex.
+ * "head" is the thin value previously obtained from the word.
  *
  * "fatp" is used to return the pointer to the locked fat_mutex.
  *
+ * "init" sets up the state of the fat_mutex corresponding to "head".
+ *
  * Returns 0 on success, a positive error code, or <0 if the
- * skinny_mutex was found to no longer contain "head".
+ * word was found to no longer contain "head".
  */
-static int skinny_mutex_promote(skinny_mutex_t *skinny,
-                                void *head,
-                                struct fat_mutex **fatp)
+static int fat_mutex_promote(void **word,
+                             void *head,
+                             struct fat_mutex **fatp,
+                             fat_mutex_init_t *init)
 {
     int res = ENOMEM;
     struct fat_mutex *fat = malloc(sizeof *fat);
@@ -346,15 +127,18 @@ static int skinny_mutex_promote(skinny_mutex_t *skinny,
     if (!fat)
         goto err;
 
-    fat->common.peg = 0;
-    fat->held = !!head;
-    /* If the skinny_mutex is held, then refcount needs to account for the
-     * pseudo-reference from the holding thread.
-     */
-    fat->refcount = fat->held;
+    fat->held = false;
+    fat->fair = false;
+    fat->queue_head = fat->queue_tail = NULL;
+    fat_mutex_set_owner(fat, 0);
+    fat->refcount = 0;
     fat->waiters = 0;
     fat->transfer_gen = 0;
     fat->transfers = 0;
+    fat->deflated = head;
+    fat->count = 0;
+    fat->generation = 0;
+    init(fat, head);
 
     res = pthread_mutex_init(&fat->mutex, NULL);
     if (res)
@@ -368,8 +152,8 @@ static int skinny_mutex_promote(skinny_mutex_t *skinny,
     if (res)
         goto err_mutex_lock;
 
-    /* fat_mutex is now ready, so try to make the skinny_mutex point to it. */
-    if (CAS(&skinny->val, head, fat))
+    /* fat_mutex is now ready, so try to make the word point to it. */
+    if (atomic_cas(word, head, fat, ATOMIC_ACQ_REL))
         return 0;
 
     res = -1;
@@ -384,56 +168,153 @@ err:
     return res;
 }
 
-/* Get and lock the fat_mutex associated with a skinny_mutex,
- * allocating it if necessary.
- *
- * "skinny" points to the skinny_mutex.
- *
- * "head" is the value that previously seen in the skinny_mutex.
- *
- * "fatp" is used to return the pointer to the locked fat_mutex.
- *
- * Returns 0 on success, a positive error code, or <0 if the
- * skinny_mutex value changed so that the operation should be retried.
- */
-static int fat_mutex_get(skinny_mutex_t *skinny,
-                         struct common *head,
-                         struct fat_mutex **fatp)
+int fat_mutex_get(void **word,
+                  void *head,
+                  struct fat_mutex **fatp,
+                  fat_mutex_init_t *init)
 {
-    if ((uintptr_t) head <= 1)
-        return skinny_mutex_promote(skinny, head, fatp);
+    if (thin(head))
+        return fat_mutex_promote(word, head, fatp, init);
     else
-        return fat_mutex_peg(skinny, head, fatp);
+        return fat_mutex_find(word, fatp);
 }
 
-/* Decrement the refcount on a fat_mutex, unlock it, and free it
- * if the conditions are right.
- */
-static int fat_mutex_release(skinny_mutex_t *skinny, struct fat_mutex *fat)
+/* Free a released fat_mutex once the grace period has passed. */
+static void fat_mutex_free(struct epoch_entry *entry)
+{
+    struct fat_mutex *fat = (struct fat_mutex *) entry;
+    int res UNUSED;
+
+    res = pthread_mutex_destroy(&fat->mutex);
+    assert(!res);
+    res = pthread_cond_destroy(&fat->cond);
+    assert(!res);
+    free(fat);
+}
+
+int fat_mutex_release(void **word, struct fat_mutex *fat)
 {
-    int keep, res;
+    int res;
 
-    /* If the decremented refcount reaches zero, then we know there are no
-     * secondary peg chains or other threads pinning the fat_mutex.  And if
-     * the skinny_mutex points to the fat_mutex, then we know that there are
-     * no pegs on the primary chain either.  So if the CAS succeeds in nulling
-     * out the skinny_mutex, we can free the fat_mutex.
+    /* If the decremented refcount reaches zero, no thread needs the
+     * fat_mutex any more.  The word only changes while it points to the
+     * fat_mutex with the fat_mutex locked, so we can return it to its thin
+     * value.  Threads in fat_mutex_find may still have loaded the pointer,
+     * so freeing the fat_mutex waits for a grace period.
      */
-    keep = (--fat->refcount || !CAS(&skinny->val, fat, NULL));
+    if (--fat->refcount)
+        return pthread_mutex_unlock(&fat->mutex);
 
-    res = pthread_mutex_unlock(&fat->mutex);
-    if (keep || res)
-        return res;
+    atomic_store_order(word, fat->deflated, ATOMIC_RELEASE);
 
-    res = pthread_mutex_destroy(&fat->mutex);
+    res = pthread_mutex_unlock(&fat->mutex);
     if (res)
         return res;
 
-    res = pthread_cond_destroy(&fat->cond);
+    epoch_defer(&fat->epoch, fat_mutex_free);
+    return 0;
+}
+
+/* Set up a new fat_mutex for the thin skinny_mutex value "head". */
+static void fat_mutex_init_mutex(struct fat_mutex *fat, void *head)
+{
+    fat->held = (uintptr_t) head & SKINNY_HELD;
+    fat->fair = (uintptr_t) head & SKINNY_MUTEX_FAIR;
+    fat_mutex_set_owner(fat, (uintptr_t) head & ~(uintptr_t)(
+                                 SKINNY_HELD | SKINNY_MUTEX_FAIR));
+    fat->deflated = (void *) ((uintptr_t) head & SKINNY_MUTEX_FAIR);
+
+    /* If the skinny_mutex is held, then refcount needs to account for the
+     * pseudo-reference from the holding thread.
+     */
+    fat->refcount = fat->held;
+}
+
+/* Wait in the FIFO of a fair fat_mutex until the lock is handed to us.
+ *
+ * The thread releasing the mutex leaves fat->held set on our behalf, so
+ * there is no window in which another thread can take it.
+ */
+static int fat_mutex_lock_queued(skinny_mutex_t *skinny,
+                                 struct fat_mutex *fat)
+{
+    struct fat_waiter w;
+    int res, old_state, old_state2;
+
+    res = pthread_cond_init(&w.cond, NULL);
     if (res)
-        return res;
+        return recover(res, fat_mutex_release(&skinny->val, fat));
+
+    w.granted = false;
+    w.next = NULL;
+    if (fat->queue_tail)
+        fat->queue_tail->next = &w;
+    else
+        fat->queue_head = &w;
+    fat->queue_tail = &w;
+    fat->waiters++;
+
+    /* As in fat_mutex_lock, defer cancellation around the wait. */
+    assert(!pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state));
+    do {
+        res = pthread_cond_wait(&w.cond, &fat->mutex);
+    } while (!res && !w.granted);
+    assert(!pthread_setcancelstate(old_state, &old_state2));
+
+    fat->waiters--;
+
+    if (!w.granted) {
+        /* Take ourselves off the queue */
+        struct fat_waiter *prev = NULL, *p = fat->queue_head;
+
+        while (p != &w) {
+            prev = p;
+            p = p->next;
+        }
+
+        if (prev)
+            prev->next = w.next;
+        else
+            fat->queue_head = w.next;
+
+        if (fat->queue_tail == &w)
+            fat->queue_tail = prev;
+
+        pthread_cond_destroy(&w.cond);
+        return recover(res, fat_mutex_release(&skinny->val, fat));
+    }
+
+    pthread_cond_destroy(&w.cond);
+    fat_mutex_set_owner(fat, debug_self());
+    return pthread_mutex_unlock(&fat->mutex);
+}
+
+/* Give up ownership of a fat_mutex, whose mutex is locked by the caller.
+ *
+ * For a fair mutex with queued waiters, ownership passes directly to the
+ * first of them.  Otherwise the mutex becomes unheld, and we wake one
+ * waiter to contend for it.
+ */
+static int fat_mutex_relinquish(struct fat_mutex *fat)
+{
+    struct fat_waiter *w = fat->queue_head;
+
+    fat_mutex_set_owner(fat, 0);
+
+    if (w) {
+        fat->queue_head = w->next;
+        if (!w->next)
+            fat->queue_tail = NULL;
+
+        w->granted = true;
+        return pthread_cond_signal(&w->cond);
+    }
+
+    fat->held = false;
+    if (fat->waiters)
+        /* Wake a single waiter. */
+        return pthread_cond_signal(&fat->cond);
 
-    free(fat);
     return 0;
 }
 
@@ -444,6 +325,9 @@ static int fat_mutex_release(skinny_mutex_t *skinny, struct fat_mutex *fat)
  */
 static int fat_mutex_lock(skinny_mutex_t *skinny, struct fat_mutex *fat)
 {
+    if (fat->fair && (fat->held || fat->queue_head))
+        return fat_mutex_lock_queued(skinny, fat);
+
     if (fat->held) {
         /* The mutex is already held, so we have to wait for it. */
         fat->waiters++;
@@ -460,7 +344,7 @@ static int fat_mutex_lock(skinny_mutex_t *skinny, struct fat_mutex *fat)
 
             if (res) {
                 fat->waiters--;
-                return recover(res, fat_mutex_release(skinny, fat));
+                return recover(res, fat_mutex_release(&skinny->val, fat));
             }
         } while (fat->held);
 
@@ -468,20 +352,45 @@ static int fat_mutex_lock(skinny_mutex_t *skinny, struct fat_mutex *fat)
     }
 
     fat->held = true;
+    fat_mutex_set_owner(fat, debug_self());
     return pthread_mutex_unlock(&fat->mutex);
 }
 
 /* Called from skinny_mutex_lock when the fast path fails. */
 int skinny_mutex_lock_slow(skinny_mutex_t *skinny)
 {
+    struct profile_wait pw;
+    bool contended = false;
+
     for (;;) {
-        struct common *head = skinny->val;
-        if (head) {
+        void *head = skinny->val;
+        if (!thin(head) || ((uintptr_t) head & SKINNY_HELD)) {
             struct fat_mutex *fat;
-            int res = fat_mutex_get(skinny, head, &fat);
+            int res;
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+            if (thin(head) && thin_held_by_self(head))
+                return EDEADLK;
+#endif
+
+            if (!contended) {
+                profile_wait_begin(&pw, __builtin_return_address(0));
+                contended = true;
+            }
+
+            res = fat_mutex_get(&skinny->val, head, &fat, fat_mutex_init_mutex);
             if (!res) {
+#ifdef SKINNY_MUTEX_ERRORCHECK
+                if (fat_mutex_held_by_self(fat))
+                    return recover(EDEADLK,
+                                   pthread_mutex_unlock(&fat->mutex));
+#endif
                 fat->refcount++;
                 res = fat_mutex_lock(skinny, fat);
+                if (!res) {
+                    profile_acquired(&pw, skinny);
+                    debug_acquired(skinny, true);
+                }
             }
 
             if (res >= 0)
@@ -490,8 +399,11 @@ int skinny_mutex_lock_slow(skinny_mutex_t *skinny)
             /* skinny_mutex value changed under us, try again. */
         } else {
             /* Recapitulate skinny_mutex_lock */
-            if (CAS(&skinny->val, head, (void *) 1))
+            if (atomic_cas(&skinny->val, head, thin_held(head),
+                           ATOMIC_ACQUIRE)) {
+                debug_acquired(skinny, true);
                 return 0;
+            }
         }
     }
 }
@@ -499,37 +411,43 @@ int skinny_mutex_lock_slow(skinny_mutex_t *skinny)
 int skinny_mutex_trylock(skinny_mutex_t *skinny)
 {
     for (;;) {
-        struct common *head = skinny->val;
+        void *head = skinny->val;
         struct fat_mutex *fat;
         int res;
 
-        switch ((uintptr_t) head) {
-        case 0:
-            if (CAS(&skinny->val, head, (void *) 1))
-                return 0;
+        if (thin(head)) {
+            if ((uintptr_t) head & SKINNY_HELD)
+                return EBUSY;
 
-            break;
+            if (atomic_cas(&skinny->val, head, thin_held(head),
+                           ATOMIC_ACQUIRE)) {
+                debug_acquired(skinny, false);
+                return 0;
+            }
 
-        case 1:
-            return EBUSY;
+            continue;
+        }
 
-        default:
-            res = fat_mutex_peg(skinny, head, &fat);
-            if (res > 0)
-                return res;
-            else if (res < 0)
-                /* skinny_mutex value changed under us, try again. */
-                break;
+        res = fat_mutex_find(&skinny->val, &fat);
+        if (res > 0)
+            return res;
+        else if (res < 0)
+            /* skinny_mutex value changed under us, try again. */
+            continue;
+
+        res = EBUSY;
+        if (!fat->held && !fat->queue_head) {
+            fat->held = true;
+            fat_mutex_set_owner(fat, debug_self());
+            fat->refcount++;
+            res = 0;
+        }
 
-            res = EBUSY;
-            if (!fat->held) {
-                fat->held = true;
-                fat->refcount++;
-                res = 0;
-            }
+        res = recover(res, pthread_mutex_unlock(&fat->mutex));
+        if (!res)
+            debug_acquired(skinny, false);
 
-            return recover(res, pthread_mutex_unlock(&fat->mutex));
-        }
+        return res;
     }
 }
 
@@ -540,13 +458,13 @@ static int fat_mutex_get_held(skinny_mutex_t *skinny, struct fat_mutex **fatp)
 {
     for (;;) {
         int res;
-        struct common *head = skinny->val;
-        if (!head)
+        void *head = skinny->val;
+        if (thin(head) && !thin_held_by_self(head))
             return EPERM;
 
-        res = fat_mutex_get(skinny, head, fatp);
+        res = fat_mutex_get(&skinny->val, head, fatp, fat_mutex_init_mutex);
         if (res == 0) {
-            if ((*fatp)->held)
+            if (fat_mutex_held_by_self(*fatp))
                 return 0;
 
             res = pthread_mutex_unlock(&(*fatp)->mutex);
@@ -565,24 +483,39 @@ static int fat_mutex_get_held(skinny_mutex_t *skinny, struct fat_mutex **fatp)
 int skinny_mutex_unlock_slow(skinny_mutex_t *skinny)
 {
     struct fat_mutex *fat;
-    int res = fat_mutex_get_held(skinny, &fat);
+    int res;
+
+    profile_released(skinny);
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+    /* skinny_mutex_unlock has no fast path in error-checking builds */
+    if (atomic_cas(&skinny->val, thin_held(0), (void *) 0, ATOMIC_RELEASE)) {
+        debug_released(skinny);
+        return 0;
+    }
+#endif
 
+    /* The fast path for fair mutexes */
+    if (atomic_cas(&skinny->val, thin_held((void *) SKINNY_MUTEX_FAIR),
+                   (void *) SKINNY_MUTEX_FAIR, ATOMIC_RELEASE)) {
+        debug_released(skinny);
+        return 0;
+    }
+
+    res = fat_mutex_get_held(skinny, &fat);
     if (res)
         return res;
 
-    fat->held = false;
-    res = 0;
-    if (fat->waiters)
-        /* Wake a single waiter. */
-        res = pthread_cond_signal(&fat->cond);
-
-    return recover(res, fat_mutex_release(skinny, fat));
+    debug_released(skinny);
+    res = fat_mutex_relinquish(fat);
+    return recover(res, fat_mutex_release(&skinny->val, fat));
 }
 
 struct cond_wait_cleanup {
     skinny_mutex_t *skinny;
     struct fat_mutex *fat;
     int lock_res;
+    const void *site;
 };
 
 /* Thread cancallation cleanup handler when waiting for the condition variable
@@ -591,35 +524,43 @@ struct cond_wait_cleanup {
 static void cond_wait_cleanup(void *v_c)
 {
     struct cond_wait_cleanup *c = v_c;
+    struct profile_wait pw;
 
     /* Cancellation of pthread_cond_wait should re-acquire the mutex. */
+    profile_wait_begin(&pw, c->site);
     c->lock_res = fat_mutex_lock(c->skinny, c->fat);
+    if (!c->lock_res) {
+        profile_acquired(&pw, c->skinny);
+        debug_acquired(c->skinny, true);
+    }
 }
 
-int skinny_mutex_cond_timedwait(pthread_cond_t *cond,
-                                skinny_mutex_t *skinny,
-                                const struct timespec *abstime)
+static int cond_timedwait(pthread_cond_t *cond,
+                          skinny_mutex_t *skinny,
+                          const struct timespec *abstime,
+                          const void *site)
 {
     struct cond_wait_cleanup c;
     int res = fat_mutex_get_held(skinny, &c.fat);
     if (res)
         return res;
 
-    /* We will release the lock, so wake a waiter */
-    if (c.fat->waiters) {
-        res = pthread_cond_signal(&c.fat->cond);
-        if (res) {
-            pthread_mutex_unlock(&c.fat->mutex);
-            return res;
-        }
-    }
+    profile_released(skinny);
+    debug_released(skinny);
 
-    /* Relinquish the mutex.  But we leave our reference accounted for in
-     * fat->refcount in place, in order to pin the fat_mutex.
+    /* Relinquish the mutex, waking a waiter or handing the mutex over to
+     * it.  But we leave our reference accounted for in fat->refcount in
+     * place, in order to pin the fat_mutex.
      */
-    c.fat->held = false;
+    res = fat_mutex_relinquish(c.fat);
+    if (res) {
+        pthread_mutex_unlock(&c.fat->mutex);
+        return res;
+    }
 
     /* pthread_cond_wait is a cancellation point */
+    c.skinny = skinny;
+    c.site = site;
     pthread_cleanup_push(cond_wait_cleanup, &c);
 
     if (!abstime)
@@ -631,23 +572,33 @@ int skinny_mutex_cond_timedwait(pthread_cond_t *cond,
     return recover(res, c.lock_res);
 }
 
+int skinny_mutex_cond_timedwait(pthread_cond_t *cond,
+                                skinny_mutex_t *skinny,
+                                const struct timespec *abstime)
+{
+    return cond_timedwait(cond, skinny, abstime, __builtin_return_address(0));
+}
+
 int skinny_mutex_cond_wait(pthread_cond_t *cond, skinny_mutex_t *skinny)
 {
-    return skinny_mutex_cond_timedwait(cond, skinny, NULL);
+    return cond_timedwait(cond, skinny, NULL, __builtin_return_address(0));
 }
 
 int skinny_mutex_transfer(skinny_mutex_t *a, skinny_mutex_t *b)
 {
     struct fat_mutex *fat_b;
+    struct profile_wait pw;
     int res;
     long transfer_gen;
 
+    profile_released(a);
+
     for (;;) {
-        struct common *b_head = b->val;
+        void *b_head = b->val;
 
-        if (!b_head) {
+        if (thin(b_head) && !((uintptr_t) b_head & SKINNY_HELD)) {
             /* b is neither held nor contended, the simple case. */
-            if (!CAS(&b->val, b_head, (void *) 1))
+            if (!atomic_cas(&b->val, b_head, thin_held(b_head), ATOMIC_ACQUIRE))
                 /* skinny mutex value changed under us, try
                    again. */
                 continue;
@@ -659,12 +610,14 @@ int skinny_mutex_transfer(skinny_mutex_t *a, skinny_mutex_t *b)
                  */
                 return recover(res, skinny_mutex_unlock(b));
 
-            /* All done.  That was easy. */
+            /* All done.  That was easy.  (b was not waited for while
+               holding a, so this does not order the locks.) */
+            debug_acquired(b, false);
             return 0;
         }
 
         /* b is held or contended, we might have work to do. */
-        res = fat_mutex_get(b, b_head, &fat_b);
+        res = fat_mutex_get(&b->val, b_head, &fat_b, fat_mutex_init_mutex);
         if (!res)
             break;
 
@@ -674,11 +627,16 @@ int skinny_mutex_transfer(skinny_mutex_t *a, skinny_mutex_t *b)
 
     fat_b->refcount++;
     transfer_gen = fat_b->transfer_gen;
+    profile_wait_begin(&pw, __builtin_return_address(0));
 
     /* We are going to wait to acquire b, so we need to unlock a.
      * Try the easy way first.
      */
-    if (!CAS(&a->val, (void *) 1, (void *) 0)) {
+    if (atomic_cas(&a->val, thin_held(0), (void *) 0, ATOMIC_RELEASE) ||
+        atomic_cas(&a->val, thin_held((void *) SKINNY_MUTEX_FAIR),
+                   (void *) SKINNY_MUTEX_FAIR, ATOMIC_RELEASE)) {
+        debug_released(a);
+    } else {
         /* We can't acquire a's fat lock while holding b's fat lock, because
          * that would risk deadlock.  So we have to drop b first. We have
          * bumped the refcount, so it won't go away.
@@ -687,7 +645,7 @@ int skinny_mutex_transfer(skinny_mutex_t *a, skinny_mutex_t *b)
         res = skinny_mutex_unlock_slow(a);
         pthread_mutex_lock(&fat_b->mutex);
         if (res)
-            return recover(res, fat_mutex_release(b, fat_b));
+            return recover(res, fat_mutex_release(&b->val, fat_b));
     }
 
     fat_b->transfers++;
@@ -696,11 +654,14 @@ int skinny_mutex_transfer(skinny_mutex_t *a, skinny_mutex_t *b)
     for (;;) {
         int old_state, old_state2;
 
-        if (!fat_b->held) {
+        if (!fat_b->held && !fat_b->queue_head) {
             /* We can acquire the lock */
             fat_b->transfers--;
             fat_b->waiters--;
             fat_b->held = true;
+            fat_mutex_set_owner(fat_b, debug_self());
+            profile_acquired(&pw, b);
+            debug_acquired(b, false);
             return pthread_mutex_unlock(&fat_b->mutex);
         }
 
@@ -723,7 +684,7 @@ int skinny_mutex_transfer(skinny_mutex_t *a, skinny_mutex_t *b)
 
     fat_b->transfers--;
     fat_b->waiters--;
-    res = recover(res, fat_mutex_release(b, fat_b));
+    res = recover(res, fat_mutex_release(&b->val, fat_b));
     return recover(res, skinny_mutex_lock(a));
 }
 
@@ -733,18 +694,19 @@ int skinny_mutex_veto_transfer(skinny_mutex_t *skinny)
     struct fat_mutex *fat;
 
     for (;;) {
-        struct common *head = skinny->val;
-        if (head == (void *) 1)
-            /* Mutex held, but no fat mutex, so there can't be any waiting
-             * transfers.
-             */
-            return 0;
+        void *head = skinny->val;
+        if (thin(head)) {
+            if (thin_held_by_self(head))
+                /* Mutex held, but no fat mutex, so there can't be any
+                 * waiting transfers.
+                 */
+                return 0;
 
-        if (head == (void *) 0)
             /* Mutex not held */
             return EPERM;
+        }
 
-        res = fat_mutex_peg(skinny, head, &fat);
+        res = fat_mutex_find(&skinny->val, &fat);
         if (res == 0)
             break;
 
@@ -756,7 +718,7 @@ int skinny_mutex_veto_transfer(skinny_mutex_t *skinny)
 
     res = EPERM;
 
-    if (fat->held) {
+    if (fat_mutex_held_by_self(fat)) {
         /* notify any waiting transfers */
         res = 0;
         fat->transfer_gen++;
@@ -766,3 +728,27 @@ int skinny_mutex_veto_transfer(skinny_mutex_t *skinny)
 
     return recover(res, pthread_mutex_unlock(&fat->mutex));
 }
+
+int skinny_mutex_held_by_self(skinny_mutex_t *skinny)
+{
+    for (;;) {
+        void *head = skinny->val;
+        struct fat_mutex *fat;
+        int res;
+
+        if (thin(head))
+            return thin_held_by_self(head);
+
+        res = fat_mutex_find(&skinny->val, &fat);
+        if (res > 0)
+            return 0;
+
+        if (res == 0) {
+            res = fat_mutex_held_by_self(fat);
+            pthread_mutex_unlock(&fat->mutex);
+            return res;
+        }
+
+        /* skinny mutex value changed under us, try again. */
+    }
+}
@@ -0,0 +1,226 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "skinny_mutex_debug.h"
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "logger.h"
+
+__thread struct debug_thread debug_thread;
+
+/*
+ * Lock order checking.
+ *
+ * The lock graph has a node for each skinny_mutex that has been involved in
+ * nested locking, and an edge from A to B when B was acquired while A was
+ * the most recently acquired lock still held by the thread.  (Edges from
+ * the other locks held are implied by paths through the graph.)  A cycle in
+ * the graph means that the locks on it are not always acquired in the same
+ * order, so threads can deadlock on them, even if they have not done so yet.
+ *
+ * The graph is only searched when an edge is added, so checking costs a
+ * search once per distinct pair of nested locks, plus a short list walk
+ * under a global mutex on every nested acquisition.
+ */
+
+#define GRAPH_BUCKETS 1024
+
+struct lock_edge {
+    struct lock_node *from;
+    struct lock_node *to;
+
+    /* The next edges in from's out list and to's in list. */
+    struct lock_edge *out_next;
+    struct lock_edge *in_next;
+};
+
+struct lock_node {
+    skinny_mutex_t *lock;
+    struct lock_node *hash_next;
+    struct lock_edge *out;
+    struct lock_edge *in;
+
+    /* The search that last visited this node */
+    unsigned long visited;
+};
+
+static pthread_mutex_t graph_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct lock_node *graph[GRAPH_BUCKETS];
+static unsigned long graph_search;
+
+static void log_inversion(skinny_mutex_t *held, skinny_mutex_t *acquired)
+{
+    log_err("skinny_mutex lock order inversion: %p acquired while holding "
+            "%p, but %p has also been acquired while holding %p",
+            (void *) acquired, (void *) held, (void *) held,
+            (void *) acquired);
+}
+
+static skinny_mutex_inversion_handler_t *inversion_handler = log_inversion;
+
+void skinny_mutex_set_inversion_handler(
+    skinny_mutex_inversion_handler_t *handler)
+{
+    inversion_handler = handler ? handler : log_inversion;
+}
+
+static struct lock_node **graph_bucket(skinny_mutex_t *m)
+{
+    return &graph[((uintptr_t) m * 0x9E3779B97F4A7C15ull) >> 54];
+}
+
+static struct lock_node *graph_find(skinny_mutex_t *m, bool create)
+{
+    struct lock_node **bucket = graph_bucket(m), *node;
+
+    for (node = *bucket; node; node = node->hash_next)
+        if (node->lock == m)
+            return node;
+
+    if (!create)
+        return NULL;
+
+    node = calloc(1, sizeof *node);
+    if (!node)
+        return NULL;
+
+    node->lock = m;
+    node->hash_next = *bucket;
+    *bucket = node;
+    return node;
+}
+
+/* Is there a path from "from" to "to"? */
+static bool graph_reaches(struct lock_node *from, struct lock_node *to)
+{
+    if (from == to)
+        return true;
+
+    if (from->visited == graph_search)
+        return false;
+
+    from->visited = graph_search;
+    for (struct lock_edge *e = from->out; e; e = e->out_next)
+        if (graph_reaches(e->to, to))
+            return true;
+
+    return false;
+}
+
+/* Add an edge from a to b, returning true if it closes a cycle. */
+static bool graph_add_edge(skinny_mutex_t *a, skinny_mutex_t *b)
+{
+    struct lock_node *from = graph_find(a, true), *to = graph_find(b, true);
+    struct lock_edge *e;
+    bool cycle;
+
+    if (!from || !to)
+        return false;
+
+    for (e = from->out; e; e = e->out_next)
+        if (e->to == to)
+            return false;
+
+    e = malloc(sizeof *e);
+    if (!e)
+        return false;
+
+    graph_search++;
+    cycle = graph_reaches(to, from);
+
+    e->from = from;
+    e->to = to;
+    e->out_next = from->out;
+    from->out = e;
+    e->in_next = to->in;
+    to->in = e;
+
+    return cycle;
+}
+
+static void graph_unlink(struct lock_edge **list,
+                         struct lock_edge *e,
+                         bool out)
+{
+    while (*list != e)
+        list = out ? &(*list)->out_next : &(*list)->in_next;
+
+    *list = out ? e->out_next : e->in_next;
+}
+
+void skinny_mutex_debug_destroy(skinny_mutex_t *m)
+{
+    struct lock_node **p, *node;
+
+    pthread_mutex_lock(&graph_mutex);
+
+    for (p = graph_bucket(m); (node = *p); p = &node->hash_next)
+        if (node->lock == m)
+            break;
+
+    if (node) {
+        *p = node->hash_next;
+
+        while (node->out) {
+            struct lock_edge *e = node->out;
+            node->out = e->out_next;
+            graph_unlink(&e->to->in, e, false);
+            free(e);
+        }
+
+        while (node->in) {
+            struct lock_edge *e = node->in;
+            node->in = e->in_next;
+            graph_unlink(&e->from->out, e, true);
+            free(e);
+        }
+
+        free(node);
+    }
+
+    pthread_mutex_unlock(&graph_mutex);
+}
+
+void debug_acquired(skinny_mutex_t *m, bool ordered)
+{
+    struct debug_thread *t = &debug_thread;
+
+    if (ordered && t->count) {
+        skinny_mutex_t *prev = t->held[t->count - 1];
+        bool cycle;
+
+        pthread_mutex_lock(&graph_mutex);
+        cycle = graph_add_edge(prev, m);
+        pthread_mutex_unlock(&graph_mutex);
+
+        if (cycle)
+            inversion_handler(prev, m);
+    }
+
+    /* If too many locks are held, we lose track of the innermost ones. */
+    if (t->count < DEBUG_MAX_HELD)
+        t->held[t->count++] = m;
+}
+
+void debug_released(skinny_mutex_t *m)
+{
+    struct debug_thread *t = &debug_thread;
+
+    for (unsigned int i = t->count; i-- > 0;) {
+        if (t->held[i] != m)
+            continue;
+
+        t->count--;
+        for (; i < t->count; i++)
+            t->held[i] = t->held[i + 1];
+
+        return;
+    }
+}
+
+#endif
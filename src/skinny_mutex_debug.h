@@ -0,0 +1,59 @@
+#ifndef SKINNY_MUTEX_DEBUG_H
+#define SKINNY_MUTEX_DEBUG_H
+
+/* Hooks used by skinny_mutex.c for the error-checking mode enabled by
+ * defining SKINNY_MUTEX_ERRORCHECK.  In normal builds they compile away
+ * entirely.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "skinny_mutex.h"
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+
+/* Locks held by a thread, in the order they were acquired. */
+#define DEBUG_MAX_HELD 16
+
+struct debug_thread {
+    skinny_mutex_t *held[DEBUG_MAX_HELD];
+    unsigned int count;
+} __attribute__((aligned(8)));
+
+extern __thread struct debug_thread debug_thread;
+
+/* The owner token of the calling thread.  It is aligned so that it can be
+ * combined with the low bits of a skinny_mutex word.
+ */
+static inline uintptr_t debug_self(void)
+{
+    return (uintptr_t) &debug_thread;
+}
+
+/* Called when the calling thread acquires a lock.  "ordered" is false for
+ * acquisitions that cannot deadlock (i.e. trylock), which are tracked but
+ * do not add to the lock graph.
+ */
+void debug_acquired(skinny_mutex_t *m, bool ordered);
+
+/* Called when the calling thread releases a lock. */
+void debug_released(skinny_mutex_t *m);
+
+#else
+
+static inline uintptr_t debug_self(void)
+{
+    return 0;
+}
+
+static inline void debug_acquired(skinny_mutex_t *m UNUSED,
+                                  bool ordered UNUSED)
+{
+}
+
+static inline void debug_released(skinny_mutex_t *m UNUSED) {}
+
+#endif
+
+#endif /* SKINNY_MUTEX_DEBUG_H */
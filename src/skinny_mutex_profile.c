@@ -0,0 +1,429 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "skinny_mutex_profile.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "skinny_mutex.h"
+
+/*
+ * The contention profiler samples contended acquisitions of skinny mutexes
+ * (those that reach a fat_mutex), recording the lock, the call site, how
+ * long the thread waited, and how long it then held the lock.
+ *
+ * Each thread aggregates its samples into its own buffer, keyed by lock and
+ * call site, so recording a sample never takes a lock or allocates (except
+ * for the thread's first sample).  Buffers are never freed, so samples from
+ * threads that have exited still appear in reports.  Reports read other
+ * threads' buffers without synchronization, so the figures in them are
+ * approximate while the profiled threads are running.
+ */
+
+/* Entries in each thread's buffer.  Must be a power of two. */
+#define PROFILE_ENTRIES 512
+
+/* Sampled locks a thread can hold at once and still get hold times for. */
+#define PROFILE_MAX_HELD 8
+
+/* Distinct (lock, site) pairs a report can merge. */
+#define PROFILE_REPORT_ENTRIES 4096
+
+struct profile_entry {
+    const void *lock;
+    const void *site;
+    uint64_t count;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t hold_count;
+    uint64_t hold_ns;
+};
+
+struct profile_held {
+    const void *lock;
+    struct profile_entry *entry;
+    uint64_t acquired;
+};
+
+struct profile_buffer {
+    struct profile_buffer *next;
+    unsigned int countdown;
+    uint64_t dropped;
+    struct profile_held held[PROFILE_MAX_HELD];
+    struct profile_entry entries[PROFILE_ENTRIES];
+};
+
+unsigned int skinny_mutex_profile_period;
+
+/* The period of the most recent profiling run, for reports */
+static unsigned int last_period;
+
+__thread unsigned int skinny_mutex_profile_held;
+
+static __thread struct profile_buffer *tls_buffer;
+
+/* All buffers ever allocated */
+static struct profile_buffer *buffers;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct profile_buffer *get_buffer(void)
+{
+    struct profile_buffer *buf = tls_buffer;
+    if (buf)
+        return buf;
+
+    buf = calloc(1, sizeof *buf);
+    if (!buf)
+        return NULL;
+
+    do {
+        buf->next = buffers;
+    } while (!__sync_bool_compare_and_swap(&buffers, buf->next, buf));
+
+    return tls_buffer = buf;
+}
+
+static struct profile_entry *find_entry(struct profile_buffer *buf,
+                                        const void *lock,
+                                        const void *site)
+{
+    uint64_t h = ((uintptr_t) lock ^ ((uintptr_t) site << 7)) *
+                 0x9E3779B97F4A7C15ull;
+    unsigned int i = h >> 32;
+
+    for (int probes = 0; probes < PROFILE_ENTRIES; probes++, i++) {
+        struct profile_entry *e = &buf->entries[i & (PROFILE_ENTRIES - 1)];
+
+        if (e->lock == lock && e->site == site)
+            return e;
+
+        if (!e->lock) {
+            e->site = site;
+            e->lock = lock;
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+void profile_wait_begin_slow(struct profile_wait *pw, const void *site)
+{
+    struct profile_buffer *buf = get_buffer();
+    if (!buf)
+        return;
+
+    if (buf->countdown) {
+        buf->countdown--;
+        return;
+    }
+
+    buf->countdown = skinny_mutex_profile_period - 1;
+    pw->site = site;
+    pw->start = now_ns();
+}
+
+void profile_acquired_slow(struct profile_wait *pw, const void *lock)
+{
+    struct profile_buffer *buf = tls_buffer;
+    struct profile_entry *e = find_entry(buf, lock, pw->site);
+    uint64_t now = now_ns(), wait = now - pw->start;
+    int i;
+
+    if (!e) {
+        buf->dropped++;
+        return;
+    }
+
+    e->count++;
+    e->wait_ns += wait;
+    if (wait > e->max_wait_ns)
+        e->max_wait_ns = wait;
+
+    /* Remember the acquisition so that the release can account for the
+       hold time.  If there is no room, forget the oldest. */
+    for (i = 0; i < PROFILE_MAX_HELD - 1; i++)
+        if (!buf->held[i].lock)
+            break;
+
+    if (buf->held[i].lock) {
+        memmove(&buf->held[0], &buf->held[1],
+                (PROFILE_MAX_HELD - 1) * sizeof buf->held[0]);
+        skinny_mutex_profile_held--;
+    }
+
+    buf->held[i].lock = lock;
+    buf->held[i].entry = e;
+    buf->held[i].acquired = now;
+    skinny_mutex_profile_held++;
+}
+
+void profile_released_slow(const void *lock)
+{
+    struct profile_buffer *buf = tls_buffer;
+
+    for (int i = 0; i < PROFILE_MAX_HELD; i++) {
+        struct profile_held *h = &buf->held[i];
+
+        if (h->lock != lock)
+            continue;
+
+        h->entry->hold_count++;
+        h->entry->hold_ns += now_ns() - h->acquired;
+
+        memmove(h, h + 1, (PROFILE_MAX_HELD - 1 - i) * sizeof *h);
+        buf->held[PROFILE_MAX_HELD - 1].lock = NULL;
+        skinny_mutex_profile_held--;
+        return;
+    }
+}
+
+int skinny_mutex_profile_start(unsigned int period)
+{
+    if (!period)
+        return EINVAL;
+
+    skinny_mutex_profile_period = last_period = period;
+    return 0;
+}
+
+void skinny_mutex_profile_stop(void)
+{
+    skinny_mutex_profile_period = 0;
+}
+
+void skinny_mutex_profile_reset(void)
+{
+    for (struct profile_buffer *buf = buffers; buf; buf = buf->next) {
+        buf->dropped = 0;
+        for (int i = 0; i < PROFILE_ENTRIES; i++) {
+            struct profile_entry *e = &buf->entries[i];
+            e->count = e->wait_ns = e->max_wait_ns = 0;
+            e->hold_count = e->hold_ns = 0;
+        }
+    }
+}
+
+/* The merged entries for a report, covered by report_mutex. */
+static skinny_mutex_t report_mutex = SKINNY_MUTEX_INITIALIZER;
+static struct profile_entry merged[PROFILE_REPORT_ENTRIES];
+static int merged_count;
+static uint64_t merged_dropped;
+
+static void merge_buffers(void)
+{
+    merged_count = 0;
+    merged_dropped = 0;
+
+    for (struct profile_buffer *buf = buffers; buf; buf = buf->next) {
+        merged_dropped += buf->dropped;
+
+        for (int i = 0; i < PROFILE_ENTRIES; i++) {
+            struct profile_entry *e = &buf->entries[i], *m;
+            int j;
+
+            if (!e->count)
+                continue;
+
+            for (j = 0; j < merged_count; j++)
+                if (merged[j].lock == e->lock && merged[j].site == e->site)
+                    break;
+
+            if (j == merged_count) {
+                if (merged_count == PROFILE_REPORT_ENTRIES) {
+                    merged_dropped += e->count;
+                    continue;
+                }
+
+                memset(&merged[merged_count++], 0, sizeof merged[0]);
+                merged[j].lock = e->lock;
+                merged[j].site = e->site;
+            }
+
+            m = &merged[j];
+            m->count += e->count;
+            m->wait_ns += e->wait_ns;
+            if (e->max_wait_ns > m->max_wait_ns)
+                m->max_wait_ns = e->max_wait_ns;
+            m->hold_count += e->hold_count;
+            m->hold_ns += e->hold_ns;
+        }
+    }
+}
+
+/* Format into a buffer and write(2) it, so that each line goes out whole. */
+static void report_line(int fd, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void report_line(int fd, const char *fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof line, fmt, ap);
+    va_end(ap);
+
+    if (len > (int) sizeof line - 1)
+        len = sizeof line - 1;
+
+    while (len > 0) {
+        ssize_t n = write(fd, line, len);
+        if (n <= 0)
+            return;
+        len -= n;
+    }
+}
+
+int skinny_mutex_profile_report(int fd, int top_n)
+{
+    int count;
+
+    skinny_mutex_lock(&report_mutex);
+    merge_buffers();
+
+    report_line(fd,
+                "skinny_mutex contention profile: %d sites, sampling 1 in "
+                "%u contended acquisitions, %llu samples dropped\n",
+                merged_count, last_period,
+                (unsigned long long) merged_dropped);
+    report_line(fd, "%4s %18s %18s %10s %14s %12s %12s %12s\n", "rank",
+                "lock", "site", "count", "wait_total_us", "wait_avg_us",
+                "wait_max_us", "hold_avg_us");
+
+    /* Selection sort of the top entries by total wait time, which is fine
+       for the handful of lines in a report. */
+    for (int rank = 0; rank < top_n && rank < merged_count; rank++) {
+        struct profile_entry tmp;
+        int best = rank;
+
+        for (int j = rank + 1; j < merged_count; j++)
+            if (merged[j].wait_ns > merged[best].wait_ns)
+                best = j;
+
+        tmp = merged[rank];
+        merged[rank] = merged[best];
+        merged[best] = tmp;
+
+        report_line(
+            fd, "%4d %18p %18p %10llu %14.1f %12.1f %12.1f %12.1f\n",
+            rank + 1, merged[rank].lock, merged[rank].site,
+            (unsigned long long) merged[rank].count,
+            merged[rank].wait_ns / 1e3,
+            merged[rank].wait_ns / 1e3 / merged[rank].count,
+            merged[rank].max_wait_ns / 1e3,
+            merged[rank].hold_count
+                ? merged[rank].hold_ns / 1e3 / merged[rank].hold_count
+                : 0.0);
+    }
+
+    count = merged_count;
+    skinny_mutex_unlock(&report_mutex);
+    return count;
+}
+
+/* Number of lines in the automatic reports. */
+static int report_top_n = 20;
+
+static void report_at_exit(void)
+{
+    skinny_mutex_profile_report(STDERR_FILENO, report_top_n);
+}
+
+/* Producing a report is not async-signal-safe, so the signal handler only
+ * posts a semaphore, and a thread waiting on it produces the report.
+ */
+static sem_t report_sem;
+
+static void report_on_signal(int sig UNUSED)
+{
+    int saved_errno = errno;
+    sem_post(&report_sem);
+    errno = saved_errno;
+}
+
+static void *report_thread(void *dummy UNUSED)
+{
+    for (;;) {
+        if (sem_wait(&report_sem))
+            continue; /* EINTR */
+
+        skinny_mutex_profile_report(STDERR_FILENO, report_top_n);
+    }
+
+    return NULL;
+}
+
+static void report_on_signal_init(int sig)
+{
+    struct sigaction sa;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (sem_init(&report_sem, 0, 0))
+        return;
+
+    if (pthread_attr_init(&attr))
+        return;
+
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, report_thread, NULL)) {
+        pthread_attr_destroy(&attr);
+        return;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = report_on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+}
+
+/*
+ * Profiling can be turned on without changing the program:
+ *
+ * SKINNY_MUTEX_PROFILE=N samples one in N contended acquisitions, and
+ * prints a report to stderr at exit.
+ *
+ * SKINNY_MUTEX_PROFILE_TOP=N sets the number of lines in that report.
+ *
+ * SKINNY_MUTEX_PROFILE_SIGNAL=S also prints a report whenever signal
+ * number S is received, from a thread started for that purpose.
+ */
+__attribute__((constructor)) static void profile_init_from_env(void)
+{
+    const char *period = getenv("SKINNY_MUTEX_PROFILE");
+    const char *top = getenv("SKINNY_MUTEX_PROFILE_TOP");
+    const char *sig = getenv("SKINNY_MUTEX_PROFILE_SIGNAL");
+
+    if (!period || atoi(period) <= 0)
+        return;
+
+    if (top && atoi(top) > 0)
+        report_top_n = atoi(top);
+
+    if (sig && atoi(sig) > 0)
+        report_on_signal_init(atoi(sig));
+
+    skinny_mutex_profile_start(atoi(period));
+    atexit(report_at_exit);
+}
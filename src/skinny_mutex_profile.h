@@ -0,0 +1,52 @@
+#ifndef SKINNY_MUTEX_PROFILE_H
+#define SKINNY_MUTEX_PROFILE_H
+
+/* Hooks used by skinny_mutex.c to feed the contention profiler.  They only
+ * appear on the slow paths, and when profiling is off they cost a load and
+ * a predictable branch.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Sample one in this many contended acquisitions, or 0 when disabled. */
+extern unsigned int skinny_mutex_profile_period;
+
+/* How many sampled acquisitions this thread is yet to release. */
+extern __thread unsigned int skinny_mutex_profile_held;
+
+struct profile_wait {
+    uint64_t start;
+    const void *site;
+};
+
+void profile_wait_begin_slow(struct profile_wait *pw, const void *site);
+void profile_acquired_slow(struct profile_wait *pw, const void *lock);
+void profile_released_slow(const void *lock);
+
+/* Called when a thread starts waiting for a contended lock.  "site" is the
+ * return address of the public entry point.
+ */
+static inline void profile_wait_begin(struct profile_wait *pw,
+                                      const void *site)
+{
+    pw->start = 0;
+    if (__builtin_expect(skinny_mutex_profile_period != 0, 0))
+        profile_wait_begin_slow(pw, site);
+}
+
+/* Called once the lock is acquired after profile_wait_begin. */
+static inline void profile_acquired(struct profile_wait *pw, const void *lock)
+{
+    if (__builtin_expect(pw->start != 0, 0))
+        profile_acquired_slow(pw, lock);
+}
+
+/* Called whenever a lock is released on a slow path. */
+static inline void profile_released(const void *lock)
+{
+    if (__builtin_expect(skinny_mutex_profile_held != 0, 0))
+        profile_released_slow(lock);
+}
+
+#endif /* SKINNY_MUTEX_PROFILE_H */
@@ -0,0 +1,253 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "skinny_pi_mutex.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/* The calling thread's kernel thread ID, or 0 if not yet known. */
+__thread uint32_t skinny_pi_mutex_tid;
+
+/* See the function of the same name in skinny_mutex.c */
+static int recover(int res1, int res2)
+{
+    if (res2 == 0)
+        return res1;
+
+    if (res1 == 0)
+        return res2;
+
+    log_err("got error %d while recovering from %d\n", res2, res1);
+    abort();
+}
+
+#ifdef __linux__
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/* The child of a fork gets a new thread ID, so forget the cached one. */
+static void forget_tid(void)
+{
+    skinny_pi_mutex_tid = 0;
+}
+
+static void register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, forget_tid);
+}
+
+uint32_t skinny_pi_mutex_gettid(void)
+{
+    pthread_once(&atfork_once, register_atfork);
+    return skinny_pi_mutex_tid = syscall(SYS_gettid);
+}
+
+static int futex(uint32_t *uaddr,
+                 int op,
+                 uint32_t val,
+                 const struct timespec *timeout,
+                 uint32_t *uaddr2,
+                 uint32_t val3)
+{
+    if (syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3) < 0)
+        return errno;
+
+    return 0;
+}
+
+static inline uint32_t owner(skinny_pi_mutex_t *m)
+{
+    return m->val & FUTEX_TID_MASK;
+}
+
+/* Called from skinny_pi_mutex_lock when the fast path fails.
+ *
+ * FUTEX_LOCK_PI makes the kernel set FUTEX_WAITERS in the mutex word, so
+ * the owner's unlock will come through skinny_pi_mutex_unlock_slow.  While
+ * we are blocked, the owner runs with at least our priority.
+ */
+int skinny_pi_mutex_lock_slow(skinny_pi_mutex_t *m)
+{
+    if (owner(m) == skinny_pi_mutex_self())
+        return EDEADLK;
+
+    for (;;) {
+        int res = futex(&m->val, FUTEX_LOCK_PI_PRIVATE, 0, NULL, NULL, 0);
+
+        /* EAGAIN means the owner is about to exit; try again. */
+        if (res != EAGAIN && res != EINTR)
+            return res;
+    }
+}
+
+/* Called from skinny_pi_mutex_unlock when the fast path fails. */
+int skinny_pi_mutex_unlock_slow(skinny_pi_mutex_t *m)
+{
+    uint32_t self = skinny_pi_mutex_self();
+
+    if (owner(m) != self)
+        return EPERM;
+
+    /* FUTEX_WAITERS might have been clear after all, in which case the
+       kernel does the equivalent of the fast path. */
+    return futex(&m->val, FUTEX_UNLOCK_PI_PRIVATE, 0, NULL, NULL, 0);
+}
+
+int skinny_pi_mutex_trylock(skinny_pi_mutex_t *m)
+{
+    if (__sync_bool_compare_and_swap(&m->val, 0, skinny_pi_mutex_self()))
+        return 0;
+
+    return EBUSY;
+}
+
+/*
+ * The condition variable is a sequence number.  A waiter samples it before
+ * releasing the mutex, and then blocks with FUTEX_WAIT_REQUEUE_PI only if it
+ * is unchanged, so a signal between the two cannot be lost.  Signallers bump
+ * the sequence number and use FUTEX_CMP_REQUEUE_PI, which either hands the
+ * mutex straight to the first waiter, or moves it onto the mutex's PI wait
+ * queue.  Broadcast requeues the rest of the waiters too, rather than waking
+ * them all to fight over the mutex.
+ */
+int skinny_pi_mutex_cond_timedwait(skinny_pi_cond_t *cond,
+                                   skinny_pi_mutex_t *m,
+                                   const struct timespec *abstime)
+{
+    uint32_t seq;
+    int res;
+
+    if (owner(m) != skinny_pi_mutex_self())
+        return EPERM;
+
+    /* Act as a cancellation point while we still hold the mutex, so that
+       cancellation cleanup handlers see it held, as they would with
+       pthread_cond_wait. */
+    pthread_testcancel();
+
+    /* Requeueing needs to know the target mutex, and all waiters on a
+       condition variable must use the same mutex. */
+    cond->mutex = m;
+
+    seq = cond->seq;
+    res = skinny_pi_mutex_unlock(m);
+    if (res)
+        return res;
+
+    res = futex(&cond->seq, FUTEX_WAIT_REQUEUE_PI_PRIVATE | FUTEX_CLOCK_REALTIME,
+                seq, abstime, &m->val, 0);
+    if (!res)
+        /* The kernel acquired the mutex on our behalf. */
+        return 0;
+
+    /* EAGAIN means there was a signal before we blocked, and EINTR is a
+       spurious wakeup.  Either way, we return without having waited. */
+    if (res == EAGAIN || res == EINTR)
+        res = 0;
+
+    /* We might have been requeued and acquired the mutex before the error
+       was noticed. */
+    if (owner(m) == skinny_pi_mutex_self())
+        return res;
+
+    return recover(res, skinny_pi_mutex_lock(m));
+}
+
+int skinny_pi_mutex_cond_wait(skinny_pi_cond_t *cond, skinny_pi_mutex_t *m)
+{
+    return skinny_pi_mutex_cond_timedwait(cond, m, NULL);
+}
+
+static int cond_requeue(skinny_pi_cond_t *cond, int nr_requeue)
+{
+    skinny_pi_mutex_t *m = cond->mutex;
+    uint32_t seq = __sync_add_and_fetch(&cond->seq, 1);
+
+    if (!m)
+        /* Nobody has ever waited */
+        return 0;
+
+    for (;;) {
+        /* The requeue count is passed in the timeout argument. */
+        int res =
+            futex(&cond->seq, FUTEX_CMP_REQUEUE_PI_PRIVATE, 1,
+                  (const struct timespec *) (uintptr_t) nr_requeue, &m->val,
+                  seq);
+        if (res != EAGAIN)
+            return res;
+
+        /* Another signaller bumped the sequence number, but our increment
+           still counts, so requeue against the new value. */
+        seq = cond->seq;
+    }
+}
+
+int skinny_pi_cond_signal(skinny_pi_cond_t *cond)
+{
+    return cond_requeue(cond, 0);
+}
+
+int skinny_pi_cond_broadcast(skinny_pi_cond_t *cond)
+{
+    return cond_requeue(cond, INT_MAX);
+}
+
+#else /* !__linux__ */
+
+/* Priority inheritance relies on Linux PI futexes. */
+
+uint32_t skinny_pi_mutex_gettid(void)
+{
+    return skinny_pi_mutex_tid = 1;
+}
+
+int skinny_pi_mutex_lock_slow(skinny_pi_mutex_t *m UNUSED)
+{
+    return ENOTSUP;
+}
+
+int skinny_pi_mutex_unlock_slow(skinny_pi_mutex_t *m UNUSED)
+{
+    return ENOTSUP;
+}
+
+int skinny_pi_mutex_trylock(skinny_pi_mutex_t *m UNUSED)
+{
+    return ENOTSUP;
+}
+
+int skinny_pi_mutex_cond_timedwait(skinny_pi_cond_t *cond UNUSED,
+                                   skinny_pi_mutex_t *m UNUSED,
+                                   const struct timespec *abstime UNUSED)
+{
+    return ENOTSUP;
+}
+
+int skinny_pi_mutex_cond_wait(skinny_pi_cond_t *cond UNUSED,
+                              skinny_pi_mutex_t *m UNUSED)
+{
+    return ENOTSUP;
+}
+
+int skinny_pi_cond_signal(skinny_pi_cond_t *cond UNUSED)
+{
+    return ENOTSUP;
+}
+
+int skinny_pi_cond_broadcast(skinny_pi_cond_t *cond UNUSED)
+{
+    return ENOTSUP;
+}
+
+#endif
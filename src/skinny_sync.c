@@ -0,0 +1,334 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "skinny_sync.h"
+
+#include <assert.h>
+#include <stdbool.h>
+
+#include "skinny_fat.h"
+
+/*
+ * These primitives use the fat_mutex machinery from skinny_mutex.c (see
+ * skinny_fat.h), with their state kept in fat->count (and, for barriers,
+ * fat->generation) while the word is inflated.  Threads blocked on the
+ * primitive hold references on the fat_mutex, so it is freed when the last
+ * of them leaves, and the word returns to the thin value in fat->deflated.
+ */
+
+/* Thin values of skinny_sem_t and skinny_barrier_t words */
+#define thin_count(head) ((uintptr_t)(head) >> 1)
+#define count_thin(count) ((void *) (((uintptr_t)(count) << 1) | 1))
+
+/* Set up a fat_mutex for a semaphore, or a barrier. */
+static void fat_mutex_init_count(struct fat_mutex *fat, void *head)
+{
+    fat->count = thin_count(head);
+}
+
+/* Change the value of an inflated semaphore */
+static void sem_set(struct fat_mutex *fat, long count)
+{
+    fat->count = count;
+    fat->deflated = count_thin(count);
+}
+
+struct sem_wait_cleanup {
+    skinny_sem_t *sem;
+    struct fat_mutex *fat;
+};
+
+/* Thread cancellation cleanup handler when waiting on a semaphore. */
+static void sem_wait_cleanup(void *v_c)
+{
+    struct sem_wait_cleanup *c = v_c;
+
+    c->fat->waiters--;
+
+    /* We might have consumed a wakeup meant for a waiter that can now
+       proceed, so pass it on. */
+    if (c->fat->count && c->fat->waiters)
+        pthread_cond_signal(&c->fat->cond);
+
+    fat_mutex_release(&c->sem->val, c->fat);
+}
+
+static int sem_wait(skinny_sem_t *sem,
+                    bool block,
+                    const struct timespec *abstime)
+{
+    struct sem_wait_cleanup c = {.sem = sem};
+    int res;
+
+    for (;;) {
+        void *head = sem->val;
+
+        if (thin(head)) {
+            if (thin_count(head)) {
+                if (atomic_cas(&sem->val, head,
+                               count_thin(thin_count(head) - 1),
+                               ATOMIC_ACQUIRE))
+                    return 0;
+
+                continue;
+            }
+
+            if (!block)
+                return EAGAIN;
+        }
+
+        res = fat_mutex_get(&sem->val, head, &c.fat, fat_mutex_init_count);
+        if (!res)
+            break;
+
+        if (res > 0)
+            return res;
+
+        /* semaphore value changed under us, try again. */
+    }
+
+    c.fat->refcount++;
+
+    if (!c.fat->count && block) {
+        c.fat->waiters++;
+
+        /* pthread_cond_wait is a cancellation point, as sem_wait should
+           be. */
+        pthread_cleanup_push(sem_wait_cleanup, &c);
+        do {
+            if (!abstime)
+                res = pthread_cond_wait(&c.fat->cond, &c.fat->mutex);
+            else
+                res = pthread_cond_timedwait(&c.fat->cond, &c.fat->mutex,
+                                             abstime);
+        } while (!res && !c.fat->count);
+        pthread_cleanup_pop(0);
+
+        c.fat->waiters--;
+    }
+
+    if (c.fat->count) {
+        sem_set(c.fat, c.fat->count - 1);
+        res = 0;
+    } else if (!res) {
+        res = EAGAIN;
+    }
+
+    return recover(res, fat_mutex_release(&sem->val, c.fat));
+}
+
+int skinny_sem_wait_slow(skinny_sem_t *sem)
+{
+    return sem_wait(sem, true, NULL);
+}
+
+int skinny_sem_trywait(skinny_sem_t *sem)
+{
+    return sem_wait(sem, false, NULL);
+}
+
+int skinny_sem_timedwait(skinny_sem_t *sem, const struct timespec *abstime)
+{
+    return sem_wait(sem, true, abstime);
+}
+
+int skinny_sem_post_slow(skinny_sem_t *sem)
+{
+    struct fat_mutex *fat;
+    int res;
+
+    for (;;) {
+        void *head = sem->val;
+
+        if (thin(head)) {
+            if (thin_count(head) >= SKINNY_SEM_VALUE_MAX)
+                return EOVERFLOW;
+
+            if (atomic_cas(&sem->val, head, count_thin(thin_count(head) + 1),
+                           ATOMIC_RELEASE))
+                return 0;
+
+            continue;
+        }
+
+        res = fat_mutex_find(&sem->val, &fat);
+        if (!res)
+            break;
+
+        if (res > 0)
+            return res;
+    }
+
+    fat->refcount++;
+    res = EOVERFLOW;
+    if (fat->count < SKINNY_SEM_VALUE_MAX) {
+        sem_set(fat, fat->count + 1);
+        res = fat->waiters ? pthread_cond_signal(&fat->cond) : 0;
+    }
+
+    return recover(res, fat_mutex_release(&sem->val, fat));
+}
+
+int skinny_sem_getvalue(skinny_sem_t *sem, int *value)
+{
+    for (;;) {
+        void *head = sem->val;
+        struct fat_mutex *fat;
+        int res;
+
+        if (thin(head)) {
+            *value = thin_count(head);
+            return 0;
+        }
+
+        res = fat_mutex_find(&sem->val, &fat);
+        if (res > 0)
+            return res;
+
+        if (!res) {
+            *value = fat->count;
+            return pthread_mutex_unlock(&fat->mutex);
+        }
+    }
+}
+
+int skinny_barrier_wait(skinny_barrier_t *barrier)
+{
+    struct fat_mutex *fat;
+    int res, old_state, old_state2;
+
+    for (;;) {
+        void *head = barrier->val;
+
+        /* A barrier for a single thread never needs to block */
+        if (thin(head) && thin_count(head) == 1)
+            return SKINNY_BARRIER_SERIAL_THREAD;
+
+        res = fat_mutex_get(&barrier->val, head, &fat, fat_mutex_init_count);
+        if (!res)
+            break;
+
+        if (res > 0)
+            return res;
+    }
+
+    /* fat->waiters counts the threads that have arrived in the current
+       generation. */
+    fat->refcount++;
+    if (++fat->waiters == fat->count) {
+        fat->waiters = 0;
+        fat->generation++;
+        res = pthread_cond_broadcast(&fat->cond);
+        res = recover(res, fat_mutex_release(&barrier->val, fat));
+        return res ? res : SKINNY_BARRIER_SERIAL_THREAD;
+    }
+
+    /* Not a cancellation point, but pthread_cond_wait is, so we need to
+       defer cancellation around it. */
+    assert(!pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state));
+    for (long generation = fat->generation;
+         !res && fat->generation == generation;)
+        res = pthread_cond_wait(&fat->cond, &fat->mutex);
+    assert(!pthread_setcancelstate(old_state, &old_state2));
+
+    return recover(res, fat_mutex_release(&barrier->val, fat));
+}
+
+/* Values of a skinny_once_t word, or fat->count when inflated */
+#define ONCE_NOT_STARTED 0
+#define ONCE_RUNNING 1
+
+static void fat_mutex_init_once(struct fat_mutex *fat, void *head)
+{
+    fat->count = (uintptr_t) head;
+}
+
+/* Leave the ONCE_RUNNING state, waking any waiting threads. */
+static int once_finish(skinny_once_t *once, long state)
+{
+    for (;;) {
+        void *head = once->val;
+        struct fat_mutex *fat;
+        int res;
+
+        if (thin(head)) {
+            assert(head == (void *) ONCE_RUNNING);
+            if (atomic_cas(&once->val, head, (void *) state, ATOMIC_RELEASE))
+                return 0;
+
+            continue;
+        }
+
+        res = fat_mutex_find(&once->val, &fat);
+        if (res > 0)
+            return res;
+
+        if (!res) {
+            fat->count = state;
+            fat->deflated = (void *) state;
+            fat->refcount++;
+            res = pthread_cond_broadcast(&fat->cond);
+            return recover(res, fat_mutex_release(&once->val, fat));
+        }
+    }
+}
+
+/* Thread cancellation cleanup handler for the init routine. */
+static void once_cancelled(void *v_once)
+{
+    once_finish(v_once, ONCE_NOT_STARTED);
+}
+
+static int once_run(skinny_once_t *once, void (*init_routine)(void))
+{
+    pthread_cleanup_push(once_cancelled, once);
+    init_routine();
+    pthread_cleanup_pop(0);
+    return once_finish(once, SKINNY_ONCE_DONE);
+}
+
+int skinny_once_slow(skinny_once_t *once, void (*init_routine)(void))
+{
+    for (;;) {
+        void *head = atomic_load_order(&once->val, ATOMIC_ACQUIRE);
+        struct fat_mutex *fat;
+        int res, old_state, old_state2;
+
+        if (head == (void *) SKINNY_ONCE_DONE)
+            return 0;
+
+        if (head == (void *) ONCE_NOT_STARTED) {
+            if (atomic_cas(&once->val, head, (void *) ONCE_RUNNING,
+                           ATOMIC_ACQUIRE))
+                return once_run(once, init_routine);
+
+            continue;
+        }
+
+        /* Another thread is running the init routine, so wait for it. */
+        res = fat_mutex_get(&once->val, head, &fat, fat_mutex_init_once);
+        if (res > 0)
+            return res;
+        else if (res < 0)
+            continue;
+
+        fat->refcount++;
+
+        /* pthread_once is not a cancellation point */
+        assert(!pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state));
+        while (!res && fat->count == ONCE_RUNNING)
+            res = pthread_cond_wait(&fat->cond, &fat->mutex);
+        assert(!pthread_setcancelstate(old_state, &old_state2));
+
+        if (!res && fat->count == ONCE_NOT_STARTED) {
+            /* The init routine was cancelled, so it is our turn. */
+            fat->count = ONCE_RUNNING;
+            fat->deflated = (void *) ONCE_RUNNING;
+            res = fat_mutex_release(&once->val, fat);
+            return res ? res : once_run(once, init_routine);
+        }
+
+        return recover(res, fat_mutex_release(&once->val, fat));
+    }
+}
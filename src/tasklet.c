@@ -1,92 +1,265 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "tasklet.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atomics.h"
+#include "epoch.h"
+#include "parking_lot.h"
+#include "reactor.h"
+#include "timer_wheel.h"
+#include "uring.h"
 
 #define pointer_bits(p) ((uintptr_t)(p) &3)
 #define pointer_clear_bits(p) ((void *) ((uintptr_t)(p) & -4))
 #define pointer_set_bits(p, bits) ((void *) ((uintptr_t)(p) | (bits)))
 
+/* Accessors for t->wait, which packs the wait_list pointer with its lock */
+static void tasklet_wait_lock(struct tasklet *t)
+{
+    skinny_bitlock_lock(&t->wait);
+}
+
+static void tasklet_wait_unlock(struct tasklet *t)
+{
+    skinny_bitlock_unlock(&t->wait);
+}
+
+static struct wait_list *tasklet_wait_list(struct tasklet *t)
+{
+    return skinny_bitlock_ptr(&t->wait);
+}
+
+static void tasklet_set_wait_list(struct tasklet *t, struct wait_list *w)
+{
+    skinny_bitlock_set_ptr(&t->wait, w);
+}
+
 void tasklet_init(struct tasklet *tasklet, struct mutex *mutex, void *data)
 {
     tasklet->mutex = mutex;
     tasklet->handler = NULL;
     tasklet->data = data;
-    mutex_init(&tasklet->wait_mutex);
-    tasklet->wait = NULL;
+    tasklet->wait = 0;
     tasklet->unwaiting = 0;
+    tasklet->priority = TASKLET_PRIORITY_NORMAL;
+    tasklet->requeues = 0;
+    tasklet->level = TASKLET_PRIORITY_NORMAL;
     tasklet->runq = NULL;
 }
 
+void tasklet_set_priority(struct tasklet *t, enum tasklet_priority prio)
+{
+    assert(prio < TASKLET_PRIORITIES);
+    atomic_store_order(&t->priority, prio, ATOMIC_RELAXED);
+}
+
 struct run_queue {
-    /* Linked list of all run queues. */
+    /* For freeing the run queue once it is destroyed.  First, so that
+       run_queue_free can find the run queue from it. */
+    struct epoch_entry epoch;
+
+    /* Linked list of all run queues, set using atomic ops */
     struct run_queue *next;
 
+    /* tasklet_run pushes tasklets onto the incoming list without taking
+       any locks.  It is an intrusive multi-producer, single-consumer queue
+       (Vyukov's), linked through runq_next, and the single consumer is
+       whoever holds the mutex.  The consumer moves tasklets from it in
+       batches onto the ready list, where tasklet_stop can remove them and
+       other workers can steal them. */
+    struct tasklet *incoming_tail; /* Producers' end, set using atomic ops */
+    struct tasklet *incoming_head; /* Consumer's end, covered by mutex */
+    struct tasklet stub;
+
+    /* While statistics are on, the tasklet whose latency is being timed,
+       and when it was made runnable.  Producers claim sample using atomic
+       ops when it is NULL; the consumer clears it. */
+    struct tasklet *sample;
+    uint64_t sample_since;
+
     struct mutex mutex;
-    struct tasklet *head;
+
+    /* The ready lists, one for each priority */
+    struct tasklet *heads[TASKLET_PRIORITIES];
+    unsigned int length; /* Number of tasklets on the ready lists */
     struct tasklet *current;
-    enum { CURRENT_STARTED, CURRENT_STOPPED, CURRENT_REQUEUE } current_state;
+    enum { CURRENT_STARTED, CURRENT_STOPPED } current_state;
 
     bool stop_waiting;
-    bool worker_waiting;
+    enum {
+        WORKER_BUSY,
+        WORKER_SLEEPING, /* In cond_wait on cond */
+        WORKER_POLLING   /* In reactor_poll, without the mutex */
+    } worker_waiting;
     thread_handle_t thread;
     struct cond cond;
+
+    /* Created by the first tasklet_fd_init for this queue, and set using
+       atomic ops.  Once there is a reactor, an idle worker waits in it
+       rather than on cond. */
+    struct reactor *reactor;
+
+    /* Created by the first tasklet_io operation started from this queue,
+       and set using atomic ops.  Its completions arrive through the
+       reactor. */
+    struct uring *uring;
+
+    /* Timers armed by tasklets on this queue.  The worker fires them when
+       it is idle, and every RUNQ_POLL_INTERVAL tasklets when busy. */
+    struct mutex timers_mutex;
+    struct timer_wheel timers; /* Covered by timers_mutex */
+    uint64_t timers_next;      /* When to advance timers, set atomically */
+
+    /* Set by run_queue_set_budget, and covered by mutex */
+    unsigned int budget_tasklets;
+    uint64_t budget_ns;
+
+    struct tasklet_stats stats; /* Covered by mutex */
+
+    /* Shared queues belong to the default scheduler.  Their workers steal
+       from each other when idle.  Queues created by run_queue_create are
+       served by whoever created them, so they are left alone. */
+    bool shared;
 };
 
-/* Threads can hold a run_queue reference without holding any locks.
-   So run_queues cannot simply be freed.  At some stage it might be
-   worth introducing RCU-like grace periods to determine when
-   run_queues can be freed.  But for now, we don't expect many of them
-   to get allocated, so we simply clean them up on exit to keep
-   valgrind happy. */
+/* How many tasklets a busy run queue runs between checks for I/O */
+#define RUNQ_POLL_INTERVAL 64
+
+/* How many times in a row a tasklet can be made runnable again while it
+   runs before it drops a priority class */
+#define RUNQ_DEMOTE_REQUEUES 4
 
+/* Number of shared queues whose workers are waiting for tasklets */
+static unsigned int idle_workers;
+
+/* Are statistics being kept?  Set using atomic ops */
+static bool stats_enabled;
+
+/* Was TASKLET_STATS set, so that cleanup_run_queues should report? */
+static bool stats_report_at_exit;
+
+/* Threads can hold a run_queue reference without holding any locks: when
+   walking the list of run queues, or following a tasklet's or timer's runq
+   field to lock the queue.  They do so inside an epoch read-side section,
+   so run_queue_destroy unlinks a run queue and then frees it only after a
+   grace period.  run_queues_mutex serializes changes to the list, while
+   readers walk it without locks.  The scheduler's queues last until
+   exit. */
 static struct run_queue *run_queues;
+static struct mutex run_queues_mutex = MUTEX_INITIALIZER;
+
+static bool incoming_empty(struct run_queue *runq);
 
-static void run_queue_destroy(struct run_queue *runq)
+/* Begin a section in which the run queues seen cannot be freed. */
+static void run_queue_epoch_enter(void)
 {
-    assert(!runq->head);
+    /* This only fails if the thread could not be registered for lack of
+       memory, and then we would not get far anyway */
+    if (epoch_enter())
+        abort();
+}
+
+static void run_queue_free(struct run_queue *runq)
+{
+    assert(!runq->length);
     assert(!runq->current);
+    assert(incoming_empty(runq));
     mutex_fini(&runq->mutex);
     cond_fini(&runq->cond);
+    mutex_fini(&runq->timers_mutex);
+    if (runq->uring)
+        uring_destroy(runq->uring);
+    if (runq->reactor)
+        reactor_destroy(runq->reactor);
     free(runq);
 }
 
 static void cleanup_run_queues(void)
 {
-    struct run_queue *runq = run_queues;
+    struct run_queue *runq;
 
+    if (stats_report_at_exit)
+        tasklet_stats_report(STDERR_FILENO);
+
+    runq = run_queues;
+    run_queues = NULL;
     while (runq) {
         struct run_queue *next = runq->next;
-        run_queue_destroy(runq);
+        run_queue_free(runq);
         runq = next;
     }
+
+    /* Run queues destroyed earlier are probably waiting for this */
+    epoch_synchronize();
 }
 
 static struct run_queue *run_queue_create_unlinked(void)
 {
     struct run_queue *runq = malloc(sizeof *runq);
 
+    runq->stub.runq_next = NULL;
+    runq->incoming_head = runq->incoming_tail = &runq->stub;
+    runq->sample = NULL;
+
     mutex_init(&runq->mutex);
-    runq->head = runq->current = NULL;
+    for (int i = 0; i < TASKLET_PRIORITIES; i++)
+        runq->heads[i] = NULL;
+
+    runq->current = NULL;
+    runq->length = 0;
+    runq->budget_tasklets = 0;
+    runq->budget_ns = 0;
+    memset(&runq->stats, 0, sizeof runq->stats);
     runq->stop_waiting = false;
-    runq->worker_waiting = false;
+    runq->worker_waiting = WORKER_BUSY;
     cond_init(&runq->cond);
+    runq->reactor = NULL;
+    runq->uring = NULL;
+    mutex_init(&runq->timers_mutex);
+    timer_wheel_init(&runq->timers, tasklet_now() / TIMER_WHEEL_TICK);
+    runq->timers_next = TIMER_WHEEL_NEVER;
+    runq->shared = false;
 
     return runq;
 }
 
 static void add_to_run_queues(struct run_queue *runq)
 {
-    do {
-        runq->next = run_queues;
-    } while (!__sync_bool_compare_and_swap(&run_queues, runq->next, runq));
+    mutex_lock(&run_queues_mutex);
+    runq->next = run_queues;
+    atomic_store_order(&run_queues, runq, ATOMIC_RELEASE);
+    mutex_unlock(&run_queues_mutex);
 
     if (!runq->next)
         atexit(cleanup_run_queues);
 }
 
+/* The run queue's next field is left alone, so that a thread that is
+   looking at it can carry on down the list. */
+static void remove_from_run_queues(struct run_queue *runq)
+{
+    struct run_queue **pp;
+
+    mutex_lock(&run_queues_mutex);
+    for (pp = &run_queues; *pp != runq; pp = &(*pp)->next)
+        assert(*pp);
+
+    atomic_store_order(pp, runq->next, ATOMIC_RELEASE);
+    mutex_unlock(&run_queues_mutex);
+}
+
 struct run_queue *run_queue_create(void)
 {
     struct run_queue *runq = run_queue_create_unlinked();
@@ -121,11 +294,14 @@ static void stop_worker(void *v_worker)
     tasklet_stop(&w->tasklet);
 }
 
+static void tasklet_run_on(struct tasklet *t, struct run_queue *target);
+
 static void worker_destroy(struct worker *w)
 {
     mutex_init(&w->mutex);
     tasklet_init(&w->tasklet, &w->mutex, w);
-    tasklet_later(&w->tasklet, stop_worker);
+    w->tasklet.handler = stop_worker;
+    tasklet_run_on(&w->tasklet, w->runq);
     thread_fini(&w->thread);
     mutex_lock(&w->mutex);
     tasklet_fini(&w->tasklet);
@@ -133,12 +309,117 @@ static void worker_destroy(struct worker *w)
     free(w);
 }
 
-static struct run_queue *default_run_queue;
-static struct worker *default_worker;
+/* The default scheduler: a run queue for each CPU, each served by a worker
+   thread pinned to that CPU.  A tasklet that is made runnable goes onto
+   the queue of the CPU that the waking thread is running on, so related
+   tasklets tend to stay on one CPU, and unrelated ones spread out across
+   all of them.  The scheduler is started when a tasklet is first run
+   without a targeted run queue, or explicitly by tasklet_scheduler_init. */
+static struct scheduler {
+    skinny_once_t once;
+
+    /* 0 until the size of the scheduler is decided, then 1 + the number
+       of workers asked for (with 0 meaning one per CPU). */
+    unsigned int requested;
+
+    unsigned int nr_queues;
+    struct run_queue **queues;
+    struct worker **workers;
+
+    /* Maps CPU numbers to indices in queues */
+    unsigned int *cpu_queue;
+    unsigned int nr_cpus;
+} scheduler = {.once = SKINNY_ONCE_INIT};
+
+static void cleanup_scheduler(void)
+{
+    unsigned int i;
+
+    /* Stop stealing first, so that each stop tasklet is run by the worker
+       it is meant to stop. */
+    for (i = 0; i < scheduler.nr_queues; i++) {
+        struct run_queue *runq = scheduler.queues[i];
+
+        mutex_lock(&runq->mutex);
+        atomic_store_order(&runq->shared, false, ATOMIC_RELAXED);
+        mutex_unlock(&runq->mutex);
+    }
+
+    for (i = 0; i < scheduler.nr_queues; i++)
+        worker_destroy(scheduler.workers[i]);
+
+    free(scheduler.workers);
+    free(scheduler.queues);
+    free(scheduler.cpu_queue);
+}
+
+static void scheduler_start(void)
+{
+    cpu_set_t allowed;
+    int *cpus;
+    unsigned int nr_allowed = 0, n, i;
+
+    /* Unless tasklet_scheduler_init got here first, size the scheduler
+       to the machine. */
+    atomic_cas(&scheduler.requested, 0, 1, ATOMIC_ACQUIRE);
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) ||
+        !CPU_COUNT(&allowed)) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+
+    cpus = malloc(CPU_COUNT(&allowed) * sizeof *cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[nr_allowed++] = cpu;
+
+    n = atomic_load_order(&scheduler.requested, ATOMIC_RELAXED) - 1;
+    if (!n)
+        n = nr_allowed;
+
+    /* CPUs outside the affinity mask fall back to cpu % n */
+    scheduler.nr_cpus = cpus[nr_allowed - 1] + 1;
+    scheduler.cpu_queue = malloc(scheduler.nr_cpus * sizeof(unsigned int));
+    for (i = 0; i < scheduler.nr_cpus; i++)
+        scheduler.cpu_queue[i] = i % n;
+    for (i = 0; i < nr_allowed; i++)
+        scheduler.cpu_queue[cpus[i]] = i % n;
+
+    scheduler.queues = malloc(n * sizeof *scheduler.queues);
+    scheduler.workers = malloc(n * sizeof *scheduler.workers);
 
-static void cleanup_default_worker(void)
+    /* The order is important here - we want cleanup_run_queues to
+       come after cleanup_scheduler. */
+    for (i = 0; i < n; i++) {
+        scheduler.queues[i] = run_queue_create_unlinked();
+        scheduler.queues[i]->shared = true;
+        add_to_run_queues(scheduler.queues[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        struct worker *w = worker_create(scheduler.queues[i]);
+
+        /* Pinning is only an optimization, so failure is harmless */
+        thread_set_cpu(thread_get_handle(&w->thread), cpus[i % nr_allowed]);
+        scheduler.workers[i] = w;
+    }
+
+    scheduler.nr_queues = n;
+    atexit(cleanup_scheduler);
+    free(cpus);
+}
+
+int tasklet_scheduler_init(unsigned int workers)
 {
-    worker_destroy(default_worker);
+    if (workers == -1U)
+        return EINVAL;
+
+    if (!atomic_cas(&scheduler.requested, 0, workers + 1, ATOMIC_RELEASE))
+        return EBUSY;
+
+    skinny_once(&scheduler.once, scheduler_start);
+    return 0;
 }
 
 TLS_VAR_DECLARE_STATIC(tls_run_queue);
@@ -151,50 +432,136 @@ void run_queue_target(struct run_queue *runq)
 static struct run_queue *thread_run_queue(void)
 {
     struct run_queue *runq = TLS_VAR_GET(tls_run_queue);
+    unsigned int cpu;
+
     if (runq)
         return runq;
 
-    for (;;) {
-        runq = default_run_queue;
-        if (runq)
-            return runq;
+    skinny_once(&scheduler.once, scheduler_start);
+
+    /* A negative result (no sched_getcpu) becomes a large cpu number */
+    cpu = sched_getcpu();
+    if (cpu < scheduler.nr_cpus)
+        return scheduler.queues[scheduler.cpu_queue[cpu]];
+
+    return scheduler.queues[cpu % scheduler.nr_queues];
+}
 
-        runq = run_queue_create_unlinked();
-        if (__sync_bool_compare_and_swap(&default_run_queue, NULL, runq))
+/* The low bits of a tasklet's runq field say what it is doing on the run
+   queue.  With none set, it is on the incoming or ready list. */
+#define RUNQ_PUSHING 1 /* Being pushed onto the incoming list */
+#define RUNQ_RUNNING 2 /* The run queue's current tasklet */
+#define RUNQ_REQUEUE 3 /* Current, and made runnable again since it started */
+
+/* Push a chain of tasklets, already linked through runq_next from first
+   to last, onto the incoming list.  Any number of threads can do this at
+   once, without locks, and the whole chain costs one exchange. */
+static void incoming_push_chain(struct run_queue *runq, struct tasklet *first,
+                                struct tasklet *last)
+{
+    struct tasklet *prev = atomic_xchg(&runq->incoming_tail, last,
+                                       ATOMIC_ACQ_REL);
+
+    /* From here on, a consumer that drains the list is sure to find the
+       chain, even if it has to wait for the link below.  So tasklet_stop
+       can stop waiting for RUNQ_PUSHING to clear.  Nobody else can follow
+       the chain's links until that link is made. */
+    for (struct tasklet *t = first;; t = t->runq_next) {
+        if (t != &runq->stub)
+            atomic_store_order(&t->runq, runq, ATOMIC_RELAXED);
+
+        if (t == last)
             break;
+    }
+
+    atomic_store_order(&prev->runq_next, first, ATOMIC_RELEASE);
+}
+
+/* Push a tasklet (or the stub) onto the incoming list. */
+static void incoming_push(struct run_queue *runq, struct tasklet *t)
+{
+    atomic_store_order(&t->runq_next, NULL, ATOMIC_RELAXED);
+    incoming_push_chain(runq, t, t);
+}
+
+/* Wait for a producer that has swapped itself in as the tail, but has not
+   yet linked itself to its predecessor t.  That is only a couple of
+   instructions, but the producer might have been preempted in between. */
+static struct tasklet *incoming_wait_next(struct tasklet *t)
+{
+    struct tasklet *next;
+
+    while (!(next = atomic_load_order(&t->runq_next, ATOMIC_ACQUIRE)))
+        sched_yield();
+
+    return next;
+}
+
+/* Pop the oldest tasklet from the incoming list, or return NULL if it is
+   empty.  Only the consumer (the holder of the run queue mutex) may call
+   this. */
+static struct tasklet *incoming_pop(struct run_queue *runq)
+{
+    struct tasklet *head = runq->incoming_head;
+    struct tasklet *next = atomic_load_order(&head->runq_next, ATOMIC_ACQUIRE);
+
+    if (head == &runq->stub) {
+        if (!next) {
+            if (atomic_load_order(&runq->incoming_tail, ATOMIC_ACQUIRE) ==
+                head)
+                return NULL;
 
-        run_queue_destroy(runq);
+            next = incoming_wait_next(head);
+        }
+
+        runq->incoming_head = head = next;
+        next = atomic_load_order(&head->runq_next, ATOMIC_ACQUIRE);
     }
 
-    /* The order is important here - we want cleanup_run_queues to
-       come after cleanup_default_worker. */
-    add_to_run_queues(runq);
+    if (!next) {
+        /* head is the last tasklet on the list.  Put the stub back behind
+           it, so that the list is never left empty. */
+        if (atomic_load_order(&runq->incoming_tail, ATOMIC_ACQUIRE) == head)
+            incoming_push(runq, &runq->stub);
 
-    default_worker = worker_create(runq);
-    atexit(cleanup_default_worker);
+        next = incoming_wait_next(head);
+    }
 
-    return runq;
+    runq->incoming_head = next;
+    return head;
+}
+
+static bool incoming_empty(struct run_queue *runq)
+{
+    return runq->incoming_head == &runq->stub &&
+           !atomic_load_order(&runq->stub.runq_next, ATOMIC_ACQUIRE) &&
+           atomic_load_order(&runq->incoming_tail, ATOMIC_ACQUIRE) ==
+               &runq->stub;
 }
 
-static void run_queue_enqueue(struct run_queue *runq, struct tasklet *t)
+/* Add a tasklet to the tail of the ready list for its priority, without
+   waking anyone. */
+static void run_queue_append(struct run_queue *runq, struct tasklet *t)
 {
+    unsigned int level = atomic_load_order(&t->priority, ATOMIC_RELAXED);
     struct tasklet *head;
 
-    mutex_assert_held(&runq->mutex);
-    assert(t->runq == runq);
+    if (t->requeues >= RUNQ_DEMOTE_REQUEUES &&
+        level < TASKLET_PRIORITIES - 1)
+        level++;
 
-    head = runq->head;
+    t->level = level;
+    head = runq->heads[level];
     if (!head) {
-        runq->head = t->runq_next = t->runq_prev = t;
-
-        if (runq->worker_waiting)
-            cond_signal(&runq->cond);
+        runq->heads[level] = t->runq_next = t->runq_prev = t;
     } else {
         struct tasklet *prev = head->runq_prev;
         t->runq_next = head;
         t->runq_prev = prev;
         prev->runq_next = head->runq_prev = t;
     }
+
+    atomic_store_order(&runq->length, runq->length + 1, ATOMIC_RELAXED);
 }
 
 static void run_queue_remove(struct run_queue *runq, struct tasklet *t)
@@ -202,190 +569,722 @@ static void run_queue_remove(struct run_queue *runq, struct tasklet *t)
     struct tasklet *next, *prev;
 
     mutex_assert_held(&runq->mutex);
-    assert(t->runq == runq);
+    assert(pointer_clear_bits(atomic_load_order(&t->runq, ATOMIC_RELAXED)) ==
+           runq);
 
     next = t->runq_next;
     prev = t->runq_prev;
     next->runq_prev = prev;
     prev->runq_next = next;
 
-    if (runq->head == t)
-        runq->head = (next == t ? NULL : next);
+    if (runq->heads[t->level] == t)
+        runq->heads[t->level] = (next == t ? NULL : next);
+
+    /* Producers only claim the sample when it is NULL */
+    if (atomic_load_order(&runq->sample, ATOMIC_RELAXED) == t)
+        atomic_store_order(&runq->sample, NULL, ATOMIC_RELAXED);
+
+    atomic_store_order(&runq->length, runq->length - 1, ATOMIC_RELAXED);
 }
 
-/* The tasklet lock does not need to be held for this. */
-void tasklet_run(struct tasklet *t)
+/* Move the tasklets on the incoming list onto the ready list.  Only those
+   pushed before the call are taken, so that a stream of producers cannot
+   keep the consumer here forever. */
+static void run_queue_drain(struct run_queue *runq)
 {
-    bool done = false;
+    struct tasklet *last =
+        atomic_load_order(&runq->incoming_tail, ATOMIC_ACQUIRE);
 
-    do {
-        struct run_queue *runq = t->runq;
-        if (!runq) {
-            runq = thread_run_queue();
-            mutex_lock(&runq->mutex);
+    mutex_assert_held(&runq->mutex);
 
-            if (__sync_bool_compare_and_swap(&t->runq, NULL, runq)) {
-                run_queue_enqueue(runq, t);
-                done = true;
-            }
-        } else {
-            mutex_lock(&runq->mutex);
+    for (;;) {
+        struct tasklet *t;
 
-            if (t->runq == runq) {
-                if (runq->current == t)
-                    runq->current_state = CURRENT_REQUEUE;
+        if (last == &runq->stub && runq->incoming_head == last)
+            break;
 
-                done = true;
-            }
-        }
+        t = incoming_pop(runq);
+        if (!t)
+            break;
 
-        mutex_unlock(&runq->mutex);
-    } while (!done);
+        run_queue_append(runq, t);
+        if (t == last)
+            break;
+    }
 }
 
-
-void wait_list_init(struct wait_list *w, int up_count)
+/* Submit the I/O that tasklets on this queue have started. */
+static void run_queue_flush(struct run_queue *runq)
 {
-    mutex_init(&w->mutex);
-    w->head = NULL;
-    w->unwaiting = 0;
-    w->up_count = up_count;
+    struct uring *uring = atomic_load_order(&runq->uring, ATOMIC_ACQUIRE);
+
+    if (uring)
+        uring_flush(uring);
 }
 
-void wait_list_fini(struct wait_list *w)
+/* The first tasklet on the highest priority ready list, or NULL. */
+static struct tasklet *run_queue_first(struct run_queue *runq)
 {
-    struct tasklet *head;
+    for (int i = 0; i < TASKLET_PRIORITIES; i++)
+        if (runq->heads[i])
+            return runq->heads[i];
 
-    mutex_lock(&w->mutex);
+    return NULL;
+}
 
-    head = w->head;
-    if (head) {
-        struct tasklet *t = head;
+/* The next tasklet to run, left on the ready list, or NULL.  The incoming
+   list is drained each time, so that a newly woken high priority tasklet
+   does not wait behind the whole backlog. */
+static struct tasklet *run_queue_next(struct run_queue *runq)
+{
+    if (!runq->length)
+        run_queue_flush(runq);
 
-        /* Remove all tasklets from the linked list */
-        do {
-            struct tasklet *next = t->wait_next;
+    run_queue_drain(runq);
+    return run_queue_first(runq);
+}
 
-            tasklet_run(t);
+/* The current tasklet has returned or been stopped.  Take it off the run
+   queue, unless it was made runnable again in the meantime. */
+static void run_queue_finish(struct run_queue *runq, struct tasklet *t)
+{
+    unsigned char requeues = t->requeues;
 
-            mutex_lock(&t->wait_mutex);
-            w->unwaiting += t->unwaiting;
-            t->wait = NULL;
-            t->unwaiting = 0;
-            mutex_unlock(&t->wait_mutex);
+    mutex_assert_held(&runq->mutex);
 
-            t = next;
-        } while (t != head);
+    /* Once the tasklet is off the run queue, another can take it */
+    t->requeues = 0;
 
-        /* If other threads are waiting on the wait_list mutex
-           to remove themselves, allow them to proceed and
-           wait until they are done. */
-        if (w->unwaiting) {
-            struct cond cond;
+    if (!atomic_cas(&t->runq, pointer_set_bits(runq, RUNQ_RUNNING), NULL,
+                    ATOMIC_RELEASE)) {
+        assert(pointer_bits(atomic_load_order(&t->runq, ATOMIC_ACQUIRE)) ==
+               RUNQ_REQUEUE);
+        atomic_store_order(&t->runq, runq, ATOMIC_RELAXED);
+        t->requeues = requeues < RUNQ_DEMOTE_REQUEUES ? requeues + 1
+                                                      : requeues;
+        if (atomic_load_order(&stats_enabled, ATOMIC_RELAXED))
+            runq->stats.requeues++;
 
-            cond_init(&cond);
-            w->head = pointer_set_bits(&cond, 1);
+        run_queue_append(runq, t);
+    }
+}
 
-            do {
-                cond_wait(&cond, &w->mutex);
-            } while (w->unwaiting);
+/* Wake runq's worker if it is waiting.  With "trylock" set, give up
+   rather than block on runq's mutex.  Returns true if the worker was
+   woken. */
+static bool worker_wake(struct run_queue *runq, bool trylock)
+{
+    bool woken;
+
+    switch (atomic_load_order(&runq->worker_waiting, ATOMIC_RELAXED)) {
+    case WORKER_POLLING:
+        /* One wakeup is enough, so spare later producers the syscall */
+        if (!atomic_cas(&runq->worker_waiting, WORKER_POLLING, WORKER_BUSY,
+                        ATOMIC_RELAXED))
+            return false;
+
+        reactor_wake(runq->reactor);
+        return true;
+
+    case WORKER_SLEEPING:
+        if (trylock) {
+            if (!mutex_trylock(&runq->mutex))
+                return false;
+        } else {
+            mutex_lock(&runq->mutex);
+        }
 
-            cond_fini(&cond);
+        /* Likewise, spare later producers the mutex */
+        woken = runq->worker_waiting == WORKER_SLEEPING;
+        if (woken) {
+            atomic_store_order(&runq->worker_waiting, WORKER_BUSY,
+                               ATOMIC_RELAXED);
+            cond_signal(&runq->cond);
         }
 
-        w->head = NULL;
-    }
+        mutex_unlock(&runq->mutex);
+        return woken;
 
-    mutex_unlock_fini(&w->mutex);
+    default:
+        return false;
+    }
 }
 
-static void tasklet_unwait(struct tasklet *t)
+/* Wake a worker that is idle, so that it can steal from runq.  This only
+   tries the locks of other queues, because the caller might hold runq's.
+   If that fails the tasklets are still run by runq's worker, and the next
+   tasklet_run onto runq tries again.  Returns true if a worker was
+   woken. */
+static bool wake_idle_worker(struct run_queue *runq)
 {
-    struct wait_list *w;
-    struct tasklet *next;
+    bool woken = false;
+
+    run_queue_epoch_enter();
+    for (struct run_queue *other =
+             atomic_load_order(&run_queues, ATOMIC_ACQUIRE);
+         other; other = atomic_load_order(&other->next, ATOMIC_ACQUIRE))
+        if (other != runq &&
+            atomic_load_order(&other->shared, ATOMIC_RELAXED) &&
+            worker_wake(other, true)) {
+            woken = true;
+            break;
+        }
 
-    mutex_lock(&t->wait_mutex);
+    epoch_exit();
+    return woken;
+}
 
-    for (;;) {
-        w = t->wait;
-        if (!w) {
-            /* Tasklet is not on a wait_list */
-            mutex_unlock(&t->wait_mutex);
-            return;
-        }
+/* Called after pushing n tasklets onto runq's incoming list.  Wake runq's
+   worker if it is waiting.  Wake idle workers to steal the rest, one for
+   each tasklet beyond the first that the worker will run. */
+static void run_queue_wake(struct run_queue *runq, unsigned int n)
+{
+    /* Pairs with the fence in run_queue_wait: either we see that the
+       worker is waiting, or it sees our tasklets. */
+    atomic_fence(ATOMIC_SEQ_CST);
 
-        t->unwaiting++;
-        mutex_unlock(&t->wait_mutex);
-        mutex_lock(&w->mutex);
-        mutex_lock(&t->wait_mutex);
+    if (atomic_load_order(&runq->worker_waiting, ATOMIC_RELAXED)) {
+        worker_wake(runq, false);
+        n--;
+    }
 
-        /* The tasklet could have been removed from the
-           waitlist, or even be on a different waitlist by
-           now. If so, we need to start again. */
-        if (t->wait == w)
-            break;
+    if (!atomic_load_order(&runq->shared, ATOMIC_RELAXED))
+        return;
 
-        if (!--w->unwaiting && pointer_bits(w->head)) {
-            /* Dropping the last reference to the
-               wait_list, so wake up the wait_list_fini
-               caller. */
-            struct cond *cond = pointer_clear_bits(w->head);
-            cond_signal(cond);
-        }
+    while (n-- && atomic_load_order(&idle_workers, ATOMIC_RELAXED) &&
+           wake_idle_worker(runq))
+        ;
+}
 
-        mutex_unlock(&w->mutex);
-    }
+/* Tasklets made runnable together, such as all the waiters woken by
+   wait_list_broadcast.  Those that need to go onto a run queue are
+   claimed one by one and chained together, and then pushed onto the run
+   queue's incoming list in one go, followed by one round of wakeups.  All
+   of them go to the same run queue, because that only depends on the
+   waking thread. */
+struct run_batch {
+    struct run_queue *runq; /* NULL until it is needed */
+    struct tasklet *first;
+    struct tasklet *last;
+    unsigned int count;
+};
 
-    /* Remove t from the waitlist */
-    t->wait = NULL;
+static void run_batch_init(struct run_batch *b, struct run_queue *target)
+{
+    b->runq = target;
+    b->first = b->last = NULL;
+    b->count = 0;
+}
 
-    /* Other threads may be accounted for in t->unwaiting.
-       We need to record them in the wait_list. */
-    w->unwaiting += t->unwaiting - 1;
-    t->unwaiting = 0;
+/* Time t's latency, unless runq is already timing another tasklet.
+   Called before t is pushed, so the consumer that pops t sees
+   sample_since. */
+static void run_queue_sample(struct run_queue *runq, struct tasklet *t)
+{
+    if (atomic_load_order(&runq->sample, ATOMIC_RELAXED) ||
+        !atomic_cas(&runq->sample, NULL, t, ATOMIC_RELAXED))
+        return;
 
-    next = t->wait_next;
-    t->wait_prev->wait_next = next;
-    next->wait_prev = t->wait_prev;
+    atomic_store_order(&runq->sample_since, tasklet_now(), ATOMIC_RELAXED);
+}
 
-    if (w->head == t) {
-        if (next == t) {
-            w->head = NULL;
+static void run_batch_add(struct run_batch *b, struct tasklet *t)
+{
+    for (;;) {
+        struct run_queue *runq = atomic_load_order(&t->runq, ATOMIC_ACQUIRE);
+
+        if (!runq) {
+            if (!b->runq)
+                b->runq = thread_run_queue();
+
+            /* Until the batch is pushed, the tasklet stays RUNQ_PUSHING,
+               so tasklet_stop waits for it. */
+            if (atomic_cas(&t->runq, NULL,
+                           pointer_set_bits(b->runq, RUNQ_PUSHING),
+                           ATOMIC_ACQUIRE)) {
+                if (atomic_load_order(&stats_enabled, ATOMIC_RELAXED))
+                    run_queue_sample(b->runq, t);
+
+                atomic_store_order(&t->runq_next, NULL, ATOMIC_RELAXED);
+                if (b->last)
+                    atomic_store_order(&b->last->runq_next, t,
+                                       ATOMIC_RELAXED);
+                else
+                    b->first = t;
+
+                b->last = t;
+                b->count++;
+                return;
+            }
+        } else if (pointer_bits(runq) == RUNQ_RUNNING) {
+            if (atomic_cas(&t->runq, runq,
+                           pointer_set_bits(pointer_clear_bits(runq),
+                                            RUNQ_REQUEUE),
+                           ATOMIC_RELEASE))
+                return;
         } else {
-            w->head = next;
-            if (w->up_count)
-                tasklet_run(next);
+            /* Already queued, or already to be requeued */
+            return;
         }
     }
+}
 
-    mutex_unlock(&t->wait_mutex);
-    mutex_unlock(&w->mutex);
+static void run_batch_flush(struct run_batch *b)
+{
+    if (!b->count)
+        return;
+
+    incoming_push_chain(b->runq, b->first, b->last);
+    run_queue_wake(b->runq, b->count);
+    run_batch_init(b, b->runq);
 }
 
-static void wait_list_broadcast_locked(struct wait_list *w)
+uint64_t tasklet_now(void)
 {
-    struct tasklet *head;
+    struct timespec ts;
 
-    mutex_assert_held(&w->mutex);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    head = w->head;
-    if (head) {
-        struct tasklet *t = head;
-        do {
-            tasklet_run(t);
-            t = t->wait_next;
-        } while (t != head);
+/* Fire the timers on runq that are due.  Called without runq's mutex. */
+static void run_queue_expire(struct run_queue *runq)
+{
+    uint64_t now;
+    struct tasklet_timer *expired;
+    struct run_batch batch;
+
+    if (atomic_load_order(&runq->timers_next, ATOMIC_RELAXED) ==
+        TIMER_WHEEL_NEVER)
+        return;
+
+    now = tasklet_now() / TIMER_WHEEL_TICK;
+    if (atomic_load_order(&runq->timers_next, ATOMIC_RELAXED) > now)
+        return;
+
+    /* The timers are fired under timers_mutex, so that once
+       tasklet_timer_cancel returns, the timer cannot fire. */
+    mutex_lock(&runq->timers_mutex);
+
+    expired = timer_wheel_advance(&runq->timers, now);
+    run_batch_init(&batch, NULL);
+    while (expired) {
+        struct tasklet_timer *timer = expired;
+
+        expired = timer->next;
+        atomic_store_order(&timer->runq, NULL, ATOMIC_RELAXED);
+        run_batch_add(&batch, timer->tasklet);
     }
+
+    run_batch_flush(&batch);
+
+    atomic_store_order(&runq->timers_next, timer_wheel_next(&runq->timers),
+                       ATOMIC_RELAXED);
+    mutex_unlock(&runq->timers_mutex);
 }
 
-void wait_list_broadcast(struct wait_list *w)
+/* Milliseconds from now until the tick "next", rounded up, for epoll_wait */
+static int timeout_ms(uint64_t next)
 {
-    mutex_lock(&w->mutex);
-    wait_list_broadcast_locked(w);
-    mutex_unlock(&w->mutex);
+    uint64_t now = tasklet_now(), deadline;
+
+    if (next == TIMER_WHEEL_NEVER)
+        return -1;
+
+    deadline = next * TIMER_WHEEL_TICK;
+    if (deadline <= now)
+        return 0;
+
+    if (deadline - now >= (uint64_t) INT_MAX * 1000000)
+        return INT_MAX;
+
+    return (deadline - now + 999999) / 1000000;
 }
 
-void wait_list_set(struct wait_list *w, int n, bool broadcast)
+/* Wait for tasklets to arrive on the incoming list, for I/O if the queue
+   has a reactor, or for the next timer to become due.  The caller should
+   check again after this returns, as it can return spuriously. */
+static void run_queue_wait(struct run_queue *runq)
+{
+    struct reactor *reactor = atomic_load_order(&runq->reactor, ATOMIC_ACQUIRE);
+    uint64_t next;
+
+    mutex_assert_held(&runq->mutex);
+
+    atomic_store_order(&runq->worker_waiting,
+                       reactor ? WORKER_POLLING : WORKER_SLEEPING,
+                       ATOMIC_RELAXED);
+
+    /* Pairs with the fences in run_queue_wake and tasklet_timer_arm */
+    atomic_fence(ATOMIC_SEQ_CST);
+    next = atomic_load_order(&runq->timers_next, ATOMIC_RELAXED);
+
+    if (incoming_empty(runq)) {
+        uint64_t idle = 0;
+
+        if (atomic_load_order(&stats_enabled, ATOMIC_RELAXED))
+            idle = tasklet_now();
+
+        if (reactor) {
+            mutex_unlock(&runq->mutex);
+            reactor_poll(reactor, timeout_ms(next));
+            mutex_lock(&runq->mutex);
+        } else if (next == TIMER_WHEEL_NEVER) {
+            cond_wait(&runq->cond, &runq->mutex);
+        } else {
+            struct timespec abstime = {
+                .tv_sec = next / (1000000000 / TIMER_WHEEL_TICK),
+                .tv_nsec = next % (1000000000 / TIMER_WHEEL_TICK) *
+                           TIMER_WHEEL_TICK};
+
+            cond_timedwait(&runq->cond, &runq->mutex, &abstime);
+        }
+
+        if (idle)
+            runq->stats.idle_ns += tasklet_now() - idle;
+    }
+
+    atomic_store_order(&runq->worker_waiting, WORKER_BUSY, ATOMIC_RELAXED);
+
+    if (next != TIMER_WHEEL_NEVER) {
+        mutex_unlock(&runq->mutex);
+        run_queue_expire(runq);
+        mutex_lock(&runq->mutex);
+    }
+}
+
+static int run_queue_reactor(struct run_queue *runq, struct reactor **rp)
+{
+    struct reactor *reactor = atomic_load_order(&runq->reactor, ATOMIC_ACQUIRE);
+
+    if (!reactor) {
+        int res = reactor_create(&reactor);
+        if (res)
+            return res;
+
+        if (atomic_cas(&runq->reactor, NULL, reactor, ATOMIC_ACQ_REL)) {
+            /* The worker might be asleep on cond.  Wake it, so that it
+               goes back to sleep in the reactor instead. */
+            worker_wake(runq, false);
+        } else {
+            reactor_destroy(reactor);
+            reactor = atomic_load_order(&runq->reactor, ATOMIC_ACQUIRE);
+        }
+    }
+
+    *rp = reactor;
+    return 0;
+}
+
+int thread_reactor(struct reactor **rp)
+{
+    return run_queue_reactor(thread_run_queue(), rp);
+}
+
+/* The run queue being served by this thread, if any */
+static __thread struct run_queue *serving;
+
+/* Serializes the creation of urings */
+static skinny_mutex_t uring_create_mutex = SKINNY_MUTEX_INITIALIZER;
+
+int thread_uring(struct uring **up, bool *batched)
+{
+    struct run_queue *runq = thread_run_queue();
+    struct uring *uring = atomic_load_order(&runq->uring, ATOMIC_ACQUIRE);
+
+    if (!uring) {
+        struct reactor *reactor;
+        int res = run_queue_reactor(runq, &reactor);
+        if (res)
+            return res;
+
+        skinny_mutex_lock(&uring_create_mutex);
+        uring = runq->uring;
+        if (!uring) {
+            res = uring_create(reactor, &uring);
+            if (!res)
+                atomic_store_order(&runq->uring, uring, ATOMIC_RELEASE);
+        }
+        skinny_mutex_unlock(&uring_create_mutex);
+
+        if (res)
+            return res;
+    }
+
+    *up = uring;
+    *batched = serving == runq;
+    return 0;
+}
+
+/* Roughly how many tasklets are waiting on a queue, without its lock */
+static unsigned int run_queue_backlog(struct run_queue *runq)
+{
+    unsigned int length = atomic_load_order(&runq->length, ATOMIC_RELAXED);
+
+    /* Anything on the incoming list probably has a backlog behind it */
+    if (atomic_load_order(&runq->incoming_tail, ATOMIC_RELAXED) !=
+        &runq->stub)
+        length += 2;
+
+    return length;
+}
+
+/* Move half of the runnable tasklets from the longest other shared queue
+   onto runq, which must be empty.  Returns true if it got any.
+
+   Holding the victim's mutex makes us its consumer, so we can drain its
+   incoming list, and then take tasklets from its ready list.  A queued
+   tasklet's runq field only changes with the queue's mutex held, so with
+   both mutexes held, a tasklet can be moved without anyone seeing it half
+   way: tasklet_run sees that it is queued either way, and tasklet_stop,
+   having locked the victim's mutex, finds that t->runq has changed and
+   starts again.  The victim's current tasklet is never moved, so
+   current_state and tasklet_stop's waiting are unaffected. */
+static bool run_queue_steal(struct run_queue *runq)
+{
+    struct run_queue *victim = NULL;
+    unsigned int longest = 1, n;
+
+    mutex_assert_held(&runq->mutex);
+    assert(!runq->length);
+
+    /* The backlogs are only hints until we hold the victim's mutex.  Only
+       shared queues can be victims, and they are never destroyed, so the
+       epoch section need only cover walking the list. */
+    run_queue_epoch_enter();
+    for (struct run_queue *other =
+             atomic_load_order(&run_queues, ATOMIC_ACQUIRE);
+         other; other = atomic_load_order(&other->next, ATOMIC_ACQUIRE)) {
+        unsigned int backlog;
+
+        if (other == runq || !atomic_load_order(&other->shared, ATOMIC_RELAXED))
+            continue;
+
+        backlog = run_queue_backlog(other);
+        if (backlog > longest) {
+            victim = other;
+            longest = backlog;
+        }
+    }
+    epoch_exit();
+
+    /* We already hold our own mutex, so block on the victim's only if we
+       can't deadlock: a thread holding the victim's mutex might be trying
+       to wake us. */
+    if (!victim || !mutex_trylock(&victim->mutex))
+        return false;
+
+    if (!victim->shared) {
+        mutex_unlock(&victim->mutex);
+        return false;
+    }
+
+    run_queue_drain(victim);
+
+    /* Leave the victim at least as many as we take */
+    n = victim->length / 2;
+    while (n--) {
+        struct tasklet *t = run_queue_first(victim);
+
+        run_queue_remove(victim, t);
+        atomic_store_order(&t->runq, runq, ATOMIC_RELEASE);
+        run_queue_append(runq, t);
+    }
+
+    mutex_unlock(&victim->mutex);
+    return !!runq->length;
+}
+
+/* Make a tasklet runnable, putting it on "target" if it is not already on
+   a run queue.  A NULL target means this thread's run queue.
+
+   This takes no locks: the tasklet is claimed for the run queue by setting
+   its runq field, and then pushed onto the incoming list.  If it is
+   already the current tasklet of a run queue, it is marked to be run
+   again when its handler returns. */
+static void tasklet_run_on(struct tasklet *t, struct run_queue *target)
+{
+    struct run_batch b;
+
+    run_batch_init(&b, target);
+    run_batch_add(&b, t);
+    run_batch_flush(&b);
+}
+
+/* The tasklet lock does not need to be held for this. */
+void tasklet_run(struct tasklet *t)
+{
+    tasklet_run_on(t, NULL);
+}
+
+
+void wait_list_init(struct wait_list *w, int up_count)
+{
+    mutex_init(&w->mutex);
+    w->head = NULL;
+    w->unwaiting = 0;
+    w->up_count = up_count;
+}
+
+void wait_list_fini(struct wait_list *w)
+{
+    struct tasklet *head;
+
+    mutex_lock(&w->mutex);
+
+    head = w->head;
+    if (head) {
+        struct tasklet *t = head;
+        struct run_batch batch;
+
+        run_batch_init(&batch, NULL);
+
+        /* Remove all tasklets from the linked list */
+        do {
+            struct tasklet *next = t->wait_next;
+
+            run_batch_add(&batch, t);
+
+            tasklet_wait_lock(t);
+            w->unwaiting += t->unwaiting;
+            tasklet_set_wait_list(t, NULL);
+            t->unwaiting = 0;
+            tasklet_wait_unlock(t);
+
+            t = next;
+        } while (t != head);
+
+        run_batch_flush(&batch);
+
+        /* If other threads are waiting on the wait_list mutex
+           to remove themselves, allow them to proceed and
+           wait until they are done. */
+        if (w->unwaiting) {
+            struct cond cond;
+
+            cond_init(&cond);
+            w->head = pointer_set_bits(&cond, 1);
+
+            do {
+                cond_wait(&cond, &w->mutex);
+            } while (w->unwaiting);
+
+            cond_fini(&cond);
+        }
+
+        w->head = NULL;
+    }
+
+    mutex_unlock_fini(&w->mutex);
+}
+
+void tasklet_unwait(struct tasklet *t)
+{
+    struct wait_list *w;
+    struct tasklet *next;
+
+    tasklet_wait_lock(t);
+
+    for (;;) {
+        w = tasklet_wait_list(t);
+        if (!w) {
+            /* Tasklet is not on a wait_list */
+            tasklet_wait_unlock(t);
+            return;
+        }
+
+        t->unwaiting++;
+        tasklet_wait_unlock(t);
+        mutex_lock(&w->mutex);
+        tasklet_wait_lock(t);
+
+        /* The tasklet could have been removed from the
+           waitlist, or even be on a different waitlist by
+           now. If so, we need to start again. */
+        if (tasklet_wait_list(t) == w)
+            break;
+
+        if (!--w->unwaiting && pointer_bits(w->head)) {
+            /* Dropping the last reference to the
+               wait_list, so wake up the wait_list_fini
+               caller. */
+            struct cond *cond = pointer_clear_bits(w->head);
+            cond_signal(cond);
+        }
+
+        mutex_unlock(&w->mutex);
+    }
+
+    /* Remove t from the waitlist */
+    tasklet_set_wait_list(t, NULL);
+
+    /* Other threads may be accounted for in t->unwaiting.
+       We need to record them in the wait_list. */
+    w->unwaiting += t->unwaiting - 1;
+    t->unwaiting = 0;
+
+    next = t->wait_next;
+    t->wait_prev->wait_next = next;
+    next->wait_prev = t->wait_prev;
+
+    if (w->head == t) {
+        if (next == t) {
+            atomic_store_order(&w->head, NULL, ATOMIC_RELAXED);
+        } else {
+            w->head = next;
+            if (w->up_count)
+                tasklet_run(next);
+        }
+    }
+
+    tasklet_wait_unlock(t);
+    mutex_unlock(&w->mutex);
+}
+
+static void wait_list_broadcast_locked(struct wait_list *w)
+{
+    struct tasklet *head;
+
+    mutex_assert_held(&w->mutex);
+
+    head = w->head;
+    if (head) {
+        struct tasklet *t = head;
+        struct run_batch batch;
+
+        run_batch_init(&batch, NULL);
+        do {
+            run_batch_add(&batch, t);
+            t = t->wait_next;
+        } while (t != head);
+
+        run_batch_flush(&batch);
+    }
+}
+
+void wait_list_broadcast(struct wait_list *w)
+{
+    mutex_lock(&w->mutex);
+    wait_list_broadcast_locked(w);
+    mutex_unlock(&w->mutex);
+}
+
+void wait_list_wake_one(struct wait_list *w)
+{
+    mutex_lock(&w->mutex);
+
+    /* Move the head to the back, so that the next call wakes another */
+    if (w->head) {
+        struct tasklet *head = w->head;
+
+        tasklet_run(head);
+        w->head = head->wait_next;
+    }
+
+    mutex_unlock(&w->mutex);
+}
+
+void wait_list_set(struct wait_list *w, int n, bool broadcast)
 {
     mutex_lock(&w->mutex);
     w->up_count = n;
@@ -396,10 +1295,13 @@ void wait_list_set(struct wait_list *w, int n, bool broadcast)
 
 static void wait_list_add(struct wait_list *w, struct tasklet *t)
 {
-    t->wait = w;
+    tasklet_set_wait_list(t, w);
 
     if (!w->head) {
-        w->head = t->wait_next = t->wait_prev = t;
+        t->wait_next = t->wait_prev = t;
+
+        /* Atomic for wait_list_nonempty, which is read without the mutex */
+        atomic_store_order(&w->head, t, ATOMIC_RELAXED);
         if (w->up_count)
             tasklet_run(t);
     } else {
@@ -417,16 +1319,16 @@ void wait_list_wait(struct wait_list *w, struct tasklet *t)
         int done = false;
 
         mutex_lock(&w->mutex);
-        mutex_lock(&t->wait_mutex);
+        tasklet_wait_lock(t);
 
-        if (!t->wait) {
+        if (!tasklet_wait_list(t)) {
             wait_list_add(w, t);
             done = true;
-        } else if (t->wait == w) {
+        } else if (tasklet_wait_list(t) == w) {
             done = true;
         }
 
-        mutex_unlock(&t->wait_mutex);
+        tasklet_wait_unlock(t);
         mutex_unlock(&w->mutex);
 
         if (done)
@@ -446,14 +1348,14 @@ bool wait_list_down(struct wait_list *w, int n, struct tasklet *t)
         int done = false;
 
         mutex_lock(&w->mutex);
-        mutex_lock(&t->wait_mutex);
+        tasklet_wait_lock(t);
 
-        if (!t->wait || t->wait == w) {
+        if (!tasklet_wait_list(t) || tasklet_wait_list(t) == w) {
             if (w->up_count >= n) {
                 w->up_count -= n;
                 res = true;
             } else {
-                if (t->wait != w)
+                if (tasklet_wait_list(t) != w)
                     wait_list_add(w, t);
 
                 t->waited = true;
@@ -463,7 +1365,7 @@ bool wait_list_down(struct wait_list *w, int n, struct tasklet *t)
             done = true;
         }
 
-        mutex_unlock(&t->wait_mutex);
+        tasklet_wait_unlock(t);
         mutex_unlock(&w->mutex);
 
         if (done)
@@ -480,6 +1382,124 @@ void wait_list_up(struct wait_list *w, int n)
     mutex_lock(&w->mutex);
 
     w->up_count += n;
+
+    /* Wake as many waiters as there are new units, in case the first
+       cannot use them all. */
+    if (w->head) {
+        struct tasklet *t = w->head;
+        struct run_batch batch;
+
+        run_batch_init(&batch, NULL);
+        do {
+            run_batch_add(&batch, t);
+            t = t->wait_next;
+        } while (--n > 0 && t != w->head);
+
+        run_batch_flush(&batch);
+    }
+
+    mutex_unlock(&w->mutex);
+}
+
+void tasklet_mutex_init(struct tasklet_mutex *m)
+{
+    wait_list_init(&m->waiters, 1);
+}
+
+void tasklet_mutex_fini(struct tasklet_mutex *m)
+{
+    assert(m->waiters.up_count == 1);
+    wait_list_fini(&m->waiters);
+}
+
+/* Take t, the head of w, off w, with both their locks held. */
+static void wait_list_remove_head(struct wait_list *w, struct tasklet *t)
+{
+    struct tasklet *next = t->wait_next;
+
+    assert(w->head == t);
+
+    tasklet_set_wait_list(t, NULL);
+
+    /* As in wait_list_fini, threads in tasklet_unwait(t) now wait for w */
+    w->unwaiting += t->unwaiting;
+    t->unwaiting = 0;
+
+    if (next == t) {
+        atomic_store_order(&w->head, NULL, ATOMIC_RELAXED);
+    } else {
+        t->wait_prev->wait_next = next;
+        next->wait_prev = t->wait_prev;
+        w->head = next;
+    }
+}
+
+/* The mutex is free to whichever tasklet is at the head of the wait_list,
+   or to anyone if it is empty.  So an unlock hands it to the first waiter
+   by running it, and tasklet_unwait runs the next one if that waiter gives
+   up. */
+bool tasklet_mutex_lock(struct tasklet_mutex *m, struct tasklet *t)
+{
+    struct wait_list *w = &m->waiters;
+    bool res;
+
+    for (;;) {
+        int done = false;
+
+        mutex_lock(&w->mutex);
+        tasklet_wait_lock(t);
+
+        if (!tasklet_wait_list(t) || tasklet_wait_list(t) == w) {
+            if (w->up_count && (!w->head || w->head == t)) {
+                w->up_count = 0;
+                if (w->head == t)
+                    wait_list_remove_head(w, t);
+
+                res = true;
+            } else {
+                if (tasklet_wait_list(t) != w)
+                    wait_list_add(w, t);
+
+                t->waited = true;
+                res = false;
+            }
+
+            done = true;
+        }
+
+        tasklet_wait_unlock(t);
+        mutex_unlock(&w->mutex);
+
+        if (done)
+            break;
+
+        tasklet_unwait(t);
+    }
+
+    return res;
+}
+
+bool tasklet_mutex_trylock(struct tasklet_mutex *m)
+{
+    struct wait_list *w = &m->waiters;
+    bool res;
+
+    mutex_lock(&w->mutex);
+    res = w->up_count && !w->head;
+    if (res)
+        w->up_count = 0;
+
+    mutex_unlock(&w->mutex);
+    return res;
+}
+
+void tasklet_mutex_unlock(struct tasklet_mutex *m)
+{
+    struct wait_list *w = &m->waiters;
+
+    mutex_lock(&w->mutex);
+    assert(!w->up_count);
+    w->up_count = 1;
     if (w->head)
         tasklet_run(w->head);
 
@@ -488,33 +1508,431 @@ void wait_list_up(struct wait_list *w, int n)
 
 bool wait_list_nonempty(struct wait_list *w)
 {
-    return !!w->head;
+    return !!atomic_load_order(&w->head, ATOMIC_RELAXED);
+}
+
+void tasklet_timer_init(struct tasklet_timer *timer, struct tasklet *t)
+{
+    timer->tasklet = t;
+    timer->runq = NULL;
+    wait_list_init(&timer->sleep, 0);
+}
+
+void tasklet_timer_fini(struct tasklet_timer *timer)
+{
+    tasklet_timer_cancel(timer);
+    wait_list_fini(&timer->sleep);
+}
+
+void tasklet_timer_cancel(struct tasklet_timer *timer)
+{
+    /* Only the owning tasklet arms the timer, so runq can only go from
+       what we see here to NULL, when the timer fires, or to another run
+       queue, when run_queue_destroy moves it. */
+    for (;;) {
+        struct run_queue *runq;
+        bool done;
+
+        run_queue_epoch_enter();
+        runq = atomic_load_order(&timer->runq, ATOMIC_ACQUIRE);
+        if (!runq) {
+            epoch_exit();
+            return;
+        }
+
+        mutex_lock(&runq->timers_mutex);
+        done = timer->runq == runq;
+        if (done) {
+            timer_wheel_remove(&runq->timers, timer);
+            timer->runq = NULL;
+        }
+
+        mutex_unlock(&runq->timers_mutex);
+        epoch_exit();
+
+        if (done || !atomic_load_order(&timer->runq, ATOMIC_RELAXED))
+            return;
+    }
+}
+
+static void tasklet_timer_arm(struct tasklet_timer *timer, uint64_t deadline)
+{
+    uint64_t expires = (deadline + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK;
+    struct run_queue *runq;
+    bool earlier;
+
+    /* Already armed for this deadline? */
+    if (atomic_load_order(&timer->runq, ATOMIC_RELAXED) &&
+        timer->expires == expires)
+        return;
+
+    tasklet_timer_cancel(timer);
+
+    runq = thread_run_queue();
+    mutex_lock(&runq->timers_mutex);
+    timer->expires = expires;
+    timer_wheel_add(&runq->timers, timer);
+    atomic_store_order(&timer->runq, runq, ATOMIC_RELAXED);
+
+    earlier = expires < runq->timers_next;
+    if (earlier)
+        atomic_store_order(&runq->timers_next, expires, ATOMIC_RELAXED);
+
+    mutex_unlock(&runq->timers_mutex);
+
+    /* If the worker is waiting, it needs to recompute its timeout.  Pairs
+       with the fence in run_queue_wait. */
+    if (earlier) {
+        atomic_fence(ATOMIC_SEQ_CST);
+        if (atomic_load_order(&runq->worker_waiting, ATOMIC_RELAXED))
+            worker_wake(runq, false);
+    }
+}
+
+bool tasklet_sleep_until(struct tasklet_timer *timer, uint64_t deadline)
+{
+    if (tasklet_now() >= deadline) {
+        /* The timer has fired, or never will now, but the tasklet is
+           still on its wait_list from waiting for it. */
+        tasklet_timer_cancel(timer);
+        tasklet_unwait(timer->tasklet);
+        return true;
+    }
+
+    tasklet_timer_arm(timer, deadline);
+    wait_list_wait(&timer->sleep, timer->tasklet);
+    return false;
+}
+
+bool wait_list_down_timed(struct wait_list *w, int n,
+                          struct tasklet_timer *timer, uint64_t deadline,
+                          bool *timed_out)
+{
+    struct tasklet *t = timer->tasklet;
+
+    *timed_out = false;
+
+    if (wait_list_down(w, n, t)) {
+        tasklet_timer_cancel(timer);
+        return true;
+    }
+
+    if (tasklet_now() >= deadline) {
+        /* Leave the wait_list, so that wait_list_up does not pick this
+           tasklet to take the count. */
+        tasklet_timer_cancel(timer);
+        tasklet_unwait(t);
+        *timed_out = true;
+        return true;
+    }
+
+    tasklet_timer_arm(timer, deadline);
+    return false;
+}
+
+static void run_queue_free_deferred(struct epoch_entry *entry)
+{
+    run_queue_free((struct run_queue *) entry);
+}
+
+/* Move the timers armed on runq onto dest's wheel. */
+static void run_queue_move_timers(struct run_queue *runq,
+                                  struct run_queue *dest)
+{
+    struct tasklet_timer *timers;
+    uint64_t next;
+    bool earlier;
+
+    mutex_lock(&runq->timers_mutex);
+    timers = timer_wheel_take_all(&runq->timers);
+    atomic_store_order(&runq->timers_next, TIMER_WHEEL_NEVER, ATOMIC_RELAXED);
+    if (!timers) {
+        mutex_unlock(&runq->timers_mutex);
+        return;
+    }
+
+    /* tasklet_timer_cancel finds that timer->runq has changed once it
+       gets runq's timers_mutex, and follows it to dest. */
+    mutex_lock(&dest->timers_mutex);
+    while (timers) {
+        struct tasklet_timer *timer = timers;
+
+        timers = timer->next;
+        timer_wheel_add(&dest->timers, timer);
+        atomic_store_order(&timer->runq, dest, ATOMIC_RELEASE);
+    }
+
+    next = timer_wheel_next(&dest->timers);
+    earlier = next < dest->timers_next;
+    if (earlier)
+        atomic_store_order(&dest->timers_next, next, ATOMIC_RELAXED);
+
+    mutex_unlock(&dest->timers_mutex);
+    mutex_unlock(&runq->timers_mutex);
+
+    /* As in tasklet_timer_arm */
+    if (earlier) {
+        atomic_fence(ATOMIC_SEQ_CST);
+        if (atomic_load_order(&dest->worker_waiting, ATOMIC_RELAXED))
+            worker_wake(dest, false);
+    }
+}
+
+void run_queue_destroy(struct run_queue *runq, struct run_queue *dest)
+{
+    struct tasklet *first = NULL, *last = NULL, *t;
+    unsigned int n = 0;
+
+    assert(!runq->shared);
+    if (!dest)
+        dest = thread_run_queue();
+
+    assert(dest != runq);
+    remove_from_run_queues(runq);
+
+    mutex_lock(&runq->mutex);
+    assert(!runq->current);
+
+    while (!incoming_empty(runq))
+        run_queue_drain(runq);
+
+    /* Chain the runnable tasklets together to push onto dest.  Until
+       then they stay claimed, so tasklet_run leaves them alone, and
+       tasklet_stop, having locked runq's mutex, finds that t->runq has
+       changed and waits for the push. */
+    while ((t = run_queue_first(runq))) {
+        run_queue_remove(runq, t);
+        atomic_store_order(&t->runq, pointer_set_bits(dest, RUNQ_PUSHING),
+                           ATOMIC_RELAXED);
+        atomic_store_order(&t->runq_next, NULL, ATOMIC_RELAXED);
+        if (last)
+            atomic_store_order(&last->runq_next, t, ATOMIC_RELAXED);
+        else
+            first = t;
+
+        last = t;
+        n++;
+    }
+
+    mutex_unlock(&runq->mutex);
+
+    if (n) {
+        incoming_push_chain(dest, first, last);
+        run_queue_wake(dest, n);
+    }
+
+    run_queue_move_timers(runq, dest);
+
+    /* Threads that looked runq up before we unlinked it, or before we
+       moved its tasklets and timers, might still be about to lock it */
+    epoch_defer(&runq->epoch, run_queue_free_deferred);
+}
+
+void run_queue_set_budget(struct run_queue *runq, unsigned int tasklets,
+                          uint64_t ns)
+{
+    mutex_lock(&runq->mutex);
+    runq->budget_tasklets = tasklets;
+    runq->budget_ns = ns;
+    mutex_unlock(&runq->mutex);
+}
+
+/* Has this call to run_queue_run used up the run queue's budget? */
+static bool run_queue_over_budget(struct run_queue *runq, unsigned int ran,
+                                  uint64_t start)
+{
+    if (runq->budget_tasklets && ran >= runq->budget_tasklets)
+        return true;
+
+    return runq->budget_ns && tasklet_now() - start >= runq->budget_ns;
+}
+
+static void tasklet_histogram_add(struct tasklet_histogram *h, uint64_t v)
+{
+    unsigned int i = v ? 63 - __builtin_clzll(v) : 0;
+
+    if (i >= TASKLET_STATS_BUCKETS)
+        i = TASKLET_STATS_BUCKETS - 1;
+
+    h->buckets[i]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* An upper bound on the given percentile of the values in h */
+static uint64_t tasklet_histogram_percentile(struct tasklet_histogram *h,
+                                             unsigned int pct)
+{
+    uint64_t seen = 0, want = (h->count * pct + 99) / 100;
+
+    for (unsigned int i = 0; i < TASKLET_STATS_BUCKETS - 1; i++) {
+        uint64_t bound = ((uint64_t) 2 << i) - 1;
+
+        seen += h->buckets[i];
+        if (seen >= want)
+            return bound < h->max ? bound : h->max;
+    }
+
+    return h->max;
+}
+
+static double tasklet_histogram_avg(struct tasklet_histogram *h)
+{
+    return h->count ? (double) h->sum / h->count : 0.0;
+}
+
+/* t is about to be run.  Record the queue depth, and t's latency if it is
+   the one being timed. */
+static void run_queue_stats_pick(struct run_queue *runq, struct tasklet *t)
+{
+    tasklet_histogram_add(&runq->stats.depth, runq->length);
+
+    if (atomic_load_order(&runq->sample, ATOMIC_RELAXED) == t) {
+        uint64_t since =
+            atomic_load_order(&runq->sample_since, ATOMIC_RELAXED);
+
+        tasklet_histogram_add(&runq->stats.latency, tasklet_now() - since);
+        atomic_store_order(&runq->sample, NULL, ATOMIC_RELAXED);
+    }
+}
+
+void tasklet_stats_start(void)
+{
+    atomic_store_order(&stats_enabled, true, ATOMIC_RELAXED);
+}
+
+void tasklet_stats_stop(void)
+{
+    atomic_store_order(&stats_enabled, false, ATOMIC_RELAXED);
+}
+
+void tasklet_stats_reset(void)
+{
+    run_queue_epoch_enter();
+    for (struct run_queue *runq =
+             atomic_load_order(&run_queues, ATOMIC_ACQUIRE);
+         runq; runq = atomic_load_order(&runq->next, ATOMIC_ACQUIRE)) {
+        mutex_lock(&runq->mutex);
+        memset(&runq->stats, 0, sizeof runq->stats);
+        mutex_unlock(&runq->mutex);
+    }
+    epoch_exit();
+}
+
+void run_queue_get_stats(struct run_queue *runq, struct tasklet_stats *stats)
+{
+    mutex_lock(&runq->mutex);
+    *stats = runq->stats;
+    mutex_unlock(&runq->mutex);
+}
+
+int tasklet_stats_report(int fd)
+{
+    int n = 0;
+
+    dprintf(fd,
+            "%18s %10s %10s %9s %10s %9s %9s %11s %11s %11s %11s %11s "
+            "%11s\n",
+            "run_queue", "ran", "requeues", "xfer_fail", "idle_ms",
+            "depth_avg", "depth_max", "lat_avg_us", "lat_p99_us",
+            "lat_max_us", "run_avg_us", "run_p99_us", "run_max_us");
+
+    run_queue_epoch_enter();
+    for (struct run_queue *runq =
+             atomic_load_order(&run_queues, ATOMIC_ACQUIRE);
+         runq; runq = atomic_load_order(&runq->next, ATOMIC_ACQUIRE)) {
+        struct tasklet_stats st;
+
+        run_queue_get_stats(runq, &st);
+        dprintf(fd,
+                "%18p %10llu %10llu %9llu %10.1f %9.1f %9llu %11.1f %11.1f "
+                "%11.1f %11.1f %11.1f %11.1f\n",
+                (void *) runq, (unsigned long long) st.ran,
+                (unsigned long long) st.requeues,
+                (unsigned long long) st.transfer_failures, st.idle_ns / 1e6,
+                tasklet_histogram_avg(&st.depth),
+                (unsigned long long) st.depth.max,
+                tasklet_histogram_avg(&st.latency) / 1e3,
+                tasklet_histogram_percentile(&st.latency, 99) / 1e3,
+                st.latency.max / 1e3,
+                tasklet_histogram_avg(&st.handler) / 1e3,
+                tasklet_histogram_percentile(&st.handler, 99) / 1e3,
+                st.handler.max / 1e3);
+        n++;
+    }
+    epoch_exit();
+
+    return n;
+}
+
+/* TASKLET_STATS=1 keeps statistics from startup, and reports them to
+   stderr at exit. */
+__attribute__((constructor)) static void stats_init_from_env(void)
+{
+    const char *env = getenv("TASKLET_STATS");
+
+    if (!env || atoi(env) <= 0)
+        return;
+
+    stats_report_at_exit = true;
+    tasklet_stats_start();
 }
 
 void run_queue_run(struct run_queue *runq, int wait)
 {
+    struct reactor *reactor = atomic_load_order(&runq->reactor, ATOMIC_ACQUIRE);
+    struct run_queue *was_serving = serving;
+    unsigned int ran = 0;
+    uint64_t start = 0;
     struct tasklet *t;
 
+    if (reactor)
+        reactor_poll(reactor, 0);
+
+    run_queue_expire(runq);
+
     mutex_lock(&runq->mutex);
+    serving = runq;
 
-    t = runq->head;
+    t = run_queue_next(runq);
     if (!t) {
+        bool shared = runq->shared;
+
         if (!wait)
             goto out;
 
-        runq->worker_waiting = true;
+        if (shared)
+            atomic_add_fetch_order(&idle_workers, 1, ATOMIC_RELAXED);
+
         do {
-            cond_wait(&runq->cond, &runq->mutex);
-            t = runq->head;
+            if (!runq->shared || !run_queue_steal(runq))
+                run_queue_wait(runq);
+
+            t = run_queue_next(runq);
         } while (!t);
-        runq->worker_waiting = false;
+
+        if (shared)
+            atomic_add_fetch_order(&idle_workers, -1, ATOMIC_RELAXED);
     }
 
     runq->thread = thread_handle_current();
+    if (runq->budget_ns)
+        start = tasklet_now();
 
     do {
+        struct run_queue *state;
+        bool timed = atomic_load_order(&stats_enabled, ATOMIC_RELAXED);
+        uint64_t handler_start = 0;
+
+        if (timed)
+            run_queue_stats_pick(runq, t);
+
         run_queue_remove(runq, t);
         runq->current = t;
+        atomic_store_order(&t->runq, pointer_set_bits(runq, RUNQ_RUNNING),
+                           ATOMIC_RELAXED);
         t->waited = false;
 
         for (;;) {
@@ -522,39 +1940,50 @@ void run_queue_run(struct run_queue *runq, int wait)
             if (mutex_transfer(&runq->mutex, t->mutex))
                 break;
 
+            if (timed)
+                runq->stats.transfer_failures++;
+
             /* mutex_transfer can fail because of a veto
                aimed at a tasket on another run queue but
                using the same mutex.  So we have to check
                that the current tasklet was really
                stopped. */
-            if (runq->current_state == CURRENT_STOPPED)
+            if (runq->current_state == CURRENT_STOPPED) {
+                run_queue_finish(runq, t);
                 goto next;
+            }
         }
 
+        if (timed)
+            handler_start = tasklet_now();
+
         t->handler(t->data);
 
-        mutex_lock(&runq->mutex);
+        if (timed) {
+            uint64_t handler_ns = tasklet_now() - handler_start;
+
+            mutex_lock(&runq->mutex);
+            runq->stats.ran++;
+            tasklet_histogram_add(&runq->stats.handler, handler_ns);
+        } else {
+            mutex_lock(&runq->mutex);
+        }
+
         if (runq->current != t)
             /* tasklet was destroyed */
             goto next;
 
-        switch (runq->current_state) {
-        case CURRENT_STARTED:
+        state = atomic_load_order(&t->runq, ATOMIC_ACQUIRE);
+        if (runq->current_state == CURRENT_STARTED &&
+            pointer_bits(state) != RUNQ_REQUEUE) {
             /* Detect dangling tasklets that are not on a
                waitlist and were not explicitly
                stopped. */
             assert(t->waited);
-            assert(t->wait);
-
-            /* fall through */
-        case CURRENT_STOPPED:
-            t->runq = NULL;
-            break;
-
-        case CURRENT_REQUEUE:
-            run_queue_enqueue(runq, t);
+            assert(tasklet_wait_list(t));
         }
 
+        run_queue_finish(runq, t);
         mutex_unlock(t->mutex);
 
     next:
@@ -563,98 +1992,158 @@ void run_queue_run(struct run_queue *runq, int wait)
             cond_broadcast(&runq->cond);
         }
 
-        t = runq->head;
+        /* Don't let a busy queue starve the tasklets waiting for I/O or
+           timers */
+        if (!(++ran % RUNQ_POLL_INTERVAL)) {
+            run_queue_flush(runq);
+            reactor = atomic_load_order(&runq->reactor, ATOMIC_ACQUIRE);
+            if (reactor || atomic_load_order(&runq->timers_next,
+                                             ATOMIC_RELAXED) !=
+                               TIMER_WHEEL_NEVER) {
+                runq->current = NULL;
+                mutex_unlock(&runq->mutex);
+                if (reactor)
+                    reactor_poll(reactor, 0);
+
+                run_queue_expire(runq);
+                mutex_lock(&runq->mutex);
+            }
+        }
+
+        if (run_queue_over_budget(runq, ran, start))
+            break;
+
+        t = run_queue_next(runq);
     } while (t);
 
     runq->current = NULL;
 
 out:
+    serving = was_serving;
     mutex_unlock(&runq->mutex);
 }
 
-void tasklet_stop(struct tasklet *t)
+/* Lock the run queue that a tasklet is on, once it is done being pushed.
+   Returns NULL if the tasklet is not on a run queue. */
+static struct run_queue *tasklet_lock_run_queue(struct tasklet *t)
 {
-    mutex_assert_held(t->mutex);
-    tasklet_unwait(t);
-
     for (;;) {
-        struct run_queue *runq = t->runq;
-        if (!runq)
-            break;
-
-        mutex_lock(&runq->mutex);
+        struct run_queue *state, *runq;
 
-        if (t->runq == runq) {
-            if (runq->current != t) {
-                run_queue_remove(runq, t);
-                t->runq = NULL;
-            } else {
-                runq->current_state = CURRENT_STOPPED;
+        /* The tasklet might move off a run queue that is then destroyed,
+           so until we hold the mutex of the queue it is on, stay in an
+           epoch section.  After that, run_queue_destroy cannot move the
+           tasklet until we release the mutex. */
+        run_queue_epoch_enter();
+        state = atomic_load_order(&t->runq, ATOMIC_ACQUIRE);
+        runq = pointer_clear_bits(state);
 
-                if (thread_handle_current() != runq->thread) {
-                    mutex_veto_transfer(t->mutex);
+        if (!runq) {
+            epoch_exit();
+            return NULL;
+        }
 
-                    /* Wait until the tasklet is done */
-                    runq->stop_waiting = true;
+        if (pointer_bits(state) == RUNQ_PUSHING) {
+            epoch_exit();
+            sched_yield();
+            continue;
+        }
 
-                    do
-                        cond_wait(&runq->cond, &runq->mutex);
-                    while (runq->current == t);
-                }
-            }
+        mutex_lock(&runq->mutex);
 
-            mutex_unlock(&runq->mutex);
-            break;
+        state = atomic_load_order(&t->runq, ATOMIC_ACQUIRE);
+        if (pointer_clear_bits(state) == runq &&
+            pointer_bits(state) != RUNQ_PUSHING) {
+            epoch_exit();
+            return runq;
         }
 
         mutex_unlock(&runq->mutex);
+        epoch_exit();
     }
 }
 
-void tasklet_fini(struct tasklet *t)
+void tasklet_stop(struct tasklet *t)
 {
+    struct run_queue *runq;
+
     mutex_assert_held(t->mutex);
     tasklet_unwait(t);
 
-    for (;;) {
-        struct run_queue *runq = t->runq;
-        if (!runq)
-            break;
+    runq = tasklet_lock_run_queue(t);
+    if (!runq)
+        return;
 
-        mutex_lock(&runq->mutex);
+    if (runq->current != t) {
+        /* It might still be on the incoming list */
+        run_queue_drain(runq);
+        run_queue_remove(runq, t);
+        atomic_store_order(&t->runq, NULL, ATOMIC_RELAXED);
+    } else {
+        runq->current_state = CURRENT_STOPPED;
 
-        if (t->runq == runq) {
-            if (runq->current != t) {
-                run_queue_remove(runq, t);
-                t->runq = NULL;
-            } else {
-                runq->current_state = CURRENT_STOPPED;
+        /* Cancel any requeue */
+        atomic_store_order(&t->runq, pointer_set_bits(runq, RUNQ_RUNNING),
+                           ATOMIC_RELAXED);
 
-                if (thread_handle_current() == runq->thread) {
-                    runq->current = NULL;
-                } else {
-                    mutex_veto_transfer(t->mutex);
+        if (thread_handle_current() != runq->thread) {
+            mutex_veto_transfer(t->mutex);
 
-                    /* Wait until the tasklet is done */
-                    runq->stop_waiting = true;
+            /* Wait until the tasklet is done */
+            runq->stop_waiting = true;
 
-                    do
-                        cond_wait(&runq->cond, &runq->mutex);
-                    while (runq->current == t);
-                }
-            }
+            do
+                cond_wait(&runq->cond, &runq->mutex);
+            while (runq->current == t);
+        }
+    }
 
+    mutex_unlock(&runq->mutex);
+}
+
+void tasklet_fini(struct tasklet *t)
+{
+    struct run_queue *runq;
+
+    mutex_assert_held(t->mutex);
+    tasklet_unwait(t);
+
+    while ((runq = tasklet_lock_run_queue(t))) {
+        if (runq->current != t) {
+            run_queue_drain(runq);
+            run_queue_remove(runq, t);
+            atomic_store_order(&t->runq, NULL, ATOMIC_RELAXED);
             mutex_unlock(&runq->mutex);
             break;
         }
 
+        runq->current_state = CURRENT_STOPPED;
+
+        if (thread_handle_current() == runq->thread) {
+            runq->current = NULL;
+            atomic_store_order(&t->runq, NULL, ATOMIC_RELAXED);
+            mutex_unlock(&runq->mutex);
+            break;
+        }
+
+        atomic_store_order(&t->runq, pointer_set_bits(runq, RUNQ_RUNNING),
+                           ATOMIC_RELAXED);
+        mutex_veto_transfer(t->mutex);
+
+        /* Wait until the tasklet is done.  A racing tasklet_run
+           might have requeued it, so then go round again. */
+        runq->stop_waiting = true;
+
+        do
+            cond_wait(&runq->cond, &runq->mutex);
+        while (runq->current == t);
+
         mutex_unlock(&runq->mutex);
     }
 
     t->mutex = NULL;
     t->handler = NULL;
     t->data = NULL;
-    mutex_fini(&t->wait_mutex);
 }
 
 static void worker_thread(void *v_worker)
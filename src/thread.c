@@ -1,7 +1,13 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "thread.h"
 
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <time.h>
 
 struct thread_params {
     void (*func)(void *data);
@@ -36,70 +42,99 @@ void thread_signal(thread_handle_t thr, int sig)
     pthread_kill(thr, sig);
 }
 
+int thread_set_cpu(thread_handle_t thr, int cpu)
+{
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(thr, sizeof cpus, &cpus);
+}
+
 void mutex_init(struct mutex *m)
 {
     skinny_mutex_init(&m->mutex);
+#ifdef SKINNY_MUTEX_ERRORCHECK
     m->init = malloc(1);
-    m->held = false;
+#endif
 }
 
 void mutex_fini(struct mutex *m)
 {
-    assert(!m->held);
+    assert(!skinny_mutex_held_by_self(&m->mutex));
+#ifdef SKINNY_MUTEX_ERRORCHECK
     free(m->init);
+#endif
     skinny_mutex_destroy(&m->mutex);
 }
 
 void mutex_lock(struct mutex *m)
 {
-    skinny_mutex_lock(&m->mutex);
-    m->held = true;
+    int res UNUSED = skinny_mutex_lock(&m->mutex);
+    assert(!res);
+}
+
+bool mutex_trylock(struct mutex *m)
+{
+    int res = skinny_mutex_trylock(&m->mutex);
+    assert(!res || res == EBUSY);
+    return !res;
 }
 
 void mutex_unlock(struct mutex *m)
 {
-    assert(m->held);
-    m->held = false;
-    skinny_mutex_unlock(&m->mutex);
+    int res UNUSED;
+
+    mutex_assert_held(m);
+    res = skinny_mutex_unlock(&m->mutex);
+    assert(!res);
 }
 
 bool mutex_transfer(struct mutex *a, struct mutex *b)
 {
-    assert(a->held);
-    a->held = false;
-    int res = skinny_mutex_transfer(&a->mutex, &b->mutex);
-    if (res != EAGAIN) {
-        b->held = true;
-        return true;
-    }
-    a->held = true;
-    return false;
+    mutex_assert_held(a);
+    return skinny_mutex_transfer(&a->mutex, &b->mutex) != EAGAIN;
 }
 
 void mutex_veto_transfer(struct mutex *m)
 {
-    assert(m->held);
+    mutex_assert_held(m);
     skinny_mutex_veto_transfer(&m->mutex);
 }
 
 void cond_init(struct cond *c)
 {
-    pthread_cond_init(&c->cond, NULL);
+    pthread_condattr_t attr;
+
+    /* So that cond_timedwait is unaffected by changes to the system time */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+#ifdef SKINNY_MUTEX_ERRORCHECK
     c->init = malloc(1);
+#endif
 }
 
 void cond_fini(struct cond *c)
 {
+#ifdef SKINNY_MUTEX_ERRORCHECK
     free(c->init);
+#endif
     pthread_cond_destroy(&c->cond);
 }
 
 void cond_wait(struct cond *c, struct mutex *m)
 {
     mutex_assert_held(m);
-    m->held = false;
     skinny_mutex_cond_wait(&c->cond, &m->mutex);
-    m->held = true;
+}
+
+void cond_timedwait(struct cond *c, struct mutex *m,
+                    const struct timespec *abstime)
+{
+    mutex_assert_held(m);
+    skinny_mutex_cond_timedwait(&c->cond, &m->mutex, abstime);
 }
 
 void cond_signal(struct cond *c)
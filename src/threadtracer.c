@@ -2,6 +2,8 @@
 
 #include <inttypes.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,9 +15,14 @@
 #define MAXTHREADS 12         //!< How many threads can we support?
 #define MAXSAMPLES 64 * 1024  //!< How many samples can we record for a thread?
 
-//! How many threads are we currently tracing?
+//! How many threads have signed in?  This can exceed MAXTHREADS, but only
+//! the first MAXTHREADS get slots.
 static _Atomic int numthreads = 0;
 
+//! How many slots have been filled in?  Slots are published in order, so
+//! that slots 0 to numready - 1 can all be read.
+static _Atomic int numready = 0;
+
 //! When (in wallclock time) did we start tracing?
 static int64_t walloffset = 0;
 
@@ -49,12 +56,29 @@ static const char *threadnames[MAXTHREADS];
 //! The thread-ids.
 static pthread_t threadids[MAXTHREADS];
 
-static __thread int tidx;
+#define NOTSIGNEDIN -1  //!< tidx of a thread that has not signed in
+#define NOSLOT -2       //!< tidx of a thread that found no slot left
+
+//! The slot of the current thread, or NOTSIGNEDIN or NOSLOT.
+static __thread int tidx = NOTSIGNEDIN;
+
+//! How many slots are in use and filled in?
+static int numslots(void)
+{
+    return atomic_load_explicit(&numready, memory_order_acquire);
+}
 
 //! Before tracing, a thread should make itself known to ThreadTracer.
+//! Signing in again from the same thread returns the existing slot, or -1
+//! again if it got none.
 int tt_signin(const char *threadname)
 {
-    int slot = numthreads++;
+    if (tidx >= 0)
+        return tidx;
+    if (tidx == NOSLOT)
+        return -1;
+
+    int slot = atomic_fetch_add_explicit(&numthreads, 1, memory_order_relaxed);
     if (slot == 0) {
         struct timespec wt, ct;
         clock_gettime(CLOCK_MONOTONIC, &wt);
@@ -77,13 +101,20 @@ int tt_signin(const char *threadname)
         isrecording = 1;
     }
     if (slot >= MAXTHREADS) {
-        numthreads = MAXTHREADS;
+        tidx = NOSLOT;
         return -1;
     }
     threadnames[slot] = threadname;
     threadids[slot] = pthread_self();
     samplecounts[slot] = 0;
     tidx = slot;
+
+    // Publish the slot now that it is filled in.  The threads that took
+    // the slots before ours are between their fetch-add and this point,
+    // so waiting for them is brief.
+    while (atomic_load_explicit(&numready, memory_order_acquire) != slot)
+        sched_yield();
+    atomic_store_explicit(&numready, slot + 1, memory_order_release);
     return slot;
 }
 
@@ -99,13 +130,17 @@ static int getrusage_thread(struct rusage *rusage)
 int tt_stamp(const char *cat, const char *tag, const char *phase)
 {
     if (!isrecording) {
-        if (!numthreads)
+        if (!atomic_load_explicit(&numthreads, memory_order_relaxed))
             fprintf(stderr,
                     "ThreadTracer: ERROR. Threads did not sign in yet. Cannot "
                     "record.\n");
         return -1;
     }
 
+    // Threads that have not signed in or got no slot are not traced.
+    if (tidx == NOTSIGNEDIN || tidx == NOSLOT)
+        return -1;
+
     struct timespec wt, ct;
     clock_gettime(CLOCK_MONOTONIC, &wt);
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ct);
@@ -171,7 +206,8 @@ int tt_report(const char *user_oname)
         oname = user_oname;
     }
 
-    if (numthreads == 0) {
+    const int nslots = numslots();
+    if (nslots == 0) {
         fprintf(stderr,
                 "ThreadTracer: Nothing to report, 0 threads signed in.\n");
         return -1;
@@ -184,7 +220,7 @@ int tt_report(const char *user_oname)
     int discarded = 0;
     fprintf(f, "{\"traceEvents\":[\n");
 
-    for (int t = 0; t < numthreads; ++t) {
+    for (int t = 0; t < nslots; ++t) {
         for (int s = 0; s < samplecounts[t]; ++s) {
             const sample_t *sample = samples[t] + s;
 
@@ -243,7 +279,7 @@ int tt_report(const char *user_oname)
             (void) 0;
         }
     }
-    for (int t = 0; t < numthreads; ++t) {
+    for (int t = 0; t < nslots; ++t) {
         fprintf(f, ",\n{");
         fprintf(f,
                 "\"name\": \"thread_name\", "
@@ -0,0 +1,187 @@
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static unsigned int level_shift(unsigned int level)
+{
+    return level * TIMER_WHEEL_BITS;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+    w->now = now;
+    w->count = 0;
+
+    for (unsigned int i = 0; i < TIMER_WHEEL_LEVELS; i++)
+        w->occupied[i] = 0;
+
+    for (unsigned int i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++)
+        w->slots[i] = NULL;
+}
+
+static void slot_insert(struct timer_wheel *w, unsigned int level,
+                        unsigned int slot, struct tasklet_timer *timer)
+{
+    struct tasklet_timer **head =
+        &w->slots[level * TIMER_WHEEL_SLOTS + slot];
+
+    timer->slot = level * TIMER_WHEEL_SLOTS + slot;
+    timer->next = *head;
+    timer->pprev = head;
+    if (*head)
+        (*head)->pprev = &timer->next;
+
+    *head = timer;
+    w->occupied[level] |= (uint64_t) 1 << slot;
+    w->count++;
+}
+
+void timer_wheel_add(struct timer_wheel *w, struct tasklet_timer *timer)
+{
+    uint64_t expires = timer->expires;
+    unsigned int level;
+
+    /* Invariant: a timer on level L lies between 1 and 63 slots ahead of
+       the current slot on that level, so each slot is cascaded or fired at
+       the start of its span and not a full turn early. */
+    if (expires <= w->now)
+        expires = w->now + 1;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned int shift = level_shift(level);
+
+        if ((expires >> shift) - (w->now >> shift) < TIMER_WHEEL_SLOTS) {
+            slot_insert(w, level, (expires >> shift) & SLOT_MASK, timer);
+            return;
+        }
+    }
+
+    /* Too far off for the wheel, so park it in the furthest slot of the top
+       level.  It gets cascaded back to the top level until it is near. */
+    level = TIMER_WHEEL_LEVELS - 1;
+    slot_insert(w, level, ((w->now >> level_shift(level)) - 1) & SLOT_MASK,
+                timer);
+}
+
+void timer_wheel_remove(struct timer_wheel *w, struct tasklet_timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+
+    if (!w->slots[timer->slot])
+        w->occupied[timer->slot / TIMER_WHEEL_SLOTS] &=
+            ~((uint64_t) 1 << (timer->slot & SLOT_MASK));
+
+    w->count--;
+}
+
+/* Take all the timers from a slot */
+static struct tasklet_timer *slot_take(struct timer_wheel *w,
+                                       unsigned int level, unsigned int slot)
+{
+    struct tasklet_timer **head =
+        &w->slots[level * TIMER_WHEEL_SLOTS + slot];
+    struct tasklet_timer *timers = *head;
+
+    *head = NULL;
+    w->occupied[level] &= ~((uint64_t) 1 << slot);
+
+    for (struct tasklet_timer *t = timers; t; t = t->next)
+        w->count--;
+
+    return timers;
+}
+
+uint64_t timer_wheel_next(struct timer_wheel *w)
+{
+    uint64_t next = TIMER_WHEEL_NEVER;
+
+    if (!w->count)
+        return next;
+
+    for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned int shift = level_shift(level);
+        uint64_t occupied = w->occupied[level], rotated, tick;
+        unsigned int cur = (w->now >> shift) & SLOT_MASK, distance;
+
+        if (!occupied)
+            continue;
+
+        /* Rotate so that bit 0 is the current slot */
+        rotated = (occupied >> cur) | (occupied << ((64 - cur) & 63));
+        distance = __builtin_ctzll(rotated);
+        if (!distance)
+            distance = TIMER_WHEEL_SLOTS;
+
+        tick = ((w->now >> shift) + distance) << shift;
+        if (tick < next)
+            next = tick;
+    }
+
+    return next;
+}
+
+struct tasklet_timer *timer_wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+    struct tasklet_timer *expired = NULL;
+
+    while (w->now < now) {
+        uint64_t tick = timer_wheel_next(w);
+        struct tasklet_timer *timer, *next;
+
+        /* Skip the ticks where there is nothing to do */
+        if (tick > now) {
+            w->now = now;
+            break;
+        }
+
+        w->now = tick;
+
+        for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            unsigned int shift = level_shift(level);
+
+            if (tick & (((uint64_t) 1 << shift) - 1))
+                break;
+
+            for (timer = slot_take(w, level, (tick >> shift) & SLOT_MASK);
+                 timer; timer = next) {
+                next = timer->next;
+                if (timer->expires <= tick) {
+                    timer->next = expired;
+                    expired = timer;
+                } else {
+                    timer_wheel_add(w, timer);
+                }
+            }
+        }
+
+        for (timer = slot_take(w, 0, tick & SLOT_MASK); timer; timer = next) {
+            next = timer->next;
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+
+    return expired;
+}
+
+struct tasklet_timer *timer_wheel_take_all(struct timer_wheel *w)
+{
+    struct tasklet_timer *all = NULL;
+
+    for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        while (w->occupied[level]) {
+            unsigned int slot = __builtin_ctzll(w->occupied[level]);
+            struct tasklet_timer *timer, *next;
+
+            for (timer = slot_take(w, level, slot); timer; timer = next) {
+                next = timer->next;
+                timer->next = all;
+                all = timer;
+            }
+        }
+    }
+
+    return all;
+}
@@ -0,0 +1,58 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+/* A hierarchical timing wheel, as used by each run queue to hold its
+ * tasklet_timers.  Time is measured in ticks of TIMER_WHEEL_TICK
+ * nanoseconds.  Level 0 has a slot for each of the next 64 ticks, level 1 a
+ * slot for each of the next 64 spans of 64 ticks, and so on.  When time
+ * reaches the start of a slot on a higher level, its timers are cascaded
+ * down to lower levels.  So adding and removing a timer are O(1), and
+ * advancing costs O(1) per timer per level, plus a bit scan per occupied
+ * slot passed.
+ *
+ * The wheel does no locking of its own.
+ */
+
+#include <stdint.h>
+
+#include "tasklet.h"
+
+#define TIMER_WHEEL_TICK 1000000 /* 1ms */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/* Returned by timer_wheel_next for an empty wheel */
+#define TIMER_WHEEL_NEVER UINT64_MAX
+
+struct timer_wheel {
+    uint64_t now; /* The last tick processed */
+    unsigned int count;
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; /* A bit for each nonempty slot */
+    struct tasklet_timer *slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+
+/* Add a timer that expires at timer->expires.  A timer that has already
+ * expired is returned by the next timer_wheel_advance.
+ */
+void timer_wheel_add(struct timer_wheel *w, struct tasklet_timer *timer);
+void timer_wheel_remove(struct timer_wheel *w, struct tasklet_timer *timer);
+
+/* Advance to tick "now", and return the timers that have expired, linked
+ * through their "next" fields.  They are no longer on the wheel.
+ */
+struct tasklet_timer *timer_wheel_advance(struct timer_wheel *w, uint64_t now);
+
+/* Remove all the timers, and return them linked through their "next"
+ * fields.
+ */
+struct tasklet_timer *timer_wheel_take_all(struct timer_wheel *w);
+
+/* The tick at which timer_wheel_advance next has work to do: no later than
+ * the first expiry, or TIMER_WHEEL_NEVER if the wheel is empty.
+ */
+uint64_t timer_wheel_next(struct timer_wheel *w);
+
+#endif
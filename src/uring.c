@@ -0,0 +1,520 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "atomics.h"
+#include "reactor.h"
+#include "tasklet.h"
+
+/* Submission queue size for each ring.  The completion queue is twice as
+   big. */
+#define URING_ENTRIES 256
+
+/* How many completions to take from the ring at a time */
+#define URING_REAP_BATCH 64
+
+/* Helper threads used when io_uring is not available.  An operation on a
+   socket or pipe blocks its helper until the file descriptor is ready, so
+   a helper is started whenever an operation would otherwise have to wait
+   for one, up to URING_HELPERS_MAX.  Helpers beyond the first
+   URING_HELPERS exit once they have been idle for URING_HELPER_IDLE_NS. */
+#define URING_HELPERS 4
+#define URING_HELPERS_MAX 256
+#define URING_HELPER_IDLE_NS (1000 * 1000000ull)
+
+struct uring {
+    struct mutex mutex;
+
+    /* The io_uring file descriptor, or -1 if io_uring is not available
+       and operations go to the helper threads. */
+    int fd;
+
+    /* Submission queue ring, shared with the kernel */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+
+    /* Entries queued but not yet passed to io_uring_enter */
+    unsigned int pending;
+
+    /* Completion queue ring, shared with the kernel */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+                          unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static void uring_unmap(struct uring *u)
+{
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+}
+
+/* Set up the io_uring instance.  Returns false if it is not available. */
+static bool uring_setup(struct uring *u)
+{
+    struct io_uring_params p;
+    const char *env = getenv("TASKLET_IO_URING");
+
+    u->fd = -1;
+    u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+    if (env && !strcmp(env, "0"))
+        return false;
+
+    memset(&p, 0, sizeof p);
+    u->fd = io_uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0)
+        return false;
+
+    /* IORING_OP_READ and friends, and offset -1 meaning the current file
+       position, arrived together. */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+        goto fail;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    u->sq_head = (unsigned int *) ((char *) u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *) ((char *) u->sq_ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned int *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array = (unsigned int *) ((char *) u->sq_ring + p.sq_off.array);
+
+    u->cq_head = (unsigned int *) ((char *) u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *) ((char *) u->cq_ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned int *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+
+    return true;
+
+fail:
+    uring_unmap(u);
+    close(u->fd);
+    u->fd = -1;
+    return false;
+}
+
+static void io_complete(struct tasklet_io *io, ssize_t result)
+{
+    io->result = result;
+    wait_list_set(&io->done, 1, true);
+}
+
+/* Take completions off the ring.  Called by the reactor when the ring's
+   file descriptor becomes readable. */
+static void uring_reap(void *v_u)
+{
+    struct uring *u = v_u;
+
+    for (;;) {
+        struct io_uring_cqe done[URING_REAP_BATCH];
+        unsigned int head, tail, n = 0;
+
+        /* Complete the operations after dropping the mutex, as that
+           wakes tasklets. */
+        mutex_lock(&u->mutex);
+        head = *u->cq_head;
+        tail = atomic_load_order(u->cq_tail, ATOMIC_ACQUIRE);
+        while (head != tail && n < URING_REAP_BATCH)
+            done[n++] = u->cqes[head++ & u->cq_mask];
+        atomic_store_order(u->cq_head, head, ATOMIC_RELEASE);
+        mutex_unlock(&u->mutex);
+
+        if (!n)
+            break;
+
+        for (unsigned int i = 0; i < n; i++)
+            io_complete((struct tasklet_io *) (uintptr_t) done[i].user_data,
+                        done[i].res);
+    }
+}
+
+int uring_create(struct reactor *r, struct uring **up)
+{
+    struct uring *u = malloc(sizeof *u);
+
+    if (!u)
+        return ENOMEM;
+
+    mutex_init(&u->mutex);
+    u->pending = 0;
+
+    if (uring_setup(u) && reactor_set_hook(r, u->fd, uring_reap, u)) {
+        uring_unmap(u);
+        close(u->fd);
+        u->fd = -1;
+    }
+
+    *up = u;
+    return 0;
+}
+
+void uring_destroy(struct uring *u)
+{
+    if (u->fd >= 0) {
+        uring_unmap(u);
+        close(u->fd);
+    }
+
+    mutex_fini(&u->mutex);
+    free(u);
+}
+
+/* Called with the mutex held */
+static void uring_enter(struct uring *u)
+{
+    int res = io_uring_enter(u->fd, u->pending, 0, 0);
+
+    /* On errors such as EBUSY (too many completions not yet reaped), the
+       entries stay queued for the next attempt. */
+    if (res > 0)
+        u->pending -= res;
+}
+
+void uring_flush(struct uring *u)
+{
+    if (!atomic_load_order(&u->pending, ATOMIC_RELAXED))
+        return;
+
+    mutex_lock(&u->mutex);
+    if (u->pending)
+        uring_enter(u);
+    mutex_unlock(&u->mutex);
+}
+
+static int uring_submit(struct uring *u, struct tasklet_io *io, bool batched)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, index;
+
+    mutex_lock(&u->mutex);
+
+    tail = *u->sq_tail;
+    if (tail - atomic_load_order(u->sq_head, ATOMIC_ACQUIRE) ==
+        u->sq_entries) {
+        uring_enter(u);
+        if (tail - atomic_load_order(u->sq_head, ATOMIC_ACQUIRE) ==
+            u->sq_entries) {
+            mutex_unlock(&u->mutex);
+            return EAGAIN;
+        }
+    }
+
+    index = tail & u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->fd = io->fd;
+    sqe->user_data = (uintptr_t) io;
+
+    switch (io->op) {
+    case TASKLET_IO_READ:
+    case TASKLET_IO_WRITE:
+        sqe->opcode =
+            io->op == TASKLET_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->addr = (uintptr_t) io->buf;
+        sqe->len = io->len;
+        sqe->off = io->offset;
+        break;
+
+    case TASKLET_IO_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        break;
+
+    case TASKLET_IO_ACCEPT:
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->addr = (uintptr_t) io->addr;
+        sqe->addr2 = (uintptr_t) io->addrlen;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        break;
+    }
+
+    u->sq_array[index] = index;
+    atomic_store_order(u->sq_tail, tail + 1, ATOMIC_RELEASE);
+    atomic_store_order(&u->pending, u->pending + 1, ATOMIC_RELAXED);
+
+    if (!batched)
+        uring_enter(u);
+
+    mutex_unlock(&u->mutex);
+    return 0;
+}
+
+/* Do an operation on a helper thread.  It blocks until the file descriptor
+   is ready, as the operation would with io_uring, even if the file
+   descriptor is non-blocking. */
+static void helper_run(void *v_io)
+{
+    struct tasklet_io *io = v_io;
+    struct pollfd pfd = {.fd = io->fd};
+    ssize_t res;
+
+    pfd.events = io->op == TASKLET_IO_READ || io->op == TASKLET_IO_ACCEPT
+                     ? POLLIN
+                     : POLLOUT;
+    if (io->op != TASKLET_IO_FSYNC)
+        poll(&pfd, 1, -1);
+
+    switch (io->op) {
+    case TASKLET_IO_READ:
+        res = io->offset == -1 ? read(io->fd, io->buf, io->len)
+                               : pread(io->fd, io->buf, io->len, io->offset);
+        break;
+
+    case TASKLET_IO_WRITE:
+        res = io->offset == -1 ? write(io->fd, io->buf, io->len)
+                               : pwrite(io->fd, io->buf, io->len, io->offset);
+        break;
+
+    case TASKLET_IO_FSYNC:
+        res = fsync(io->fd);
+        break;
+
+    case TASKLET_IO_ACCEPT:
+    default:
+        res = accept4(io->fd, io->addr, io->addrlen, SOCK_CLOEXEC);
+        break;
+    }
+
+    io_complete(io, res < 0 ? -errno : res);
+}
+
+static struct {
+    struct mutex mutex;
+    struct cond cond;
+
+    /* Operations waiting for a helper, linked through helper_next */
+    struct tasklet_io *head;
+    struct tasklet_io **tail;
+
+    unsigned int queued;
+    unsigned int idle;
+    unsigned int threads;
+} helpers;
+
+static skinny_once_t helpers_once = SKINNY_ONCE_INIT;
+
+static void helpers_init(void)
+{
+    mutex_init(&helpers.mutex);
+    cond_init(&helpers.cond);
+    helpers.head = NULL;
+    helpers.tail = &helpers.head;
+    helpers.queued = helpers.idle = helpers.threads = 0;
+}
+
+static void *helper_thread(void *dummy)
+{
+    (void) dummy;
+
+    mutex_lock(&helpers.mutex);
+    for (;;) {
+        struct tasklet_io *io;
+
+        while (!helpers.head) {
+            uint64_t deadline = tasklet_now() + URING_HELPER_IDLE_NS;
+            struct timespec abstime = {
+                .tv_sec = deadline / 1000000000,
+                .tv_nsec = deadline % 1000000000,
+            };
+
+            helpers.idle++;
+            cond_timedwait(&helpers.cond, &helpers.mutex, &abstime);
+            helpers.idle--;
+
+            if (!helpers.head && helpers.threads > URING_HELPERS &&
+                tasklet_now() >= deadline) {
+                helpers.threads--;
+                mutex_unlock(&helpers.mutex);
+                return NULL;
+            }
+        }
+
+        io = helpers.head;
+        helpers.head = io->helper_next;
+        if (!helpers.head)
+            helpers.tail = &helpers.head;
+
+        helpers.queued--;
+        mutex_unlock(&helpers.mutex);
+
+        helper_run(io);
+        mutex_lock(&helpers.mutex);
+    }
+}
+
+/* Called with the helpers' mutex held */
+static bool helper_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    bool started;
+
+    if (pthread_attr_init(&attr))
+        return false;
+
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = !pthread_create(&thread, &attr, helper_thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (started)
+        helpers.threads++;
+
+    return started;
+}
+
+static int helper_submit(struct tasklet_io *io)
+{
+    skinny_once(&helpers_once, helpers_init);
+    mutex_lock(&helpers.mutex);
+
+    /* Every operation already queued will take an idle helper, so start
+       another unless one is left over for this one. */
+    if (helpers.queued >= helpers.idle &&
+        helpers.threads < URING_HELPERS_MAX && !helper_start() &&
+        !helpers.threads) {
+        mutex_unlock(&helpers.mutex);
+        return ENOMEM;
+    }
+
+    io->helper_next = NULL;
+    *helpers.tail = io;
+    helpers.tail = &io->helper_next;
+    helpers.queued++;
+    cond_signal(&helpers.cond);
+
+    mutex_unlock(&helpers.mutex);
+    return 0;
+}
+
+void tasklet_io_init(struct tasklet_io *io)
+{
+    wait_list_init(&io->done, 0);
+}
+
+void tasklet_io_fini(struct tasklet_io *io)
+{
+    wait_list_fini(&io->done);
+}
+
+static int tasklet_io_submit(struct tasklet_io *io)
+{
+    struct uring *u;
+    bool batched;
+    int res;
+
+    res = thread_uring(&u, &batched);
+    if (res)
+        return res;
+
+    wait_list_set(&io->done, 0, false);
+
+    if (u->fd < 0)
+        return helper_submit(io);
+
+    return uring_submit(u, io, batched);
+}
+
+int tasklet_io_read(struct tasklet_io *io, int fd, void *buf, size_t len,
+                    off_t offset)
+{
+    io->op = TASKLET_IO_READ;
+    io->fd = fd;
+    io->buf = buf;
+    io->len = len;
+    io->offset = offset;
+    return tasklet_io_submit(io);
+}
+
+int tasklet_io_write(struct tasklet_io *io, int fd, const void *buf,
+                     size_t len, off_t offset)
+{
+    io->op = TASKLET_IO_WRITE;
+    io->fd = fd;
+    io->buf = (void *) buf;
+    io->len = len;
+    io->offset = offset;
+    return tasklet_io_submit(io);
+}
+
+int tasklet_io_fsync(struct tasklet_io *io, int fd)
+{
+    io->op = TASKLET_IO_FSYNC;
+    io->fd = fd;
+    return tasklet_io_submit(io);
+}
+
+int tasklet_io_accept(struct tasklet_io *io, int fd, struct sockaddr *addr,
+                      socklen_t *addrlen)
+{
+    io->op = TASKLET_IO_ACCEPT;
+    io->fd = fd;
+    io->addr = addr;
+    io->addrlen = addrlen;
+    return tasklet_io_submit(io);
+}
@@ -0,0 +1,31 @@
+#ifndef URING_H
+#define URING_H
+
+/* The completion-based I/O engine behind struct tasklet_io.  Each run queue
+ * that submits I/O gets its own io_uring instance, whose completion queue
+ * is watched by the run queue's reactor.  Tasklets running on the run
+ * queue's worker only queue their submissions, and run_queue_run submits
+ * them all with one io_uring_enter when it runs out of tasklets, or every
+ * so often when busy.  Where io_uring is not available, operations are
+ * done by a pool of helper threads instead.
+ */
+
+#include <stdbool.h>
+
+struct reactor;
+struct uring;
+
+/* Never fails for lack of io_uring, only for lack of memory. */
+int uring_create(struct reactor *r, struct uring **up);
+void uring_destroy(struct uring *u);
+
+/* Submit the queued operations. */
+void uring_flush(struct uring *u);
+
+/* The io_uring of the calling thread's run queue, created if need be.
+ * "batched" is set if the calling thread is that run queue's worker, and
+ * so will flush submissions itself.  Defined in tasklet.c.
+ */
+int thread_uring(struct uring **up, bool *batched);
+
+#endif
@@ -0,0 +1,302 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "atomics.h"
+#include "parking_lot.h"
+#include "skinny_mutex.h"
+#include "skinny_sync.h"
+
+/*
+ * Litmus and stress tests for the orderings used by the primitives.  On
+ * x86-64 most of the reorderings they look for cannot happen in hardware,
+ * so these mainly guard against compiler reordering.  They are more
+ * interesting when run on a weakly ordered CPU, or under emulation, e.g.:
+ *
+ *   make check CC=aarch64-linux-gnu-gcc \
+ *       RUNNER="qemu-aarch64 -L /usr/aarch64-linux-gnu"
+ */
+
+#define THREADS 4
+
+/* A spinning barrier for two threads, so that each round of a litmus test
+ * starts both sides as close together as possible.  It yields while
+ * spinning, in case there are fewer CPUs than threads.
+ */
+struct spin_barrier {
+    unsigned int arrived;
+    unsigned int round;
+};
+
+static void spin_barrier_wait(struct spin_barrier *b)
+{
+    unsigned int round = atomic_load_order(&b->round, ATOMIC_ACQUIRE);
+
+    if (atomic_add_fetch_order(&b->arrived, 1, ATOMIC_ACQ_REL) == 2) {
+        atomic_store_order(&b->arrived, 0, ATOMIC_RELAXED);
+        atomic_store_order(&b->round, round + 1, ATOMIC_RELEASE);
+        return;
+    }
+
+    while (atomic_load_order(&b->round, ATOMIC_ACQUIRE) == round)
+        sched_yield();
+}
+
+/* Message passing: a release store of a flag publishes the data written
+ * before it to a thread that reads the flag with an acquire load.
+ */
+#define MP_ROUNDS 200000
+
+static long mp_data[MP_ROUNDS];
+static bool mp_flag[MP_ROUNDS];
+
+static void *mp_writer(void *dummy)
+{
+    (void) dummy;
+
+    for (long i = 0; i < MP_ROUNDS; i++) {
+        atomic_store_order(&mp_data[i], i + 1, ATOMIC_RELAXED);
+        atomic_store_order(&mp_flag[i], true, ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void test_message_passing(void)
+{
+    pthread_t thread;
+
+    assert(!pthread_create(&thread, NULL, mp_writer, NULL));
+
+    for (long i = 0; i < MP_ROUNDS; i++) {
+        while (!atomic_load_order(&mp_flag[i], ATOMIC_ACQUIRE))
+            sched_yield();
+        assert(atomic_load_order(&mp_data[i], ATOMIC_RELAXED) == i + 1);
+    }
+
+    assert(!pthread_join(thread, NULL));
+}
+
+/* Store buffering: with a full fence between each thread's store and its
+ * load, at least one thread must see the other's store.  epoch.c depends
+ * on this.
+ */
+#define SB_ROUNDS 50000
+
+struct test_sb {
+    struct spin_barrier barrier;
+    int x, y;
+    int r1[SB_ROUNDS], r2[SB_ROUNDS];
+};
+
+static void *sb_thread(void *v_sb)
+{
+    struct test_sb *sb = v_sb;
+
+    for (int i = 0; i < SB_ROUNDS; i++) {
+        spin_barrier_wait(&sb->barrier);
+        atomic_store_order(&sb->y, i + 1, ATOMIC_RELAXED);
+        atomic_fence(ATOMIC_SEQ_CST);
+        sb->r2[i] = atomic_load_order(&sb->x, ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static void test_store_buffering(void)
+{
+    static struct test_sb sb;
+    pthread_t thread;
+
+    assert(!pthread_create(&thread, NULL, sb_thread, &sb));
+
+    for (int i = 0; i < SB_ROUNDS; i++) {
+        spin_barrier_wait(&sb.barrier);
+        atomic_store_order(&sb.x, i + 1, ATOMIC_RELAXED);
+        atomic_fence(ATOMIC_SEQ_CST);
+        sb.r1[i] = atomic_load_order(&sb.y, ATOMIC_RELAXED);
+    }
+
+    assert(!pthread_join(thread, NULL));
+
+    for (int i = 0; i < SB_ROUNDS; i++)
+        assert(sb.r1[i] == i + 1 || sb.r2[i] == i + 1);
+}
+
+/* atomic_cas and atomic_xchg are atomic read-modify-writes: no increments
+ * are lost, and every value exchanged in is exchanged out exactly once.
+ */
+#define RMW_ROUNDS 100000
+
+struct test_rmw {
+    unsigned long counter;
+    unsigned long slot;
+    unsigned long seen[THREADS];
+};
+
+struct rmw_arg {
+    struct test_rmw *tr;
+    int index;
+};
+
+static void *rmw_worker(void *v_arg)
+{
+    struct rmw_arg *arg = v_arg;
+    struct test_rmw *tr = arg->tr;
+    unsigned long seen = 0;
+
+    for (unsigned long i = 1; i <= RMW_ROUNDS; i++) {
+        unsigned long v;
+
+        do {
+            v = atomic_load_order(&tr->counter, ATOMIC_RELAXED);
+        } while (!atomic_cas(&tr->counter, v, v + 1, ATOMIC_RELAXED));
+
+        /* Exchange in a value unique to this thread and round, and sum
+         * whatever comes out.
+         */
+        seen += atomic_xchg(&tr->slot, i * THREADS + arg->index,
+                            ATOMIC_ACQ_REL);
+    }
+
+    tr->seen[arg->index] = seen;
+    return NULL;
+}
+
+static void test_rmw(void)
+{
+    static struct test_rmw tr;
+    struct rmw_arg args[THREADS];
+    pthread_t threads[THREADS];
+    unsigned long expected = 0, seen;
+
+    for (int i = 0; i < THREADS; i++) {
+        args[i].tr = &tr;
+        args[i].index = i;
+        assert(!pthread_create(&threads[i], NULL, rmw_worker, &args[i]));
+    }
+
+    for (int i = 0; i < THREADS; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tr.counter == (unsigned long) THREADS * RMW_ROUNDS);
+
+    for (unsigned long i = 1; i <= RMW_ROUNDS; i++)
+        for (int t = 0; t < THREADS; t++)
+            expected += i * THREADS + t;
+
+    seen = tr.slot;
+    for (int t = 0; t < THREADS; t++)
+        seen += tr.seen[t];
+
+    assert(seen == expected);
+}
+
+/* Locks built on the acquire and release orderings give mutual exclusion
+ * and make the data written in one critical section visible in the next.
+ * The protected data is deliberately accessed non-atomically.
+ */
+#define LOCK_ROUNDS 100000
+
+struct test_lock {
+    void (*lock)(struct test_lock *tl);
+    void (*unlock)(struct test_lock *tl);
+    skinny_mutex_t mutex;
+    skinny_sem_t sem;
+    skinny_bytelock_t bytelock;
+    uintptr_t bitlock;
+    long a, b;
+};
+
+static void *lock_thread(void *v_tl)
+{
+    struct test_lock *tl = v_tl;
+
+    for (int i = 0; i < LOCK_ROUNDS; i++) {
+        tl->lock(tl);
+        assert(tl->a == tl->b);
+        tl->a++;
+        tl->b++;
+        tl->unlock(tl);
+    }
+
+    return NULL;
+}
+
+static void do_test_lock(void (*lock)(struct test_lock *tl),
+                         void (*unlock)(struct test_lock *tl))
+{
+    struct test_lock tl = {.lock = lock, .unlock = unlock, .a = 0, .b = 0};
+    pthread_t threads[THREADS];
+
+    assert(!skinny_mutex_init(&tl.mutex));
+    assert(!skinny_sem_init(&tl.sem, 1));
+    skinny_bytelock_init(&tl.bytelock);
+    tl.bitlock = 0;
+
+    for (int i = 0; i < THREADS; i++)
+        assert(!pthread_create(&threads[i], NULL, lock_thread, &tl));
+
+    for (int i = 0; i < THREADS; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tl.a == (long) THREADS * LOCK_ROUNDS && tl.b == tl.a);
+    assert(!skinny_mutex_destroy(&tl.mutex));
+    assert(!skinny_sem_destroy(&tl.sem));
+}
+
+static void mutex_lock(struct test_lock *tl)
+{
+    assert(!skinny_mutex_lock(&tl->mutex));
+}
+
+static void mutex_unlock(struct test_lock *tl)
+{
+    assert(!skinny_mutex_unlock(&tl->mutex));
+}
+
+static void sem_lock(struct test_lock *tl)
+{
+    assert(!skinny_sem_wait(&tl->sem));
+}
+
+static void sem_unlock(struct test_lock *tl)
+{
+    assert(!skinny_sem_post(&tl->sem));
+}
+
+static void bytelock_lock(struct test_lock *tl)
+{
+    skinny_bytelock_lock(&tl->bytelock);
+}
+
+static void bytelock_unlock(struct test_lock *tl)
+{
+    skinny_bytelock_unlock(&tl->bytelock);
+}
+
+static void bitlock_lock(struct test_lock *tl)
+{
+    skinny_bitlock_lock(&tl->bitlock);
+}
+
+static void bitlock_unlock(struct test_lock *tl)
+{
+    skinny_bitlock_unlock(&tl->bitlock);
+}
+
+int main(void)
+{
+    test_message_passing();
+    test_store_buffering();
+    test_rmw();
+    do_test_lock(mutex_lock, mutex_unlock);
+    do_test_lock(sem_lock, sem_unlock);
+    do_test_lock(bytelock_lock, bytelock_unlock);
+    do_test_lock(bitlock_lock, bitlock_unlock);
+
+    return 0;
+}
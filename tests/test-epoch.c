@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "epoch.h"
+
+/* Wait a millisecond */
+static void delay(void)
+{
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    assert(!nanosleep(&ts, NULL));
+}
+
+struct object {
+    struct epoch_entry entry;
+    bool freed;
+    long value;
+};
+
+static void mark_freed(struct epoch_entry *entry)
+{
+    ((struct object *) entry)->freed = true;
+}
+
+static void test_defer(void)
+{
+    struct object obj = {.freed = false};
+
+    assert(!epoch_enter());
+    assert(!epoch_enter());
+    epoch_exit();
+    epoch_exit();
+
+    epoch_defer(&obj.entry, mark_freed);
+    epoch_synchronize();
+    assert(obj.freed);
+}
+
+struct test_reader {
+    bool entered;
+    bool exited;
+};
+
+static void *reader_thread(void *v_tr)
+{
+    struct test_reader *tr = v_tr;
+
+    assert(!epoch_enter());
+    __atomic_store_n(&tr->entered, true, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < 10; i++)
+        delay();
+    __atomic_store_n(&tr->exited, true, __ATOMIC_SEQ_CST);
+    epoch_exit();
+
+    return NULL;
+}
+
+/* A grace period waits for a section already in progress. */
+static void test_grace_period(void)
+{
+    struct test_reader tr = {.entered = false, .exited = false};
+    struct object obj = {.freed = false};
+    pthread_t thread;
+
+    assert(!pthread_create(&thread, NULL, reader_thread, &tr));
+    while (!__atomic_load_n(&tr.entered, __ATOMIC_SEQ_CST))
+        delay();
+
+    epoch_defer(&obj.entry, mark_freed);
+    epoch_synchronize();
+    assert(__atomic_load_n(&tr.exited, __ATOMIC_SEQ_CST));
+    assert(obj.freed);
+
+    assert(!pthread_join(thread, NULL));
+}
+
+static void *defer_and_exit_thread(void *v_obj)
+{
+    struct object *obj = v_obj;
+
+    epoch_defer(&obj->entry, mark_freed);
+    return NULL;
+}
+
+/* Entries deferred by a thread that exits are still reclaimed. */
+static void test_orphans(void)
+{
+    struct object obj = {.freed = false};
+    pthread_t thread;
+
+    assert(!pthread_create(&thread, NULL, defer_and_exit_thread, &obj));
+    assert(!pthread_join(thread, NULL));
+
+    epoch_synchronize();
+    assert(obj.freed);
+}
+
+#define STRESS_READERS 4
+#define STRESS_UPDATES 100000
+
+static struct object *shared;
+static bool stop;
+
+static void free_object(struct epoch_entry *entry)
+{
+    struct object *obj = (struct object *) entry;
+
+    /* Poison the object, so that readers notice if they can still see it */
+    obj->value = -1;
+    free(obj);
+}
+
+static void *stress_reader(void *dummy)
+{
+    (void) dummy;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        struct object *obj;
+
+        assert(!epoch_enter());
+        obj = __atomic_load_n(&shared, __ATOMIC_ACQUIRE);
+        assert(obj->value >= 0);
+        epoch_exit();
+    }
+
+    return NULL;
+}
+
+static void test_stress(void)
+{
+    pthread_t threads[STRESS_READERS];
+
+    shared = malloc(sizeof *shared);
+    assert(shared);
+    shared->value = 0;
+
+    for (int i = 0; i < STRESS_READERS; i++)
+        assert(!pthread_create(&threads[i], NULL, stress_reader, NULL));
+
+    for (long i = 1; i <= STRESS_UPDATES; i++) {
+        struct object *obj = malloc(sizeof *obj), *old;
+
+        assert(obj);
+        obj->value = i;
+        old = __atomic_exchange_n(&shared, obj, __ATOMIC_ACQ_REL);
+        epoch_defer(&old->entry, free_object);
+    }
+
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < STRESS_READERS; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    epoch_synchronize();
+    free(shared);
+}
+
+int main(void)
+{
+    test_defer();
+    test_grace_period();
+    test_orphans();
+    test_stress();
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "mcs_lock.h"
+
+/* Wait a millisecond */
+static void delay(void)
+{
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    assert(!nanosleep(&ts, NULL));
+}
+
+static void test_trylock(void)
+{
+    mcs_lock_t lock = MCS_LOCK_INITIALIZER;
+    struct mcs_node a, b;
+
+    assert(!mcs_lock_trylock(&lock, &a));
+    assert(mcs_lock_trylock(&lock, &b) == EBUSY);
+    assert(mcs_lock_destroy(&lock) == EBUSY);
+    mcs_unlock(&lock, &a);
+    assert(!mcs_lock_destroy(&lock));
+}
+
+struct test_contention {
+    mcs_lock_t lock;
+    bool held;
+    int count;
+};
+
+#define ITERATIONS 1000
+
+static void *contention_thread(void *v_tc)
+{
+    struct test_contention *tc = v_tc;
+    struct mcs_node node;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        mcs_lock(&tc->lock, &node);
+        assert(!tc->held);
+        tc->held = true;
+        if (!(i % 100))
+            delay();
+        tc->held = false;
+        tc->count++;
+        mcs_unlock(&tc->lock, &node);
+    }
+
+    return NULL;
+}
+
+static void test_contention(void)
+{
+    struct test_contention tc = {.held = false, .count = 0};
+    pthread_t threads[10];
+
+    mcs_lock_init(&tc.lock);
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_create(&threads[i], NULL, contention_thread, &tc));
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tc.count == 10 * ITERATIONS);
+    assert(!mcs_lock_destroy(&tc.lock));
+}
+
+struct test_fifo {
+    mcs_lock_t lock;
+    int next;
+    int order[10];
+};
+
+struct test_fifo_thread {
+    struct test_fifo *tf;
+    int index;
+};
+
+static void *fifo_thread(void *v_tft)
+{
+    struct test_fifo_thread *tft = v_tft;
+    struct test_fifo *tf = tft->tf;
+    struct mcs_node node;
+
+    mcs_lock(&tf->lock, &node);
+    tf->order[tf->next++] = tft->index;
+    mcs_unlock(&tf->lock, &node);
+
+    return NULL;
+}
+
+/* Waiters acquire the lock in the order they queued */
+static void test_fifo(void)
+{
+    struct test_fifo tf = {.next = 0};
+    struct test_fifo_thread tfts[10];
+    pthread_t threads[10];
+    struct mcs_node node;
+
+    mcs_lock_init(&tf.lock);
+    mcs_lock(&tf.lock, &node);
+
+    for (int i = 0; i < 10; i++) {
+        tfts[i].tf = &tf;
+        tfts[i].index = i;
+        assert(!pthread_create(&threads[i], NULL, fifo_thread, &tfts[i]));
+        delay();
+    }
+
+    mcs_unlock(&tf.lock, &node);
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    for (int i = 0; i < 10; i++)
+        assert(tf.order[i] == i);
+}
+
+int main(void)
+{
+    test_trylock();
+    test_contention();
+    test_fifo();
+
+    return 0;
+}
@@ -0,0 +1,210 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "parking_lot.h"
+
+/* Wait a millisecond */
+static void delay(void)
+{
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    assert(!nanosleep(&ts, NULL));
+}
+
+static bool validate_false(void *arg UNUSED)
+{
+    return false;
+}
+
+static void test_park_validate(void)
+{
+    int word = 0;
+
+    assert(parking_lot_park(&word, validate_false, NULL, NULL) == EAGAIN);
+    assert(parking_lot_unpark_one(&word, NULL, NULL) == 0);
+}
+
+static void test_park_timeout(void)
+{
+    int word = 0;
+    struct timespec t;
+
+    assert(!clock_gettime(CLOCK_REALTIME, &t));
+    t.tv_nsec += 1000000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_nsec -= 1000000000;
+        t.tv_sec++;
+    }
+
+    assert(parking_lot_park(&word, NULL, NULL, &t) == ETIMEDOUT);
+    assert(parking_lot_unpark_all(&word) == 0);
+}
+
+struct test_unpark {
+    int word;
+    int woken;
+    skinny_bytelock_t lock;
+};
+
+static void *park_thread(void *v_tu)
+{
+    struct test_unpark *tu = v_tu;
+
+    assert(!parking_lot_park(&tu->word, NULL, NULL, NULL));
+    skinny_bytelock_lock(&tu->lock);
+    tu->woken++;
+    skinny_bytelock_unlock(&tu->lock);
+    return NULL;
+}
+
+static void test_unpark(void)
+{
+    struct test_unpark tu = {.woken = 0};
+    pthread_t threads[4];
+    int i, woken;
+
+    skinny_bytelock_init(&tu.lock);
+
+    for (i = 0; i < 4; i++)
+        assert(!pthread_create(&threads[i], NULL, park_thread, &tu));
+
+    /* Keep prodding until all four threads have parked and been woken. */
+    woken = 0;
+    while (woken < 4) {
+        delay();
+        woken += parking_lot_unpark_one(&tu.word, NULL, NULL);
+    }
+
+    for (i = 0; i < 4; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tu.woken == 4);
+
+    for (i = 0; i < 4; i++)
+        assert(!pthread_create(&threads[i], NULL, park_thread, &tu));
+
+    woken = 0;
+    while (woken < 4) {
+        delay();
+        woken += parking_lot_unpark_all(&tu.word);
+    }
+
+    for (i = 0; i < 4; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tu.woken == 8);
+}
+
+struct test_contention {
+    skinny_bytelock_t bytelocks[3];
+    uintptr_t bitlock;
+    bool held;
+    int count;
+};
+
+#define ITERATIONS 1000
+
+static void *bytelock_thread(void *v_tc)
+{
+    struct test_contention *tc = v_tc;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        skinny_bytelock_lock(&tc->bytelocks[1]);
+        assert(!tc->held);
+        tc->held = true;
+        if (!(i % 100))
+            delay();
+        tc->held = false;
+        tc->count++;
+        skinny_bytelock_unlock(&tc->bytelocks[1]);
+    }
+
+    return NULL;
+}
+
+static void test_bytelock_contention(void)
+{
+    struct test_contention tc = {.held = false, .count = 0};
+    pthread_t threads[10];
+
+    for (int i = 0; i < 3; i++)
+        skinny_bytelock_init(&tc.bytelocks[i]);
+
+    /* Neighbouring bytes must be left alone */
+    tc.bytelocks[0].val = 0xf0;
+    tc.bytelocks[2].val = 0xf0;
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_create(&threads[i], NULL, bytelock_thread, &tc));
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tc.count == 10 * ITERATIONS);
+    assert(tc.bytelocks[0].val == 0xf0);
+    assert(tc.bytelocks[1].val == 0);
+    assert(tc.bytelocks[2].val == 0xf0);
+}
+
+static void test_bytelock_trylock(void)
+{
+    skinny_bytelock_t lock = SKINNY_BYTELOCK_INITIALIZER;
+
+    assert(!skinny_bytelock_trylock(&lock));
+    assert(skinny_bytelock_trylock(&lock) == EBUSY);
+    skinny_bytelock_unlock(&lock);
+    assert(!skinny_bytelock_trylock(&lock));
+    skinny_bytelock_unlock(&lock);
+    assert(lock.val == 0);
+}
+
+static void *bitlock_thread(void *v_tc)
+{
+    struct test_contention *tc = v_tc;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        skinny_bitlock_lock(&tc->bitlock);
+        assert(!tc->held);
+        assert(skinny_bitlock_ptr(&tc->bitlock) == &tc->count);
+        tc->held = true;
+        if (!(i % 100))
+            delay();
+        tc->held = false;
+        tc->count++;
+        skinny_bitlock_unlock(&tc->bitlock);
+    }
+
+    return NULL;
+}
+
+static void test_bitlock_contention(void)
+{
+    struct test_contention tc = {.held = false, .count = 0, .bitlock = 0};
+    pthread_t threads[10];
+
+    skinny_bitlock_lock(&tc.bitlock);
+    skinny_bitlock_set_ptr(&tc.bitlock, &tc.count);
+    skinny_bitlock_unlock(&tc.bitlock);
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_create(&threads[i], NULL, bitlock_thread, &tc));
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tc.count == 10 * ITERATIONS);
+    assert(tc.bitlock == (uintptr_t) &tc.count);
+}
+
+int main(void)
+{
+    test_park_validate();
+    test_park_timeout();
+    test_unpark();
+    test_bytelock_trylock();
+    test_bytelock_contention();
+    test_bitlock_contention();
+
+    return 0;
+}
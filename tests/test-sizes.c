@@ -0,0 +1,42 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "epoch.h"
+#include "mcs_lock.h"
+#include "parking_lot.h"
+#include "skinny_mutex.h"
+#include "skinny_pi_mutex.h"
+#include "skinny_sync.h"
+#include "tasklet.h"
+
+/* Report the sizes of the public structures, and check the ones that are
+ * embedded by the million: a struct mutex is one word, and a struct tasklet
+ * ten.
+ */
+#define REPORT(type) printf("  %-24s %3zu\n", #type, sizeof(type))
+
+int main(void)
+{
+    REPORT(skinny_mutex_t);
+    REPORT(skinny_pi_mutex_t);
+    REPORT(skinny_sem_t);
+    REPORT(skinny_barrier_t);
+    REPORT(skinny_once_t);
+    REPORT(skinny_bytelock_t);
+    REPORT(mcs_lock_t);
+    REPORT(struct epoch_entry);
+    REPORT(struct mutex);
+    REPORT(struct cond);
+    REPORT(struct tasklet);
+    REPORT(struct wait_list);
+    REPORT(struct tasklet_fd);
+    REPORT(struct tasklet_timer);
+    REPORT(struct tasklet_io);
+
+#ifndef SKINNY_MUTEX_ERRORCHECK
+    assert(sizeof(struct mutex) == sizeof(void *));
+    assert(sizeof(struct tasklet) <= 10 * sizeof(void *));
+#endif
+
+    return 0;
+}
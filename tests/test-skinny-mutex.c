@@ -1,16 +1,32 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include "skinny_mutex.h"
 
+/* Whether the do_test_* harnesses should use fair mutexes */
+static bool fair;
+
+static int init_mutex(skinny_mutex_t *mutex)
+{
+    return fair ? skinny_mutex_init_fair(mutex) : skinny_mutex_init(mutex);
+}
+
 static void test_static_mutex(void)
 {
     static skinny_mutex_t static_mutex = SKINNY_MUTEX_INITIALIZER;
+    static skinny_mutex_t static_fair_mutex = SKINNY_MUTEX_FAIR_INITIALIZER;
 
     assert(!skinny_mutex_lock(&static_mutex));
     assert(!skinny_mutex_unlock(&static_mutex));
     assert(!skinny_mutex_destroy(&static_mutex));
+
+    assert(!skinny_mutex_lock(&static_fair_mutex));
+    assert(skinny_mutex_destroy(&static_fair_mutex) == EBUSY);
+    assert(!skinny_mutex_unlock(&static_fair_mutex));
+    assert(!skinny_mutex_destroy(&static_fair_mutex));
 }
 
 static void test_lock_unlock(skinny_mutex_t *mutex)
@@ -219,11 +235,205 @@ static void test_unlock_not_held(skinny_mutex_t *mutex)
     assert(skinny_mutex_unlock(mutex) == EPERM);
 }
 
+struct test_fifo {
+    skinny_mutex_t *mutex;
+    int next;
+    int order[10];
+};
+
+struct test_fifo_thread {
+    struct test_fifo *tf;
+    int index;
+};
+
+static void *fifo_thread(void *v_tft)
+{
+    struct test_fifo_thread *tft = v_tft;
+    struct test_fifo *tf = tft->tf;
+
+    assert(!skinny_mutex_lock(tf->mutex));
+    tf->order[tf->next++] = tft->index;
+    assert(!skinny_mutex_unlock(tf->mutex));
+
+    return NULL;
+}
+
+/* Fair mutexes are acquired in the order that threads started waiting. */
+static void test_fair_fifo(skinny_mutex_t *mutex)
+{
+    struct test_fifo tf = {.mutex = mutex, .next = 0};
+    struct test_fifo_thread tfts[10];
+    pthread_t threads[10];
+
+    assert(!skinny_mutex_lock(mutex));
+
+    for (int i = 0; i < 10; i++) {
+        tfts[i].tf = &tf;
+        tfts[i].index = i;
+        assert(!pthread_create(&threads[i], NULL, fifo_thread, &tfts[i]));
+        delay();
+    }
+
+    assert(!skinny_mutex_unlock(mutex));
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    for (int i = 0; i < 10; i++)
+        assert(tf.order[i] == i);
+}
+
+/* A fair mutex cannot be immediately retaken by the thread releasing it
+   when another thread is waiting. */
+static void test_fair_no_barging(skinny_mutex_t *mutex)
+{
+    struct test_fifo tf = {.mutex = mutex, .next = 0};
+    struct test_fifo_thread tft = {.tf = &tf, .index = 0};
+    pthread_t thread;
+
+    assert(!skinny_mutex_lock(mutex));
+    assert(!pthread_create(&thread, NULL, fifo_thread, &tft));
+    delay();
+    assert(!skinny_mutex_unlock(mutex));
+    assert(!skinny_mutex_lock(mutex));
+    assert(tf.next == 1);
+    assert(!skinny_mutex_unlock(mutex));
+    assert(!pthread_join(thread, NULL));
+}
+
+/* Contended acquisitions show up in the profile report */
+static void test_profile(skinny_mutex_t *mutex)
+{
+    FILE *f = tmpfile();
+    char report[4096], addr[32];
+    size_t len;
+
+    assert(f);
+    skinny_mutex_profile_reset();
+    assert(skinny_mutex_profile_start(0) == EINVAL);
+    assert(!skinny_mutex_profile_start(1));
+    test_contention(mutex);
+    skinny_mutex_profile_stop();
+
+    assert(skinny_mutex_profile_report(fileno(f), 5) > 0);
+    rewind(f);
+    len = fread(report, 1, sizeof report - 1, f);
+    report[len] = 0;
+    fclose(f);
+
+    snprintf(addr, sizeof addr, "%p", (void *) mutex);
+    assert(strstr(report, addr));
+}
+
+#ifdef SKINNY_MUTEX_ERRORCHECK
+/* Relocking a mutex held by the calling thread is reported */
+static void test_relock(skinny_mutex_t *mutex)
+{
+    assert(!skinny_mutex_held_by_self(mutex));
+    assert(!skinny_mutex_lock(mutex));
+    assert(skinny_mutex_held_by_self(mutex));
+    assert(skinny_mutex_lock(mutex) == EDEADLK);
+    assert(skinny_mutex_trylock(mutex) == EBUSY);
+    assert(!skinny_mutex_unlock(mutex));
+    assert(!skinny_mutex_held_by_self(mutex));
+}
+
+static void *not_owner_thread(void *v_mutex)
+{
+    skinny_mutex_t *mutex = v_mutex;
+    pthread_cond_t cond;
+
+    assert(!pthread_cond_init(&cond, NULL));
+    assert(!skinny_mutex_held_by_self(mutex));
+    assert(skinny_mutex_unlock(mutex) == EPERM);
+    assert(skinny_mutex_cond_wait(&cond, mutex) == EPERM);
+    assert(skinny_mutex_veto_transfer(mutex) == EPERM);
+    assert(!pthread_cond_destroy(&cond));
+    return NULL;
+}
+
+/* Releasing a mutex held by another thread is reported */
+static void test_not_owner(skinny_mutex_t *mutex)
+{
+    pthread_t thread;
+
+    assert(!skinny_mutex_lock(mutex));
+    assert(!pthread_create(&thread, NULL, not_owner_thread, mutex));
+    assert(!pthread_join(thread, NULL));
+    assert(skinny_mutex_held_by_self(mutex));
+    assert(!skinny_mutex_unlock(mutex));
+}
+
+static skinny_mutex_t *inversion_held, *inversion_acquired;
+static int inversions;
+
+static void count_inversion(skinny_mutex_t *held, skinny_mutex_t *acquired)
+{
+    inversion_held = held;
+    inversion_acquired = acquired;
+    inversions++;
+}
+
+static void lock_pair(skinny_mutex_t *a, skinny_mutex_t *b)
+{
+    assert(!skinny_mutex_lock(a));
+    assert(!skinny_mutex_lock(b));
+    assert(!skinny_mutex_unlock(b));
+    assert(!skinny_mutex_unlock(a));
+}
+
+/* Acquiring locks in inconsistent orders is reported, even though no
+   deadlock happens. */
+static void test_lock_order(void)
+{
+    skinny_mutex_t a, b, c;
+
+    assert(!skinny_mutex_init(&a));
+    assert(!skinny_mutex_init(&b));
+    assert(!skinny_mutex_init(&c));
+    skinny_mutex_set_inversion_handler(count_inversion);
+
+    lock_pair(&a, &b);
+    lock_pair(&b, &c);
+    lock_pair(&a, &c);
+    assert(inversions == 0);
+
+    /* trylock cannot deadlock, so it does not count */
+    assert(!skinny_mutex_lock(&c));
+    assert(!skinny_mutex_trylock(&a));
+    assert(!skinny_mutex_unlock(&a));
+    assert(!skinny_mutex_unlock(&c));
+    assert(inversions == 0);
+
+    /* c -> a closes the cycle a -> b -> c -> a */
+    lock_pair(&c, &a);
+    assert(inversions == 1);
+    assert(inversion_held == &c && inversion_acquired == &a);
+
+    /* Each inversion is only reported once */
+    lock_pair(&c, &a);
+    assert(inversions == 1);
+
+    /* Destroying a mutex forgets its ordering */
+    assert(!skinny_mutex_destroy(&b));
+    assert(!skinny_mutex_init(&b));
+    lock_pair(&b, &a);
+    assert(inversions == 1);
+    lock_pair(&c, &b);
+    assert(inversions == 2);
+
+    skinny_mutex_set_inversion_handler(NULL);
+    assert(!skinny_mutex_destroy(&a));
+    assert(!skinny_mutex_destroy(&b));
+    assert(!skinny_mutex_destroy(&c));
+}
+#endif
+
 static void do_test_simple(void (*f)(skinny_mutex_t *m))
 {
     skinny_mutex_t mutex;
 
-    assert(!skinny_mutex_init(&mutex));
+    assert(!init_mutex(&mutex));
     f(&mutex);
     assert(!skinny_mutex_destroy(&mutex));
 }
@@ -259,7 +469,7 @@ static void do_test_cond_wait(void (*f)(skinny_mutex_t *m))
     struct do_test_cond dt;
     pthread_t thread;
 
-    assert(!skinny_mutex_init(&dt.mutex));
+    assert(!init_mutex(&dt.mutex));
     assert(!pthread_cond_init(&dt.cond, NULL));
     dt.phase = 0;
     assert(!pthread_create(&thread, NULL, do_test_cond_thread, &dt));
@@ -303,7 +513,7 @@ static void do_test_hammer(void (*f)(skinny_mutex_t *m))
     pthread_t threads[10];
     int i;
 
-    assert(!skinny_mutex_init(&mutex));
+    assert(!init_mutex(&mutex));
 
     for (i = 0; i < 10; i++)
         assert(
@@ -342,6 +552,28 @@ int main(void)
     do_test(test_cond_timedwait, 1);
     do_test(test_cond_wait_cancellation, 1);
     do_test(test_unlock_not_held, 0);
+    do_test(test_profile, 0);
+#ifdef SKINNY_MUTEX_ERRORCHECK
+    do_test(test_relock, 1);
+    do_test(test_not_owner, 1);
+    test_lock_order();
+#endif
+
+    fair = true;
+    do_test(test_lock_unlock, 1);
+    do_test(test_contention, 1);
+    do_test(test_lock_cancellation, 1);
+    do_test(test_trylock, 0);
+    do_test(test_cond_wait, 1);
+    do_test(test_cond_timedwait, 1);
+    do_test(test_cond_wait_cancellation, 1);
+    do_test(test_unlock_not_held, 0);
+    do_test(test_fair_fifo, 0);
+    do_test(test_fair_no_barging, 0);
+#ifdef SKINNY_MUTEX_ERRORCHECK
+    do_test(test_relock, 1);
+    do_test(test_not_owner, 1);
+#endif
 
     return 0;
 }
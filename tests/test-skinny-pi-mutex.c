@@ -0,0 +1,293 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "skinny_pi_mutex.h"
+
+/* Wait a millisecond */
+static void delay(void)
+{
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    assert(!nanosleep(&ts, NULL));
+}
+
+static void *unlock_thread(void *v_m)
+{
+    skinny_pi_mutex_t *m = v_m;
+    assert(skinny_pi_mutex_unlock(m) == EPERM);
+    assert(skinny_pi_mutex_trylock(m) == EBUSY);
+    return NULL;
+}
+
+static void test_errors(void)
+{
+    skinny_pi_mutex_t m = SKINNY_PI_MUTEX_INITIALIZER;
+    pthread_t thread;
+
+    assert(skinny_pi_mutex_unlock(&m) == EPERM);
+    assert(!skinny_pi_mutex_lock(&m));
+    assert(skinny_pi_mutex_lock(&m) == EDEADLK);
+    assert(skinny_pi_mutex_destroy(&m) == EBUSY);
+
+    assert(!pthread_create(&thread, NULL, unlock_thread, &m));
+    assert(!pthread_join(thread, NULL));
+
+    assert(!skinny_pi_mutex_unlock(&m));
+    assert(!skinny_pi_mutex_trylock(&m));
+    assert(!skinny_pi_mutex_unlock(&m));
+    assert(!skinny_pi_mutex_destroy(&m));
+}
+
+struct test_contention {
+    skinny_pi_mutex_t mutex;
+    bool held;
+    int count;
+};
+
+static void *bump(void *v_tc)
+{
+    struct test_contention *tc = v_tc;
+
+    assert(!skinny_pi_mutex_lock(&tc->mutex));
+    assert(!tc->held);
+    tc->held = true;
+    delay();
+    tc->held = false;
+    tc->count++;
+    assert(!skinny_pi_mutex_unlock(&tc->mutex));
+
+    return NULL;
+}
+
+static void test_contention(void)
+{
+    struct test_contention tc = {.held = false, .count = 0};
+    pthread_t threads[10];
+
+    assert(!skinny_pi_mutex_init(&tc.mutex));
+    assert(!skinny_pi_mutex_lock(&tc.mutex));
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_create(&threads[i], NULL, bump, &tc));
+
+    delay();
+    assert(!skinny_pi_mutex_unlock(&tc.mutex));
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tc.count == 10);
+    assert(!skinny_pi_mutex_destroy(&tc.mutex));
+}
+
+struct test_cond_wait {
+    skinny_pi_mutex_t mutex;
+    skinny_pi_cond_t cond;
+    int phase;
+    int woken;
+};
+
+static void *cond_wait_thread(void *v_tcw)
+{
+    struct test_cond_wait *tcw = v_tcw;
+
+    assert(!skinny_pi_mutex_lock(&tcw->mutex));
+    while (!tcw->phase)
+        assert(!skinny_pi_mutex_cond_wait(&tcw->cond, &tcw->mutex));
+    tcw->woken++;
+    assert(!skinny_pi_mutex_unlock(&tcw->mutex));
+
+    return NULL;
+}
+
+static void test_cond_wait(bool broadcast)
+{
+    struct test_cond_wait tcw = {.phase = 0, .woken = 0};
+    pthread_t threads[4];
+
+    assert(!skinny_pi_mutex_init(&tcw.mutex));
+    assert(!skinny_pi_cond_init(&tcw.cond));
+
+    for (int i = 0; i < 4; i++)
+        assert(!pthread_create(&threads[i], NULL, cond_wait_thread, &tcw));
+
+    delay();
+    assert(!skinny_pi_mutex_lock(&tcw.mutex));
+    tcw.phase = 1;
+    if (broadcast) {
+        assert(!skinny_pi_cond_broadcast(&tcw.cond));
+    } else {
+        for (int i = 0; i < 4; i++)
+            assert(!skinny_pi_cond_signal(&tcw.cond));
+    }
+    assert(!skinny_pi_mutex_unlock(&tcw.mutex));
+
+    for (int i = 0; i < 4; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(tcw.woken == 4);
+    assert(!skinny_pi_mutex_destroy(&tcw.mutex));
+    assert(!skinny_pi_cond_destroy(&tcw.cond));
+}
+
+static void test_cond_timedwait(void)
+{
+    skinny_pi_mutex_t m = SKINNY_PI_MUTEX_INITIALIZER;
+    skinny_pi_cond_t cond = SKINNY_PI_COND_INITIALIZER;
+    struct timespec t;
+
+    assert(!clock_gettime(CLOCK_REALTIME, &t));
+    t.tv_nsec += 1000000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_nsec -= 1000000000;
+        t.tv_sec++;
+    }
+
+    assert(!skinny_pi_mutex_lock(&m));
+    assert(skinny_pi_mutex_cond_timedwait(&cond, &m, &t) == ETIMEDOUT);
+    assert(!skinny_pi_mutex_unlock(&m));
+    assert(!skinny_pi_mutex_destroy(&m));
+}
+
+/*
+ * The classic priority inversion: a low priority thread holds the mutex, a
+ * high priority thread blocks on it, and a medium priority thread hogs the
+ * CPU.  All three are confined to one CPU.  Without priority inheritance the
+ * high priority thread waits for the medium priority thread to finish.  With
+ * it, the low priority thread is boosted past the medium priority thread and
+ * releases the mutex promptly.
+ */
+struct test_inversion {
+    skinny_pi_mutex_t mutex;
+    volatile bool low_locked;
+    volatile bool medium_started;
+    volatile bool medium_done;
+    bool medium_done_when_acquired;
+};
+
+static double now(clockid_t clock)
+{
+    struct timespec ts;
+    assert(!clock_gettime(clock, &ts));
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void spin(clockid_t clock, double seconds)
+{
+    double end = now(clock) + seconds;
+    while (now(clock) < end)
+        ;
+}
+
+static void *inversion_low(void *v_ti)
+{
+    struct test_inversion *ti = v_ti;
+
+    assert(!skinny_pi_mutex_lock(&ti->mutex));
+    ti->low_locked = true;
+
+    while (!ti->medium_started)
+        delay();
+
+    /* 10ms of work, counted only while we are actually on the CPU. */
+    spin(CLOCK_THREAD_CPUTIME_ID, 0.01);
+    assert(!skinny_pi_mutex_unlock(&ti->mutex));
+
+    return NULL;
+}
+
+static void *inversion_medium(void *v_ti)
+{
+    struct test_inversion *ti = v_ti;
+
+    ti->medium_started = true;
+    spin(CLOCK_MONOTONIC, 0.2);
+    ti->medium_done = true;
+
+    return NULL;
+}
+
+static void *inversion_high(void *v_ti)
+{
+    struct test_inversion *ti = v_ti;
+
+    assert(!skinny_pi_mutex_lock(&ti->mutex));
+    ti->medium_done_when_acquired = ti->medium_done;
+    assert(!skinny_pi_mutex_unlock(&ti->mutex));
+
+    return NULL;
+}
+
+static int create_fifo_thread(pthread_t *thread,
+                              int priority,
+                              void *(*func)(void *),
+                              void *arg)
+{
+    pthread_attr_t attr;
+    struct sched_param param = {.sched_priority = priority};
+    cpu_set_t cpus;
+    int res;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+
+    assert(!pthread_attr_init(&attr));
+    assert(!pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED));
+    assert(!pthread_attr_setschedpolicy(&attr, SCHED_FIFO));
+    assert(!pthread_attr_setschedparam(&attr, &param));
+    assert(!pthread_attr_setaffinity_np(&attr, sizeof cpus, &cpus));
+    res = pthread_create(thread, &attr, func, arg);
+    assert(!pthread_attr_destroy(&attr));
+
+    return res;
+}
+
+static void test_priority_inversion(void)
+{
+    struct test_inversion ti = {
+        .low_locked = false,
+        .medium_started = false,
+        .medium_done = false,
+    };
+    pthread_t low, medium, high;
+    int res;
+
+    assert(!skinny_pi_mutex_init(&ti.mutex));
+
+    res = create_fifo_thread(&low, 10, inversion_low, &ti);
+    if (res == EPERM) {
+        fprintf(stderr, "no permission for SCHED_FIFO, "
+                        "skipping priority inversion test\n");
+        return;
+    }
+    assert(!res);
+
+    while (!ti.low_locked)
+        delay();
+
+    assert(!create_fifo_thread(&high, 30, inversion_high, &ti));
+    delay();
+    assert(!create_fifo_thread(&medium, 20, inversion_medium, &ti));
+
+    assert(!pthread_join(high, NULL));
+    assert(!pthread_join(medium, NULL));
+    assert(!pthread_join(low, NULL));
+
+    assert(!ti.medium_done_when_acquired);
+    assert(!skinny_pi_mutex_destroy(&ti.mutex));
+}
+
+int main(void)
+{
+    test_errors();
+    test_contention();
+    test_cond_wait(false);
+    test_cond_wait(true);
+    test_cond_timedwait();
+    test_priority_inversion();
+
+    return 0;
+}
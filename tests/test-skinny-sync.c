@@ -0,0 +1,327 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "skinny_sync.h"
+
+/* Wait a millisecond */
+static void delay(void)
+{
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    assert(!nanosleep(&ts, NULL));
+}
+
+/* Has the word of a primitive returned to a thin value? */
+static bool deflated(void *val)
+{
+    return ((uintptr_t) val & 3) || !val;
+}
+
+static void test_sem_simple(void)
+{
+    static skinny_sem_t static_sem = SKINNY_SEM_INITIALIZER(2);
+    skinny_sem_t sem;
+    int value;
+
+    assert(!skinny_sem_trywait(&static_sem));
+    assert(!skinny_sem_wait(&static_sem));
+    assert(skinny_sem_trywait(&static_sem) == EAGAIN);
+    assert(!skinny_sem_destroy(&static_sem));
+
+    assert(skinny_sem_init(&sem, (unsigned int) SKINNY_SEM_VALUE_MAX + 1) ==
+           EINVAL);
+    assert(!skinny_sem_init(&sem, 0));
+    assert(!skinny_sem_getvalue(&sem, &value));
+    assert(value == 0);
+    assert(skinny_sem_trywait(&sem) == EAGAIN);
+    assert(!skinny_sem_post(&sem));
+    assert(!skinny_sem_post(&sem));
+    assert(!skinny_sem_getvalue(&sem, &value));
+    assert(value == 2);
+    assert(!skinny_sem_wait(&sem));
+    assert(!skinny_sem_trywait(&sem));
+    assert(skinny_sem_trywait(&sem) == EAGAIN);
+    assert(!skinny_sem_destroy(&sem));
+
+    assert(!skinny_sem_init(&sem, SKINNY_SEM_VALUE_MAX));
+    assert(skinny_sem_post(&sem) == EOVERFLOW);
+    assert(!skinny_sem_destroy(&sem));
+}
+
+struct test_sem {
+    skinny_sem_t items;
+    skinny_sem_t spaces;
+    int buf[4];
+    int count;
+};
+
+#define SEM_ITEMS 10000
+
+static void *sem_producer(void *v_ts)
+{
+    struct test_sem *ts = v_ts;
+
+    for (int i = 0; i < SEM_ITEMS; i++) {
+        assert(!skinny_sem_wait(&ts->spaces));
+        ts->buf[i % 4] = i;
+        assert(!skinny_sem_post(&ts->items));
+    }
+
+    return NULL;
+}
+
+static void test_sem_producer_consumer(void)
+{
+    struct test_sem ts;
+    pthread_t thread;
+
+    assert(!skinny_sem_init(&ts.items, 0));
+    assert(!skinny_sem_init(&ts.spaces, 4));
+
+    assert(!pthread_create(&thread, NULL, sem_producer, &ts));
+
+    for (int i = 0; i < SEM_ITEMS; i++) {
+        assert(!skinny_sem_wait(&ts.items));
+        assert(ts.buf[i % 4] == i);
+        assert(!skinny_sem_post(&ts.spaces));
+    }
+
+    assert(!pthread_join(thread, NULL));
+
+    /* Nobody is blocked, so both words should be thin again */
+    assert(deflated(ts.items.val));
+    assert(deflated(ts.spaces.val));
+    assert(!skinny_sem_destroy(&ts.items));
+    assert(!skinny_sem_destroy(&ts.spaces));
+}
+
+static void *sem_count_thread(void *v_ts)
+{
+    struct test_sem *ts = v_ts;
+
+    for (int i = 0; i < SEM_ITEMS; i++) {
+        /* The semaphore acts as a mutex here */
+        assert(!skinny_sem_wait(&ts->items));
+        ts->count++;
+        assert(!skinny_sem_post(&ts->items));
+    }
+
+    return NULL;
+}
+
+static void test_sem_contention(void)
+{
+    struct test_sem ts = {.items = SKINNY_SEM_INITIALIZER(1), .count = 0};
+    pthread_t threads[4];
+    int value;
+
+    for (int i = 0; i < 4; i++)
+        assert(!pthread_create(&threads[i], NULL, sem_count_thread, &ts));
+
+    for (int i = 0; i < 4; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(ts.count == 4 * SEM_ITEMS);
+    assert(!skinny_sem_getvalue(&ts.items, &value));
+    assert(value == 1);
+    assert(!skinny_sem_destroy(&ts.items));
+}
+
+static void test_sem_timedwait(void)
+{
+    skinny_sem_t sem = SKINNY_SEM_INITIALIZER(0);
+    struct timespec t;
+
+    assert(!clock_gettime(CLOCK_REALTIME, &t));
+
+    t.tv_nsec += 1000000;
+    if (t.tv_nsec > 1000000000) {
+        t.tv_nsec -= 1000000000;
+        t.tv_sec++;
+    }
+
+    assert(skinny_sem_timedwait(&sem, &t) == ETIMEDOUT);
+    assert(!skinny_sem_post(&sem));
+    assert(!skinny_sem_timedwait(&sem, &t));
+    assert(!skinny_sem_destroy(&sem));
+}
+
+static void *sem_wait_thread(void *v_sem)
+{
+    assert(!skinny_sem_wait(v_sem));
+    return NULL;
+}
+
+static void test_sem_wait_cancellation(void)
+{
+    skinny_sem_t sem = SKINNY_SEM_INITIALIZER(0);
+    pthread_t thread;
+    void *retval;
+
+    assert(!pthread_create(&thread, NULL, sem_wait_thread, &sem));
+
+    delay();
+    assert(skinny_sem_destroy(&sem) == EBUSY);
+    assert(!pthread_cancel(thread));
+    assert(!pthread_join(thread, &retval));
+    assert(retval == PTHREAD_CANCELED);
+
+    /* The cancelled waiter should have dropped its reference */
+    assert(!skinny_sem_destroy(&sem));
+
+    /* And the semaphore still works */
+    assert(!pthread_create(&thread, NULL, sem_wait_thread, &sem));
+    delay();
+    assert(!skinny_sem_post(&sem));
+    assert(!pthread_join(thread, &retval));
+    assert(retval == NULL);
+    assert(!skinny_sem_destroy(&sem));
+}
+
+#define BARRIER_THREADS 8
+#define BARRIER_ROUNDS 1000
+
+struct test_barrier {
+    skinny_barrier_t barrier;
+    int arrived[BARRIER_ROUNDS];
+    int serial[BARRIER_ROUNDS];
+};
+
+static void *barrier_thread(void *v_tb)
+{
+    struct test_barrier *tb = v_tb;
+
+    for (int i = 0; i < BARRIER_ROUNDS; i++) {
+        int res;
+
+        __atomic_add_fetch(&tb->arrived[i], 1, __ATOMIC_RELAXED);
+        res = skinny_barrier_wait(&tb->barrier);
+        assert(res == 0 || res == SKINNY_BARRIER_SERIAL_THREAD);
+
+        /* Everyone has arrived in this round */
+        assert(tb->arrived[i] == BARRIER_THREADS);
+        if (res == SKINNY_BARRIER_SERIAL_THREAD)
+            __atomic_add_fetch(&tb->serial[i], 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static void test_barrier(void)
+{
+    static struct test_barrier tb;
+    pthread_t threads[BARRIER_THREADS];
+
+    assert(skinny_barrier_init(&tb.barrier, 0) == EINVAL);
+    assert(!skinny_barrier_init(&tb.barrier, BARRIER_THREADS));
+
+    for (int i = 0; i < BARRIER_THREADS; i++)
+        assert(!pthread_create(&threads[i], NULL, barrier_thread, &tb));
+
+    for (int i = 0; i < BARRIER_THREADS; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    for (int i = 0; i < BARRIER_ROUNDS; i++)
+        assert(tb.serial[i] == 1);
+
+    assert(!skinny_barrier_destroy(&tb.barrier));
+}
+
+static void test_barrier_single(void)
+{
+    skinny_barrier_t barrier = SKINNY_BARRIER_INITIALIZER(1);
+
+    assert(skinny_barrier_wait(&barrier) == SKINNY_BARRIER_SERIAL_THREAD);
+    assert(skinny_barrier_wait(&barrier) == SKINNY_BARRIER_SERIAL_THREAD);
+    assert(!skinny_barrier_destroy(&barrier));
+}
+
+static skinny_once_t once = SKINNY_ONCE_INIT;
+static int once_calls;
+
+static void once_init(void)
+{
+    once_calls++;
+    delay();
+}
+
+static void *once_thread(void *dummy)
+{
+    (void) dummy;
+    assert(!skinny_once(&once, once_init));
+    assert(once_calls == 1);
+    return NULL;
+}
+
+static void test_once(void)
+{
+    pthread_t threads[10];
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_create(&threads[i], NULL, once_thread, NULL));
+
+    for (int i = 0; i < 10; i++)
+        assert(!pthread_join(threads[i], NULL));
+
+    assert(once_calls == 1);
+    assert(once.val == (void *) SKINNY_ONCE_DONE);
+}
+
+static skinny_once_t cancel_once = SKINNY_ONCE_INIT;
+static int cancel_once_calls;
+
+static void cancel_once_init(void)
+{
+    /* The first call blocks until it is cancelled */
+    if (cancel_once_calls++ == 0)
+        for (;;)
+            delay();
+}
+
+static void *cancel_once_thread(void *dummy)
+{
+    (void) dummy;
+    assert(!skinny_once(&cancel_once, cancel_once_init));
+    return NULL;
+}
+
+static void test_once_cancellation(void)
+{
+    pthread_t first, second;
+    void *retval;
+
+    assert(!pthread_create(&first, NULL, cancel_once_thread, NULL));
+    delay();
+
+    /* The second thread waits for the first to finish */
+    assert(!pthread_create(&second, NULL, cancel_once_thread, NULL));
+    delay();
+    assert(cancel_once_calls == 1);
+
+    /* Cancelling the first lets the second run the routine */
+    assert(!pthread_cancel(first));
+    assert(!pthread_join(first, &retval));
+    assert(retval == PTHREAD_CANCELED);
+    assert(!pthread_join(second, &retval));
+    assert(retval == NULL);
+
+    assert(cancel_once_calls == 2);
+    assert(cancel_once.val == (void *) SKINNY_ONCE_DONE);
+}
+
+int main(void)
+{
+    test_sem_simple();
+    test_sem_producer_consumer();
+    test_sem_contention();
+    test_sem_timedwait();
+    test_sem_wait_cancellation();
+    test_barrier();
+    test_barrier_single();
+    test_once();
+    test_once_cancellation();
+
+    return 0;
+}
@@ -1,6 +1,14 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "atomics.h"
 #include "tasklet.h"
 
 struct test_tasklet {
@@ -18,12 +26,28 @@ void test_tasklet_wait(void *v_tt)
         tt->got++;
 }
 
+/* Initialize a tasklet guarded by its own mutex. */
+static void test_tasklet_init(struct mutex *mutex, struct tasklet *tasklet,
+                              void *data)
+{
+    mutex_init(mutex);
+    tasklet_init(tasklet, mutex, data);
+}
+
+/* Finalize a tasklet set up by test_tasklet_init.  The caller holds the
+   mutex, and has already finalized anything else that refers to the
+   tasklet, such as its timers. */
+static void test_tasklet_fini(struct mutex *mutex, struct tasklet *tasklet)
+{
+    tasklet_fini(tasklet);
+    mutex_unlock_fini(mutex);
+}
+
 struct test_tasklet *test_tasklet_create(struct wait_list *sema)
 {
     struct test_tasklet *tt = malloc(sizeof *tt);
 
-    mutex_init(&tt->mutex);
-    tasklet_init(&tt->tasklet, &tt->mutex, tt);
+    test_tasklet_init(&tt->mutex, &tt->tasklet, tt);
     tt->sema = sema;
     tt->got = 0;
 
@@ -37,8 +61,7 @@ struct test_tasklet *test_tasklet_create(struct wait_list *sema)
 void test_tasklet_destroy(struct test_tasklet *tt)
 {
     mutex_lock(&tt->mutex);
-    tasklet_fini(&tt->tasklet);
-    mutex_unlock_fini(&tt->mutex);
+    test_tasklet_fini(&tt->mutex, &tt->tasklet);
     free(tt);
 }
 
@@ -98,16 +121,14 @@ static void test_run_queue_waiting_done(void *v_t)
     struct trqw *t = v_t;
 
     t->ran = true;
-    tasklet_fini(&t->tasklet);
-    mutex_unlock_fini(&t->mutex);
+    test_tasklet_fini(&t->mutex, &t->tasklet);
 }
 
 static void test_run_queue_waiting_thread(void *v_t)
 {
     struct trqw *t = v_t;
 
-    mutex_init(&t->mutex);
-    tasklet_init(&t->tasklet, &t->mutex, t);
+    test_tasklet_init(&t->mutex, &t->tasklet, t);
 
     run_queue_target(t->runq);
     delay();
@@ -125,9 +146,1940 @@ static void test_run_queue_waiting(void)
     thread_fini(&thr);
 }
 
+#define SCHEDULER_THREADS 4
+#define SCHEDULER_TASKLETS 100
+
+struct ts_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    thread_handle_t waker;
+    unsigned int *ran;
+};
+
+static void test_scheduler_handler(void *v_t)
+{
+    struct ts_tasklet *t = v_t;
+
+    /* Tasklets run on the scheduler's workers, not the waking thread */
+    assert(!pthread_equal(thread_handle_current(), t->waker));
+    atomic_add_fetch_order(t->ran, 1, ATOMIC_RELEASE);
+    tasklet_stop(&t->tasklet);
+}
+
+struct ts_thread {
+    struct thread thread;
+    struct ts_tasklet tasklets[SCHEDULER_TASKLETS];
+    unsigned int ran;
+};
+
+static void test_scheduler_thread(void *v_tt)
+{
+    struct ts_thread *tt = v_tt;
+
+    for (int i = 0; i < SCHEDULER_TASKLETS; i++) {
+        struct ts_tasklet *t = &tt->tasklets[i];
+
+        test_tasklet_init(&t->mutex, &t->tasklet, t);
+        t->waker = thread_handle_current();
+        t->ran = &tt->ran;
+        tasklet_later(&t->tasklet, test_scheduler_handler);
+    }
+
+    while (atomic_load_order(&tt->ran, ATOMIC_ACQUIRE) < SCHEDULER_TASKLETS)
+        delay();
+
+    for (int i = 0; i < SCHEDULER_TASKLETS; i++) {
+        struct ts_tasklet *t = &tt->tasklets[i];
+
+        mutex_lock(&t->mutex);
+        test_tasklet_fini(&t->mutex, &t->tasklet);
+    }
+}
+
+static void test_scheduler(void)
+{
+    struct ts_thread *threads = calloc(SCHEDULER_THREADS, sizeof *threads);
+
+    assert(!tasklet_scheduler_init(SCHEDULER_THREADS));
+    assert(tasklet_scheduler_init(0) == EBUSY);
+
+    for (int i = 0; i < SCHEDULER_THREADS; i++)
+        thread_init(&threads[i].thread, test_scheduler_thread, &threads[i]);
+
+    for (int i = 0; i < SCHEDULER_THREADS; i++)
+        thread_fini(&threads[i].thread);
+
+    free(threads);
+}
+
+#define STEAL_TASKLETS 200
+
+struct tst_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    thread_handle_t runner;
+    unsigned int *ran;
+};
+
+static void test_steal_handler(void *v_t)
+{
+    struct tst_tasklet *t = v_t;
+
+    t->runner = thread_handle_current();
+    delay();
+    atomic_add_fetch_order(t->ran, 1, ATOMIC_RELEASE);
+    tasklet_stop(&t->tasklet);
+}
+
+/* A backlog on one queue gets spread across idle workers.  Run after
+ * test_scheduler, so there are several workers.  All the tasklets are
+ * made runnable from this thread, so without stealing they would all be
+ * run by one worker (or by one per CPU that this thread migrates to).
+ */
+static void test_steal(void)
+{
+    struct tst_tasklet *tasklets = calloc(STEAL_TASKLETS, sizeof *tasklets);
+    unsigned int ran = 0, runners = 0;
+
+    for (int i = 0; i < STEAL_TASKLETS; i++) {
+        struct tst_tasklet *t = &tasklets[i];
+
+        test_tasklet_init(&t->mutex, &t->tasklet, t);
+        t->ran = &ran;
+        tasklet_later(&t->tasklet, test_steal_handler);
+    }
+
+    while (atomic_load_order(&ran, ATOMIC_ACQUIRE) < STEAL_TASKLETS)
+        delay();
+
+    for (int i = 0; i < STEAL_TASKLETS; i++) {
+        struct tst_tasklet *t = &tasklets[i];
+        int j;
+
+        for (j = 0; j < i; j++)
+            if (pthread_equal(tasklets[j].runner, t->runner))
+                break;
+
+        if (j == i)
+            runners++;
+
+        mutex_lock(&t->mutex);
+        test_tasklet_fini(&t->mutex, &t->tasklet);
+    }
+
+    assert(runners > 1);
+    free(tasklets);
+}
+
+#define BROADCAST_TASKLETS 1000
+
+struct tb_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct wait_list *w;
+    bool joined;
+    unsigned int *count;
+};
+
+static void test_broadcast_handler(void *v_t)
+{
+    struct tb_tasklet *t = v_t;
+
+    if (!t->joined) {
+        t->joined = true;
+        wait_list_wait(t->w, &t->tasklet);
+    } else {
+        tasklet_stop(&t->tasklet);
+    }
+
+    atomic_add_fetch_order(t->count, 1, ATOMIC_RELEASE);
+}
+
+static void test_broadcast_wait_for(unsigned int *count, unsigned int n)
+{
+    while (atomic_load_order(count, ATOMIC_ACQUIRE) < n)
+        delay();
+}
+
+/* Waking many waiters at once: wait_list_up wakes as many as there are new
+   units, and wait_list_broadcast wakes the rest. */
+static void test_broadcast(void)
+{
+    struct tb_tasklet *tasklets
+        = malloc(BROADCAST_TASKLETS * sizeof *tasklets);
+    struct wait_list w;
+    unsigned int count = 0;
+
+    wait_list_init(&w, 0);
+
+    for (int i = 0; i < BROADCAST_TASKLETS; i++) {
+        struct tb_tasklet *t = &tasklets[i];
+
+        test_tasklet_init(&t->mutex, &t->tasklet, t);
+        t->w = &w;
+        t->joined = false;
+        t->count = &count;
+        tasklet_later(&t->tasklet, test_broadcast_handler);
+    }
+
+    test_broadcast_wait_for(&count, BROADCAST_TASKLETS);
+
+    wait_list_up(&w, BROADCAST_TASKLETS / 2);
+    test_broadcast_wait_for(&count, BROADCAST_TASKLETS * 3 / 2);
+
+    wait_list_broadcast(&w);
+    test_broadcast_wait_for(&count, BROADCAST_TASKLETS * 2);
+
+    for (int i = 0; i < BROADCAST_TASKLETS; i++) {
+        struct tb_tasklet *t = &tasklets[i];
+
+        mutex_lock(&t->mutex);
+        test_tasklet_fini(&t->mutex, &t->tasklet);
+    }
+
+    assert(count == BROADCAST_TASKLETS * 2);
+    wait_list_fini(&w);
+    free(tasklets);
+}
+
+#define MPSC_PRODUCERS 4
+#define MPSC_TASKLETS 16
+#define MPSC_ROUNDS 2000
+
+struct tm_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    unsigned int pending; /* Covered by mutex */
+    unsigned int handled; /* Ditto */
+};
+
+struct tm_producer {
+    struct thread thread;
+    struct run_queue *runq;
+    struct tm_tasklet tasklets[MPSC_TASKLETS];
+    unsigned int *done;
+};
+
+static void test_mpsc_handler(void *v_t)
+{
+    struct tm_tasklet *t = v_t;
+
+    t->handled += t->pending;
+    t->pending = 0;
+    tasklet_stop(&t->tasklet);
+}
+
+static void test_mpsc_producer(void *v_p)
+{
+    struct tm_producer *p = v_p;
+
+    run_queue_target(p->runq);
+
+    for (int round = 0; round < MPSC_ROUNDS; round++) {
+        for (int i = 0; i < MPSC_TASKLETS; i++) {
+            struct tm_tasklet *t = &p->tasklets[i];
+
+            mutex_lock(&t->mutex);
+
+            /* Now and then, stop the tasklet wherever it has got to: on
+               the incoming list, on the ready list, or about to run. */
+            if ((round + i) % 7 == 0)
+                tasklet_stop(&t->tasklet);
+
+            t->pending++;
+            mutex_unlock(&t->mutex);
+
+            tasklet_run(&t->tasklet);
+        }
+    }
+
+    atomic_add_fetch_order(p->done, 1, ATOMIC_RELEASE);
+}
+
+/* Many threads make tasklets runnable on one run queue at once.  Every
+ * wakeup must lead to a later run of the handler.
+ */
+static void test_mpsc(void)
+{
+    struct run_queue *runq = run_queue_create();
+    struct tm_producer *producers = calloc(MPSC_PRODUCERS, sizeof *producers);
+    unsigned int done = 0;
+
+    for (int i = 0; i < MPSC_PRODUCERS; i++) {
+        struct tm_producer *p = &producers[i];
+
+        p->runq = runq;
+        p->done = &done;
+
+        for (int j = 0; j < MPSC_TASKLETS; j++) {
+            struct tm_tasklet *t = &p->tasklets[j];
+
+            test_tasklet_init(&t->mutex, &t->tasklet, t);
+            t->tasklet.handler = test_mpsc_handler;
+            t->pending = t->handled = 0;
+        }
+
+        thread_init(&p->thread, test_mpsc_producer, p);
+    }
+
+    while (atomic_load_order(&done, ATOMIC_ACQUIRE) < MPSC_PRODUCERS)
+        run_queue_run(runq, false);
+
+    run_queue_run(runq, false);
+
+    for (int i = 0; i < MPSC_PRODUCERS; i++) {
+        struct tm_producer *p = &producers[i];
+
+        thread_fini(&p->thread);
+
+        for (int j = 0; j < MPSC_TASKLETS; j++) {
+            struct tm_tasklet *t = &p->tasklets[j];
+
+            mutex_lock(&t->mutex);
+            assert(t->handled == MPSC_ROUNDS);
+            assert(!t->pending);
+            test_tasklet_fini(&t->mutex, &t->tasklet);
+        }
+    }
+
+    free(producers);
+}
+
+#define FD_MESSAGES 1000
+#define FD_MESSAGE_SIZE 10
+
+struct tf_reader {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_fd tfd;
+    size_t got;
+    bool eof;
+};
+
+static void test_fd_reader(void *v_r)
+{
+    struct tf_reader *r = v_r;
+    char buf[64];
+
+    for (;;) {
+        ssize_t n = read(r->tfd.fd, buf, sizeof buf);
+
+        if (n > 0) {
+            r->got += n;
+        } else if (n == 0) {
+            atomic_store_order(&r->eof, true, ATOMIC_RELEASE);
+            tasklet_stop(&r->tasklet);
+            return;
+        } else {
+            assert(errno == EAGAIN);
+            if (!tasklet_fd_wait_readable(&r->tfd, &r->tasklet))
+                return;
+        }
+    }
+}
+
+/* A tasklet reads a socket as data trickles in, and sees it close. */
+static void test_fd_readable(void)
+{
+    struct tf_reader r = {.got = 0, .eof = false};
+    struct tasklet_fd dup;
+    char msg[FD_MESSAGE_SIZE] = "123456789";
+    int sv[2];
+
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    assert(!fcntl(sv[0], F_SETFL, O_NONBLOCK));
+    assert(!tasklet_fd_init(&r.tfd, sv[0]));
+    assert(tasklet_fd_init(&dup, sv[0]) == EEXIST);
+
+    test_tasklet_init(&r.mutex, &r.tasklet, &r);
+    mutex_lock(&r.mutex);
+    tasklet_goto(&r.tasklet, test_fd_reader);
+    mutex_unlock(&r.mutex);
+
+    for (int i = 0; i < FD_MESSAGES; i++) {
+        assert(write(sv[1], msg, sizeof msg) == sizeof msg);
+        if (i % 100 == 0)
+            delay();
+    }
+
+    assert(!close(sv[1]));
+
+    while (!atomic_load_order(&r.eof, ATOMIC_ACQUIRE))
+        delay();
+
+    mutex_lock(&r.mutex);
+    assert(r.got == FD_MESSAGES * FD_MESSAGE_SIZE);
+    tasklet_fd_fini(&r.tfd);
+    test_tasklet_fini(&r.mutex, &r.tasklet);
+    assert(!close(sv[0]));
+}
+
+#define FD_WRITE_TOTAL (1024 * 1024)
+
+struct tf_writer {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_fd tfd;
+    size_t written;
+};
+
+static void test_fd_writer(void *v_w)
+{
+    struct tf_writer *w = v_w;
+    char buf[4096] = {0};
+
+    while (w->written < FD_WRITE_TOTAL) {
+        size_t len = FD_WRITE_TOTAL - w->written;
+        ssize_t n = write(w->tfd.fd, buf, len < sizeof buf ? len : sizeof buf);
+
+        if (n > 0) {
+            w->written += n;
+        } else {
+            assert(n < 0 && errno == EAGAIN);
+            if (!tasklet_fd_wait_writable(&w->tfd, &w->tasklet))
+                return;
+        }
+    }
+
+    tasklet_stop(&w->tasklet);
+}
+
+/* A tasklet fills a pipe, and waits for the reader to make room. */
+static void test_fd_writable(void)
+{
+    struct tf_writer w = {.written = 0};
+    char buf[4096];
+    size_t got = 0;
+    int p[2];
+
+    assert(!pipe(p));
+    assert(!fcntl(p[1], F_SETFL, O_NONBLOCK));
+    assert(!tasklet_fd_init(&w.tfd, p[1]));
+
+    test_tasklet_init(&w.mutex, &w.tasklet, &w);
+    mutex_lock(&w.mutex);
+    tasklet_goto(&w.tasklet, test_fd_writer);
+    mutex_unlock(&w.mutex);
+
+    while (got < FD_WRITE_TOTAL) {
+        ssize_t n = read(p[0], buf, sizeof buf);
+        assert(n > 0);
+        got += n;
+    }
+
+    mutex_lock(&w.mutex);
+    assert(w.written == FD_WRITE_TOTAL);
+    tasklet_fd_fini(&w.tfd);
+    test_tasklet_fini(&w.mutex, &w.tasklet);
+    assert(!close(p[0]));
+    assert(!close(p[1]));
+}
+
+#define IO_BLOCKS 8
+#define IO_BLOCK_SIZE 4096
+#define IO_MESSAGE "hello"
+
+/* The steps of test_io_handler, in order: write the blocks, fsync, read
+   them back, accept a connection, and read a message from it. */
+enum {
+    IO_WRITE,
+    IO_FSYNC = IO_WRITE + IO_BLOCKS,
+    IO_READ,
+    IO_ACCEPT = IO_READ + IO_BLOCKS,
+    IO_RECV,
+    IO_DONE
+};
+
+struct test_io {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_io io;
+    int file;
+    int listener;
+    int conn;
+    int step;
+    bool started;
+    bool done;
+    char block[IO_BLOCK_SIZE];
+    char buf[IO_BLOCK_SIZE];
+};
+
+static void test_io_start(struct test_io *ti)
+{
+    int step = ti->step;
+
+    if (step < IO_FSYNC) {
+        memset(ti->block, 'a' + step, IO_BLOCK_SIZE);
+        assert(!tasklet_io_write(&ti->io, ti->file, ti->block, IO_BLOCK_SIZE,
+                                 (off_t) step * IO_BLOCK_SIZE));
+    } else if (step == IO_FSYNC) {
+        assert(!tasklet_io_fsync(&ti->io, ti->file));
+    } else if (step < IO_ACCEPT) {
+        assert(!tasklet_io_read(&ti->io, ti->file, ti->buf, IO_BLOCK_SIZE,
+                                (off_t) (step - IO_READ) * IO_BLOCK_SIZE));
+    } else if (step == IO_ACCEPT) {
+        assert(!tasklet_io_accept(&ti->io, ti->listener, NULL, NULL));
+    } else {
+        assert(!tasklet_io_read(&ti->io, ti->conn, ti->buf, sizeof ti->buf,
+                                -1));
+    }
+}
+
+static void test_io_check(struct test_io *ti)
+{
+    int step = ti->step;
+
+    if (step < IO_FSYNC) {
+        assert(ti->io.result == IO_BLOCK_SIZE);
+    } else if (step == IO_FSYNC) {
+        assert(ti->io.result == 0);
+    } else if (step < IO_ACCEPT) {
+        assert(ti->io.result == IO_BLOCK_SIZE);
+        for (int i = 0; i < IO_BLOCK_SIZE; i++)
+            assert(ti->buf[i] == 'a' + step - IO_READ);
+    } else if (step == IO_ACCEPT) {
+        assert(ti->io.result >= 0);
+        ti->conn = ti->io.result;
+    } else {
+        assert(ti->io.result == sizeof IO_MESSAGE);
+        assert(!strcmp(ti->buf, IO_MESSAGE));
+    }
+}
+
+static void test_io_handler(void *v_ti)
+{
+    struct test_io *ti = v_ti;
+
+    while (ti->step < IO_DONE) {
+        if (!ti->started) {
+            test_io_start(ti);
+            ti->started = true;
+        }
+
+        if (!tasklet_io_wait(&ti->io, &ti->tasklet))
+            return;
+
+        test_io_check(ti);
+        ti->started = false;
+        ti->step++;
+    }
+
+    atomic_store_order(&ti->done, true, ATOMIC_RELEASE);
+    tasklet_stop(&ti->tasklet);
+}
+
+/* A tasklet writes, syncs and reads back a file, and then accepts a
+   connection and reads from it, without blocking its worker. */
+static void test_io(void)
+{
+    struct test_io *ti = malloc(sizeof *ti);
+    char path[] = "/tmp/test-tasklet-XXXXXX";
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof addr;
+    int sock;
+
+    ti->file = mkstemp(path);
+    assert(ti->file >= 0);
+    assert(!unlink(path));
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ti->listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(ti->listener >= 0);
+    assert(!bind(ti->listener, (struct sockaddr *) &addr, addrlen));
+    assert(!listen(ti->listener, 1));
+    assert(!getsockname(ti->listener, (struct sockaddr *) &addr, &addrlen));
+
+    ti->step = IO_WRITE;
+    ti->started = ti->done = false;
+    tasklet_io_init(&ti->io);
+    test_tasklet_init(&ti->mutex, &ti->tasklet, ti);
+    mutex_lock(&ti->mutex);
+    tasklet_goto(&ti->tasklet, test_io_handler);
+    mutex_unlock(&ti->mutex);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    assert(sock >= 0);
+    assert(!connect(sock, (struct sockaddr *) &addr, addrlen));
+    assert(write(sock, IO_MESSAGE, sizeof IO_MESSAGE) == sizeof IO_MESSAGE);
+
+    while (!atomic_load_order(&ti->done, ATOMIC_ACQUIRE))
+        delay();
+
+    mutex_lock(&ti->mutex);
+    test_tasklet_fini(&ti->mutex, &ti->tasklet);
+    tasklet_io_fini(&ti->io);
+    assert(!close(sock));
+    assert(!close(ti->conn));
+    assert(!close(ti->listener));
+    assert(!close(ti->file));
+    free(ti);
+}
+
+#define IO_BLOCKED 8
+
+struct test_io_blocked {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_io io;
+    int pipe[2];
+    char c;
+    bool started;
+    bool done;
+};
+
+static void test_io_blocked_handler(void *v_tib)
+{
+    struct test_io_blocked *tib = v_tib;
+
+    if (!tib->started) {
+        tib->started = true;
+        assert(!tasklet_io_read(&tib->io, tib->pipe[0], &tib->c, 1, -1));
+    }
+
+    if (!tasklet_io_wait(&tib->io, &tib->tasklet))
+        return;
+
+    assert(tib->io.result == 1);
+    tasklet_stop(&tib->tasklet);
+    atomic_store_order(&tib->done, true, ATOMIC_RELEASE);
+}
+
+/* Reads from empty pipes block more helper threads than the pool starts
+   with, and other operations still complete meanwhile. */
+static void test_io_blocked(void)
+{
+    struct test_io_blocked *tibs = malloc(IO_BLOCKED * sizeof *tibs);
+
+    for (int i = 0; i < IO_BLOCKED; i++) {
+        struct test_io_blocked *tib = &tibs[i];
+
+        assert(!pipe(tib->pipe));
+        tib->started = tib->done = false;
+        tasklet_io_init(&tib->io);
+        test_tasklet_init(&tib->mutex, &tib->tasklet, tib);
+        mutex_lock(&tib->mutex);
+        tasklet_goto(&tib->tasklet, test_io_blocked_handler);
+        mutex_unlock(&tib->mutex);
+    }
+
+    test_io();
+
+    for (int i = 0; i < IO_BLOCKED; i++) {
+        struct test_io_blocked *tib = &tibs[i];
+
+        assert(!atomic_load_order(&tib->done, ATOMIC_ACQUIRE));
+        assert(write(tib->pipe[1], "x", 1) == 1);
+        while (!atomic_load_order(&tib->done, ATOMIC_ACQUIRE))
+            delay();
+
+        mutex_lock(&tib->mutex);
+        test_tasklet_fini(&tib->mutex, &tib->tasklet);
+        tasklet_io_fini(&tib->io);
+        assert(!close(tib->pipe[0]));
+        assert(!close(tib->pipe[1]));
+    }
+
+    free(tibs);
+}
+
+/* Run test_io with the helper threads rather than io_uring.  This is done
+   in a child process, so that every run queue creates its ring after the
+   environment variable is set. */
+static void test_io_fallback(void)
+{
+    int status;
+    pid_t pid = fork();
+
+    assert(pid >= 0);
+    if (!pid) {
+        assert(!setenv("TASKLET_IO_URING", "0", 1));
+        test_io();
+        test_io_blocked();
+        exit(0);
+    }
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+#define SLEEPERS 50
+#define SLEEP_STEPS 3
+
+struct test_sleeper {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_timer timer;
+    uint64_t deadline;
+    int steps;
+    bool early;
+};
+
+static void test_sleeper_handler(void *v_s)
+{
+    struct test_sleeper *s = v_s;
+
+    while (tasklet_sleep_until(&s->timer, s->deadline)) {
+        if (tasklet_now() < s->deadline)
+            s->early = true;
+
+        if (++s->steps == SLEEP_STEPS) {
+            tasklet_stop(&s->tasklet);
+            return;
+        }
+
+        /* Spread the deadlines over the first two levels of the wheel */
+        s->deadline += (uint64_t) (rand() % 200) * 1000000;
+    }
+}
+
+/* Tasklets sleep a few times each, and never wake early. */
+static void test_sleep(void)
+{
+    struct test_sleeper *sleepers = malloc(SLEEPERS * sizeof *sleepers);
+    uint64_t start = tasklet_now();
+
+    for (int i = 0; i < SLEEPERS; i++) {
+        struct test_sleeper *s = &sleepers[i];
+
+        test_tasklet_init(&s->mutex, &s->tasklet, s);
+        tasklet_timer_init(&s->timer, &s->tasklet);
+        s->deadline = start + (uint64_t) (rand() % 100) * 1000000;
+        s->steps = 0;
+        s->early = false;
+
+        mutex_lock(&s->mutex);
+        tasklet_goto(&s->tasklet, test_sleeper_handler);
+        mutex_unlock(&s->mutex);
+    }
+
+    for (int i = 0; i < SLEEPERS; i++) {
+        struct test_sleeper *s = &sleepers[i];
+
+        for (;;) {
+            mutex_lock(&s->mutex);
+            if (s->steps == SLEEP_STEPS)
+                break;
+
+            mutex_unlock(&s->mutex);
+            delay();
+        }
+
+        assert(!s->early);
+        tasklet_timer_fini(&s->timer);
+        test_tasklet_fini(&s->mutex, &s->tasklet);
+    }
+
+    free(sleepers);
+}
+
+struct test_sleep_fini {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_timer timer;
+    struct wait_list idle;
+    uint64_t deadline;
+    int runs;
+    bool slept;
+};
+
+static void test_sleep_fini_handler(void *v_s)
+{
+    struct test_sleep_fini *s = v_s;
+
+    s->runs++;
+    if (!s->slept) {
+        if (!tasklet_sleep_until(&s->timer, s->deadline))
+            return;
+
+        /* The sleep is over, so the tasklet is on no wait_list, and
+           finalizing the timer must not run it again. */
+        tasklet_timer_fini(&s->timer);
+        atomic_store_order(&s->slept, true, ATOMIC_RELEASE);
+    }
+
+    wait_list_wait(&s->idle, &s->tasklet);
+}
+
+/* A tasklet can finalize its timer once its sleep has ended. */
+static void test_sleep_fini(void)
+{
+    struct test_sleep_fini s;
+
+    test_tasklet_init(&s.mutex, &s.tasklet, &s);
+    tasklet_timer_init(&s.timer, &s.tasklet);
+    wait_list_init(&s.idle, 0);
+    s.deadline = tasklet_now() + 5 * 1000000;
+    s.runs = 0;
+    s.slept = false;
+
+    mutex_lock(&s.mutex);
+    tasklet_goto(&s.tasklet, test_sleep_fini_handler);
+    mutex_unlock(&s.mutex);
+
+    while (!atomic_load_order(&s.slept, ATOMIC_ACQUIRE))
+        delay();
+
+    /* Give any extra run the chance to happen */
+    for (int i = 0; i < 10; i++)
+        delay();
+
+    mutex_lock(&s.mutex);
+    assert(s.runs == 2);
+    test_tasklet_fini(&s.mutex, &s.tasklet);
+    wait_list_fini(&s.idle);
+}
+
+struct test_timed {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_timer timer;
+    struct wait_list *sema;
+    uint64_t deadline;
+    enum { TIMED_WAITING, TIMED_GOT, TIMED_OUT } outcome;
+};
+
+static void test_timed_handler(void *v_tt)
+{
+    struct test_timed *tt = v_tt;
+    bool timed_out;
+
+    if (!wait_list_down_timed(tt->sema, 1, &tt->timer, tt->deadline,
+                              &timed_out))
+        return;
+
+    assert(!timed_out || tasklet_now() >= tt->deadline);
+    assert(!tt->timer.runq);
+    atomic_store_order(&tt->outcome, timed_out ? TIMED_OUT : TIMED_GOT,
+                       ATOMIC_RELEASE);
+    tasklet_stop(&tt->tasklet);
+}
+
+static void test_timed_start(struct test_timed *tt, struct wait_list *sema,
+                             uint64_t timeout)
+{
+    test_tasklet_init(&tt->mutex, &tt->tasklet, tt);
+    tasklet_timer_init(&tt->timer, &tt->tasklet);
+    tt->sema = sema;
+    tt->deadline = tasklet_now() + timeout;
+    tt->outcome = TIMED_WAITING;
+
+    mutex_lock(&tt->mutex);
+    tasklet_goto(&tt->tasklet, test_timed_handler);
+    mutex_unlock(&tt->mutex);
+}
+
+static void test_timed_finish(struct test_timed *tt)
+{
+    while (atomic_load_order(&tt->outcome, ATOMIC_ACQUIRE) == TIMED_WAITING)
+        delay();
+
+    mutex_lock(&tt->mutex);
+    tasklet_timer_fini(&tt->timer);
+    test_tasklet_fini(&tt->mutex, &tt->tasklet);
+}
+
+/* wait_list_down_timed times out when nobody ups the wait_list, and when
+   somebody does, it succeeds and its timer is cancelled. */
+static void test_down_timed(void)
+{
+    struct test_timed a, b;
+    struct wait_list sema;
+
+    wait_list_init(&sema, 0);
+
+    test_timed_start(&a, &sema, 20 * 1000000);
+    test_timed_finish(&a);
+    assert(a.outcome == TIMED_OUT);
+
+    /* The timed-out tasklet left the wait_list, so this up goes to b */
+    test_timed_start(&b, &sema, 10ull * 1000 * 1000000);
+    wait_list_up(&sema, 1);
+    test_timed_finish(&b);
+    assert(b.outcome == TIMED_GOT);
+
+    wait_list_fini(&sema);
+}
+
+#define PRIORITY_TASKLETS 4
+#define PRIORITY_REQUEUES 10
+
+struct tp_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    int *order;
+    int *ran;
+    int id;
+    int requeues;
+};
+
+static void test_priority_handler(void *v_t)
+{
+    struct tp_tasklet *t = v_t;
+
+    t->order[(*t->ran)++] = t->id;
+    if (t->requeues > 0) {
+        t->requeues--;
+        tasklet_later(&t->tasklet, test_priority_handler);
+    } else {
+        tasklet_stop(&t->tasklet);
+    }
+}
+
+/* Higher priority tasklets run first, FIFO within a class, a tasklet that
+   keeps requeueing itself is demoted, and budgets bound each
+   run_queue_run. */
+static void test_priority(void)
+{
+    struct run_queue *runq = run_queue_create();
+    struct tp_tasklet ts[PRIORITY_TASKLETS];
+    int order[PRIORITY_REQUEUES + PRIORITY_TASKLETS];
+    int ran = 0, low_at = -1;
+    static const enum tasklet_priority prios[PRIORITY_TASKLETS] = {
+        TASKLET_PRIORITY_LOW, TASKLET_PRIORITY_NORMAL, TASKLET_PRIORITY_LOW,
+        TASKLET_PRIORITY_HIGH
+    };
+
+    run_queue_target(runq);
+
+    for (int i = 0; i < PRIORITY_TASKLETS; i++) {
+        struct tp_tasklet *t = &ts[i];
+
+        test_tasklet_init(&t->mutex, &t->tasklet, t);
+        tasklet_set_priority(&t->tasklet, prios[i]);
+        t->order = order;
+        t->ran = &ran;
+        t->id = i;
+        t->requeues = 0;
+        tasklet_later(&t->tasklet, test_priority_handler);
+    }
+
+    run_queue_run(runq, false);
+    assert(ran == PRIORITY_TASKLETS);
+    assert(order[0] == 3 && order[1] == 1 && order[2] == 0 && order[3] == 2);
+
+    /* Without demotion, tasklet 1 would run all its turns before the low
+       priority tasklet 0 got one. */
+    ran = 0;
+    ts[1].requeues = PRIORITY_REQUEUES;
+    tasklet_later(&ts[1].tasklet, test_priority_handler);
+    tasklet_later(&ts[0].tasklet, test_priority_handler);
+    run_queue_run(runq, false);
+    assert(ran == PRIORITY_REQUEUES + 2);
+    for (int i = 0; i < ran; i++)
+        if (order[i] == 0)
+            low_at = i;
+
+    assert(low_at > 0 && low_at < ran - 1);
+
+    /* Budgets */
+    ran = 0;
+    run_queue_set_budget(runq, 3, 0);
+    ts[1].requeues = PRIORITY_REQUEUES;
+    tasklet_later(&ts[1].tasklet, test_priority_handler);
+    run_queue_run(runq, false);
+    assert(ran == 3);
+
+    run_queue_set_budget(runq, 0, 1);
+    run_queue_run(runq, false);
+    assert(ran == 4);
+
+    run_queue_set_budget(runq, 0, 0);
+    run_queue_run(runq, false);
+    assert(ran == PRIORITY_REQUEUES + 1);
+
+    for (int i = 0; i < PRIORITY_TASKLETS; i++) {
+        mutex_lock(&ts[i].mutex);
+        test_tasklet_fini(&ts[i].mutex, &ts[i].tasklet);
+    }
+
+    run_queue_target(NULL);
+}
+
+struct tss_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_timer timer;
+    uint64_t deadline;
+    bool done;
+};
+
+static void test_stats_sleeper(void *v_t)
+{
+    struct tss_tasklet *t = v_t;
+
+    if (!tasklet_sleep_until(&t->timer, t->deadline))
+        return;
+
+    tasklet_stop(&t->tasklet);
+    t->done = true;
+}
+
+/* Statistics count what a run queue did while they were on. */
+static void test_stats(void)
+{
+    struct run_queue *runq = run_queue_create();
+    struct tp_tasklet ts[PRIORITY_TASKLETS];
+    struct tss_tasklet sleeper;
+    struct tasklet_stats st;
+    int order[PRIORITY_REQUEUES + PRIORITY_TASKLETS];
+    int ran = 0, devnull;
+    uint64_t counted;
+
+    run_queue_target(runq);
+    tasklet_stats_start();
+    tasklet_stats_reset();
+
+    for (int i = 0; i < PRIORITY_TASKLETS; i++) {
+        struct tp_tasklet *t = &ts[i];
+
+        test_tasklet_init(&t->mutex, &t->tasklet, t);
+        t->order = order;
+        t->ran = &ran;
+        t->id = i;
+        t->requeues = i ? 0 : PRIORITY_REQUEUES;
+        tasklet_later(&t->tasklet, test_priority_handler);
+    }
+
+    run_queue_run(runq, false);
+    assert(ran == PRIORITY_REQUEUES + PRIORITY_TASKLETS);
+
+    run_queue_get_stats(runq, &st);
+    assert(st.ran == (uint64_t) ran);
+    assert(st.requeues == PRIORITY_REQUEUES);
+    assert(st.transfer_failures == 0);
+    assert(st.handler.count == st.ran && st.depth.count == st.ran);
+    assert(st.depth.max == PRIORITY_TASKLETS);
+    assert(st.latency.count >= 1 && st.latency.count <= PRIORITY_TASKLETS);
+
+    /* Waiting for a timer is idle time */
+    test_tasklet_init(&sleeper.mutex, &sleeper.tasklet, &sleeper);
+    tasklet_timer_init(&sleeper.timer, &sleeper.tasklet);
+    sleeper.deadline = tasklet_now() + 5 * 1000000;
+    sleeper.done = false;
+    tasklet_later(&sleeper.tasklet, test_stats_sleeper);
+    while (!sleeper.done)
+        run_queue_run(runq, true);
+
+    run_queue_get_stats(runq, &st);
+    assert(st.ran >= (uint64_t) ran + 2);
+    assert(st.idle_ns > 0);
+    counted = st.ran;
+
+    devnull = open("/dev/null", O_WRONLY);
+    assert(devnull >= 0);
+    assert(tasklet_stats_report(devnull) >= 1);
+    close(devnull);
+
+    /* Nothing is counted once they are off */
+    tasklet_stats_stop();
+    ts[1].requeues = 1;
+    tasklet_later(&ts[1].tasklet, test_priority_handler);
+    run_queue_run(runq, false);
+    assert(ran == PRIORITY_REQUEUES + PRIORITY_TASKLETS + 2);
+    run_queue_get_stats(runq, &st);
+    assert(st.ran == counted);
+
+    tasklet_stats_reset();
+    run_queue_get_stats(runq, &st);
+    assert(st.ran == 0 && st.handler.count == 0 && st.idle_ns == 0);
+
+    mutex_lock(&sleeper.mutex);
+    tasklet_timer_fini(&sleeper.timer);
+    test_tasklet_fini(&sleeper.mutex, &sleeper.tasklet);
+    for (int i = 0; i < PRIORITY_TASKLETS; i++) {
+        mutex_lock(&ts[i].mutex);
+        test_tasklet_fini(&ts[i].mutex, &ts[i].tasklet);
+    }
+
+    run_queue_target(NULL);
+    run_queue_destroy(runq, NULL);
+}
+
+#define DESTROY_TASKLETS 10
+#define DESTROY_CHURN 1000
+
+struct td_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_timer timer;
+    uint64_t deadline;
+    unsigned int *ran;
+};
+
+static void test_destroy_handler(void *v_t)
+{
+    struct td_tasklet *t = v_t;
+
+    if (t->deadline && !tasklet_sleep_until(&t->timer, t->deadline))
+        return;
+
+    tasklet_stop(&t->tasklet);
+    atomic_add_fetch_order(t->ran, 1, ATOMIC_RELEASE);
+}
+
+/* Queue tasklets on runq, the first of them sleeping on a timer armed
+   from runq, and the rest runnable. */
+static void test_destroy_start(struct td_tasklet *ts, struct run_queue *runq,
+                               unsigned int *ran)
+{
+    run_queue_target(runq);
+
+    for (int i = 0; i < DESTROY_TASKLETS; i++) {
+        struct td_tasklet *t = &ts[i];
+
+        test_tasklet_init(&t->mutex, &t->tasklet, t);
+        tasklet_timer_init(&t->timer, &t->tasklet);
+        t->deadline = i ? 0 : tasklet_now() + 20 * 1000000;
+        t->ran = ran;
+        tasklet_later(&t->tasklet, test_destroy_handler);
+
+        if (!i)
+            run_queue_run(runq, false);
+    }
+
+    run_queue_target(NULL);
+}
+
+static void test_destroy_finish(struct td_tasklet *ts)
+{
+    for (int i = 0; i < DESTROY_TASKLETS; i++) {
+        struct td_tasklet *t = &ts[i];
+
+        mutex_lock(&t->mutex);
+        tasklet_timer_fini(&t->timer);
+        test_tasklet_fini(&t->mutex, &t->tasklet);
+    }
+}
+
+/* Destroying a run queue moves its tasklets and timers elsewhere, and run
+   queues can be created and destroyed over and over. */
+static void test_run_queue_destroy(void)
+{
+    struct td_tasklet ts[DESTROY_TASKLETS];
+    struct run_queue *runq, *dest;
+    unsigned int ran = 0;
+
+    /* To the default scheduler */
+    runq = run_queue_create();
+    test_destroy_start(ts, runq, &ran);
+    assert(ran == 0);
+    run_queue_destroy(runq, NULL);
+    while (atomic_load_order(&ran, ATOMIC_ACQUIRE) < DESTROY_TASKLETS)
+        delay();
+
+    test_destroy_finish(ts);
+
+    /* To another private queue */
+    ran = 0;
+    runq = run_queue_create();
+    dest = run_queue_create();
+    test_destroy_start(ts, runq, &ran);
+    run_queue_destroy(runq, dest);
+    run_queue_target(dest);
+    while (ran < DESTROY_TASKLETS)
+        run_queue_run(dest, true);
+
+    run_queue_target(NULL);
+    test_destroy_finish(ts);
+    run_queue_destroy(dest, NULL);
+
+    for (int i = 0; i < DESTROY_CHURN; i++)
+        run_queue_destroy(run_queue_create(), NULL);
+}
+
+/* A run queue without a reactor waits for its timers on its condition
+   variable. */
+static void test_timer_private_queue(void)
+{
+    struct run_queue *runq = run_queue_create();
+    struct test_timed tt;
+    struct wait_list sema;
+
+    wait_list_init(&sema, 0);
+    run_queue_target(runq);
+
+    test_timed_start(&tt, &sema, 20 * 1000000);
+    while (atomic_load_order(&tt.outcome, ATOMIC_ACQUIRE) == TIMED_WAITING)
+        run_queue_run(runq, true);
+
+    assert(tt.outcome == TIMED_OUT);
+    test_timed_finish(&tt);
+    run_queue_target(NULL);
+    wait_list_fini(&sema);
+}
+
+static void test_chan_nop(void *v_t)
+{
+    (void) v_t;
+}
+
+/* Capacity rounding, FIFO order, sends from a select, and closing, all
+   without needing to wait. */
+static void test_chan_basic(void)
+{
+    struct mutex mutex;
+    struct tasklet t;
+    struct tasklet_chan c;
+    struct tasklet_chan_case cs = {.chan = &c, .op = TASKLET_CHAN_SEND};
+    struct tasklet_select s;
+    void *msg;
+
+    test_tasklet_init(&mutex, &t, NULL);
+    mutex_lock(&mutex);
+    tasklet_set_handler(&t, test_chan_nop);
+    mutex_unlock(&mutex);
+
+    assert(!tasklet_chan_init(&c, 3));
+    for (uintptr_t i = 1; i <= 4; i++)
+        assert(!tasklet_chan_send(&c, (void *) i, &t));
+
+    assert(tasklet_chan_send(&c, (void *) 5, &t) == EAGAIN);
+
+    tasklet_select_init(&s, &t, &cs, 1);
+    cs.msg = (void *) 5;
+    assert(tasklet_select(&s) == -1);
+    assert(!tasklet_chan_recv(&c, &msg, &t) && msg == (void *) 1);
+    assert(tasklet_select(&s) == 0 && cs.result == 0);
+    tasklet_select_fini(&s);
+
+    for (uintptr_t i = 2; i <= 5; i++)
+        assert(!tasklet_chan_recv(&c, &msg, &t) && msg == (void *) i);
+
+    assert(tasklet_chan_recv(&c, &msg, &t) == EAGAIN);
+    assert(!tasklet_chan_send(&c, (void *) 6, &t));
+    tasklet_chan_close(&c);
+    tasklet_chan_close(&c);
+    assert(tasklet_chan_send(&c, (void *) 7, &t) == EPIPE);
+
+    /* Messages sent before the close are still received */
+    assert(!tasklet_chan_recv(&c, &msg, &t) && msg == (void *) 6);
+    assert(tasklet_chan_recv(&c, &msg, &t) == EPIPE);
+
+    mutex_lock(&mutex);
+    test_tasklet_fini(&mutex, &t);
+    tasklet_chan_fini(&c);
+}
+
+#define CHAN_PRODUCERS 4
+#define CHAN_CONSUMERS 4
+#define CHAN_MESSAGES 2000
+
+struct test_chan {
+    struct tasklet_chan chan;
+    unsigned int producing;
+    unsigned int consuming;
+    unsigned long sum;
+    unsigned long received;
+};
+
+struct tc_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct test_chan *tc;
+    uintptr_t next;
+    uintptr_t end;
+};
+
+static void test_chan_producer(void *v_t)
+{
+    struct tc_tasklet *t = v_t;
+    struct test_chan *tc = t->tc;
+
+    while (t->next < t->end) {
+        int res = tasklet_chan_send(&tc->chan, (void *) t->next, &t->tasklet);
+
+        if (res == EAGAIN)
+            return;
+
+        assert(!res);
+        t->next++;
+    }
+
+    /* The last producer to finish closes the channel */
+    if (!atomic_add_fetch_order(&tc->producing, -1, ATOMIC_ACQ_REL))
+        tasklet_chan_close(&tc->chan);
+
+    tasklet_stop(&t->tasklet);
+}
+
+static void test_chan_consumer(void *v_t)
+{
+    struct tc_tasklet *t = v_t;
+    struct test_chan *tc = t->tc;
+    void *msg;
+    int res;
+
+    while (!(res = tasklet_chan_recv(&tc->chan, &msg, &t->tasklet))) {
+        atomic_add_fetch_order(&tc->sum, (uintptr_t) msg, ATOMIC_RELAXED);
+        atomic_add_fetch_order(&tc->received, 1, ATOMIC_RELAXED);
+    }
+
+    if (res == EAGAIN)
+        return;
+
+    assert(res == EPIPE);
+    assert(tasklet_chan_recv(&tc->chan, &msg, &t->tasklet) == EPIPE);
+    tasklet_stop(&t->tasklet);
+    atomic_add_fetch_order(&tc->consuming, -1, ATOMIC_RELEASE);
+}
+
+static void tc_tasklet_start(struct tc_tasklet *t, struct test_chan *tc,
+                             void (*handler)(void *))
+{
+    test_tasklet_init(&t->mutex, &t->tasklet, t);
+    t->tc = tc;
+
+    mutex_lock(&t->mutex);
+    tasklet_goto(&t->tasklet, handler);
+    mutex_unlock(&t->mutex);
+}
+
+/* Producers and consumers exchange messages through a small channel, so
+   that both sides often wait.  Every message arrives exactly once, and the
+   consumers see the close once the channel is drained. */
+static void test_chan_pipeline(void)
+{
+    struct test_chan tc;
+    struct tc_tasklet producers[CHAN_PRODUCERS], consumers[CHAN_CONSUMERS];
+    unsigned long n = (unsigned long) CHAN_PRODUCERS * CHAN_MESSAGES;
+
+    assert(!tasklet_chan_init(&tc.chan, 4));
+    tc.producing = CHAN_PRODUCERS;
+    tc.consuming = CHAN_CONSUMERS;
+    tc.sum = tc.received = 0;
+
+    for (int i = 0; i < CHAN_CONSUMERS; i++)
+        tc_tasklet_start(&consumers[i], &tc, test_chan_consumer);
+
+    for (int i = 0; i < CHAN_PRODUCERS; i++) {
+        producers[i].next = (uintptr_t) i * CHAN_MESSAGES + 1;
+        producers[i].end = producers[i].next + CHAN_MESSAGES;
+        tc_tasklet_start(&producers[i], &tc, test_chan_producer);
+    }
+
+    while (atomic_load_order(&tc.consuming, ATOMIC_ACQUIRE))
+        delay();
+
+    assert(tc.received == n);
+    assert(tc.sum == n * (n + 1) / 2);
+
+    for (int i = 0; i < CHAN_PRODUCERS; i++) {
+        mutex_lock(&producers[i].mutex);
+        test_tasklet_fini(&producers[i].mutex, &producers[i].tasklet);
+    }
+
+    for (int i = 0; i < CHAN_CONSUMERS; i++) {
+        mutex_lock(&consumers[i].mutex);
+        test_tasklet_fini(&consumers[i].mutex, &consumers[i].tasklet);
+    }
+
+    tasklet_chan_fini(&tc.chan);
+}
+
+#define SELECT_CHANS 2
+
+struct test_selector {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct test_chan *tcs;
+    struct tasklet_chan_case cases[SELECT_CHANS];
+    struct tasklet_select select;
+    unsigned int open;
+    unsigned long sums[SELECT_CHANS];
+    bool done;
+};
+
+static void test_selector_handler(void *v_ts)
+{
+    struct test_selector *ts = v_ts;
+    int i;
+
+    while ((i = tasklet_select(&ts->select)) >= 0) {
+        struct tasklet_chan_case *cs = &ts->cases[i];
+
+        if (!cs->result) {
+            ts->sums[(struct test_chan *) cs->chan - ts->tcs]
+                += (uintptr_t) cs->msg;
+            continue;
+        }
+
+        /* Stop selecting on the closed channel */
+        assert(cs->result == EPIPE);
+        tasklet_select_fini(&ts->select);
+        ts->cases[i] = ts->cases[--ts->open];
+        if (!ts->open) {
+            atomic_store_order(&ts->done, true, ATOMIC_RELEASE);
+            tasklet_stop(&ts->tasklet);
+            return;
+        }
+
+        tasklet_select_init(&ts->select, &ts->tasklet, ts->cases, ts->open);
+    }
+}
+
+/* A tasklet receives from two channels at once, each fed by its own
+   producer, until both are closed. */
+static void test_chan_select(void)
+{
+    struct test_chan tcs[SELECT_CHANS];
+    struct tc_tasklet producers[SELECT_CHANS];
+    struct test_selector ts;
+    unsigned long expected = (unsigned long) CHAN_MESSAGES
+                             * (CHAN_MESSAGES + 1) / 2;
+
+    test_tasklet_init(&ts.mutex, &ts.tasklet, &ts);
+    ts.tcs = tcs;
+    ts.open = SELECT_CHANS;
+    ts.done = false;
+
+    for (int i = 0; i < SELECT_CHANS; i++) {
+        assert(!tasklet_chan_init(&tcs[i].chan, 2));
+        tcs[i].producing = 1;
+        ts.cases[i].chan = &tcs[i].chan;
+        ts.cases[i].op = TASKLET_CHAN_RECV;
+        ts.sums[i] = 0;
+    }
+
+    tasklet_select_init(&ts.select, &ts.tasklet, ts.cases, SELECT_CHANS);
+    mutex_lock(&ts.mutex);
+    tasklet_goto(&ts.tasklet, test_selector_handler);
+    mutex_unlock(&ts.mutex);
+
+    for (int i = 0; i < SELECT_CHANS; i++) {
+        producers[i].next = 1;
+        producers[i].end = CHAN_MESSAGES + 1;
+        tc_tasklet_start(&producers[i], &tcs[i], test_chan_producer);
+    }
+
+    while (!atomic_load_order(&ts.done, ATOMIC_ACQUIRE))
+        delay();
+
+    mutex_lock(&ts.mutex);
+    for (int i = 0; i < SELECT_CHANS; i++)
+        assert(ts.sums[i] == expected);
+
+    test_tasklet_fini(&ts.mutex, &ts.tasklet);
+
+    for (int i = 0; i < SELECT_CHANS; i++) {
+        mutex_lock(&producers[i].mutex);
+        test_tasklet_fini(&producers[i].mutex, &producers[i].tasklet);
+        tasklet_chan_fini(&tcs[i].chan);
+    }
+}
+
+#define TMUTEX_TASKLETS 8
+#define TMUTEX_ROUNDS 1000
+
+struct tmx_shared {
+    struct tasklet_mutex mutex;
+    long a, b; /* Only touched with the tasklet_mutex held */
+    unsigned int done;
+};
+
+struct tmx_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tmx_shared *shared;
+    unsigned int rounds;
+};
+
+static void test_tmutex_locked(void *v_t);
+
+static void test_tmutex_lock(void *v_t)
+{
+    struct tmx_tasklet *t = v_t;
+
+    if (!tasklet_mutex_lock(&t->shared->mutex, &t->tasklet))
+        return;
+
+    /* Hold the mutex across a return to the worker */
+    assert(t->shared->a == t->shared->b);
+    t->shared->a++;
+    tasklet_later(&t->tasklet, test_tmutex_locked);
+}
+
+static void test_tmutex_locked(void *v_t)
+{
+    struct tmx_tasklet *t = v_t;
+
+    t->shared->b++;
+    tasklet_mutex_unlock(&t->shared->mutex);
+
+    if (++t->rounds < TMUTEX_ROUNDS) {
+        tasklet_later(&t->tasklet, test_tmutex_lock);
+    } else {
+        tasklet_stop(&t->tasklet);
+        atomic_add_fetch_order(&t->shared->done, 1, ATOMIC_RELEASE);
+    }
+}
+
+/* Tasklets on all the workers take turns holding a tasklet_mutex. */
+static void test_tasklet_mutex(void)
+{
+    struct tmx_shared shared = {.a = 0, .b = 0, .done = 0};
+    struct tmx_tasklet ts[TMUTEX_TASKLETS];
+
+    tasklet_mutex_init(&shared.mutex);
+
+    for (int i = 0; i < TMUTEX_TASKLETS; i++) {
+        test_tasklet_init(&ts[i].mutex, &ts[i].tasklet, &ts[i]);
+        ts[i].shared = &shared;
+        ts[i].rounds = 0;
+        tasklet_later(&ts[i].tasklet, test_tmutex_lock);
+    }
+
+    while (atomic_load_order(&shared.done, ATOMIC_ACQUIRE) < TMUTEX_TASKLETS)
+        delay();
+
+    for (int i = 0; i < TMUTEX_TASKLETS; i++) {
+        mutex_lock(&ts[i].mutex);
+        test_tasklet_fini(&ts[i].mutex, &ts[i].tasklet);
+    }
+
+    assert(shared.a == (long) TMUTEX_TASKLETS * TMUTEX_ROUNDS);
+    assert(shared.b == shared.a);
+    assert(tasklet_mutex_trylock(&shared.mutex));
+    tasklet_mutex_unlock(&shared.mutex);
+    tasklet_mutex_fini(&shared.mutex);
+}
+
+struct th_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_mutex *tmutex;
+    int id;
+    int *order;
+    int *got;
+};
+
+static void test_handoff_handler(void *v_t)
+{
+    struct th_tasklet *t = v_t;
+
+    if (!tasklet_mutex_lock(t->tmutex, &t->tasklet))
+        return;
+
+    /* Keep the mutex */
+    t->order[(*t->got)++] = t->id;
+    tasklet_stop(&t->tasklet);
+}
+
+static void test_handoff_goto(struct th_tasklet *t)
+{
+    mutex_lock(&t->mutex);
+    tasklet_goto(&t->tasklet, test_handoff_handler);
+    mutex_unlock(&t->mutex);
+}
+
+static void test_handoff_stop(struct th_tasklet *t)
+{
+    mutex_lock(&t->mutex);
+    tasklet_stop(&t->tasklet);
+    mutex_unlock(&t->mutex);
+}
+
+/* An unlock hands the mutex to the first waiter, and a waiter that is
+   stopped passes its turn on. */
+static void test_tasklet_mutex_handoff(void)
+{
+    struct run_queue *runq = run_queue_create();
+    struct tasklet_mutex tmutex;
+    struct th_tasklet ts[4];
+    int order[4], got = 0;
+
+    run_queue_target(runq);
+    tasklet_mutex_init(&tmutex);
+
+    for (int i = 0; i < 4; i++) {
+        test_tasklet_init(&ts[i].mutex, &ts[i].tasklet, &ts[i]);
+        ts[i].tmutex = &tmutex;
+        ts[i].id = i;
+        ts[i].order = order;
+        ts[i].got = &got;
+    }
+
+    test_handoff_goto(&ts[0]);
+    assert(got == 1 && order[0] == 0);
+    assert(!tasklet_mutex_trylock(&tmutex));
+
+    /* Tasklet 1 gives up its place in the queue before the unlock */
+    test_handoff_goto(&ts[1]);
+    test_handoff_goto(&ts[2]);
+    assert(got == 1);
+    test_handoff_stop(&ts[1]);
+    tasklet_mutex_unlock(&tmutex);
+    run_queue_run(runq, false);
+    assert(got == 2 && order[1] == 2);
+
+    /* Tasklet 1 is handed the mutex but stopped before it takes it, and a
+       latecomer cannot jump the queue meanwhile */
+    test_handoff_goto(&ts[1]);
+    test_handoff_goto(&ts[3]);
+    tasklet_mutex_unlock(&tmutex);
+    assert(!tasklet_mutex_trylock(&tmutex));
+    test_handoff_stop(&ts[1]);
+    run_queue_run(runq, false);
+    assert(got == 3 && order[2] == 3);
+
+    tasklet_mutex_unlock(&tmutex);
+    for (int i = 0; i < 4; i++) {
+        mutex_lock(&ts[i].mutex);
+        test_tasklet_fini(&ts[i].mutex, &ts[i].tasklet);
+    }
+
+    tasklet_mutex_fini(&tmutex);
+    run_queue_target(NULL);
+    run_queue_destroy(runq, NULL);
+}
+
+#define JOIN_CHILDREN 16
+
+struct tj_tasklet {
+    struct mutex mutex;
+    struct tasklet tasklet;
+    struct tasklet_join join;
+    struct tasklet_group *group;
+    struct tj_tasklet *children; /* For the parent */
+    unsigned int id;
+    bool started;      /* Whether the children have been started */
+    unsigned int next; /* The next child to join */
+    uintptr_t sum;
+};
+
+static void tj_tasklet_init(struct tj_tasklet *t, unsigned int id,
+                            struct tasklet_group *group)
+{
+    test_tasklet_init(&t->mutex, &t->tasklet, t);
+    tasklet_join_init(&t->join);
+    t->group = group;
+    t->children = NULL;
+    t->id = id;
+    t->started = false;
+    t->next = 0;
+    t->sum = 0;
+}
+
+static void tj_tasklet_fini(struct tj_tasklet *t)
+{
+    mutex_lock(&t->mutex);
+    test_tasklet_fini(&t->mutex, &t->tasklet);
+    tasklet_join_fini(&t->join);
+}
+
+static void test_join_child(void *v_t)
+{
+    struct tj_tasklet *t = v_t;
+
+    tasklet_stop(&t->tasklet);
+    tasklet_join_complete(&t->join, (void *) (uintptr_t) (t->id * t->id));
+}
+
+static void test_join_parent(void *v_t)
+{
+    struct tj_tasklet *t = v_t;
+
+    if (!t->started) {
+        t->started = true;
+        for (unsigned int i = 0; i < JOIN_CHILDREN; i++)
+            tasklet_later(&t->children[i].tasklet, test_join_child);
+    }
+
+    /* Join the children in order, however they finish */
+    while (t->next < JOIN_CHILDREN) {
+        void *result;
+
+        if (!tasklet_join(&t->children[t->next].join, &t->tasklet, &result))
+            return;
+
+        t->sum += (uintptr_t) result;
+        t->next++;
+    }
+
+    tasklet_stop(&t->tasklet);
+    tasklet_join_complete(&t->join, (void *) t->sum);
+}
+
+/* A tasklet joins its children, and a thread joins it. */
+static void test_join(void)
+{
+    struct tj_tasklet parent, children[JOIN_CHILDREN];
+    uintptr_t expected = 0;
+
+    tj_tasklet_init(&parent, 0, NULL);
+    parent.children = children;
+    for (unsigned int i = 0; i < JOIN_CHILDREN; i++) {
+        tj_tasklet_init(&children[i], i, NULL);
+        expected += i * i;
+    }
+
+    tasklet_later(&parent.tasklet, test_join_parent);
+    assert((uintptr_t) tasklet_join_blocking(&parent.join) == expected);
+
+    /* Once complete, it stays complete */
+    assert((uintptr_t) tasklet_join_blocking(&parent.join) == expected);
+
+    tj_tasklet_fini(&parent);
+    for (unsigned int i = 0; i < JOIN_CHILDREN; i++)
+        tj_tasklet_fini(&children[i]);
+}
+
+static void test_group_child(void *v_t)
+{
+    struct tj_tasklet *t = v_t;
+
+    atomic_add_fetch_order(&t->sum, 1, ATOMIC_RELAXED);
+    tasklet_stop(&t->tasklet);
+    tasklet_group_done(t->group);
+}
+
+/* The first child starts the rest, so the group grows while it runs */
+static void test_group_first_child(void *v_t)
+{
+    struct tj_tasklet *t = v_t;
+
+    tasklet_group_add(t->group, JOIN_CHILDREN - 1);
+    for (unsigned int i = 1; i < JOIN_CHILDREN; i++)
+        tasklet_later(&t->children[i].tasklet, test_group_child);
+
+    test_group_child(t);
+}
+
+static void test_group_parent(void *v_t)
+{
+    struct tj_tasklet *t = v_t;
+
+    if (!t->started) {
+        t->started = true;
+        tasklet_later(&t->children[0].tasklet, test_group_first_child);
+    }
+
+    if (!tasklet_group_join(t->group, &t->tasklet))
+        return;
+
+    tasklet_stop(&t->tasklet);
+    tasklet_join_complete(&t->join, NULL);
+}
+
+/* A group completes once all its children are done. */
+static void test_group(void)
+{
+    struct tasklet_group group, empty;
+    struct tj_tasklet parent, children[JOIN_CHILDREN];
+    uintptr_t ran = 0;
+
+    tasklet_group_init(&group, 1);
+    tj_tasklet_init(&parent, 0, &group);
+    parent.children = children;
+    for (unsigned int i = 0; i < JOIN_CHILDREN; i++) {
+        tj_tasklet_init(&children[i], i, &group);
+        children[i].children = children;
+    }
+
+    tasklet_later(&parent.tasklet, test_group_parent);
+    tasklet_join_blocking(&parent.join);
+    tasklet_group_join_blocking(&group);
+
+    for (unsigned int i = 0; i < JOIN_CHILDREN; i++)
+        ran += atomic_load_order(&children[i].sum, ATOMIC_RELAXED);
+
+    assert(ran == JOIN_CHILDREN);
+
+    tj_tasklet_fini(&parent);
+    for (unsigned int i = 0; i < JOIN_CHILDREN; i++)
+        tj_tasklet_fini(&children[i]);
+
+    tasklet_group_fini(&group);
+
+    /* A group with no children is complete at once */
+    tasklet_group_init(&empty, 0);
+    tasklet_group_join_blocking(&empty);
+    tasklet_group_fini(&empty);
+}
+
+#define CORO_MESSAGES 1000
+#define CORO_DEPTH 200
+#define CORO_MANY 200
+
+struct tco_state {
+    struct mutex mutex;
+    struct tasklet_coro co;
+    struct tasklet_chan *chan;
+    struct tasklet_timer timer;
+    struct tasklet_join join;
+};
+
+/* Use some stack, to check that it is really there */
+static unsigned long test_coro_recurse(unsigned int depth)
+{
+    volatile unsigned long buf[16];
+
+    buf[0] = depth;
+    if (!depth)
+        return 0;
+
+    return buf[0] + test_coro_recurse(depth - 1);
+}
+
+static void test_coro_fn(struct tasklet_coro *co)
+{
+    struct tco_state *st = co->data;
+    uintptr_t sum = 0;
+    void *msg;
+    int res;
+
+    /* Receive everything, blocking-style, with stack frames live across
+       each wait */
+    for (;;) {
+        tasklet_coro_await(co, (res = tasklet_chan_recv(st->chan, &msg,
+                                                        &co->tasklet)) !=
+                                   EAGAIN);
+        if (res == EPIPE)
+            break;
+
+        sum += (uintptr_t) msg;
+        if (!((uintptr_t) msg % 100))
+            tasklet_coro_yield(co);
+    }
+
+    assert(test_coro_recurse(CORO_DEPTH) ==
+           (unsigned long) CORO_DEPTH * (CORO_DEPTH + 1) / 2);
+
+    /* And a timer */
+    {
+        uint64_t deadline = tasklet_now() + 2 * 1000000;
+
+        tasklet_coro_await(co, tasklet_sleep_until(&st->timer, deadline));
+        assert(tasklet_now() >= deadline);
+    }
+
+    tasklet_join_complete(&st->join, (void *) sum);
+}
+
+/* A coroutine receives from a stackless producer, and sleeps. */
+static void test_coro(void)
+{
+    struct tco_state st;
+    struct tc_tasklet producer;
+    struct test_chan tc;
+
+    mutex_init(&st.mutex);
+    assert(!tasklet_chan_init(&tc.chan, 4));
+    assert(!tasklet_coro_init(&st.co, &st.mutex, test_coro_fn, &st, 0));
+    tasklet_timer_init(&st.timer, &st.co.tasklet);
+    tasklet_join_init(&st.join);
+    st.chan = &tc.chan;
+    tasklet_run(&st.co.tasklet);
+
+    tc.producing = 1;
+    producer.next = 1;
+    producer.end = CORO_MESSAGES + 1;
+    tc_tasklet_start(&producer, &tc, test_chan_producer);
+
+    assert((uintptr_t) tasklet_join_blocking(&st.join) ==
+           (uintptr_t) CORO_MESSAGES * (CORO_MESSAGES + 1) / 2);
+
+    mutex_lock(&producer.mutex);
+    test_tasklet_fini(&producer.mutex, &producer.tasklet);
+    mutex_lock(&st.mutex);
+    tasklet_timer_fini(&st.timer);
+    tasklet_coro_fini(&st.co);
+    assert(!st.co.stack);
+    mutex_unlock_fini(&st.mutex);
+    tasklet_join_fini(&st.join);
+    tasklet_chan_fini(&tc.chan);
+}
+
+struct tcm_shared {
+    struct wait_list sema;
+    struct wait_list never;
+    unsigned int done;
+};
+
+struct tcm_coro {
+    struct mutex mutex;
+    struct tasklet_coro co;
+    struct tcm_shared *shared;
+};
+
+static void test_coro_many_fn(struct tasklet_coro *co)
+{
+    struct tcm_coro *c = co->data;
+
+    for (int i = 0; i < 10; i++) {
+        tasklet_coro_down(co, &c->shared->sema, 1);
+        tasklet_coro_yield(co);
+        wait_list_up(&c->shared->sema, 1);
+    }
+
+    atomic_add_fetch_order(&c->shared->done, 1, ATOMIC_RELEASE);
+
+    /* Wait forever, to be abandoned by tasklet_coro_fini */
+    tasklet_coro_down(co, &c->shared->never, 1);
+    abort();
+}
+
+/* Many coroutines share a semaphore across the workers, twice over so
+   that the second round reuses pooled stacks. */
+static void test_coro_many(void)
+{
+    static struct tcm_coro cs[CORO_MANY];
+    struct tcm_shared shared;
+
+    wait_list_init(&shared.never, 0);
+    for (int round = 0; round < 2; round++) {
+        wait_list_init(&shared.sema, 4);
+        shared.done = 0;
+
+        for (int i = 0; i < CORO_MANY; i++) {
+            mutex_init(&cs[i].mutex);
+            cs[i].shared = &shared;
+            assert(!tasklet_coro_init(&cs[i].co, &cs[i].mutex,
+                                      test_coro_many_fn, &cs[i], 0));
+            tasklet_run(&cs[i].co.tasklet);
+        }
+
+        while (atomic_load_order(&shared.done, ATOMIC_ACQUIRE) < CORO_MANY)
+            delay();
+
+        for (int i = 0; i < CORO_MANY; i++) {
+            mutex_lock(&cs[i].mutex);
+            tasklet_coro_fini(&cs[i].co);
+            mutex_unlock_fini(&cs[i].mutex);
+        }
+
+        wait_list_fini(&shared.sema);
+    }
+
+    wait_list_fini(&shared.never);
+}
+
 int main(void)
 {
+    test_io_fallback();
     test_wait_list();
+    test_priority();
     test_run_queue_waiting();
+    test_mpsc();
+    test_scheduler();
+    test_steal();
+    test_broadcast();
+    test_fd_readable();
+    test_fd_writable();
+    test_io();
+    test_sleep();
+    test_sleep_fini();
+    test_down_timed();
+    test_timer_private_queue();
+    test_stats();
+    test_run_queue_destroy();
+    test_chan_basic();
+    test_chan_pipeline();
+    test_chan_select();
+    test_tasklet_mutex();
+    test_tasklet_mutex_handoff();
+    test_join();
+    test_group();
+    test_coro();
+    test_coro_many();
     return 0;
 }